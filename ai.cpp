@@ -4,17 +4,41 @@
 
 #include "ai.h"
 #include "astar.h"
+#include "entities.h"
 #include "navigation.h"
+#include "profiler.h"
+
+namespace
+{
+  // How many ticks there are between updates of an agent on each AI_LOD
+  const uint64_t lodUpdateIntervals[AISystem::nLODs] = { 1, 4, 16 };
+
+  // Agents with goals within these distances of the centre are on the FULL and REDUCED tiers, everything else is LOW
+  const float fLODFullDistance = 40.0f;
+  const float fLODReducedDistance = 100.0f;
+
+  // Agents this close to the edge of the view frustum are treated as on screen so that they are already at the full rate
+  // when they come into view
+  const float fLODFrustumMargin = 10.0f;
+
+  // How close an agent has to get to a position to count as having arrived
+  const float fArrivalRadius = 1.0f;
+}
 
 AIGoalTakeControlPoint::AIGoalTakeControlPoint(const spitfire::math::cVec3& _controlPointPosition) :
   controlPointPosition(_controlPointPosition)
 {
 }
 
-bool AIGoalTakeControlPoint::IsSatisfied(const AISystem& ai, const AIAgent& agent) const
+bool AIGoalTakeControlPoint::Start(const AISystem& ai, AIAgent& agent)
+{
+  agent.blackboard.SetArrivalTrigger(controlPointPosition, fArrivalRadius);
+  return false;
+}
+
+bool AIGoalTakeControlPoint::OnArrived(const AISystem& ai, AIAgent& agent)
 {
-  const float fRadius = 1.0f;
-  return (agent.position - controlPointPosition).GetLength() < fRadius;
+  return true;
 }
 
 
@@ -23,25 +47,29 @@ AIGoalPatrol::AIGoalPatrol(const std::list<spitfire::math::cVec3>& _patrolPoints
 {
 }
 
-bool AIGoalPatrol::IsSatisfied(const AISystem& ai, const AIAgent& agent) const
+bool AIGoalPatrol::Start(const AISystem& ai, AIAgent& agent)
 {
-  return patrolPoints.empty();
+  if (patrolPoints.empty()) return true;
+
+  agent.blackboard.SetArrivalTrigger(patrolPoints.front(), fArrivalRadius);
+  return false;
 }
 
-void AIGoalPatrol::Update(const AISystem& ai, const AIAgent& agent)
+bool AIGoalPatrol::OnArrived(const AISystem& ai, AIAgent& agent)
 {
-  if (!patrolPoints.empty()) {
-    // Check if we are close enough to the next patrol point to be able to count it as visited
-    auto&& point = patrolPoints.front();
-    const float fRadius = 1.0f;
-    if ((agent.position - point).GetLength() < fRadius) {
-      // We were close enough to the first patrol point so we can remove it
-      patrolPoints.pop_front();
-    }
-  }
+  // We were close enough to the first patrol point so we can remove it and wait for the next one
+  patrolPoints.pop_front();
+
+  return Start(ai, agent);
 }
 
 
+AIActionGoto::AIActionGoto(const std::list<Node>& _path, const spitfire::math::cVec3& _targetPosition) :
+  path(_path),
+  targetPosition(_targetPosition)
+{
+}
+
 void AIActionGoto::Update(const AISystem& ai, AIAgent& agent)
 {
   spitfire::math::cVec3 target = targetPosition;
@@ -52,8 +80,8 @@ void AIActionGoto::Update(const AISystem& ai, AIAgent& agent)
   }
 
 
-  // Update agent
-  const float fSpeed = 0.1f;
+  // Update agent, speeds are in units per second so that they don't depend on the tick rate
+  const float fSpeed = 6.0f * ai.GetTimeStepSeconds();
   spitfire::math::cVec3& position(agent.position);
   const float fDistance = spitfire::math::cVec3(target - position).GetLength();
   if (fDistance < 2.0f) {
@@ -66,7 +94,7 @@ void AIActionGoto::Update(const AISystem& ai, AIAgent& agent)
     }
   } else if (fDistance < 6.0f) {
     // Ease into the target position
-    float fEasing = 0.1f;
+    const float fEasing = 6.0f * ai.GetTimeStepSeconds();
     const spitfire::math::cVec3 direction = (target - position).GetNormalised();
     position += std::min(fSpeed, (fEasing * fDistance)) * direction;
   } else {
@@ -76,163 +104,283 @@ void AIActionGoto::Update(const AISystem& ai, AIAgent& agent)
   }
 }
 
-AIAgent::AIAgent(const spitfire::math::cVec3& _position, const spitfire::math::cQuaternion& _rotation) :
-  position(_position),
-  rotation(_rotation)
+
+// ** AIBlackboard
+
+AIBlackboard::AIBlackboard() :
+  bIsGoalStarted(false),
+  lod(AI_LOD::FULL),
+  lastUpdateTick(0)
 {
+  ClearTriggers();
 }
 
+AIBlackboard::AIBlackboard(AIBlackboard&& rhs) noexcept :
+  goals(std::move(rhs.goals)),
+  actions(std::move(rhs.actions)),
+  bIsGoalStarted(rhs.bIsGoalStarted),
+  arrival(rhs.arrival),
+  lod(rhs.lod),
+  lastUpdateTick(rhs.lastUpdateTick)
+{
+  rhs.goals.clear();
+  rhs.actions.clear();
+  rhs.bIsGoalStarted = false;
+  rhs.ClearTriggers();
+}
 
-AISystem::AISystem(const NavigationMesh& _navigationMesh) :
-  navigationMesh(_navigationMesh)
+AIBlackboard::~AIBlackboard()
 {
+  Clear();
 }
 
-aiagentid_t AISystem::AddAgent(const spitfire::math::cVec3& position, const spitfire::math::cQuaternion& rotation)
+AIBlackboard& AIBlackboard::operator=(AIBlackboard&& rhs) noexcept
 {
-  const aiagentid_t n = std::numeric_limits<aiagentid_t>::max();
-  for (aiagentid_t id = 0; id < n; id++) {
-    if (agents.find(id) == agents.end()) {
-      agents.insert(std::make_pair(id, std::unique_ptr<AIAgent>(new AIAgent(position, rotation))));
-      return id;
-    }
+  if (&rhs != this) {
+    Clear();
+
+    goals.swap(rhs.goals);
+    actions.swap(rhs.actions);
+    bIsGoalStarted = rhs.bIsGoalStarted;
+    arrival = rhs.arrival;
+    lod = rhs.lod;
+    lastUpdateTick = rhs.lastUpdateTick;
   }
 
-  assert(false);
-  return 0;
+  return *this;
 }
 
-void AISystem::RemoveAgent(aiagentid_t id)
+void AIBlackboard::Clear()
 {
-  agents.erase(id);
+  for (auto& pGoal : goals) delete pGoal;
+  goals.clear();
+  bIsGoalStarted = false;
+  ClearTriggers();
+
+  ClearActions();
 }
 
-const spitfire::math::cVec3& AISystem::GetAgentPosition(aiagentid_t id) const
+void AIBlackboard::SetArrivalTrigger(const spitfire::math::cVec3& position, float fRadius)
 {
-  auto iter = agents.find(id);
-  assert(iter != agents.end());
+  arrival.position = position;
+  arrival.fSquaredRadius = fRadius * fRadius;
+  arrival.bIsSet = true;
+}
 
-  return iter->second->position;
+void AIBlackboard::ClearTriggers()
+{
+  arrival.fSquaredRadius = 0.0f;
+  arrival.bIsSet = false;
 }
 
-void AISystem::SetAgentPositionAndRotation(aiagentid_t id, const spitfire::math::cVec3& position, const spitfire::math::cQuaternion& rotation)
+void AIBlackboard::ClearActions()
 {
-  auto iter = agents.find(id);
-  if (iter != agents.end()) {
-    iter->second->position = position;
-    iter->second->rotation = rotation;
-  }
+  for (auto& pAction : actions) delete pAction;
+  actions.clear();
 }
 
-size_t AISystem::GetAgentGoalCount(aiagentid_t id) const
+bool AIBlackboard::GetGoalPosition(spitfire::math::cVec3& goalPosition) const
 {
-  auto iter = agents.find(id);
-  if (iter != agents.end()) return iter->second->blackboard.goals.size();
+  if (goals.empty()) return false;
 
-  return 0;
+  AIGoal* pGoal = *(goals.begin());
+  AIGoalTakeControlPoint* pGoalTakeControlPoint = (AIGoalTakeControlPoint*)pGoal;
+  goalPosition = pGoalTakeControlPoint->controlPointPosition;
+  return true;
 }
 
-size_t AISystem::GetAgentActionCount(aiagentid_t id) const
-{
-  auto iter = agents.find(id);
-  if (iter != agents.end()) return iter->second->blackboard.actions.size();
 
-  return 0;
+// ** AIAgent
+
+AIAgent::AIAgent(spitfire::math::cVec3& _position, spitfire::math::cQuaternion& _rotation, AIBlackboard& _blackboard) :
+  position(_position),
+  rotation(_rotation),
+  blackboard(_blackboard)
+{
 }
 
-bool AISystem::GetAgentGoalPosition(aiagentid_t id, spitfire::math::cVec3& goalPosition) const
+
+// ** AISystem
+
+AISystem::AISystem(const NavigationMesh& _navigationMesh) :
+  navigationMesh(_navigationMesh),
+  bIsLODEnabled(false),
+  bIsLODFrustumEnabled(false),
+  tick(0),
+  fTimeStepSeconds(0.0f)
 {
-  auto iter = agents.find(id);
-  if (iter != agents.end()) {
-    if (!iter->second->blackboard.goals.empty()) {
-      AIGoal* pGoal = *(iter->second->blackboard.goals.begin());
-      AIGoalTakeControlPoint* pGoalTakeControlPoint = (AIGoalTakeControlPoint*)pGoal;
-      goalPosition = pGoalTakeControlPoint->controlPointPosition;
-      return true;
-    }
+  for (size_t i = 0; i < nLODs; i++) {
+    nAgentsPerLOD[i] = 0;
+    nUpdatedAgentsPerLOD[i] = 0;
   }
+}
 
-  return false;
+void AISystem::SetLODCentre(const spitfire::math::cVec3& position)
+{
+  bIsLODEnabled = true;
+  lodCentre = position;
 }
 
-void AISystem::AddAgentGoal(aiagentid_t id, AIGoal* pGoal)
+void AISystem::SetLODFrustum(const cFrustumCuller& frustum)
 {
-  auto iter = agents.find(id);
-  if (iter != agents.end()) iter->second->blackboard.goals.push_back(pGoal);
+  bIsLODFrustumEnabled = true;
+  lodFrustum = frustum;
 }
 
-void AISystem::Update(spitfire::durationms_t currentSimulationTime)
+AI_LOD AISystem::GetLOD(const spitfire::math::cVec3& position, const AIBlackboard& blackboard) const
 {
-  // Update agents
-  for (auto& iter : agents) {
-    AIAgent& agent = *(iter.second);
+  if (!bIsLODEnabled) return AI_LOD::FULL;
 
-    // No goals, nothing to do
-    if (agent.blackboard.goals.empty()) continue;
+  // Idle agents have nothing to do until they are given a goal
+  if (blackboard.goals.empty()) return AI_LOD::LOW;
 
-    // Remove any goals that are satisfied
-    const size_t nGoalsBefore = agent.blackboard.goals.size();
+  // Agents on screen would be seen to stand still and then jump on the slower tiers
+  if (bIsLODFrustumEnabled && lodFrustum.IsSphereVisible(position, fLODFrustumMargin)) return AI_LOD::FULL;
 
-    std::list<AIGoal*> satisfiedGoals;
+  const float fSquaredDistance = (position - lodCentre).GetSquaredLength();
+  if (fSquaredDistance < (fLODFullDistance * fLODFullDistance)) return AI_LOD::FULL;
+  else if (fSquaredDistance < (fLODReducedDistance * fLODReducedDistance)) return AI_LOD::REDUCED;
 
-    // Work out which goals are satisfied and can be removed
-    for (auto& pGoal : agent.blackboard.goals) {
-      if (pGoal->IsSatisfied(*this, agent)) {
-        satisfiedGoals.push_back(pGoal);
-      }
-    }
+  return AI_LOD::LOW;
+}
 
-    // Remove and delete the satisfied goals
-    for (auto& pGoal : satisfiedGoals) {
-      delete pGoal;
+void AISystem::Update(cEntityStore& entities, float fTickSeconds)
+{
+  tick++;
 
-      agent.blackboard.goals.remove(pGoal);
-    }
+  for (size_t i = 0; i < nLODs; i++) {
+    nAgentsPerLOD[i] = 0;
+    nUpdatedAgentsPerLOD[i] = 0;
+  }
+
+  const uint64_t nMaxElapsedTicks = lodUpdateIntervals[size_t(AI_LOD::LOW)];
+
+  // Walk the dense component arrays of every archetype that has agents, the agents are updated in place
+  for (auto& archetype : entities.GetArchetypes()) {
+    if (!archetype.HasComponents(COMPONENT::AGENT)) continue;
+
+    const size_t n = archetype.size();
+    for (size_t i = 0; i < n; i++) {
+      spitfire::math::cVec3& position = archetype.positions[i];
+      AIBlackboard& blackboard = archetype.blackboards[i];
+
+      blackboard.lod = GetLOD(position, blackboard);
+      nAgentsPerLOD[size_t(blackboard.lod)]++;
+
+      // Stagger the agents on the slower tiers by their id so that a different group is updated each tick
+      if (((tick + archetype.entities[i]) % lodUpdateIntervals[size_t(blackboard.lod)]) != 0) continue;
 
-    // HACK: If we removed any goals then remove all our actions
-    if ((nGoalsBefore - agent.blackboard.goals.size()) != 0) {
-      // Delete all actions
-      for (auto& pAction : agent.blackboard.actions) {
-        delete pAction;
-      }
+      nUpdatedAgentsPerLOD[size_t(blackboard.lod)]++;
 
-      // Remove all actions
-      agent.blackboard.actions.clear();
+      // Catch up on the ticks since the last update or since the agent was created, an agent that has moved to a faster tier
+      // may have waited less than its old interval
+      const uint64_t nElapsedTicks = std::min(tick - blackboard.lastUpdateTick, nMaxElapsedTicks);
+      blackboard.lastUpdateTick = tick;
+      fTimeStepSeconds = float(nElapsedTicks) * fTickSeconds;
+
+      const float fPreviousX = position.x;
+      const float fPreviousZ = position.z;
+
+      AIAgent agent(position, archetype.rotations[i], blackboard);
+      UpdateAgent(agent);
+
+      // Only agents that moved across the terrain need to be snapped to it again
+      if ((position.x != fPreviousX) || (position.z != fPreviousZ)) archetype.moved.push_back(uint32_t(i));
     }
+  }
+}
 
-    // No goals any more, nothing to do
-    if (agent.blackboard.goals.empty()) continue;
+void AISystem::UpdateAgent(AIAgent& agent)
+{
+  // No goals, nothing to do
+  if (!StartGoal(agent)) return;
 
-    // If we don't have an action yet then we need to work out which action can satisfy our primary goal and add it
-    if (agent.blackboard.actions.empty()) {
-      // TODO: Work out which actions satisfy our goals and add them
+  // If we don't have an action yet then we need to work out which action can satisfy our primary goal and add it
+  if (agent.blackboard.actions.empty()) {
+    // TODO: Work out which actions satisfy our goals and add them
 
-      const Node* pNodeFrom = navigationMesh.GetClosestNodeToPoint(agent.position);
-      ASSERT(pNodeFrom != nullptr);
+    PROFILE_ZONE("AI path request");
 
-      AIGoal* pGoal = *(agent.blackboard.goals.begin());
-      AIGoalTakeControlPoint* pGoalTakeControlPoint = (AIGoalTakeControlPoint*)pGoal;
+    const Node* pNodeFrom = navigationMesh.GetClosestNodeToPoint(agent.position);
+    ASSERT(pNodeFrom != nullptr);
 
-      const Node* pNodeTo = navigationMesh.GetClosestNodeToPoint(pGoalTakeControlPoint->controlPointPosition);
-      ASSERT(pNodeTo != nullptr);
+    AIGoal* pGoal = *(agent.blackboard.goals.begin());
+    AIGoalTakeControlPoint* pGoalTakeControlPoint = (AIGoalTakeControlPoint*)pGoal;
 
-      std::list<Node> path;
+    const Node* pNodeTo = navigationMesh.GetClosestNodeToPoint(pGoalTakeControlPoint->controlPointPosition);
+    ASSERT(pNodeTo != nullptr);
 
-      // If our starting node is not the same node as our end node then we need to find out the path between them
-      if ((pNodeFrom != nullptr) && (pNodeTo != nullptr) && (pNodeFrom != pNodeTo)) {
-        astar::config<Node> cfg;
-        cfg.node_limit = 1000;
-        cfg.cost_limit = 1000;
-        cfg.route_cost = 0.0f;
+    std::list<Node> path;
 
-        astar::astar(*pNodeFrom, *pNodeTo, path, &astar::straight_distance_heuristic<Node>, cfg);
-      }
+    // If our starting node is not the same node as our end node then we need to find out the path between them
+    if ((pNodeFrom != nullptr) && (pNodeTo != nullptr) && (pNodeFrom != pNodeTo)) {
+      astar::config<Node> cfg;
+      cfg.node_limit = 1000;
+      cfg.cost_limit = 1000;
+      cfg.route_cost = 0.0f;
 
-      agent.blackboard.actions.push_back(new AIActionGoto(path, pGoalTakeControlPoint->controlPointPosition));
+      PROFILE_ZONE("A*");
+      astar::astar(*pNodeFrom, *pNodeTo, path, &astar::straight_distance_heuristic<Node>, cfg);
+      PROFILE_COUNTER("A* nodes examined", cfg.result_nodes_examined);
     }
 
-    for (auto pAction : agent.blackboard.actions) {
-      pAction->Update(*this, agent);
+    agent.blackboard.actions.push_back(new AIActionGoto(path, pGoalTakeControlPoint->controlPointPosition));
+  }
+
+  const spitfire::math::cVec3 previousPosition = agent.position;
+
+  for (auto pAction : agent.blackboard.actions) {
+    pAction->Update(*this, agent);
+  }
+
+  // An agent that has not moved cannot have arrived anywhere new so there is nothing to evaluate
+  if ((agent.position.x != previousPosition.x) || (agent.position.y != previousPosition.y) || (agent.position.z != previousPosition.z)) CheckTriggers(agent);
+}
+
+bool AISystem::StartGoal(AIAgent& agent)
+{
+  AIBlackboard& blackboard = agent.blackboard;
+
+  while (!blackboard.goals.empty() && !blackboard.bIsGoalStarted) {
+    blackboard.bIsGoalStarted = true;
+
+    if (blackboard.goals.front()->Start(*this, agent)) {
+      CompleteGoal(agent);
+      continue;
     }
+
+    // The agent may already be where the goal wants it to be
+    CheckTriggers(agent);
   }
+
+  return !blackboard.goals.empty();
+}
+
+void AISystem::CheckTriggers(AIAgent& agent)
+{
+  AIBlackboard& blackboard = agent.blackboard;
+
+  AIArrivalTrigger& arrival = blackboard.arrival;
+  if (!arrival.bIsSet) return;
+
+  const float fSquaredDistance = (agent.position - arrival.position).GetSquaredLength();
+  if (fSquaredDistance >= arrival.fSquaredRadius) return;
+
+  // The trigger has fired, the goal registers another one if it is still waiting for something
+  blackboard.ClearTriggers();
+
+  if (blackboard.goals.front()->OnArrived(*this, agent)) CompleteGoal(agent);
+}
+
+void AISystem::CompleteGoal(AIAgent& agent)
+{
+  AIBlackboard& blackboard = agent.blackboard;
+
+  delete blackboard.goals.front();
+  blackboard.goals.pop_front();
+  blackboard.bIsGoalStarted = false;
+  blackboard.ClearTriggers();
+
+  // The actions were for the goal that we just completed
+  blackboard.ClearActions();
 }
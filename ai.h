@@ -2,32 +2,53 @@
 #define AI_H
 
 #include <list>
-#include <map>
-#include <memory>
 
 #include <spitfire/spitfire.h>
 #include <spitfire/math/cVec3.h>
 #include <spitfire/math/cQuaternion.h>
 
+#include "culling.h"
+
 struct Node;
 class NavigationMesh;
-
-typedef uint16_t aiagentid_t;
+class cEntityStore;
 
 class AISystem;
 struct AIAgent;
 
+// How often an agent is updated, agents that are off screen and far from the camera or have nothing to do are updated less
+// often.  The renderer only interpolates between consecutive ticks so agents that are on screen and moving are always FULL.
+enum class AI_LOD {
+  FULL, // Every tick
+  REDUCED, // Every 4 ticks
+  LOW, // Every 16 ticks
+
+  COUNT
+};
+
+// ** AIGoal
+//
+// Goals are not polled.  When a goal becomes the agent's current goal it registers the conditions that it is waiting for
+// on the agent's blackboard and the AISystem only calls it again when one of them is met.
+
 class AIGoal {
 public:
-  virtual bool IsSatisfied(const AISystem& ai, const AIAgent& agent) const = 0;
-  virtual void Update(const AISystem& ai, const AIAgent& agent) {}
+  virtual ~AIGoal() {}
+
+  // Registers the goal's triggers, returns true if there is nothing to do
+  virtual bool Start(const AISystem& ai, AIAgent& agent) = 0;
+
+  // Called when the agent arrives within the radius of the arrival trigger, returns true if the goal is satisfied,
+  // otherwise the goal registers its next trigger
+  virtual bool OnArrived(const AISystem& ai, AIAgent& agent) = 0;
 };
 
 class AIGoalTakeControlPoint : public AIGoal {
 public:
   explicit AIGoalTakeControlPoint(const spitfire::math::cVec3& controlPointPosition);
 
-  virtual bool IsSatisfied(const AISystem& ai, const AIAgent& agent) const override;
+  virtual bool Start(const AISystem& ai, AIAgent& agent) override;
+  virtual bool OnArrived(const AISystem& ai, AIAgent& agent) override;
 
   spitfire::math::cVec3 controlPointPosition;
 };
@@ -42,8 +63,8 @@ class AIGoalPatrol : public AIGoal {
 public:
   explicit AIGoalPatrol(const std::list<spitfire::math::cVec3>& patrolPoints);
 
-  virtual bool IsSatisfied(const AISystem& ai, const AIAgent& agent) const override;
-  virtual void Update(const AISystem& ai, const AIAgent& agent) override;
+  virtual bool Start(const AISystem& ai, AIAgent& agent) override;
+  virtual bool OnArrived(const AISystem& ai, AIAgent& agent) override;
 
   std::list<spitfire::math::cVec3> patrolPoints;
 };
@@ -57,11 +78,7 @@ public:
 
 class AIActionGoto : public AIAction {
 public:
-  explicit AIActionGoto(const std::list<Node>& _path, const spitfire::math::cVec3& _targetPosition) :
-    path(_path),
-    targetPosition(_targetPosition)
-  {
-  }
+  AIActionGoto(const std::list<Node>& path, const spitfire::math::cVec3& targetPosition);
 
 private:
   virtual void Update(const AISystem& ai, AIAgent& agent) override;
@@ -113,41 +130,117 @@ private:
 
 
 
-struct AIAgent {
-  explicit AIAgent(const spitfire::math::cVec3& position, const spitfire::math::cQuaternion& rotation);
+// ** AIArrivalTrigger
+//
+// Fires when the agent moves to within a radius of a position
 
+struct AIArrivalTrigger {
   spitfire::math::cVec3 position;
-  spitfire::math::cQuaternion rotation;
+  float fSquaredRadius;
+  bool bIsSet;
+};
+
+
+// ** AIBlackboard
+//
+// The AI state for one agent, stored in the entity store's AGENT component array.  It owns its goals and actions so it
+// can be moved but not copied.
+
+struct AIBlackboard {
+  AIBlackboard();
+  AIBlackboard(AIBlackboard&& rhs) noexcept;
+  ~AIBlackboard();
+
+  AIBlackboard& operator=(AIBlackboard&& rhs) noexcept;
+
+  bool GetGoalPosition(spitfire::math::cVec3& goalPosition) const;
+
+  void SetArrivalTrigger(const spitfire::math::cVec3& position, float fRadius);
+  void ClearTriggers();
 
-  struct Blackboard {
-    std::list<AIGoal*> goals;
-    std::list<AIAction*> actions;
-  };
-  Blackboard blackboard;
+  void ClearActions();
+
+  // New goals are added to the back, the goal at the front is the current goal
+  std::list<AIGoal*> goals;
+  std::list<AIAction*> actions;
+
+  bool bIsGoalStarted; // Set once the current goal has registered its triggers
+  AIArrivalTrigger arrival;
+
+  AI_LOD lod;
+  uint64_t lastUpdateTick; // The AISystem tick that the agent was last updated on, or created on if it has not been updated yet
+
+private:
+  void Clear();
 };
 
+
+// ** AIAgent
+//
+// A view of one agent's components while it is being updated, the components themselves live in the entity store
+
+struct AIAgent {
+  AIAgent(spitfire::math::cVec3& position, spitfire::math::cQuaternion& rotation, AIBlackboard& blackboard);
+
+  spitfire::math::cVec3& position;
+  spitfire::math::cQuaternion& rotation;
+  AIBlackboard& blackboard;
+};
+
+// ** AISystem
+//
+// Updates the agents.  Once a level of detail centre has been set, usually the camera, every agent is given an AI_LOD each
+// tick from whether it is inside the view frustum, its distance to the centre and whether it has any goals.  The agents on the slower tiers are spread over the
+// ticks by their entity id so the number of agents updated each tick stays about the same, and each update covers all of
+// the time since the agent was last updated.
+
 class AISystem {
 public:
+  static const size_t nLODs = size_t(AI_LOD::COUNT);
+
   explicit AISystem(const NavigationMesh& navigationMesh);
 
-  aiagentid_t AddAgent(const spitfire::math::cVec3& position, const spitfire::math::cQuaternion& rotation);
-  void RemoveAgent(aiagentid_t id);
+  // Every agent is updated every tick until this is called
+  void SetLODCentre(const spitfire::math::cVec3& position);
 
-  const spitfire::math::cVec3& GetAgentPosition(aiagentid_t id) const;
-  void SetAgentPositionAndRotation(aiagentid_t id, const spitfire::math::cVec3& position, const spitfire::math::cQuaternion& rotation);
+  // Agents inside the frustum are always updated every tick, without a frustum the tiers only depend on distance
+  void SetLODFrustum(const cFrustumCuller& frustum);
 
-  size_t GetAgentGoalCount(aiagentid_t id) const;
-  size_t GetAgentActionCount(aiagentid_t id) const;
+  // New agents should set their lastUpdateTick to this so that their first update covers the ticks they have waited
+  uint64_t GetTick() const { return tick; }
 
-  bool GetAgentGoalPosition(aiagentid_t id, spitfire::math::cVec3& goalPosition) const;
-  void AddAgentGoal(aiagentid_t id, AIGoal* pGoal);
+  // Advance every entity with an AGENT component by a fixed time step in seconds
+  void Update(cEntityStore& entities, float fTimeStepSeconds);
 
-  void Update(spitfire::durationms_t currentSimulationTime);
+  // The time step of the agent that is being updated, agents on the slower tiers take bigger steps
+  float GetTimeStepSeconds() const { return fTimeStepSeconds; }
+
+  // Statistics for the last tick
+  size_t GetLODAgentCount(AI_LOD lod) const { return nAgentsPerLOD[size_t(lod)]; }
+  size_t GetLODUpdatedAgentCount(AI_LOD lod) const { return nUpdatedAgentsPerLOD[size_t(lod)]; }
 
 private:
+  AI_LOD GetLOD(const spitfire::math::cVec3& position, const AIBlackboard& blackboard) const;
+
+  void UpdateAgent(AIAgent& agent);
+
+  // Starts the current goal if it has not been started yet, returns false if the agent has no goals left
+  bool StartGoal(AIAgent& agent);
+  void CheckTriggers(AIAgent& agent);
+  void CompleteGoal(AIAgent& agent);
+
   const NavigationMesh& navigationMesh;
 
-  std::map<aiagentid_t, std::unique_ptr<AIAgent> > agents;
+  bool bIsLODEnabled;
+  spitfire::math::cVec3 lodCentre;
+  bool bIsLODFrustumEnabled;
+  cFrustumCuller lodFrustum;
+
+  uint64_t tick;
+  float fTimeStepSeconds;
+
+  size_t nAgentsPerLOD[nLODs];
+  size_t nUpdatedAgentsPerLOD[nLODs];
 };
 
 #endif // AI_H
@@ -0,0 +1,126 @@
+#include <cassert>
+
+#include <spitfire/util/log.h>
+
+#include "assetloader.h"
+#include "jobsystem.h"
+#include "profiler.h"
+
+namespace
+{
+  double GetMillisecondsBetween(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+  {
+    return std::chrono::duration<double, std::milli>(end - start).count();
+  }
+}
+
+// ** cAssetLoader
+
+cAssetLoader::cAssetLoader(cJobSystem& _jobs) :
+  jobs(_jobs),
+  nFinished(0),
+  bIsStarted(false)
+{
+}
+
+size_t cAssetLoader::Add(const std::string& sName, const std::function<void()>& load, const std::function<void()>& upload, const std::vector<size_t>& dependencies)
+{
+  // The workers hold indices into the assets so they cannot move once loading has started
+  assert(!bIsStarted);
+
+  const size_t index = assets.size();
+
+  Asset asset;
+  asset.sName = sName;
+  asset.load = load;
+  asset.upload = upload;
+  asset.nDependenciesRemaining = dependencies.size();
+  asset.state = STATE::WAITING;
+  asset.fLoadMS = 0.0;
+  asset.fUploadMS = 0.0;
+  assets.push_back(asset);
+
+  for (auto dependency : dependencies) {
+    assert(dependency < index);
+    assets[dependency].dependents.push_back(index);
+  }
+
+  return index;
+}
+
+void cAssetLoader::Start()
+{
+  assert(!bIsStarted);
+  bIsStarted = true;
+
+  startTime = std::chrono::steady_clock::now();
+  finishTime = startTime;
+
+  const size_t n = assets.size();
+  for (size_t i = 0; i < n; i++) {
+    if (assets[i].nDependenciesRemaining == 0) StartLoading(i);
+  }
+}
+
+void cAssetLoader::Update()
+{
+  PROFILE_ZONE("Asset uploads");
+
+  jobs.RunMainThreadJobs();
+}
+
+double cAssetLoader::GetElapsedMS() const
+{
+  if (!bIsStarted) return 0.0;
+
+  return GetMillisecondsBetween(startTime, IsFinished() ? finishTime : std::chrono::steady_clock::now());
+}
+
+void cAssetLoader::StartLoading(size_t index)
+{
+  Asset& asset = assets[index];
+  asset.state = STATE::LOADING;
+
+  if (!asset.load) {
+    OnLoaded(index);
+    return;
+  }
+
+  jobs.AddJob([this, index]() {
+    Asset& asset = assets[index];
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    asset.load();
+    asset.fLoadMS = GetMillisecondsBetween(start, std::chrono::steady_clock::now());
+
+    jobs.AddMainThreadJob([this, index]() { OnLoaded(index); });
+  });
+}
+
+void cAssetLoader::OnLoaded(size_t index)
+{
+  Asset& asset = assets[index];
+
+  if (asset.upload) {
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    asset.upload();
+    asset.fUploadMS = GetMillisecondsBetween(start, std::chrono::steady_clock::now());
+  }
+
+  asset.state = STATE::FINISHED;
+  nFinished++;
+  if (IsFinished()) finishTime = std::chrono::steady_clock::now();
+
+  for (auto dependent : asset.dependents) {
+    assert(assets[dependent].nDependenciesRemaining != 0);
+    assets[dependent].nDependenciesRemaining--;
+    if (assets[dependent].nDependenciesRemaining == 0) StartLoading(dependent);
+  }
+}
+
+void cAssetLoader::LogTimings() const
+{
+  for (auto& asset : assets) LOG(asset.sName, ": load ", asset.fLoadMS, " ms, upload ", asset.fUploadMS, " ms");
+
+  LOG("Loaded ", assets.size(), " assets in ", GetElapsedMS(), " ms");
+}
@@ -0,0 +1,73 @@
+#ifndef ASSETLOADER_H
+#define ASSETLOADER_H
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+
+class cJobSystem;
+
+// ** cAssetLoader
+//
+// Loads assets with the job system.  Each asset has a load function that runs on a worker thread followed by an upload
+// function that runs on the main thread for anything that needs OpenGL, either can be empty.  An asset only starts
+// loading once every asset that it depends on has been uploaded, assets with nothing in common load at the same time.
+
+class cAssetLoader
+{
+public:
+  enum class STATE {
+    WAITING,
+    LOADING,
+    FINISHED
+  };
+
+  struct Asset {
+    std::string sName;
+    std::function<void()> load;
+    std::function<void()> upload;
+    std::vector<size_t> dependents;
+    size_t nDependenciesRemaining;
+
+    STATE state;
+    double fLoadMS; // Written by the worker thread, only read once the asset is finished
+    double fUploadMS;
+  };
+
+  explicit cAssetLoader(cJobSystem& jobs);
+
+  // Assets can only be added before Start is called, returns the handle of the asset for other assets to depend on
+  size_t Add(const std::string& sName, const std::function<void()>& load, const std::function<void()>& upload, const std::vector<size_t>& dependencies = std::vector<size_t>());
+
+  void Start();
+
+  // Called from the main thread every frame, uploads the assets that have finished loading
+  void Update();
+
+  bool IsFinished() const { return (nFinished == assets.size()); }
+  size_t GetFinishedCount() const { return nFinished; }
+  double GetElapsedMS() const;
+
+  const std::vector<Asset>& GetAssets() const { return assets; }
+
+  void LogTimings() const;
+
+private:
+  void StartLoading(size_t index);
+  void OnLoaded(size_t index);
+
+  cJobSystem& jobs;
+
+  std::vector<Asset> assets;
+  size_t nFinished;
+  bool bIsStarted;
+
+  std::chrono::steady_clock::time_point startTime;
+  std::chrono::steady_clock::time_point finishTime;
+};
+
+#endif // ASSETLOADER_H
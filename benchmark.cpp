@@ -0,0 +1,467 @@
+// Microbenchmarks for the navigation, ray casting, heightmap and AI code.  Every workload is generated from a seeded random
+// number generator so that runs are comparable, results are written as JSON so that they can be tracked over time.
+//
+// Usage: rebellion_benchmark [--seed=N] [--repeats=N] [--filter=text] [--heightmap=path] [--output=path]
+//
+// --filter only runs the benchmarks with the text in their name, without --output the JSON is written to stdout.
+
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+#include <spitfire/math/math.h>
+#include <spitfire/math/cVec3.h>
+#include <spitfire/math/cQuaternion.h>
+#include <spitfire/math/cColour.h>
+#include <spitfire/math/geometry.h>
+
+// Application headers
+#include "ai.h"
+#include "astar.h"
+#include "entities.h"
+#include "heightmap.h"
+#include "navigation.h"
+#include "raycast.h"
+
+namespace
+{
+  struct Settings {
+    Settings();
+
+    uint32_t seed;
+    size_t nRepeats;
+    std::string sFilter;
+    std::string sHeightmapFilePath;
+    std::string sOutputFilePath;
+  };
+
+  Settings::Settings() :
+    seed(1),
+    nRepeats(5),
+    sHeightmapFilePath("textures/heightmap.png")
+  {
+  }
+
+  bool ParseArgument(const char* szArgument, const char* szName, std::string& sValue)
+  {
+    const size_t length = strlen(szName);
+    if ((strncmp(szArgument, szName, length) != 0) || (szArgument[length] != '=')) return false;
+
+    sValue = szArgument + length + 1;
+    return true;
+  }
+
+  bool ParseCommandLine(int argc, char** argv, Settings& settings)
+  {
+    for (int i = 1; i < argc; i++) {
+      std::string sValue;
+      if (ParseArgument(argv[i], "--seed", sValue)) settings.seed = uint32_t(strtoul(sValue.c_str(), nullptr, 10));
+      else if (ParseArgument(argv[i], "--repeats", sValue)) settings.nRepeats = std::max<size_t>(1, size_t(strtoul(sValue.c_str(), nullptr, 10)));
+      else if (ParseArgument(argv[i], "--filter", sValue)) settings.sFilter = sValue;
+      else if (ParseArgument(argv[i], "--heightmap", sValue)) settings.sHeightmapFilePath = sValue;
+      else if (ParseArgument(argv[i], "--output", sValue)) settings.sOutputFilePath = sValue;
+      else {
+        std::cerr<<"Unknown argument \""<<argv[i]<<"\""<<std::endl;
+        std::cerr<<"Usage: rebellion_benchmark [--seed=N] [--repeats=N] [--filter=text] [--heightmap=path] [--output=path]"<<std::endl;
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+
+  // ** cBenchmarkRunner
+  //
+  // Each benchmark has a setup that is not timed and a function that is timed once per repeat.  The function is told the
+  // repeat index and returns the number of operations it did so that we can report the time per operation.
+
+  class cBenchmarkRunner
+  {
+  public:
+    explicit cBenchmarkRunner(const Settings& settings);
+
+    void Run(const std::string& sName, const std::function<size_t(size_t)>& function);
+
+    // The setup function is called before each repeat and is not timed
+    void Run(const std::string& sName, const std::function<void()>& setup, const std::function<size_t(size_t)>& function);
+
+    void WriteJSON(std::ostream& o) const;
+
+  private:
+    struct Result {
+      std::string sName;
+      size_t nOperations;
+      double fMinMS;
+      double fMedianMS;
+      double fMeanMS;
+      double fMaxMS;
+    };
+
+    const Settings& settings;
+    std::vector<Result> results;
+  };
+
+  cBenchmarkRunner::cBenchmarkRunner(const Settings& _settings) :
+    settings(_settings)
+  {
+  }
+
+  void cBenchmarkRunner::Run(const std::string& sName, const std::function<size_t(size_t)>& function)
+  {
+    Run(sName, std::function<void()>(), function);
+  }
+
+  void cBenchmarkRunner::Run(const std::string& sName, const std::function<void()>& setup, const std::function<size_t(size_t)>& function)
+  {
+    if (!settings.sFilter.empty() && (sName.find(settings.sFilter) == std::string::npos)) return;
+
+    std::cerr<<"Running "<<sName<<std::endl;
+
+    std::vector<double> times;
+    size_t nOperations = 0;
+
+    for (size_t i = 0; i < settings.nRepeats; i++) {
+      if (setup) setup();
+
+      const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+      nOperations = function(i);
+
+      times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    std::sort(times.begin(), times.end());
+
+    Result result;
+    result.sName = sName;
+    result.nOperations = nOperations;
+    result.fMinMS = times.front();
+    result.fMedianMS = times[times.size() / 2];
+    result.fMaxMS = times.back();
+    result.fMeanMS = 0.0;
+    for (auto fTime : times) result.fMeanMS += fTime;
+    result.fMeanMS /= double(times.size());
+
+    results.push_back(result);
+  }
+
+  void cBenchmarkRunner::WriteJSON(std::ostream& o) const
+  {
+    o<<"{"<<std::endl;
+    o<<"  \"seed\": "<<settings.seed<<","<<std::endl;
+    o<<"  \"repeats\": "<<settings.nRepeats<<","<<std::endl;
+    o<<"  \"benchmarks\": ["<<std::endl;
+
+    const size_t n = results.size();
+    for (size_t i = 0; i < n; i++) {
+      const Result& result = results[i];
+      const double fOperations = double(std::max<size_t>(1, result.nOperations));
+      o<<"    { \"name\": \""<<result.sName<<"\", \"operations\": "<<result.nOperations<<
+        ", \"min_ms\": "<<result.fMinMS<<", \"median_ms\": "<<result.fMedianMS<<", \"mean_ms\": "<<result.fMeanMS<<", \"max_ms\": "<<result.fMaxMS<<
+        ", \"median_ns_per_operation\": "<<(1000000.0 * result.fMedianMS / fOperations)<<" }"<<((i + 1) < n ? "," : "")<<std::endl;
+    }
+
+    o<<"  ]"<<std::endl;
+    o<<"}"<<std::endl;
+  }
+
+
+  spitfire::math::cVec3 GetRandomPoint(std::mt19937& generator, float fAreaSize)
+  {
+    std::uniform_real_distribution<float> distribution(0.0f, fAreaSize);
+    const float x = distribution(generator);
+    const float z = distribution(generator);
+    return spitfire::math::cVec3(x, 0.0f, z);
+  }
+
+  // Results are written here so that the compiler cannot throw away the work being measured
+  volatile float fSink = 0.0f;
+
+  const spitfire::math::cVec3 heightMapScale(0.5f, 10.0f, 0.5f);
+  const float fNavigationMeshSpacing = 10.0f;
+
+
+  void BenchmarkNavigation(cBenchmarkRunner& runner, const Settings& settings, const cHeightmapData& heightMapData)
+  {
+    const size_t sizes[] = { 8, 16, 32, 64 };
+    for (auto size : sizes) {
+      NavigationMesh navigationMesh;
+      CreateGridNavigationMesh(navigationMesh, heightMapData, heightMapScale, size, size, fNavigationMeshSpacing, settings.seed);
+
+      const float fAreaSize = fNavigationMeshSpacing * float(size + 1);
+
+      {
+        std::mt19937 generator(settings.seed);
+        std::vector<spitfire::math::cVec3> points;
+        for (size_t i = 0; i < 10000; i++) points.push_back(GetRandomPoint(generator, fAreaSize));
+
+        runner.Run("navigation_closest_node_" + std::to_string(size) + "x" + std::to_string(size), [&](size_t) {
+          size_t nFound = 0;
+          for (auto& point : points) {
+            if (navigationMesh.GetClosestNodeToPoint(point) != nullptr) nFound++;
+          }
+          assert(nFound == points.size());
+          return points.size();
+        });
+      }
+
+      {
+        std::mt19937 generator(settings.seed);
+        std::uniform_int_distribution<size_t> distribution(0, navigationMesh.GetNodeCount() - 1);
+        std::vector<std::pair<size_t, size_t>> pairs;
+        for (size_t i = 0; i < 100; i++) pairs.push_back(std::make_pair(distribution(generator), distribution(generator)));
+
+        runner.Run("navigation_astar_" + std::to_string(size) + "x" + std::to_string(size), [&](size_t) {
+          for (auto& pair : pairs) {
+            astar::config<Node> cfg;
+            cfg.node_limit = navigationMesh.GetNodeCount();
+            cfg.cost_limit = 1000000.0f;
+            cfg.route_cost = 0.0f;
+
+            std::list<Node> path;
+            astar::astar(navigationMesh.GetNode(pair.first), navigationMesh.GetNode(pair.second), path, &astar::straight_distance_heuristic<Node>, cfg);
+          }
+          return pairs.size();
+        });
+      }
+    }
+  }
+
+  void BenchmarkRayCasts(cBenchmarkRunner& runner, const Settings& settings, const cHeightmapData& heightMapData)
+  {
+    std::unique_ptr<spitfire::math::cQuadtree<spitfire::math::cAABB2>> quadtree = BuildHeightmapQuadtree(heightMapData, heightMapScale);
+
+    const float fAreaSize = heightMapScale.x * float(heightMapData.GetWidth());
+
+    // Rays start above the heightmap and point down at a random point on it
+    std::mt19937 generator(settings.seed);
+    std::vector<spitfire::math::cRay3> rays;
+    for (size_t i = 0; i < 1000; i++) {
+      spitfire::math::cVec3 origin = GetRandomPoint(generator, fAreaSize);
+      origin.y = 2.0f * heightMapScale.y;
+      spitfire::math::cVec3 target = GetRandomPoint(generator, fAreaSize);
+
+      spitfire::math::cRay3 ray;
+      ray.SetOriginAndDirection(origin, (target - origin).GetNormalised());
+      ray.SetLength(10000.0f);
+      rays.push_back(ray);
+    }
+
+    runner.Run("heightmap_raycast", [&](size_t) {
+      size_t nHits = 0;
+      for (auto& ray : rays) {
+        if (CollideRayWithHeightmap(heightMapData, heightMapScale, *quadtree, ray, nullptr) >= 0.0f) nHits++;
+      }
+      fSink = float(nHits);
+      return rays.size();
+    });
+  }
+
+  bool BenchmarkHeightmap(cBenchmarkRunner& runner, const Settings& settings, const cHeightmapData& heightMapData)
+  {
+    if (!settings.sHeightmapFilePath.empty()) {
+      const spitfire::string_t sHeightmapFilePath = spitfire::string::ToString_t(settings.sHeightmapFilePath);
+
+      // Load it once outside of the timing, otherwise a bad path would be timed and reported as a result, this also means
+      // that every repeat reads the file from the OS file cache
+      {
+        cHeightmapData data;
+        if (!data.LoadFromFile(sHeightmapFilePath)) {
+          std::cerr<<"Could not load heightmap ""<<settings.sHeightmapFilePath<<"""<<std::endl;
+          return false;
+        }
+      }
+
+      runner.Run("heightmap_load_from_file", [&](size_t) {
+        cHeightmapData data;
+        data.LoadFromFile(sHeightmapFilePath);
+        return size_t(1);
+      });
+    }
+
+    runner.Run("heightmap_create_procedural_512", [&](size_t repeat) {
+      cHeightmapData data;
+      data.CreateProcedural(512, 512, settings.seed + uint32_t(repeat));
+      return size_t(1);
+    });
+
+    {
+      // Every repeat moves the sun a little further around so that nothing can be reused between repeats
+      cHeightmapData data;
+      data.CreateProcedural(heightMapData.GetWidth(), heightMapData.GetDepth(), settings.seed);
+
+      runner.Run("heightmap_bake_lightmap", [&](size_t repeat) {
+        const float fAzimuth = 0.1f * float(repeat);
+        data.BakeLightmap(spitfire::math::cVec3(cosf(fAzimuth), 0.5f, sinf(fAzimuth)));
+        return data.GetLightmapWidth() * data.GetLightmapDepth();
+      });
+    }
+
+    runner.Run("heightmap_get_normal", [&](size_t) {
+      const size_t width = heightMapData.GetWidth();
+      const size_t depth = heightMapData.GetDepth();
+      spitfire::math::cVec3 total;
+      for (size_t y = 0; y < depth; y++) {
+        for (size_t x = 0; x < width; x++) total += heightMapData.GetNormal(x, y, heightMapScale);
+      }
+      fSink = total.y;
+      return width * depth;
+    });
+
+    {
+      // Random points over the whole heightmap, like a tick's worth of moved soldiers
+      const size_t nPoints = 100000;
+      std::mt19937 generator(settings.seed);
+      std::uniform_real_distribution<float> distributionX(0.0f, float(heightMapData.GetWidth()));
+      std::uniform_real_distribution<float> distributionZ(0.0f, float(heightMapData.GetDepth()));
+      std::vector<float> x(nPoints);
+      std::vector<float> z(nPoints);
+      for (size_t i = 0; i < nPoints; i++) {
+        x[i] = distributionX(generator);
+        z[i] = distributionZ(generator);
+      }
+
+      std::vector<float> heights(nPoints);
+
+      runner.Run("heightmap_sample_heights", [&](size_t) {
+        heightMapData.SampleHeights(&x[0], &z[0], &heights[0], nPoints);
+        fSink = heights[0];
+        return nPoints;
+      });
+    }
+
+    {
+      const size_t width = heightMapData.GetLightmapWidth();
+      const size_t depth = heightMapData.GetLightmapDepth();
+
+      std::mt19937 generator(settings.seed);
+      std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+      std::vector<spitfire::math::cColour> source(width * depth);
+      for (auto& colour : source) {
+        const float fValue = distribution(generator);
+        colour = spitfire::math::cColour(fValue, fValue, fValue);
+      }
+
+      std::vector<spitfire::math::cColour> destination;
+
+      runner.Run("heightmap_smooth_image", [&](size_t) {
+        heightMapData.SmoothImage(source, width, depth, 10, destination);
+        return width * depth;
+      });
+    }
+
+    return true;
+  }
+
+  void BenchmarkAI(cBenchmarkRunner& runner, const Settings& settings, const cHeightmapData& heightMapData)
+  {
+    const size_t nNodesPerSide = 24;
+    NavigationMesh navigationMesh;
+    CreateGridNavigationMesh(navigationMesh, heightMapData, heightMapScale, nNodesPerSide, nNodesPerSide, fNavigationMeshSpacing, settings.seed);
+
+    const float fAreaSize = fNavigationMeshSpacing * float(nNodesPerSide + 1);
+    const float fTimeStepSeconds = 1.0f / 60.0f;
+    const size_t nTicks = 10;
+
+    const size_t agentCounts[] = { 1000, 10000, 100000 };
+    for (auto nAgents : agentCounts) {
+      // Every benchmark and every repeat starts from the same agents and goals
+      std::unique_ptr<AISystem> ai;
+      std::unique_ptr<cEntityStore> entities;
+
+      // The simulation snaps the agents that moved to the terrain after every tick, which empties the moved lists, there is
+      // no terrain here so they are just emptied, otherwise every tick would add to the lists and the growing would be timed
+      auto ClearMoved = [&]() {
+        for (auto& archetype : entities->GetArchetypes()) archetype.moved.clear();
+      };
+
+      auto Tick = [&]() {
+        ai->Update(*entities, fTimeStepSeconds);
+        ClearMoved();
+      };
+
+      auto Setup = [&]() {
+        ai.reset(new AISystem(navigationMesh));
+
+        std::mt19937 generator(settings.seed);
+        entities.reset(new cEntityStore);
+        for (size_t i = 0; i < nAgents; i++) {
+          const entityid_t id = entities->AddEntity(COMPONENT::AGENT, TYPE::SOLDIER, GetRandomPoint(generator, fAreaSize), spitfire::math::cQuaternion());
+          entities->GetBlackboard(id)->goals.push_back(new AIGoalTakeControlPoint(GetRandomPoint(generator, fAreaSize)));
+        }
+        ClearMoved();
+      };
+
+      // Run the first tick outside of the timing so that every agent has planned its path
+      auto SetupMoving = [&](bool bIsLODEnabled) {
+        Setup();
+        Tick();
+        if (bIsLODEnabled) ai->SetLODCentre(spitfire::math::cVec3(0.5f * fAreaSize, 0.0f, 0.5f * fAreaSize));
+      };
+
+      // The first tick plans a path for every agent
+      runner.Run("ai_first_tick_" + std::to_string(nAgents), [&]() { Setup(); }, [&](size_t) {
+        Tick();
+        return nAgents;
+      });
+
+      // Following ticks just move the agents along their paths
+      runner.Run("ai_tick_" + std::to_string(nAgents), [&]() { SetupMoving(false); }, [&](size_t) {
+        for (size_t i = 0; i < nTicks; i++) Tick();
+        return nTicks * nAgents;
+      });
+
+      // The same ticks with the camera over the middle of the area, the agents further away are updated less often
+      runner.Run("ai_tick_lod_" + std::to_string(nAgents), [&]() { SetupMoving(true); }, [&](size_t) {
+        for (size_t i = 0; i < nTicks; i++) Tick();
+        return nTicks * nAgents;
+      });
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  Settings settings;
+  if (!ParseCommandLine(argc, argv, settings)) return EXIT_FAILURE;
+
+  // Every benchmark that needs a heightmap uses the same procedural one
+  cHeightmapData heightMapData;
+  heightMapData.CreateProcedural(512, 512, settings.seed);
+
+  cBenchmarkRunner runner(settings);
+
+  BenchmarkNavigation(runner, settings, heightMapData);
+  BenchmarkRayCasts(runner, settings, heightMapData);
+  if (!BenchmarkHeightmap(runner, settings, heightMapData)) return EXIT_FAILURE;
+  BenchmarkAI(runner, settings, heightMapData);
+
+  if (settings.sOutputFilePath.empty()) runner.WriteJSON(std::cout);
+  else {
+    std::ofstream file(settings.sOutputFilePath.c_str());
+    if (!file.good()) {
+      std::cerr<<"Could not open \""<<settings.sOutputFilePath<<"\""<<std::endl;
+      return EXIT_FAILURE;
+    }
+
+    runner.WriteJSON(file);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,170 @@
+#include <cassert>
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 1))
+#define BUILD_BLUR_SSE
+#include <xmmintrin.h>
+#endif
+
+// Application headers
+#include "blur.h"
+#include "parallel.h"
+
+namespace
+{
+  // 4 rows or columns side by side, lane i is the pixel from line i.  Lanes are stored as 4 floats in a row.
+#ifdef BUILD_BLUR_SSE
+  typedef __m128 lanes_t;
+
+  inline lanes_t Load(const float* p) { return _mm_loadu_ps(p); }
+  inline void Store(float* p, lanes_t a) { _mm_storeu_ps(p, a); }
+  inline lanes_t Set1(float f) { return _mm_set1_ps(f); }
+  inline lanes_t Add(lanes_t a, lanes_t b) { return _mm_add_ps(a, b); }
+  inline lanes_t Sub(lanes_t a, lanes_t b) { return _mm_sub_ps(a, b); }
+  inline lanes_t Mul(lanes_t a, lanes_t b) { return _mm_mul_ps(a, b); }
+#else
+  struct lanes_t {
+    float f[4];
+  };
+
+  inline lanes_t Load(const float* p) { lanes_t r = { { p[0], p[1], p[2], p[3] } }; return r; }
+  inline void Store(float* p, lanes_t a) { p[0] = a.f[0]; p[1] = a.f[1]; p[2] = a.f[2]; p[3] = a.f[3]; }
+  inline lanes_t Set1(float f) { lanes_t r = { { f, f, f, f } }; return r; }
+  inline lanes_t Add(lanes_t a, lanes_t b) { lanes_t r = { { a.f[0] + b.f[0], a.f[1] + b.f[1], a.f[2] + b.f[2], a.f[3] + b.f[3] } }; return r; }
+  inline lanes_t Sub(lanes_t a, lanes_t b) { lanes_t r = { { a.f[0] - b.f[0], a.f[1] - b.f[1], a.f[2] - b.f[2], a.f[3] - b.f[3] } }; return r; }
+  inline lanes_t Mul(lanes_t a, lanes_t b) { lanes_t r = { { a.f[0] * b.f[0], a.f[1] * b.f[1], a.f[2] * b.f[2], a.f[3] * b.f[3] } }; return r; }
+#endif
+
+  // One box filter along n pixels of 4 lines at once
+  void BoxFilterLanes(const float* pSource, float* pDestination, size_t n, size_t radius)
+  {
+    const lanes_t inverseWindow = Set1(1.0f / float((2 * radius) + 1));
+
+    // The window starts centred on the first pixel with the first pixel repeated to the left of it
+    lanes_t sum = Mul(Set1(float(radius + 1)), Load(pSource));
+    for (size_t i = 1; i <= radius; i++) sum = Add(sum, Load(pSource + (4 * std::min(i, n - 1))));
+
+    for (size_t i = 0; i < n; i++) {
+      Store(pDestination + (4 * i), Mul(sum, inverseWindow));
+
+      // Slide the window one pixel to the right
+      sum = Add(sum, Load(pSource + (4 * std::min(i + radius + 1, n - 1))));
+      sum = Sub(sum, Load(pSource + (4 * ((i >= radius) ? (i - radius) : 0))));
+    }
+  }
+
+  // Runs every pass over 4 lines that have already been gathered into a, the result is left in a
+  void BoxFilterLanesPasses(std::vector<float>& a, std::vector<float>& b, size_t n, size_t radius, size_t nPasses)
+  {
+    for (size_t pass = 0; pass < nPasses; pass++) {
+      BoxFilterLanes(&a[0], &b[0], n, radius);
+      a.swap(b);
+    }
+  }
+
+  void BlurRows(float* pImage, size_t width, size_t height, size_t radius, size_t nPasses)
+  {
+    const size_t nGroups = (height + 3) / 4;
+
+    parallel::ParallelFor(nGroups, [&](size_t begin, size_t end) {
+      std::vector<float> a(4 * width);
+      std::vector<float> b(4 * width);
+
+      for (size_t group = begin; group < end; group++) {
+        // The last group repeats the last row if the height is not a multiple of 4
+        float* pRows[4];
+        for (size_t i = 0; i < 4; i++) pRows[i] = pImage + (std::min((group * 4) + i, height - 1) * width);
+
+        // Gather the 4 rows into lanes, 4 pixels at a time with a transpose where we can
+        size_t x = 0;
+#ifdef BUILD_BLUR_SSE
+        for (; (x + 4) <= width; x += 4) {
+          __m128 row0 = _mm_loadu_ps(pRows[0] + x);
+          __m128 row1 = _mm_loadu_ps(pRows[1] + x);
+          __m128 row2 = _mm_loadu_ps(pRows[2] + x);
+          __m128 row3 = _mm_loadu_ps(pRows[3] + x);
+          _MM_TRANSPOSE4_PS(row0, row1, row2, row3);
+          _mm_storeu_ps(&a[4 * (x + 0)], row0);
+          _mm_storeu_ps(&a[4 * (x + 1)], row1);
+          _mm_storeu_ps(&a[4 * (x + 2)], row2);
+          _mm_storeu_ps(&a[4 * (x + 3)], row3);
+        }
+#endif
+        for (; x < width; x++) {
+          for (size_t i = 0; i < 4; i++) a[(4 * x) + i] = pRows[i][x];
+        }
+
+        BoxFilterLanesPasses(a, b, width, radius, nPasses);
+
+        // Scatter the lanes back to the rows, rows that were only repeated to fill the group are written by their own group
+        const size_t nRows = std::min<size_t>(4, height - (group * 4));
+        x = 0;
+#ifdef BUILD_BLUR_SSE
+        if (nRows == 4) {
+          for (; (x + 4) <= width; x += 4) {
+            __m128 row0 = _mm_loadu_ps(&a[4 * (x + 0)]);
+            __m128 row1 = _mm_loadu_ps(&a[4 * (x + 1)]);
+            __m128 row2 = _mm_loadu_ps(&a[4 * (x + 2)]);
+            __m128 row3 = _mm_loadu_ps(&a[4 * (x + 3)]);
+            _MM_TRANSPOSE4_PS(row0, row1, row2, row3);
+            _mm_storeu_ps(pRows[0] + x, row0);
+            _mm_storeu_ps(pRows[1] + x, row1);
+            _mm_storeu_ps(pRows[2] + x, row2);
+            _mm_storeu_ps(pRows[3] + x, row3);
+          }
+        }
+#endif
+        for (; x < width; x++) {
+          for (size_t i = 0; i < nRows; i++) pRows[i][x] = a[(4 * x) + i];
+        }
+      }
+    });
+  }
+
+  void BlurColumns(float* pImage, size_t width, size_t height, size_t radius, size_t nPasses)
+  {
+    const size_t nGroups = (width + 3) / 4;
+
+    parallel::ParallelFor(nGroups, [&](size_t begin, size_t end) {
+      std::vector<float> a(4 * height);
+      std::vector<float> b(4 * height);
+
+      for (size_t group = begin; group < end; group++) {
+        const size_t x = group * 4;
+        const size_t nColumns = std::min<size_t>(4, width - x);
+
+        // 4 neighbouring columns are already side by side in memory, the last group repeats the last column if the width is
+        // not a multiple of 4
+        for (size_t y = 0; y < height; y++) {
+          const float* pPixels = pImage + (y * width) + x;
+          if (nColumns == 4) Store(&a[4 * y], Load(pPixels));
+          else {
+            for (size_t i = 0; i < 4; i++) a[(4 * y) + i] = pPixels[std::min(i, nColumns - 1)];
+          }
+        }
+
+        BoxFilterLanesPasses(a, b, height, radius, nPasses);
+
+        for (size_t y = 0; y < height; y++) {
+          float* pPixels = pImage + (y * width) + x;
+          if (nColumns == 4) Store(pPixels, Load(&a[4 * y]));
+          else {
+            for (size_t i = 0; i < nColumns; i++) pPixels[i] = a[(4 * y) + i];
+          }
+        }
+      }
+    });
+  }
+}
+
+void BoxBlur(float* pImage, size_t width, size_t height, size_t radius, size_t nPasses)
+{
+  if ((width == 0) || (height == 0) || (radius == 0) || (nPasses == 0)) return;
+
+  // Box filters along the same axis can be applied in any order, so every horizontal pass is done while a group of rows is
+  // gathered and then every vertical pass while a group of columns is gathered
+  BlurRows(pImage, width, height, radius, nPasses);
+  BlurColumns(pImage, width, height, radius, nPasses);
+}
@@ -0,0 +1,14 @@
+#ifndef BLUR_H
+#define BLUR_H
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+
+// Blurs a single channel image in place with nPasses box filters of (2 * radius) + 1 pixels along each axis, edge pixels are
+// repeated outside the image.  3 passes are close enough to a Gaussian with a variance of radius * (radius + 1).
+//
+// Each box filter is a running sum so the cost does not depend on the radius.  4 rows or 4 columns are filtered at once with
+// SSE and the rows and columns are spread over every core.
+void BoxBlur(float* pImage, size_t width, size_t height, size_t radius, size_t nPasses);
+
+#endif // BLUR_H
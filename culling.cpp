@@ -0,0 +1,168 @@
+#include <cassert>
+#include <cmath>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 1))
+#define BUILD_CULLING_SSE
+#include <xmmintrin.h>
+#endif
+
+#include "culling.h"
+
+// ** cBoundingBoxes
+
+void cBoundingBoxes::clear()
+{
+  minX.clear();
+  minY.clear();
+  minZ.clear();
+  maxX.clear();
+  maxY.clear();
+  maxZ.clear();
+}
+
+void cBoundingBoxes::reserve(size_t n)
+{
+  minX.reserve(n);
+  minY.reserve(n);
+  minZ.reserve(n);
+  maxX.reserve(n);
+  maxY.reserve(n);
+  maxZ.reserve(n);
+}
+
+void cBoundingBoxes::push_back(const spitfire::math::cVec3& minimum, const spitfire::math::cVec3& maximum)
+{
+  minX.push_back(minimum.x);
+  minY.push_back(minimum.y);
+  minZ.push_back(minimum.z);
+  maxX.push_back(maximum.x);
+  maxY.push_back(maximum.y);
+  maxZ.push_back(maximum.z);
+}
+
+
+// ** cFrustumCuller
+
+cFrustumCuller::cFrustumCuller()
+{
+  // Start with planes that accept everything
+  for (size_t i = 0; i < nPlanes; i++) {
+    planes[i][0] = 0.0f;
+    planes[i][1] = 0.0f;
+    planes[i][2] = 0.0f;
+    planes[i][3] = 1.0f;
+  }
+}
+
+void cFrustumCuller::SetViewProjection(const spitfire::math::cMat4& matViewProjection)
+{
+  // Gribb/Hartmann plane extraction, the matrix is column major so row i is entries[i], entries[4 + i], entries[8 + i], entries[12 + i]
+  const float* m = matViewProjection.entries;
+
+  const float rows[4][4] = {
+    { m[0], m[4], m[8], m[12] },
+    { m[1], m[5], m[9], m[13] },
+    { m[2], m[6], m[10], m[14] },
+    { m[3], m[7], m[11], m[15] },
+  };
+
+  for (size_t i = 0; i < 4; i++) {
+    planes[0][i] = rows[3][i] + rows[0][i]; // Left
+    planes[1][i] = rows[3][i] - rows[0][i]; // Right
+    planes[2][i] = rows[3][i] + rows[1][i]; // Bottom
+    planes[3][i] = rows[3][i] - rows[1][i]; // Top
+    planes[4][i] = rows[3][i] + rows[2][i]; // Near
+    planes[5][i] = rows[3][i] - rows[2][i]; // Far
+  }
+
+  for (size_t i = 0; i < nPlanes; i++) {
+    const float fLength = sqrtf((planes[i][0] * planes[i][0]) + (planes[i][1] * planes[i][1]) + (planes[i][2] * planes[i][2]));
+    if (fLength > 0.0f) {
+      const float fInverseLength = 1.0f / fLength;
+      for (size_t j = 0; j < 4; j++) planes[i][j] *= fInverseLength;
+    }
+  }
+}
+
+void cFrustumCuller::Cull(const cBoundingBoxes& boxes, std::vector<uint32_t>& visible) const
+{
+  visible.clear();
+
+  const size_t n = boxes.size();
+  if (n == 0) return;
+
+  // For each plane only the corner furthest along the plane normal needs to be tested, which corner that is only depends on
+  // the signs of the normal so we pick the min or max arrays once per plane instead of once per box
+  const float* pX[nPlanes];
+  const float* pY[nPlanes];
+  const float* pZ[nPlanes];
+  for (size_t p = 0; p < nPlanes; p++) {
+    pX[p] = (planes[p][0] >= 0.0f) ? &boxes.maxX[0] : &boxes.minX[0];
+    pY[p] = (planes[p][1] >= 0.0f) ? &boxes.maxY[0] : &boxes.minY[0];
+    pZ[p] = (planes[p][2] >= 0.0f) ? &boxes.maxZ[0] : &boxes.minZ[0];
+  }
+
+  size_t i = 0;
+
+#ifdef BUILD_CULLING_SSE
+  __m128 planeX[nPlanes];
+  __m128 planeY[nPlanes];
+  __m128 planeZ[nPlanes];
+  __m128 planeD[nPlanes];
+  for (size_t p = 0; p < nPlanes; p++) {
+    planeX[p] = _mm_set1_ps(planes[p][0]);
+    planeY[p] = _mm_set1_ps(planes[p][1]);
+    planeZ[p] = _mm_set1_ps(planes[p][2]);
+    planeD[p] = _mm_set1_ps(planes[p][3]);
+  }
+
+  const __m128 zero = _mm_setzero_ps();
+
+  // Test 4 boxes at a time
+  for (; (i + 4) <= n; i += 4) {
+    __m128 outside = _mm_setzero_ps();
+
+    for (size_t p = 0; p < nPlanes; p++) {
+      const __m128 x = _mm_loadu_ps(pX[p] + i);
+      const __m128 y = _mm_loadu_ps(pY[p] + i);
+      const __m128 z = _mm_loadu_ps(pZ[p] + i);
+
+      const __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(planeX[p], x), _mm_mul_ps(planeY[p], y)), _mm_add_ps(_mm_mul_ps(planeZ[p], z), planeD[p]));
+      outside = _mm_or_ps(outside, _mm_cmplt_ps(distance, zero));
+    }
+
+    // Compact the visible boxes into the output list
+    const int mask = ~_mm_movemask_ps(outside) & 0xF;
+    if (mask != 0) {
+      if ((mask & 1) != 0) visible.push_back(uint32_t(i));
+      if ((mask & 2) != 0) visible.push_back(uint32_t(i + 1));
+      if ((mask & 4) != 0) visible.push_back(uint32_t(i + 2));
+      if ((mask & 8) != 0) visible.push_back(uint32_t(i + 3));
+    }
+  }
+#endif
+
+  // Any remaining boxes
+  for (; i < n; i++) {
+    bool bIsOutside = false;
+    for (size_t p = 0; p < nPlanes; p++) {
+      const float fDistance = (planes[p][0] * pX[p][i]) + (planes[p][1] * pY[p][i]) + (planes[p][2] * pZ[p][i]) + planes[p][3];
+      if (fDistance < 0.0f) {
+        bIsOutside = true;
+        break;
+      }
+    }
+
+    if (!bIsOutside) visible.push_back(uint32_t(i));
+  }
+}
+
+bool cFrustumCuller::IsSphereVisible(const spitfire::math::cVec3& centre, float fRadius) const
+{
+  for (size_t p = 0; p < nPlanes; p++) {
+    const float fDistance = (planes[p][0] * centre.x) + (planes[p][1] * centre.y) + (planes[p][2] * centre.z) + planes[p][3];
+    if (fDistance < -fRadius) return false;
+  }
+
+  return true;
+}
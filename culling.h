@@ -0,0 +1,58 @@
+#ifndef CULLING_H
+#define CULLING_H
+
+#include <vector>
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+#include <spitfire/math/cVec3.h>
+#include <spitfire/math/cMat4.h>
+
+// ** cBoundingBoxes
+//
+// Axis aligned bounding boxes stored as a structure of arrays so that several boxes can be tested at once
+
+class cBoundingBoxes
+{
+public:
+  size_t size() const { return minX.size(); }
+  bool empty() const { return minX.empty(); }
+
+  void clear();
+  void reserve(size_t n);
+
+  void push_back(const spitfire::math::cVec3& minimum, const spitfire::math::cVec3& maximum);
+
+  std::vector<float> minX;
+  std::vector<float> minY;
+  std::vector<float> minZ;
+  std::vector<float> maxX;
+  std::vector<float> maxY;
+  std::vector<float> maxZ;
+};
+
+
+// ** cFrustumCuller
+
+class cFrustumCuller
+{
+public:
+  cFrustumCuller();
+
+  // Extract the six clipping planes from a projection * view matrix
+  void SetViewProjection(const spitfire::math::cMat4& matViewProjection);
+
+  // Fills visible with the indices of the boxes that are at least partially inside the frustum
+  void Cull(const cBoundingBoxes& boxes, std::vector<uint32_t>& visible) const;
+
+  // Returns true if the sphere is at least partially inside the frustum
+  bool IsSphereVisible(const spitfire::math::cVec3& centre, float fRadius) const;
+
+private:
+  static const size_t nPlanes = 6;
+
+  // Each plane is stored as a normal and a distance, a point is inside when (normal . point) + distance >= 0
+  float planes[nPlanes][4];
+};
+
+#endif // CULLING_H
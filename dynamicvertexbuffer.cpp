@@ -0,0 +1,249 @@
+#include <cassert>
+#include <cstring>
+
+// Spitfire headers
+#include <spitfire/util/log.h>
+
+// Application headers
+#include "dynamicvertexbuffer.h"
+#include "profiler.h"
+
+namespace
+{
+  const GLuint ATTRIBUTE_POSITION = 0;
+  const GLuint ATTRIBUTE_NORMAL = 1;
+
+  // shaders/font.vert
+  const GLuint ATTRIBUTE_FONT_POSITION = 0;
+  const GLuint ATTRIBUTE_FONT_COLOUR = 1;
+  const GLuint ATTRIBUTE_FONT_TEXCOORD0 = 2;
+}
+
+// ** cDynamicVertexBufferRing
+
+cDynamicVertexBufferRing::cDynamicVertexBufferRing() :
+  buffer(0),
+  nBytesPerFrame(0),
+  region(0),
+  nBytesUsed(0),
+  frameNumber(0),
+  nBytesUsedLastFrame(0),
+  nWaits(0),
+  nWaitsLastFrame(0)
+{
+  for (size_t i = 0; i < nFrames; i++) fences[i] = 0;
+}
+
+void cDynamicVertexBufferRing::Create(size_t _nBytesPerFrame)
+{
+  Destroy();
+
+  assert(_nBytesPerFrame != 0);
+  nBytesPerFrame = _nBytesPerFrame;
+
+  glGenBuffers(1, &buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, buffer);
+  glBufferData(GL_ARRAY_BUFFER, nFrames * nBytesPerFrame, nullptr, GL_STREAM_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void cDynamicVertexBufferRing::Destroy()
+{
+  for (size_t i = 0; i < nFrames; i++) {
+    if (fences[i] != 0) {
+      glDeleteSync(fences[i]);
+      fences[i] = 0;
+    }
+  }
+
+  if (buffer != 0) {
+    glDeleteBuffers(1, &buffer);
+    buffer = 0;
+  }
+
+  nBytesPerFrame = 0;
+  region = 0;
+  nBytesUsed = 0;
+}
+
+void cDynamicVertexBufferRing::BeginFrame()
+{
+  assert(IsValid());
+
+  PROFILE_ZONE("Dynamic vertex buffer wait");
+
+  frameNumber++;
+  nBytesUsed = 0;
+
+  // Wait for the GPU to finish with the last frame that used this region, this only happens if we are more than nFrames ahead
+  if (fences[region] != 0) {
+    GLenum result = glClientWaitSync(fences[region], 0, 0);
+    if ((result != GL_ALREADY_SIGNALED) && (result != GL_CONDITION_SATISFIED)) {
+      nWaits++;
+
+      const GLuint64 timeoutNS = 1000000000;
+      do {
+        result = glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, timeoutNS);
+      } while (result == GL_TIMEOUT_EXPIRED);
+
+      if (result == GL_WAIT_FAILED) LOGERROR("cDynamicVertexBufferRing::BeginFrame glClientWaitSync FAILED");
+    }
+
+    glDeleteSync(fences[region]);
+    fences[region] = 0;
+  }
+}
+
+void cDynamicVertexBufferRing::EndFrame()
+{
+  assert(IsValid());
+  assert(fences[region] == 0);
+
+  fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+  region = (region + 1) % nFrames;
+
+  nBytesUsedLastFrame = nBytesUsed;
+  nWaitsLastFrame = nWaits;
+  nWaits = 0;
+}
+
+bool cDynamicVertexBufferRing::Write(const void* pData, size_t nBytes, size_t stride, size_t& outOffset)
+{
+  assert(IsValid());
+  assert(stride != 0);
+
+  // Round up to a whole vertex from the start of the buffer
+  const size_t regionStart = region * nBytesPerFrame;
+  const size_t offset = (((regionStart + nBytesUsed) + stride - 1) / stride) * stride;
+  if ((offset + nBytes) > (regionStart + nBytesPerFrame)) return false;
+
+  glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+  // We know the GPU is not using this region so there is no need for the driver to synchronise with it
+  void* pMapped = glMapBufferRange(GL_ARRAY_BUFFER, offset, nBytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+  if (pMapped == nullptr) {
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return false;
+  }
+
+  memcpy(pMapped, pData, nBytes);
+
+  glUnmapBuffer(GL_ARRAY_BUFFER);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  nBytesUsed = (offset + nBytes) - regionStart;
+  outOffset = offset;
+
+  return true;
+}
+
+
+// ** cDynamicGeometry
+
+cDynamicGeometry::cDynamicGeometry() :
+  pRing(nullptr),
+  primitive(cRenderQueue::PRIMITIVE::TRIANGLES),
+  stride(0),
+  vertexArray(0),
+  frameNumber(0),
+  firstVertex(0),
+  nVertices(0)
+{
+}
+
+void cDynamicGeometry::Create(cDynamicVertexBufferRing& ring, VERTEX_FORMAT format, cRenderQueue::PRIMITIVE _primitive)
+{
+  Destroy();
+
+  assert(ring.IsValid());
+
+  pRing = &ring;
+  primitive = _primitive;
+
+  glGenVertexArrays(1, &vertexArray);
+  glBindVertexArray(vertexArray);
+
+  glBindBuffer(GL_ARRAY_BUFFER, ring.GetBuffer());
+
+  switch (format) {
+    case VERTEX_FORMAT::V3_N3: {
+      stride = 6 * sizeof(float);
+      glEnableVertexAttribArray(ATTRIBUTE_POSITION);
+      glVertexAttribPointer(ATTRIBUTE_POSITION, 3, GL_FLOAT, GL_FALSE, GLsizei(stride), (const GLvoid*)0);
+      glEnableVertexAttribArray(ATTRIBUTE_NORMAL);
+      glVertexAttribPointer(ATTRIBUTE_NORMAL, 3, GL_FLOAT, GL_FALSE, GLsizei(stride), (const GLvoid*)(3 * sizeof(float)));
+      break;
+    }
+    case VERTEX_FORMAT::V2_C4_T2: {
+      stride = 8 * sizeof(float);
+      glEnableVertexAttribArray(ATTRIBUTE_FONT_POSITION);
+      glVertexAttribPointer(ATTRIBUTE_FONT_POSITION, 2, GL_FLOAT, GL_FALSE, GLsizei(stride), (const GLvoid*)0);
+      glEnableVertexAttribArray(ATTRIBUTE_FONT_COLOUR);
+      glVertexAttribPointer(ATTRIBUTE_FONT_COLOUR, 4, GL_FLOAT, GL_FALSE, GLsizei(stride), (const GLvoid*)(2 * sizeof(float)));
+      glEnableVertexAttribArray(ATTRIBUTE_FONT_TEXCOORD0);
+      glVertexAttribPointer(ATTRIBUTE_FONT_TEXCOORD0, 2, GL_FLOAT, GL_FALSE, GLsizei(stride), (const GLvoid*)(6 * sizeof(float)));
+      break;
+    }
+  }
+
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void cDynamicGeometry::Destroy()
+{
+  if (vertexArray != 0) {
+    glDeleteVertexArrays(1, &vertexArray);
+    vertexArray = 0;
+  }
+
+  pRing = nullptr;
+  stride = 0;
+  frameNumber = 0;
+  firstVertex = 0;
+  nVertices = 0;
+}
+
+void cDynamicGeometry::SetVertices(const std::vector<float>& vertices, size_t _nVertices)
+{
+  assert(IsValid());
+
+  frameNumber = pRing->GetFrameNumber();
+  firstVertex = 0;
+  nVertices = 0;
+
+  if (_nVertices == 0) return;
+
+  const size_t nBytes = _nVertices * stride;
+  assert(vertices.size() * sizeof(float) >= nBytes);
+
+  size_t offset = 0;
+  if (!pRing->Write(&vertices[0], nBytes, stride, offset)) {
+    LOGERROR("cDynamicGeometry::SetVertices Dynamic vertex buffer is full, skipping ", _nVertices, " vertices");
+    return;
+  }
+
+  firstVertex = offset / stride;
+  nVertices = _nVertices;
+}
+
+size_t cDynamicGeometry::GetVertexCount() const
+{
+  // Vertices from an earlier frame may have been overwritten already
+  return ((pRing != nullptr) && (frameNumber == pRing->GetFrameNumber())) ? nVertices : 0;
+}
+
+size_t cDynamicGeometry::Draw()
+{
+  assert(IsValid());
+
+  const size_t n = GetVertexCount();
+  if (n == 0) return 0;
+
+  glBindVertexArray(vertexArray);
+  glDrawArrays((primitive == cRenderQueue::PRIMITIVE::LINES) ? GL_LINES : GL_TRIANGLES, GLint(firstVertex), GLsizei(n));
+  glBindVertexArray(0);
+
+  return 1;
+}
@@ -0,0 +1,108 @@
+#ifndef DYNAMICVERTEXBUFFER_H
+#define DYNAMICVERTEXBUFFER_H
+
+#include <vector>
+
+// OpenGL headers
+#include <GL/GLee.h>
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+
+// Application headers
+#include "renderqueue.h"
+
+// ** cDynamicVertexBufferRing
+//
+// One vertex buffer shared by all of the geometry that changes every frame.  The buffer is split into a region per frame
+// in flight, each frame writes into the next region with an unsynchronized map so the driver never has to stall or
+// allocate.  A fence is placed at the end of each frame and the region is only written again once the fence has signalled.
+
+class cDynamicVertexBufferRing
+{
+public:
+  static const size_t nFrames = 3;
+
+  cDynamicVertexBufferRing();
+
+  bool IsValid() const { return (buffer != 0); }
+
+  void Create(size_t nBytesPerFrame);
+  void Destroy();
+
+  // Waits until the GPU has finished with the region for this frame
+  void BeginFrame();
+
+  // Called after the last draw call that uses this frame's region
+  void EndFrame();
+
+  // Copies vertices into this frame's region, the offset is a multiple of the stride so that it can be used as the first
+  // vertex of a draw call.  Returns false if the region is full.
+  bool Write(const void* pData, size_t nBytes, size_t stride, size_t& outOffset);
+
+  GLuint GetBuffer() const { return buffer; }
+  uint64_t GetFrameNumber() const { return frameNumber; }
+
+  // Statistics for the last frame
+  size_t GetBytesPerFrame() const { return nBytesPerFrame; }
+  size_t GetBytesUsed() const { return nBytesUsedLastFrame; }
+  size_t GetWaitCount() const { return nWaitsLastFrame; }
+
+private:
+  GLuint buffer;
+  GLsync fences[nFrames];
+
+  size_t nBytesPerFrame;
+  size_t region;
+  size_t nBytesUsed;
+  uint64_t frameNumber;
+
+  size_t nBytesUsedLastFrame;
+  size_t nWaits;
+  size_t nWaitsLastFrame;
+};
+
+
+// ** cDynamicGeometry
+//
+// Vertices that are written into the ring every frame and drawn straight from it.  The vertex array points at the start
+// of the ring buffer and each frame's vertices are found by the first vertex passed to the draw call.
+// Attribute locations match shaders/colour.vert and shaders/font.vert.
+
+class cDynamicGeometry : public cRenderQueueDrawable
+{
+public:
+  enum class VERTEX_FORMAT {
+    V3_N3,    // opengl::cGeometryBuilder_v3_n3
+    V2_C4_T2, // opengl::cGeometryBuilder_v2_c4_t2
+  };
+
+  cDynamicGeometry();
+
+  bool IsValid() const { return (vertexArray != 0); }
+
+  void Create(cDynamicVertexBufferRing& ring, VERTEX_FORMAT format, cRenderQueue::PRIMITIVE primitive);
+  void Destroy();
+
+  // The vertices only last for the current frame so they have to be set again every frame
+  void SetVertices(const std::vector<float>& vertices, size_t nVertices);
+
+  // Returns 0 if the vertices have not been set this frame
+  size_t GetVertexCount() const;
+
+  // The shader and matrices must already be set
+  size_t Draw() override;
+
+private:
+  cDynamicVertexBufferRing* pRing;
+  cRenderQueue::PRIMITIVE primitive;
+  size_t stride;
+
+  GLuint vertexArray;
+
+  uint64_t frameNumber;
+  size_t firstVertex;
+  size_t nVertices;
+};
+
+#endif // DYNAMICVERTEXBUFFER_H
@@ -0,0 +1,128 @@
+#include <cassert>
+
+#include <limits>
+
+// Application headers
+#include "entities.h"
+
+// ** cArchetype
+
+cArchetype::cArchetype(uint32_t _components) :
+  components(_components)
+{
+}
+
+
+// ** cEntityStore
+
+size_t cEntityStore::GetOrAddArchetype(uint32_t components)
+{
+  // There are only ever a handful of archetypes
+  const size_t n = archetypes.size();
+  for (size_t i = 0; i < n; i++) {
+    if (archetypes[i].components == components) return i;
+  }
+
+  archetypes.push_back(cArchetype(components));
+  return n;
+}
+
+entityid_t cEntityStore::AddEntity(uint32_t components, TYPE type, const spitfire::math::cVec3& position, const spitfire::math::cQuaternion& rotation)
+{
+  // Every entity has a transform
+  components |= COMPONENT::TRANSFORM;
+
+  entityid_t id = 0;
+  if (!freeIDs.empty()) {
+    id = freeIDs.back();
+    freeIDs.pop_back();
+  } else {
+    assert(locations.size() < std::numeric_limits<entityid_t>::max());
+    id = entityid_t(locations.size());
+    locations.push_back(Location());
+  }
+
+  const size_t archetypeIndex = GetOrAddArchetype(components);
+  cArchetype& archetype = archetypes[archetypeIndex];
+
+  Location& location = locations[id];
+  location.archetype = uint32_t(archetypeIndex);
+  location.index = uint32_t(archetype.size());
+
+  archetype.entities.push_back(id);
+  archetype.positions.push_back(position);
+  archetype.rotations.push_back(rotation);
+  archetype.types.push_back(type);
+  if (archetype.HasComponents(COMPONENT::AGENT)) archetype.blackboards.push_back(AIBlackboard());
+  archetype.moved.push_back(location.index);
+
+  return id;
+}
+
+void cEntityStore::RemoveEntity(entityid_t id)
+{
+  if (!IsValid(id)) return;
+
+  Location& location = locations[id];
+  cArchetype& archetype = archetypes[location.archetype];
+  const size_t index = location.index;
+  const size_t last = archetype.size() - 1;
+
+  // Forget the removed entity and follow the last entity to its new index
+  for (size_t i = 0; i < archetype.moved.size();) {
+    if (archetype.moved[i] == index) {
+      archetype.moved[i] = archetype.moved.back();
+      archetype.moved.pop_back();
+    } else {
+      if (archetype.moved[i] == last) archetype.moved[i] = uint32_t(index);
+      i++;
+    }
+  }
+
+  // Move the last entity into the hole to keep the arrays dense
+  if (index != last) {
+    const entityid_t moved = archetype.entities[last];
+    archetype.entities[index] = moved;
+    archetype.positions[index] = archetype.positions[last];
+    archetype.rotations[index] = archetype.rotations[last];
+    archetype.types[index] = archetype.types[last];
+    if (archetype.HasComponents(COMPONENT::AGENT)) archetype.blackboards[index] = std::move(archetype.blackboards[last]);
+
+    locations[moved].index = uint32_t(index);
+  }
+
+  archetype.entities.pop_back();
+  archetype.positions.pop_back();
+  archetype.rotations.pop_back();
+  archetype.types.pop_back();
+  if (archetype.HasComponents(COMPONENT::AGENT)) archetype.blackboards.pop_back();
+
+  location.archetype = INVALID_ARCHETYPE;
+  location.index = 0;
+  freeIDs.push_back(id);
+}
+
+const spitfire::math::cVec3& cEntityStore::GetPosition(entityid_t id) const
+{
+  assert(IsValid(id));
+  const Location& location = locations[id];
+  return archetypes[location.archetype].positions[location.index];
+}
+
+TYPE cEntityStore::GetType(entityid_t id) const
+{
+  assert(IsValid(id));
+  const Location& location = locations[id];
+  return archetypes[location.archetype].types[location.index];
+}
+
+AIBlackboard* cEntityStore::GetBlackboard(entityid_t id)
+{
+  if (!IsValid(id)) return nullptr;
+
+  const Location& location = locations[id];
+  cArchetype& archetype = archetypes[location.archetype];
+  if (!archetype.HasComponents(COMPONENT::AGENT)) return nullptr;
+
+  return &archetype.blackboards[location.index];
+}
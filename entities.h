@@ -0,0 +1,99 @@
+#ifndef ENTITIES_H
+#define ENTITIES_H
+
+#include <vector>
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+#include <spitfire/math/cVec3.h>
+#include <spitfire/math/cQuaternion.h>
+
+// Application headers
+#include "ai.h"
+
+typedef uint32_t entityid_t;
+
+enum class TYPE {
+  SOLDIER,
+  BULLET,
+  TREE,
+};
+
+// Components that an entity can have, every entity has a transform and a type
+namespace COMPONENT
+{
+  const uint32_t TRANSFORM = 0x1;
+  const uint32_t AGENT = 0x2;
+}
+
+
+// ** cArchetype
+//
+// Every entity with exactly the same set of components.  The components are stored in dense parallel arrays so that a
+// system can walk straight through them, index i in every array belongs to entities[i].
+
+struct cArchetype {
+  explicit cArchetype(uint32_t components);
+
+  size_t size() const { return entities.size(); }
+  bool HasComponents(uint32_t _components) const { return ((components & _components) == _components); }
+
+  uint32_t components;
+
+  std::vector<entityid_t> entities;
+
+  // COMPONENT::TRANSFORM
+  std::vector<spitfire::math::cVec3> positions;
+  std::vector<spitfire::math::cQuaternion> rotations;
+  std::vector<TYPE> types;
+
+  // COMPONENT::AGENT
+  std::vector<AIBlackboard> blackboards;
+
+  // Indices of the entities whose x or z has changed since they were last snapped to the terrain, new entities start here too
+  std::vector<uint32_t> moved;
+};
+
+
+// ** cEntityStore
+//
+// Owns every entity in the simulation.  Entity ids are small integers that are reused after an entity is removed so
+// arrays indexed by id stay dense, GetEntityIDCount is one more than the largest id that has been handed out.
+// Removing an entity moves the last entity of its archetype into its place.
+
+class cEntityStore
+{
+public:
+  entityid_t AddEntity(uint32_t components, TYPE type, const spitfire::math::cVec3& position, const spitfire::math::cQuaternion& rotation);
+  void RemoveEntity(entityid_t id);
+
+  bool IsValid(entityid_t id) const { return (id < locations.size()) && (locations[id].archetype != INVALID_ARCHETYPE); }
+
+  size_t GetEntityCount() const { return locations.size() - freeIDs.size(); }
+  size_t GetEntityIDCount() const { return locations.size(); }
+
+  std::vector<cArchetype>& GetArchetypes() { return archetypes; }
+  const std::vector<cArchetype>& GetArchetypes() const { return archetypes; }
+
+  // Access to a single entity's components, systems that touch every entity should walk the archetypes instead
+  const spitfire::math::cVec3& GetPosition(entityid_t id) const;
+  TYPE GetType(entityid_t id) const;
+  AIBlackboard* GetBlackboard(entityid_t id); // Returns nullptr if the entity is not an agent
+
+private:
+  static const uint32_t INVALID_ARCHETYPE = 0xFFFFFFFF;
+
+  struct Location {
+    uint32_t archetype;
+    uint32_t index;
+  };
+
+  size_t GetOrAddArchetype(uint32_t components);
+
+  std::vector<cArchetype> archetypes;
+
+  std::vector<Location> locations; // Indexed by entity id
+  std::vector<entityid_t> freeIDs;
+};
+
+#endif // ENTITIES_H
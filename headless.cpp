@@ -0,0 +1,184 @@
+// Runs the simulation without a window or an OpenGL context so that the AI, navigation and heightmap code can be measured
+// on machines without a GPU.
+//
+// Usage: rebellion_headless [--agents=N] [--map-size=N] [--ticks=N] [--seed=N] [--heightmap=path]
+//
+// Without --heightmap a procedural heightmap of map size by map size is used.  The procedural heightmap, the navigation mesh
+// and the agents and their goals are all generated from the seed so a run can be repeated exactly.
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <new>
+#include <string>
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+#include <spitfire/math/cVec3.h>
+
+// Application headers
+#include "heightmap.h"
+#include "navigation.h"
+#include "simulation.h"
+
+namespace
+{
+  std::atomic<size_t> nAllocations(0);
+  std::atomic<size_t> nAllocatedBytes(0);
+
+  void* Allocate(size_t size)
+  {
+    nAllocations++;
+    nAllocatedBytes += size;
+
+    void* p = malloc((size != 0) ? size : 1);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+  }
+
+  struct Settings {
+    Settings();
+
+    size_t nAgents;
+    size_t nMapSize;
+    size_t nTicks;
+    uint32_t seed;
+    std::string sHeightmapFilePath;
+  };
+
+  Settings::Settings() :
+    nAgents(1000),
+    nMapSize(512),
+    nTicks(1000),
+    seed(1)
+  {
+  }
+
+  bool ParseArgument(const char* szArgument, const char* szName, std::string& sValue)
+  {
+    const size_t length = strlen(szName);
+    if ((strncmp(szArgument, szName, length) != 0) || (szArgument[length] != '=')) return false;
+
+    sValue = szArgument + length + 1;
+    return true;
+  }
+
+  bool ParseCommandLine(int argc, char** argv, Settings& settings)
+  {
+    for (int i = 1; i < argc; i++) {
+      std::string sValue;
+      if (ParseArgument(argv[i], "--agents", sValue)) settings.nAgents = size_t(strtoul(sValue.c_str(), nullptr, 10));
+      else if (ParseArgument(argv[i], "--map-size", sValue)) settings.nMapSize = size_t(strtoul(sValue.c_str(), nullptr, 10));
+      else if (ParseArgument(argv[i], "--ticks", sValue)) settings.nTicks = size_t(strtoul(sValue.c_str(), nullptr, 10));
+      else if (ParseArgument(argv[i], "--seed", sValue)) settings.seed = uint32_t(strtoul(sValue.c_str(), nullptr, 10));
+      else if (ParseArgument(argv[i], "--heightmap", sValue)) settings.sHeightmapFilePath = sValue;
+      else {
+        std::cerr<<"Unknown argument \""<<argv[i]<<"\""<<std::endl;
+        std::cerr<<"Usage: rebellion_headless [--agents=N] [--map-size=N] [--ticks=N] [--seed=N] [--heightmap=path]"<<std::endl;
+        return false;
+      }
+    }
+
+    if (settings.nMapSize < 64) {
+      std::cerr<<"The map size must be at least 64"<<std::endl;
+      return false;
+    }
+
+    return true;
+  }
+
+  double GetMillisecondsSince(std::chrono::steady_clock::time_point start)
+  {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  }
+}
+
+// Count every allocation so that we can see how much the simulation allocates per tick
+void* operator new(size_t size) { return Allocate(size); }
+void* operator new[](size_t size) { return Allocate(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+int main(int argc, char** argv)
+{
+  Settings settings;
+  if (!ParseCommandLine(argc, argv, settings)) return EXIT_FAILURE;
+
+  const spitfire::math::cVec3 heightMapScale(0.5f, 10.0f, 0.5f);
+
+  // Load or create our heightmap
+  cHeightmapData heightMapData;
+  {
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    if (!settings.sHeightmapFilePath.empty()) {
+      if (!heightMapData.LoadFromFile(spitfire::string::ToString_t(settings.sHeightmapFilePath))) return EXIT_FAILURE;
+    } else if (!heightMapData.CreateProcedural(settings.nMapSize, settings.nMapSize, settings.seed)) {
+      return EXIT_FAILURE;
+    }
+
+    std::cout<<"Heightmap: "<<heightMapData.GetWidth()<<"x"<<heightMapData.GetDepth()<<" in "<<GetMillisecondsSince(start)<<" ms"<<std::endl;
+  }
+
+  // Cover the heightmap with a navigation mesh with a node every 10 units
+  const float fAreaSize = heightMapScale.x * float(std::min(heightMapData.GetWidth(), heightMapData.GetDepth()));
+  const float fSpacing = 10.0f;
+  const size_t nNodesPerSide = std::max<size_t>(2, size_t(fAreaSize / fSpacing) - 1);
+
+  NavigationMesh navigationMesh;
+  {
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    CreateGridNavigationMesh(navigationMesh, heightMapData, heightMapScale, nNodesPerSide, nNodesPerSide, fSpacing, settings.seed);
+
+    std::cout<<"Navigation mesh: "<<navigationMesh.GetNodeCount()<<" nodes, "<<navigationMesh.GetEdgeCount()<<" edges in "<<GetMillisecondsSince(start)<<" ms"<<std::endl;
+  }
+
+  cSimulation simulation(navigationMesh, heightMapData, heightMapScale);
+  {
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // Raw heightmaps that were too big to load at full resolution are paged in around the agents
+    const spitfire::string_t sHeightmapFilePath = spitfire::string::ToString_t(settings.sHeightmapFilePath);
+    HEIGHTMAP_FORMAT format = HEIGHTMAP_FORMAT::R16;
+    if (cHeightmapStream::GetFormatFromFilename(sHeightmapFilePath, format) && !simulation.OpenHeightmapStream(sHeightmapFilePath)) return EXIT_FAILURE;
+
+    simulation.CreateSoldiers(settings.nAgents, fAreaSize, settings.seed);
+
+    std::cout<<"Agents: "<<settings.nAgents<<" in "<<GetMillisecondsSince(start)<<" ms"<<std::endl;
+  }
+
+  // Run the simulation as fast as we can
+  const size_t nAllocationsBefore = nAllocations;
+  const size_t nAllocatedBytesBefore = nAllocatedBytes;
+
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < settings.nTicks; i++) simulation.Step();
+
+  const double fTotalMS = GetMillisecondsSince(start);
+
+  const size_t nTickAllocations = nAllocations - nAllocationsBefore;
+  const size_t nTickAllocatedBytes = nAllocatedBytes - nAllocatedBytesBefore;
+
+  const cSimulation::Timings& timings = simulation.GetTimings();
+  const double fTicks = double(std::max<size_t>(1, timings.nTicks));
+
+  std::cout<<"Ticks: "<<settings.nTicks<<" in "<<fTotalMS<<" ms, "<<(1000.0 * double(settings.nTicks) / fTotalMS)<<" ticks/s"<<std::endl;
+  std::cout<<"  Commands: "<<(1000.0 * timings.fCommandsSeconds / fTicks)<<" ms/tick"<<std::endl;
+  std::cout<<"  AI: "<<(1000.0 * timings.fAISeconds / fTicks)<<" ms/tick"<<std::endl;
+  std::cout<<"  Heightmap: "<<(1000.0 * timings.fHeightmapSeconds / fTicks)<<" ms/tick"<<std::endl;
+  std::cout<<"  Snapshot: "<<(1000.0 * timings.fSnapshotSeconds / fTicks)<<" ms/tick"<<std::endl;
+  const cHeightmapStream& heightmapStream = simulation.GetHeightmapStream();
+  if (heightmapStream.IsOpen()) std::cout<<"Heightmap tiles: "<<heightmapStream.GetResidentTileCount()<<" of "<<heightmapStream.GetTileCount()<<" resident, "<<heightmapStream.GetTilesPagedIn()<<" paged in, "<<heightmapStream.GetTilesEvicted()<<" evicted"<<std::endl;
+  std::cout<<"Allocations: "<<nTickAllocations<<" ("<<nTickAllocatedBytes<<" bytes), "<<(double(nTickAllocations) / fTicks)<<" per tick"<<std::endl;
+
+  return EXIT_SUCCESS;
+}
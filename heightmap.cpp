@@ -1,12 +1,76 @@
+#include <cassert>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define BUILD_HEIGHTMAP_SSE
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <limits>
+#include <random>
+
 #include <libvoodoomm/cImage.h>
 
 #include <spitfire/util/log.h>
 
+#include "blur.h"
 #include "heightmap.h"
+#include "heightmapstream.h"
+#include "parallel.h"
+#include "pngreader.h"
+#include "terraincache.h"
 
-int round_up_or_down(float n)
+namespace
 {
-  return (n - ((int)n) >= 0.5) ? (int)n + 1 : (int)n;
+  // I find that an exagerated height scale gives a better, more obvious result
+  const float fLightmapScaleY = 100.0f;
+
+  // How bright a texel in full shadow is compared to one in full sun
+  const float fLightmapAmbient = 0.5f;
+
+  // The height in lightmap units that a point has to be under the horizon before it is fully shadowed
+  const float fSunPenumbra = 1.0f;
+
+  // Ambient occlusion is how much of the sky each point can see, approximated by sweeping a low sun around the horizon
+  const size_t nAmbientOcclusionDirections = 8;
+  const float fAmbientOcclusionElevationDegrees = 10.0f;
+  const float fAmbientOcclusionPenumbra = 4.0f;
+
+  // How dark a point that cannot see any of the sky is, 0 would be black
+  const float fAmbientOcclusionMinimum = 0.5f;
+
+  // Writes each intensity from 0 to 1 as an opaque grey RGBA8 pixel
+  void ConvertIntensityToRGBA8(const float* pIntensity, uint8_t* pRGBA, size_t n)
+  {
+    size_t i = 0;
+
+#ifdef BUILD_HEIGHTMAP_SSE
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_set1_ps(255.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128i alpha = _mm_set1_epi32(int(0xFF000000));
+
+    for (; (i + 4) <= n; i += 4) {
+      const __m128 value = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(pIntensity + i), zero), one);
+      const __m128i grey = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(value, scale), half));
+
+      // Copy the grey byte of each 32 bit pixel into red, green and blue
+      const __m128i rgba = _mm_or_si128(_mm_or_si128(grey, _mm_slli_epi32(grey, 8)), _mm_or_si128(_mm_slli_epi32(grey, 16), alpha));
+      _mm_storeu_si128((__m128i*)(pRGBA + (4 * i)), rgba);
+    }
+#endif
+
+    // Any remaining pixels
+    for (; i < n; i++) {
+      const uint8_t grey = uint8_t((255.0f * spitfire::math::clamp(pIntensity[i], 0.0f, 1.0f)) + 0.5f);
+      pRGBA[(4 * i) + 0] = grey;
+      pRGBA[(4 * i) + 1] = grey;
+      pRGBA[(4 * i) + 2] = grey;
+      pRGBA[(4 * i) + 3] = 255;
+    }
+  }
 }
 
 
@@ -15,307 +79,624 @@ cHeightmapData::cHeightmapData() :
   depth(0),
   fLowestPoint(0.0f),
   fHighestPoint(0.0f),
+  pHeightmap(nullptr),
+  pNormalsX(nullptr),
+  pNormalsY(nullptr),
+  pNormalsZ(nullptr),
+  pAmbientOcclusion(nullptr),
+  pLightmap(nullptr),
   widthLightmap(0),
   depthLightmap(0)
 {
 }
 
+size_t cHeightmapData::GetLoadStep(size_t width, size_t depth)
+{
+  const size_t size = std::max(width, depth);
+  if (size <= nMaxLoadedSamplesPerSide) return 1;
+
+  // Round up so that ((size - 1) / step) + 1 fits
+  return ((size - 1) + (nMaxLoadedSamplesPerSide - 2)) / (nMaxLoadedSamplesPerSide - 1);
+}
+
 bool cHeightmapData::LoadFromFile(const spitfire::string_t& sFilename)
 {
+  // Raw heightmaps are read straight out of the file
+  HEIGHTMAP_FORMAT format = HEIGHTMAP_FORMAT::R16;
+  if (cHeightmapStream::GetFormatFromFilename(sFilename, format)) {
+    cHeightmapStream stream;
+    if (!stream.Open(sFilename, format)) return false;
+
+    const size_t step = GetLoadStep(stream.GetWidth(), stream.GetDepth());
+    const size_t loadWidth = ((stream.GetWidth() - 1) / step) + 1;
+    const size_t loadDepth = ((stream.GetDepth() - 1) / step) + 1;
+    if (step != 1) LOG("cHeightmapData::LoadFromFile \"", sFilename, "\" is ", stream.GetWidth(), "x", stream.GetDepth(), ", loading every ", step, " samples as ", loadWidth, "x", loadDepth);
+
+    return LoadFromStream(stream, 0, 0, loadWidth, loadDepth, step);
+  }
+
+  png::Header header;
+  const bool bIsPNG = png::ReadHeader(sFilename, header);
+
+  // The image loader reduces 16 bit images to 8 bits per channel so we decode those ourselves
+  if (bIsPNG && (header.bitDepth == 16)) {
+    const size_t step = GetLoadStep(header.width, header.height);
+    const size_t loadWidth = ((header.width - 1) / step) + 1;
+    const size_t loadDepth = ((header.height - 1) / step) + 1;
+    if (step != 1) LOG("cHeightmapData::LoadFromFile \"", sFilename, "\" is ", header.width, "x", header.height, ", loading every ", step, " samples as ", loadWidth, "x", loadDepth);
+
+    heightmap.resize(loadWidth * loadDepth);
+
+    const float fScale = 1.0f / 65535.0f;
+    const bool bResult = png::Read16BitRows(sFilename, [this, step, loadWidth, fScale](size_t y, const uint16_t* pRow) {
+      if ((y % step) != 0) return;
+
+      float* pHeights = &heightmap[(y / step) * loadWidth];
+      for (size_t x = 0; x < loadWidth; x++) pHeights[x] = fScale * float(pRow[x * step]);
+    });
+    if (!bResult) return false;
+
+    width = loadWidth;
+    depth = loadDepth;
+
+    UpdateLowestAndHighestPoints();
+
+    CreateDerivedData();
+
+    return true;
+  }
+
   voodoo::cImage image;
   if (!image.LoadFromFile(sFilename)) {
     LOG("cHeightmapData::LoadFromFile Could not load \"", sFilename, "\"");
     return false;
   }
 
-  width = image.GetWidth();
-  depth = image.GetHeight();
+  const size_t nBytesPerPixel = image.GetBytesPerPixel();
 
-  // Create heightmap data
-  const size_t n = width * depth;
+  // 2 bytes is only grey and alpha if the header says so, otherwise it could be a packed colour format
+  const bool bIsGreyAlpha = (bIsPNG && (header.bitDepth == 8) && (header.colourType == png::COLOUR_TYPE::GREY_ALPHA));
+  if ((nBytesPerPixel == 0) || (nBytesPerPixel > 4) || ((nBytesPerPixel == 2) && !bIsGreyAlpha)) {
+    LOGERROR("cHeightmapData::LoadFromFile \"", sFilename, "\" has an unsupported pixel format with ", nBytesPerPixel, " bytes per pixel, use an 8 or 16 bit image or a raw R16 or R32F heightmap");
+    return false;
+  }
 
-  heightmap.resize(n, 0);
+  const size_t imageWidth = image.GetWidth();
+  const size_t imageHeight = image.GetHeight();
+  const size_t step = GetLoadStep(imageWidth, imageHeight);
 
-  const uint8_t* pPixels = image.GetPointerToBuffer();
+  width = ((imageWidth - 1) / step) + 1;
+  depth = ((imageHeight - 1) / step) + 1;
+  if (step != 1) LOG("cHeightmapData::LoadFromFile \"", sFilename, "\" is ", imageWidth, "x", imageHeight, ", loading every ", step, " samples as ", width, "x", depth);
 
+  // Create heightmap data
+  heightmap.resize(width * depth, 0);
+
+  // 8 bits per channel, for grey and alpha or colour images the first channel is used
+  const uint8_t* pPixels = image.GetPointerToBuffer();
   for (size_t y = 0; y < depth; y++) {
-    for (size_t x = 0; x < width; x++) {
-      const float fValue = float(pPixels[(y * width) + x]) / 255.0f;
-      heightmap[(y * width) + x] = fValue;
+    const uint8_t* pRow = pPixels + ((y * step * imageWidth) * nBytesPerPixel);
+    for (size_t x = 0; x < width; x++) heightmap[(y * width) + x] = float(pRow[x * step * nBytesPerPixel]) / 255.0f;
+  }
 
-      if (fValue < fLowestPoint) fLowestPoint = fValue;
-      if (fValue > fHighestPoint) fHighestPoint = fValue;
-    }
+  UpdateLowestAndHighestPoints();
+
+  CreateDerivedData();
+
+  return true;
+}
+
+bool cHeightmapData::LoadFromStream(const cHeightmapStream& stream, size_t x, size_t z, size_t _width, size_t _depth, size_t step)
+{
+  if (
+    (_width < 2) || (_depth < 2) || (step == 0) ||
+    ((x + ((_width - 1) * step)) >= stream.GetWidth()) || ((z + ((_depth - 1) * step)) >= stream.GetDepth())
+  ) {
+    LOG("cHeightmapData::LoadFromStream Invalid region ", x, ",", z, " ", _width, "x", _depth, " step ", step);
+    return false;
   }
 
+  width = _width;
+  depth = _depth;
 
-  // Calculate shadowmap texture
-  std::vector<spitfire::math::cColour> _lightmap;
-  _lightmap.resize(n, spitfire::math::cColour());
+  heightmap.resize(width * depth);
+  stream.ReadRegion(x, z, width, depth, &heightmap[0], step);
 
-  // I find that an exagerated z scale gives a better, more obvious result
-  const float fScaleY = 100.0f;
-  const spitfire::math::cColour ambientColour(1.0f, 1.0f, 1.0f);
-  const spitfire::math::cColour shadowColour = 0.5f * ambientColour;
-  const size_t size = width;
-  const spitfire::math::cVec3 sunPosition(50.0f, 100.0f, 100.0f);
-  GenerateLightmap(heightmap, _lightmap, fScaleY, ambientColour, shadowColour, size, sunPosition);
+  UpdateLowestAndHighestPoints();
 
-  widthLightmap = width;
-  depthLightmap = depth;
+  CreateDerivedData();
 
+  return true;
+}
 
-#if 0
-  // For debugging
-  {
-    const size_t nLightmap = widthLightmap * depthLightmap;
-
-    // Copy the lightmap from the cColour vector to the uint8_t vector
-    lightmap.resize(nLightmap * 4, 0);
-
-    for (size_t y = 0; y < depthLightmap; y++) {
-      for (size_t x = 0; x < widthLightmap; x++) {
-        const size_t src = (y * widthLightmap) + x;
-        const size_t dst = 4 * ((y * widthLightmap) + x);
-        lightmap[dst + 0] = uint8_t(_lightmap[src].r * 255.0f);
-        lightmap[dst + 1] = uint8_t(_lightmap[src].g * 255.0f);
-        lightmap[dst + 2] = uint8_t(_lightmap[src].b * 255.0f);
-        lightmap[dst + 3] = uint8_t(_lightmap[src].a * 255.0f);
-      }
-    }
+bool cHeightmapData::LoadFromCache(const cTerrainCache& cache)
+{
+  const size_t n = cache.GetWidth() * cache.GetDepth();
+
+  const float* pCachedHeightmap = cache.GetSection<float>(TERRAIN_CACHE_SECTION::HEIGHTS, n);
+  const float* pCachedNormalsX = cache.GetSection<float>(TERRAIN_CACHE_SECTION::NORMALS_X, n);
+  const float* pCachedNormalsY = cache.GetSection<float>(TERRAIN_CACHE_SECTION::NORMALS_Y, n);
+  const float* pCachedNormalsZ = cache.GetSection<float>(TERRAIN_CACHE_SECTION::NORMALS_Z, n);
+  const float* pCachedAmbientOcclusion = cache.GetSection<float>(TERRAIN_CACHE_SECTION::AMBIENT_OCCLUSION, n);
+  const uint8_t* pCachedLightmap = cache.GetSection<uint8_t>(TERRAIN_CACHE_SECTION::LIGHTMAP, 4 * n);
+  if (
+    (pCachedHeightmap == nullptr) || (pCachedNormalsX == nullptr) || (pCachedNormalsY == nullptr) || (pCachedNormalsZ == nullptr) ||
+    (pCachedAmbientOcclusion == nullptr) || (pCachedLightmap == nullptr)
+  ) {
+    LOG("cHeightmapData::LoadFromCache The cache is missing some of the heightmap");
+    return false;
   }
 
-  voodoo::cImage generated;
-  const uint8_t* pBuffer = &lightmap[0];
-  generated.CreateFromBuffer(pBuffer, widthLightmap, depthLightmap, opengl::PIXELFORMAT::R8G8B8A8);
-  generated.SaveToBMP(TEXT("/home/chris/dev/tests/openglmm_heightmap/textures/generated.bmp"));
+  width = cache.GetWidth();
+  depth = cache.GetDepth();
+  fLowestPoint = cache.GetLowestPoint();
+  fHighestPoint = cache.GetHighestPoint();
+
+  // Everything is used in place so we can release anything that we made ourselves
+  std::vector<float>().swap(heightmap);
+  std::vector<float>().swap(normalsX);
+  std::vector<float>().swap(normalsY);
+  std::vector<float>().swap(normalsZ);
+  std::vector<float>().swap(ambientOcclusion);
+  std::vector<uint8_t>().swap(lightmap);
+
+  pHeightmap = pCachedHeightmap;
+  pNormalsX = pCachedNormalsX;
+  pNormalsY = pCachedNormalsY;
+  pNormalsZ = pCachedNormalsZ;
+  pAmbientOcclusion = pCachedAmbientOcclusion;
+  pLightmap = pCachedLightmap;
 
-  exit(0);
-#endif
+  widthLightmap = width;
+  depthLightmap = depth;
 
+  return true;
+}
 
-  {
-    // Smooth the lightmap
-    std::vector<spitfire::math::cColour> smoothed;
+void cHeightmapData::AddToCache(cTerrainCacheWriter& writer) const
+{
+  const size_t n = width * depth;
+  assert(pLightmap != nullptr);
+
+  writer.SetHeightmap(width, depth, fLowestPoint, fHighestPoint);
+  writer.AddToSection(TERRAIN_CACHE_SECTION::HEIGHTS, pHeightmap, n * sizeof(float));
+  writer.AddToSection(TERRAIN_CACHE_SECTION::NORMALS_X, pNormalsX, n * sizeof(float));
+  writer.AddToSection(TERRAIN_CACHE_SECTION::NORMALS_Y, pNormalsY, n * sizeof(float));
+  writer.AddToSection(TERRAIN_CACHE_SECTION::NORMALS_Z, pNormalsZ, n * sizeof(float));
+  writer.AddToSection(TERRAIN_CACHE_SECTION::AMBIENT_OCCLUSION, pAmbientOcclusion, n * sizeof(float));
+  writer.AddToSection(TERRAIN_CACHE_SECTION::LIGHTMAP, pLightmap, 4 * n);
+}
 
-    SmoothImage(_lightmap, widthLightmap, depthLightmap, 10, smoothed);
+void cHeightmapData::UpdateLowestAndHighestPoints()
+{
+  fLowestPoint = std::numeric_limits<float>::max();
+  fHighestPoint = -std::numeric_limits<float>::max();
 
-    _lightmap = smoothed;
+  for (auto&& fValue : heightmap) {
+    if (fValue < fLowestPoint) fLowestPoint = fValue;
+    if (fValue > fHighestPoint) fHighestPoint = fValue;
   }
+}
 
+void cHeightmapData::CreateDerivedData()
+{
+  pHeightmap = &heightmap[0];
 
-  /*for (size_t i = 0; i < 3; i++) {
-  // Double the resolution of the lightmap
-  std::vector<spitfire::math::cColour> lightmapCopy;
+  CreateNormals();
+  CreateLightmap();
+}
 
-  DoubleImageSize(_lightmap, widthLightmap, depthLightmap, lightmapCopy);
+bool cHeightmapData::CreateProcedural(size_t _width, size_t _depth, uint32_t seed)
+{
+  if ((_width < 2) || (_depth < 2)) {
+    LOG("cHeightmapData::CreateProcedural Invalid size ", _width, "x", _depth);
+    return false;
+  }
 
-  _lightmap = lightmapCopy;
-  widthLightmap *= 2;
-  depthLightmap *= 2;
+  width = _width;
+  depth = _depth;
 
+  heightmap.resize(width * depth, 0);
 
-  // Smooth the lightmap
-  std::vector<spitfire::math::cColour> smoothed;
+  // A few octaves of sine waves with random directions and phases give us smooth rolling hills that look the same for every seed
+  std::mt19937 generator(seed);
+  std::uniform_real_distribution<float> distribution(0.0f, 2.0f * spitfire::math::cPI);
 
-  SmoothImage(_lightmap, widthLightmap, depthLightmap, 10, smoothed);
+  const size_t nOctaves = 4;
+  float fDirectionX[nOctaves];
+  float fDirectionZ[nOctaves];
+  float fPhase[nOctaves];
+  for (size_t i = 0; i < nOctaves; i++) {
+    const float fAngle = distribution(generator);
+    fDirectionX[i] = cosf(fAngle);
+    fDirectionZ[i] = sinf(fAngle);
+    fPhase[i] = distribution(generator);
+  }
 
-  _lightmap = smoothed;
-  }*/
+  // The longest wave spans the whole map
+  const float fBaseFrequency = 2.0f * spitfire::math::cPI / float(std::max(width, depth));
 
-  const size_t nLightmap = widthLightmap * depthLightmap;
+  fLowestPoint = std::numeric_limits<float>::max();
+  fHighestPoint = -std::numeric_limits<float>::max();
 
+  for (size_t y = 0; y < depth; y++) {
+    for (size_t x = 0; x < width; x++) {
+      float fValue = 0.0f;
+      float fAmplitude = 0.5f;
+      float fFrequency = fBaseFrequency;
+      for (size_t i = 0; i < nOctaves; i++) {
+        fValue += fAmplitude * sinf((fFrequency * ((fDirectionX[i] * float(x)) + (fDirectionZ[i] * float(y)))) + fPhase[i]);
+        fAmplitude *= 0.5f;
+        fFrequency *= 2.0f;
+      }
 
-  // Copy the lightmap from the cColour vector to the uint8_t vector
-  lightmap.resize(nLightmap * 4, 0);
+      // The amplitudes add up to less than 1 so this is always within 0 to 1
+      fValue = 0.5f + (0.5f * fValue);
+      heightmap[(y * width) + x] = fValue;
 
-  for (size_t y = 0; y < depthLightmap; y++) {
-    for (size_t x = 0; x < widthLightmap; x++) {
-      const size_t src = (y * widthLightmap) + x;
-      const size_t dst = 4 * ((y * widthLightmap) + x);
-      lightmap[dst + 0] = uint8_t(_lightmap[src].r * 255.0f);
-      lightmap[dst + 1] = uint8_t(_lightmap[src].g * 255.0f);
-      lightmap[dst + 2] = uint8_t(_lightmap[src].b * 255.0f);
-      lightmap[dst + 3] = uint8_t(_lightmap[src].a * 255.0f);
+      if (fValue < fLowestPoint) fLowestPoint = fValue;
+      if (fValue > fHighestPoint) fHighestPoint = fValue;
     }
   }
 
+  CreateDerivedData();
+
   return true;
 }
 
-void cHeightmapData::DoubleImageSize(const std::vector<spitfire::math::cColour>& source, size_t widthSource, size_t heightSource, std::vector<spitfire::math::cColour>& destination)
+void cHeightmapData::CreateNormals()
 {
-  const size_t widthDestination = 2 * widthSource;
-  const size_t heightDestination = 2 * heightSource;
-  const size_t n = widthDestination * heightDestination;
-
-  destination.resize(n, spitfire::math::cColour());
-
-  for (size_t y = 0; y < heightSource; y++) {
-    for (size_t x = 0; x < widthSource; x++) {
-      const spitfire::math::cColour& colour = source[(y * widthSource) + x];
-      destination[(2 * ((y * widthDestination) + x)) + 0] = colour;
-      destination[(2 * ((y * widthDestination) + x)) + 1] = colour;
-      destination[widthDestination + (2 * ((y * widthDestination) + x)) + 0] = colour;
-      destination[widthDestination + (2 * ((y * widthDestination) + x)) + 1] = colour;
-    }
-  }
-}
+  const size_t n = width * depth;
 
-void cHeightmapData::SmoothImage(const std::vector<spitfire::math::cColour>& source, size_t _width, size_t _height, size_t iterations, std::vector<spitfire::math::cColour>& destination) const
-{
-  const size_t n = _width * _height;
+  normalsX.resize(n);
+  normalsY.resize(n);
+  normalsZ.resize(n);
 
-  destination.resize(n, spitfire::math::cColour());
+  if (n == 0) return;
 
-  std::vector<spitfire::math::cColour> temp = source;
+  // The normal of a height field is (-dh/dx, 1, -dh/dz) normalised, the slopes are central differences that are clamped at
+  // the edges.  Each row only reads the rows either side of it so the rows are independent.
+  for (size_t y = 0; y < depth; y++) {
+    const float* pRow = &pHeightmap[y * width];
+    const float* pRowAbove = &pHeightmap[((y != 0) ? (y - 1) : y) * width];
+    const float* pRowBelow = &pHeightmap[(((y + 1) < depth) ? (y + 1) : y) * width];
+
+    float* pRowNormalsX = &normalsX[y * width];
+    float* pRowNormalsY = &normalsY[y * width];
+    float* pRowNormalsZ = &normalsZ[y * width];
+
+    auto CreateNormal = [&](size_t x) {
+      const size_t left = (x != 0) ? (x - 1) : x;
+      const size_t right = ((x + 1) < width) ? (x + 1) : x;
+
+      const float fSlopeX = 0.5f * (pRow[right] - pRow[left]);
+      const float fSlopeZ = 0.5f * (pRowBelow[x] - pRowAbove[x]);
+      const float fInverseLength = 1.0f / sqrtf((fSlopeX * fSlopeX) + (fSlopeZ * fSlopeZ) + 1.0f);
+
+      pRowNormalsX[x] = -fSlopeX * fInverseLength;
+      pRowNormalsY[x] = fInverseLength;
+      pRowNormalsZ[x] = -fSlopeZ * fInverseLength;
+    };
+
+    CreateNormal(0);
+
+    size_t x = 1;
+
+#ifdef BUILD_HEIGHTMAP_SSE
+    // Everything except the first and last columns has both neighbours so 4 normals can be made at a time
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+
+    for (; (x + 5) <= width; x += 4) {
+      const __m128 slopeX = _mm_mul_ps(half, _mm_sub_ps(_mm_loadu_ps(pRow + x + 1), _mm_loadu_ps(pRow + x - 1)));
+      const __m128 slopeZ = _mm_mul_ps(half, _mm_sub_ps(_mm_loadu_ps(pRowBelow + x), _mm_loadu_ps(pRowAbove + x)));
+      const __m128 lengthSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(slopeX, slopeX), _mm_mul_ps(slopeZ, slopeZ)), one);
+      const __m128 inverseLength = _mm_div_ps(one, _mm_sqrt_ps(lengthSquared));
+
+      _mm_storeu_ps(pRowNormalsX + x, _mm_xor_ps(_mm_mul_ps(slopeX, inverseLength), signMask));
+      _mm_storeu_ps(pRowNormalsY + x, inverseLength);
+      _mm_storeu_ps(pRowNormalsZ + x, _mm_xor_ps(_mm_mul_ps(slopeZ, inverseLength), signMask));
+    }
+#endif
 
-  spitfire::math::cColour surrounding[5];
+    // Any remaining columns
+    for (; x < width; x++) CreateNormal(x);
+  }
 
-  for (size_t i = 0; i < iterations; i++) {
-    for (size_t y = 0; y < depthLightmap; y++) {
-      for (size_t x = 0; x < widthLightmap; x++) {
+  pNormalsX = &normalsX[0];
+  pNormalsY = &normalsY[0];
+  pNormalsZ = &normalsZ[0];
+}
 
-        surrounding[0] = surrounding[1] = surrounding[2] = surrounding[3] = surrounding[4] = GetLightmapPixel(temp, x, y);
+void cHeightmapData::CreateLightmap()
+{
+  CreateAmbientOcclusion();
 
-        // We sample from the 4 surrounding pixels in a cross shape
-        if (x != 0) surrounding[0] = GetLightmapPixel(temp, x - 1, y);
-        if ((y + 1) < depthLightmap) surrounding[1] = GetLightmapPixel(temp, x, y + 1);
-        if (y != 0) surrounding[3] = GetLightmapPixel(temp, x, y - 1);
-        if ((x + 1) < widthLightmap) surrounding[4] = GetLightmapPixel(temp, x + 1, y);
+  BakeLightmap(spitfire::math::cVec3(50.0f, 100.0f, 100.0f).GetNormalised());
+}
 
-        //const spitfire::math::cColour averageOfSurrounding = 0.25f * (surrounding[0] + surrounding[1] + surrounding[3] + surrounding[4]);
-        //const spitfire::math::cColour colour = 0.5f * (surrounding[2] + averageOfSurrounding);
-        const spitfire::math::cColour colour = 0.25f * (surrounding[0] + surrounding[1] + surrounding[3] + surrounding[4]);
+void cHeightmapData::SweepVisibility(const spitfire::math::cVec3& direction, float fPenumbra, std::vector<float>& visibility) const
+{
+  const size_t n = width * depth;
+  visibility.resize(n);
 
-        const size_t index = (y * widthLightmap) + x;
+  const float fHorizontal = sqrtf((direction.x * direction.x) + (direction.z * direction.z));
+  if ((n == 0) || (fHorizontal < 0.0001f) || (direction.y <= 0.0f)) {
+    // The sun is straight overhead or below the horizon
+    std::fill(visibility.begin(), visibility.end(), (direction.y > 0.0f) ? 1.0f : 0.0f);
+    return;
+  }
 
-        destination[index] = colour;
+  // Walk lines away from the sun, one texel along the main axis at a time.  Each line keeps the highest terrain it has
+  // passed so far, dropped by the slope of the sun ray for every step, a point is in shadow if it is below that horizon.
+  // Lines are one texel apart across the minor axis so every texel is visited by exactly one line and the lines can be
+  // walked in parallel.
+  const bool bIsMainAxisX = (fabsf(direction.x) >= fabsf(direction.z));
+  const float fMain = bIsMainAxisX ? direction.x : direction.z;
+  const float fMinor = bIsMainAxisX ? direction.z : direction.x;
+  const size_t mainSize = bIsMainAxisX ? width : depth;
+  const size_t minorSize = bIsMainAxisX ? depth : width;
+  const size_t mainStride = bIsMainAxisX ? 1 : width;
+  const size_t minorStride = bIsMainAxisX ? width : 1;
+
+  // Light travels away from the sun, so start at the edge facing the sun
+  const bool bIsMainReversed = (fMain > 0.0f);
+  const float fMinorStep = -fMinor / fabsf(fMain);
+  const float fDrop = sqrtf(1.0f + (fMinorStep * fMinorStep)) * (direction.y / fHorizontal);
+
+  // Lines that start off the side of the map still cross it later on
+  const int firstLine = (fMinorStep >= 0.0f) ? -int(ceilf(fMinorStep * float(mainSize - 1))) : 0;
+  const int lastLine = int(minorSize) + ((fMinorStep < 0.0f) ? int(ceilf(-fMinorStep * float(mainSize - 1))) : 0);
+
+  const float* pHeights = pHeightmap;
+  float* pVisibility = &visibility[0];
+
+  parallel::ParallelFor(size_t(lastLine - firstLine), [&](size_t begin, size_t end) {
+    for (size_t line = begin; line < end; line++) {
+      const float fLine = float(int(line) + firstLine);
+      float fHorizon = -std::numeric_limits<float>::max();
+
+      for (size_t step = 0; step < mainSize; step++) {
+        fHorizon -= fDrop;
+
+        const float fMinorPosition = fLine + (fMinorStep * float(step));
+        const int minor = int(floorf(fMinorPosition + 0.5f));
+        if ((minor < 0) || (minor >= int(minorSize))) continue;
+
+        const size_t main = bIsMainReversed ? (mainSize - 1 - step) : step;
+        const size_t index = (main * mainStride) + (size_t(minor) * minorStride);
+
+        const float fHeight = fLightmapScaleY * pHeights[index];
+        pVisibility[index] = spitfire::math::clamp(1.0f - ((fHorizon - fHeight) / fPenumbra), 0.0f, 1.0f);
+
+        // The horizon follows the line exactly rather than the nearest texel so that it does not step
+        const float fMinorClamped = spitfire::math::clamp(fMinorPosition, 0.0f, float(minorSize - 1));
+        const size_t minor0 = size_t(fMinorClamped);
+        const size_t minor1 = std::min(minor0 + 1, minorSize - 1);
+        const float fFraction = fMinorClamped - float(minor0);
+        const float fHeight0 = pHeights[(main * mainStride) + (minor0 * minorStride)];
+        const float fHeight1 = pHeights[(main * mainStride) + (minor1 * minorStride)];
+        fHorizon = std::max(fHorizon, fLightmapScaleY * (fHeight0 + (fFraction * (fHeight1 - fHeight0))));
       }
     }
+  });
+}
+
+void cHeightmapData::CreateAmbientOcclusion()
+{
+  const size_t n = width * depth;
+  ambientOcclusion.assign(n, 0.0f);
 
+  const float fElevation = spitfire::math::DegreesToRadians(fAmbientOcclusionElevationDegrees);
 
-    // If we are still going then set temp to destination for the next iteration
-    if ((i + 1) < iterations) temp = destination;
+  std::vector<float> visibility;
+  for (size_t i = 0; i < nAmbientOcclusionDirections; i++) {
+    const float fAzimuth = 2.0f * spitfire::math::cPI * float(i) / float(nAmbientOcclusionDirections);
+    const spitfire::math::cVec3 direction(cosf(fAzimuth) * cosf(fElevation), sinf(fElevation), sinf(fAzimuth) * cosf(fElevation));
+    SweepVisibility(direction, fAmbientOcclusionPenumbra, visibility);
+
+    for (size_t j = 0; j < n; j++) ambientOcclusion[j] += visibility[j];
   }
-}
 
-spitfire::math::cColour cHeightmapData::GetLightmapPixel(const std::vector<spitfire::math::cColour>& _lightmap, size_t x, size_t y) const
-{
-  assert(x < widthLightmap);
-  assert(y < depthLightmap);
+  const float fScale = (1.0f - fAmbientOcclusionMinimum) / float(nAmbientOcclusionDirections);
+  for (size_t j = 0; j < n; j++) ambientOcclusion[j] = fAmbientOcclusionMinimum + (fScale * ambientOcclusion[j]);
 
-  const size_t index = (y * widthLightmap) + x;
-  return _lightmap[index];
+  pAmbientOcclusion = &ambientOcclusion[0];
 }
 
-float cHeightmapData::GetHeight(size_t x, size_t y) const
+void cHeightmapData::BakeLightmap(const spitfire::math::cVec3& sunDirection)
 {
-  if (((y * width) + x) >= heightmap.size()) return 0.0f;
+  const size_t n = width * depth;
+  assert(pAmbientOcclusion != nullptr);
 
-  return heightmap[(y * depth) + x];
-}
+  const spitfire::math::cVec3 direction = sunDirection.GetNormalised();
 
-spitfire::math::cVec3 cHeightmapData::GetNormalOfTriangle(const spitfire::math::cVec3& p0, const spitfire::math::cVec3& p1, const spitfire::math::cVec3& p2) const
-{
-  const spitfire::math::cVec3 v0 = p1 - p0;
-  const spitfire::math::cVec3 v1 = p2 - p0;
+  // The whole lightmap is worked out in a single grey channel, first the sun visibility is written and then it is turned
+  // into the final intensity in place
+  std::vector<float> intensity;
+  SweepVisibility(direction, fSunPenumbra, intensity);
 
-  return v0.CrossProduct(v1);
-}
+  // The normals are stored for a scale of 1, stretch them by the same height scale that the shadows were worked out at
+  parallel::ParallelFor(depth, [&](size_t begin, size_t end) {
+    for (size_t y = begin; y < end; y++) {
+      for (size_t x = 0; x < width; x++) {
+        const size_t index = (y * width) + x;
 
-spitfire::math::cVec3 cHeightmapData::GetNormal(size_t x, size_t y, const spitfire::math::cVec3& scale) const
-{
-  assert(((y * depth) + x) < heightmap.size());
+        spitfire::math::cVec3 normal(fLightmapScaleY * pNormalsX[index], pNormalsY[index], fLightmapScaleY * pNormalsZ[index]);
+        normal.Normalise();
+        const float fDiffuse = std::max(0.0f, normal.DotProduct(direction));
 
-  // Get the height of the target point and the 4 heights in a cross shape around the target
-  spitfire::math::cVec3 points[5];
+        intensity[index] = pAmbientOcclusion[index] * (fLightmapAmbient + ((1.0f - fLightmapAmbient) * intensity[index] * fDiffuse));
+      }
+    }
+  });
 
-  points[0] = points[1] = points[2] = points[3] = points[4] = spitfire::math::cVec3(float(x), float(y), GetHeight(x, y));
+  widthLightmap = width;
+  depthLightmap = depth;
 
-  // First column
-  if (x != 0) points[0] = spitfire::math::cVec3(float(x - 1), float(y), GetHeight(x - 1, y));
+  // Smooth the lightmap, about the same as 10 iterations of a 4 tap cross filter
+  BoxBlur(&intensity[0], widthLightmap, depthLightmap, 2, 3);
 
-  // Second column
-  if ((x != 0) && (y != 0)) points[1] = spitfire::math::cVec3(float(x), float(y - 1), GetHeight(x, y - 1));
-  //points[2] = spitfire::math::cVec3(float(x), float(y), GetHeight(x, y));
-  if ((y + 1) < depth) points[3] = spitfire::math::cVec3(float(x), float(y + 1), GetHeight(x, y + 1));
+  lightmap.resize(n * 4);
+  ConvertIntensityToRGBA8(&intensity[0], &lightmap[0], n);
+  pLightmap = &lightmap[0];
 
-  // Third column
-  if ((x + 1) < width) points[4] = spitfire::math::cVec3(float(x + 1), float(y), GetHeight(x + 1, y));
 
-  points[0] *= scale;
-  points[1] *= scale;
-  points[2] *= scale;
-  points[3] *= scale;
-  points[4] *= scale;
+#if 0
+  // For debugging
+  voodoo::cImage generated;
+  const uint8_t* pBuffer = &lightmap[0];
+  generated.CreateFromBuffer(pBuffer, widthLightmap, depthLightmap, opengl::PIXELFORMAT::R8G8B8A8);
+  generated.SaveToBMP(TEXT("/home/chris/dev/tests/openglmm_heightmap/textures/generated.bmp"));
 
-  spitfire::math::cVec3 normal;
+  exit(0);
+#endif
+}
 
-  normal += GetNormalOfTriangle(points[0], points[2], points[1]);
-  normal += GetNormalOfTriangle(points[0], points[2], points[3]);
-  normal += GetNormalOfTriangle(points[4], points[2], points[1]);
-  normal += GetNormalOfTriangle(points[4], points[2], points[3]);
+void cHeightmapData::SmoothImage(const std::vector<spitfire::math::cColour>& source, size_t _width, size_t _height, size_t iterations, std::vector<spitfire::math::cColour>& destination) const
+{
+  const size_t n = _width * _height;
+  assert(source.size() >= n);
+
+  // Each iteration of the old 4 tap cross filter added a variance of 0.5 along each axis, 3 box passes of radius r add
+  // r * (r + 1) so pick the radius that comes closest
+  const size_t radius = size_t(0.5f + (0.5f * (sqrtf(1.0f + (2.0f * float(iterations))) - 1.0f)));
+  const size_t nPasses = 3;
+
+  // Split the colours into one plane per channel and blur each plane in place
+  std::vector<float> channels(4 * n);
+  float* pRed = &channels[0];
+  float* pGreen = pRed + n;
+  float* pBlue = pGreen + n;
+  float* pAlpha = pBlue + n;
+  for (size_t i = 0; i < n; i++) {
+    pRed[i] = source[i].r;
+    pGreen[i] = source[i].g;
+    pBlue[i] = source[i].b;
+    pAlpha[i] = source[i].a;
+  }
 
-  normal.Normalise();
+  for (size_t channel = 0; channel < 4; channel++) BoxBlur(&channels[channel * n], _width, _height, radius, nPasses);
 
-  return normal;
+  destination.resize(n);
+  for (size_t i = 0; i < n; i++) destination[i] = spitfire::math::cColour(pRed[i], pGreen[i], pBlue[i], pAlpha[i]);
 }
 
-const uint8_t* cHeightmapData::GetLightmapBuffer() const
+float cHeightmapData::GetHeight(size_t x, size_t y) const
 {
-  assert(!lightmap.empty());
-  return &lightmap[0];
+  if ((x >= width) || (y >= depth)) return 0.0f;
+
+  return pHeightmap[(y * width) + x];
 }
 
-// http://www.cyberhead.de/download/articles/shadowmap/
+float cHeightmapData::SampleHeight(float x, float z) const
+{
+  if ((width < 2) || (depth < 2)) return 0.0f;
+
+  // The top left corner of the cell is clamped so that the bottom right corner is always inside the heightmap
+  x = spitfire::math::clamp(x, 0.0f, float(width - 1));
+  z = spitfire::math::clamp(z, 0.0f, float(depth - 1));
+
+  const size_t cellX = std::min(size_t(x), width - 2);
+  const size_t cellZ = std::min(size_t(z), depth - 2);
+
+  const float fractionX = x - float(cellX);
+  const float fractionZ = z - float(cellZ);
+
+  const float* pCell = &pHeightmap[(cellZ * width) + cellX];
+  const float fTop = pCell[0] + (fractionX * (pCell[1] - pCell[0]));
+  const float fBottom = pCell[width] + (fractionX * (pCell[width + 1] - pCell[width]));
+  return fTop + (fractionZ * (fBottom - fTop));
+}
 
-void cHeightmapData::GenerateLightmap(const std::vector<float>& heightmap, std::vector<spitfire::math::cColour>& _lightmap, float fScaleY, const spitfire::math::cColour& ambientColour, const spitfire::math::cColour& shadowColour, size_t size, const spitfire::math::cVec3& sunPosition)
+spitfire::math::cVec3 cHeightmapData::SampleNormal(float x, float z, const spitfire::math::cVec3& scale) const
 {
-  assert(!_lightmap.empty());
+  // Central differences one grid cell either side, converted to world units so that the slope matches the rendered terrain
+  const float fSlopeX = scale.y * (SampleHeight(x + 1.0f, z) - SampleHeight(x - 1.0f, z)) / (2.0f * scale.x);
+  const float fSlopeZ = scale.y * (SampleHeight(x, z + 1.0f) - SampleHeight(x, z - 1.0f)) / (2.0f * scale.z);
 
-  const size_t n = size * size;
-  for (size_t index = 0; index < n; index++) {
-    _lightmap[index] = ambientColour;
+  return spitfire::math::cVec3(-fSlopeX, 1.0f, -fSlopeZ).GetNormalised();
+}
+
+void cHeightmapData::SampleHeights(const float* pX, const float* pZ, float* pOutHeights, size_t n) const
+{
+  size_t i = 0;
+
+#ifdef BUILD_HEIGHTMAP_SSE
+  if ((width >= 2) && (depth >= 2)) {
+    // The top left corner of the cell is clamped so that the bottom right corner is always inside the heightmap
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 maxX = _mm_set1_ps(float(width - 1));
+    const __m128 maxZ = _mm_set1_ps(float(depth - 1));
+    const __m128i maxCellX = _mm_set1_epi32(int(width - 2));
+    const __m128i maxCellZ = _mm_set1_epi32(int(depth - 2));
+
+    const float* pHeights = pHeightmap;
+
+    // SSE has no gather so the cells are worked out 4 at a time, the corners are loaded one by one and then blended 4 at a time
+    alignas(16) int32_t cellsX[4];
+    alignas(16) int32_t cellsZ[4];
+    alignas(16) float h00[4];
+    alignas(16) float h10[4];
+    alignas(16) float h01[4];
+    alignas(16) float h11[4];
+
+    for (; (i + 4) <= n; i += 4) {
+      const __m128 x = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(pX + i), zero), maxX);
+      const __m128 z = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(pZ + i), zero), maxZ);
+
+      // The coordinates are positive so truncating is the same as flooring
+      __m128i cellX = _mm_cvttps_epi32(x);
+      __m128i cellZ = _mm_cvttps_epi32(z);
+
+      // SSE2 has no integer min so compare and select instead
+      __m128i mask = _mm_cmpgt_epi32(cellX, maxCellX);
+      cellX = _mm_or_si128(_mm_and_si128(mask, maxCellX), _mm_andnot_si128(mask, cellX));
+      mask = _mm_cmpgt_epi32(cellZ, maxCellZ);
+      cellZ = _mm_or_si128(_mm_and_si128(mask, maxCellZ), _mm_andnot_si128(mask, cellZ));
+
+      const __m128 fractionX = _mm_sub_ps(x, _mm_cvtepi32_ps(cellX));
+      const __m128 fractionZ = _mm_sub_ps(z, _mm_cvtepi32_ps(cellZ));
+
+      _mm_store_si128((__m128i*)cellsX, cellX);
+      _mm_store_si128((__m128i*)cellsZ, cellZ);
+
+      for (size_t j = 0; j < 4; j++) {
+        const float* pCell = pHeights + (size_t(cellsZ[j]) * width) + size_t(cellsX[j]);
+        h00[j] = pCell[0];
+        h10[j] = pCell[1];
+        h01[j] = pCell[width];
+        h11[j] = pCell[width + 1];
+      }
+
+      const __m128 top = _mm_add_ps(_mm_load_ps(h00), _mm_mul_ps(fractionX, _mm_sub_ps(_mm_load_ps(h10), _mm_load_ps(h00))));
+      const __m128 bottom = _mm_add_ps(_mm_load_ps(h01), _mm_mul_ps(fractionX, _mm_sub_ps(_mm_load_ps(h11), _mm_load_ps(h01))));
+      _mm_storeu_ps(pOutHeights + i, _mm_add_ps(top, _mm_mul_ps(fractionZ, _mm_sub_ps(bottom, top))));
+    }
   }
+#endif
 
-  /*spitfire::math::cVec3 CurrentPos;
-  spitfire::math::cVec3 LightDir;
+  // Any remaining points
+  for (; i < n; i++) pOutHeights[i] = SampleHeight(pX[i], pZ[i]);
+}
 
-  int LerpX, LerpZ;
+spitfire::math::cVec3 cHeightmapData::GetNormal(size_t x, size_t y, const spitfire::math::cVec3& scale) const
+{
+  assert(x < width);
+  assert(y < depth);
 
-  // For every pixel on the map
-  for (size_t z = 0; z < size; ++z) {
-  for (size_t x = 0; x < size; ++x) {
-  // Set current position in terrain
-  CurrentPos.Set(float(x), (heightmap[(z * size) + x] * fScaleY), float(z));
+  const size_t index = (y * width) + x;
 
-  // Calc new direction of lightray
-  LightDir = (sunPosition - CurrentPos).GetNormalised();
+  // Normals are transformed by the inverse transpose of the scale, the common 1 / scale.y factor drops out when normalising
+  spitfire::math::cVec3 normal((scale.y / scale.x) * pNormalsX[index], pNormalsY[index], (scale.y / scale.z) * pNormalsZ[index]);
+  normal.Normalise();
 
-  //Start the test
-  while (
-  (CurrentPos.x >= 0) &&
-  (CurrentPos.x < size) &&
-  (CurrentPos.z >= 0) &&
-  (CurrentPos.z < size) &&
-  (CurrentPos != sunPosition) && (CurrentPos.y < 255)
-  ) {
-  CurrentPos += LightDir;
-
-  // Round the values up or down to the nearest int
-  LerpX = round_up_or_down(CurrentPos.x);
-  LerpZ = round_up_or_down(CurrentPos.z);
-
-  const size_t index = (LerpZ * size) + LerpX;
-  if (index < n) {
-  // Hit?
-  if (CurrentPos.y <= (heightmap[index] * fScaleY)) {
-  _lightmap[(z * size) + x] = shadowColour;
-  break;
-  }
-  }
-  }
-  }
-  }*/
+  return normal;
+}
+
+const uint8_t* cHeightmapData::GetLightmapBuffer() const
+{
+  assert(pLightmap != nullptr);
+  return pLightmap;
 }
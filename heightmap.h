@@ -6,42 +6,104 @@
 #include <spitfire/math/cColour.h>
 #include <spitfire/util/string.h>
 
+class cHeightmapStream;
+class cTerrainCache;
+class cTerrainCacheWriter;
+
 class cHeightmapData
 {
 public:
   cHeightmapData();
 
+  // Maps with more samples per side than this are loaded at a lower resolution
+  static const size_t nMaxLoadedSamplesPerSide = 4097;
+
+  // The step between the samples that are kept when a width by depth map is loaded, 1 unless the map is too big
+  static size_t GetLoadStep(size_t width, size_t depth);
+
+  // Loads 8 bit grey, grey and alpha or colour images, 16 bit PNGs at full precision, or raw .r16 and .r32 heightmaps which
+  // must be square.  The first channel of colour images is used.  Maps that are too big are loaded at a lower resolution,
+  // the full resolution heights of a raw map can still be paged in through a cHeightmapStream.
   bool LoadFromFile(const spitfire::string_t& sFilename);
 
+  // Loads a region of a streamed heightmap, width by depth samples are loaded taking every step'th sample of the stream
+  bool LoadFromStream(const cHeightmapStream& stream, size_t x, size_t z, size_t width, size_t depth, size_t step = 1);
+
+  // Uses the heights, normals and lightmap in place in the cache, the cache must stay open while the heightmap is used
+  bool LoadFromCache(const cTerrainCache& cache);
+  void AddToCache(cTerrainCacheWriter& writer) const;
+
+  // Generates rolling hills, the same seed always creates the same heightmap
+  bool CreateProcedural(size_t width, size_t depth, uint32_t seed);
+
   size_t GetWidth() const { return width; }
   size_t GetDepth() const { return depth; }
   float GetLowestPoint() const { return fLowestPoint; }
   float GetHighestPoint() const { return fHighestPoint; }
 
+  // Returns the height of a single point on the grid, or 0 for points outside the heightmap
   float GetHeight(size_t x, size_t y) const;
+
+  // Bilinearly interpolates the height at a point given in heightmap coordinates, points outside the heightmap are clamped
+  // to the edge
+  float SampleHeight(float x, float z) const;
+
+  // Returns the world space normal at a point given in heightmap coordinates, from the slope of the interpolated heights
+  spitfire::math::cVec3 SampleNormal(float x, float z, const spitfire::math::cVec3& scale) const;
+
+  // The same as SampleHeight for n points, the points are processed 4 at a time with SSE where it is available
+  void SampleHeights(const float* pX, const float* pZ, float* pOutHeights, size_t n) const;
+
+
+  // Returns the world space normal of a point on the grid, the normals are worked out once when the heightmap is created
   spitfire::math::cVec3 GetNormal(size_t x, size_t y, const spitfire::math::cVec3& scale) const;
 
+  // Recalculates the sun shadows and lighting for a new direction towards the sun, the ambient occlusion is kept from when
+  // the heightmap was created
+  void BakeLightmap(const spitfire::math::cVec3& sunDirection);
+
   size_t GetLightmapWidth() const { return widthLightmap; }
   size_t GetLightmapDepth() const { return depthLightmap; }
   const uint8_t* GetLightmapBuffer() const;
 
-private:
-  spitfire::math::cVec3 GetNormalOfTriangle(const spitfire::math::cVec3& p0, const spitfire::math::cVec3& p1, const spitfire::math::cVec3& p2) const;
+  // Blurs an image by about as much as the given number of iterations of a 4 tap cross filter
+  void SmoothImage(const std::vector<spitfire::math::cColour>& source, size_t width, size_t height, size_t iterations, std::vector<spitfire::math::cColour>& destination) const;
 
-  static void GenerateLightmap(const std::vector<float>& heightmap, std::vector<spitfire::math::cColour>& lightmap, float fScaleY, const spitfire::math::cColour& ambientColour, const spitfire::math::cColour& shadowColor, size_t size, const spitfire::math::cVec3& sunPosition);
+private:
+  cHeightmapData(const cHeightmapData&) = delete;
+  cHeightmapData& operator=(const cHeightmapData&) = delete;
 
-  static void DoubleImageSize(const std::vector<spitfire::math::cColour>& source, size_t width, size_t height, std::vector<spitfire::math::cColour>& destination);
-  void SmoothImage(const std::vector<spitfire::math::cColour>& source, size_t width, size_t height, size_t iterations, std::vector<spitfire::math::cColour>& destination) const;
+  void UpdateLowestAndHighestPoints();
+  void CreateDerivedData();
+  void CreateNormals();
+  void CreateLightmap();
+  void CreateAmbientOcclusion();
 
-  spitfire::math::cColour GetLightmapPixel(const std::vector<spitfire::math::cColour>& lightmap, size_t x, size_t y) const;
+  void SweepVisibility(const spitfire::math::cVec3& direction, float fPenumbra, std::vector<float>& visibility) const;
 
-  std::vector<float> heightmap;
   size_t width;
   size_t depth;
 
   float fLowestPoint;
   float fHighestPoint;
 
+  // The data is read through these pointers, they point either at the arrays below or straight into a terrain cache
+  const float* pHeightmap;
+  const float* pNormalsX;
+  const float* pNormalsY;
+  const float* pNormalsZ;
+  const float* pAmbientOcclusion;
+  const uint8_t* pLightmap;
+
+  std::vector<float> heightmap;
+
+  // Normals for a scale of 1 on every axis, one array per component
+  std::vector<float> normalsX;
+  std::vector<float> normalsY;
+  std::vector<float> normalsZ;
+
+  std::vector<float> ambientOcclusion;
+
   std::vector<uint8_t> lightmap;
   size_t widthLightmap;
   size_t depthLightmap;
@@ -0,0 +1,261 @@
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#include <algorithm>
+
+#include <spitfire/math/math.h>
+#include <spitfire/util/log.h>
+
+#include "heightmapstream.h"
+#include "parallel.h"
+
+namespace
+{
+  size_t GetBytesPerSample(HEIGHTMAP_FORMAT format)
+  {
+    return (format == HEIGHTMAP_FORMAT::R16) ? sizeof(uint16_t) : sizeof(float);
+  }
+
+  bool IsExtension(const spitfire::string_t& sFilename, const char* szExtension)
+  {
+    const size_t length = strlen(szExtension);
+    if (sFilename.length() <= length) return false;
+
+    const size_t offset = sFilename.length() - length;
+    if (sFilename[offset - 1] != TEXT('.')) return false;
+
+    // Extensions are compared without caring about case
+    for (size_t i = 0; i < length; i++) {
+      spitfire::string_t::value_type c = sFilename[offset + i];
+      if ((c >= TEXT('A')) && (c <= TEXT('Z'))) c = c - TEXT('A') + TEXT('a');
+      if (c != spitfire::string_t::value_type(szExtension[i])) return false;
+    }
+
+    return true;
+  }
+}
+
+
+// ** cHeightmapStream
+
+cHeightmapStream::Tile::Tile() :
+  lastUsed(0)
+{
+}
+
+cHeightmapStream::cHeightmapStream() :
+  format(HEIGHTMAP_FORMAT::R16),
+  width(0),
+  depth(0),
+  tilesX(0),
+  tilesZ(0),
+  nMaxResidentTiles(256),
+  update(0),
+  nTilesPagedIn(0),
+  nTilesEvicted(0)
+{
+}
+
+bool cHeightmapStream::GetFormatFromFilename(const spitfire::string_t& sFilename, HEIGHTMAP_FORMAT& format)
+{
+  if (IsExtension(sFilename, "r16") || IsExtension(sFilename, "raw")) {
+    format = HEIGHTMAP_FORMAT::R16;
+    return true;
+  } else if (IsExtension(sFilename, "r32") || IsExtension(sFilename, "f32")) {
+    format = HEIGHTMAP_FORMAT::R32F;
+    return true;
+  }
+
+  return false;
+}
+
+bool cHeightmapStream::Open(const spitfire::string_t& sFilename, HEIGHTMAP_FORMAT _format, size_t _width, size_t _depth)
+{
+  Close();
+
+  if (!file.Open(sFilename)) return false;
+
+  format = _format;
+
+  const size_t nBytesPerSample = GetBytesPerSample(format);
+  const size_t nSamples = file.GetSize() / nBytesPerSample;
+
+  if ((_width == 0) && (_depth == 0)) {
+    // Find the side of a square map, rounding and then checking catches any floating point error
+    _width = size_t(sqrt(double(nSamples)) + 0.5);
+    _depth = _width;
+    if ((_width * _depth) != nSamples) {
+      LOG("cHeightmapStream::Open \"", sFilename, "\" is not square, ", nSamples, " samples");
+      Close();
+      return false;
+    }
+  }
+
+  if ((_width < 2) || (_depth < 2) || ((_width * _depth) > nSamples)) {
+    LOG("cHeightmapStream::Open \"", sFilename, "\" is too small for ", _width, "x", _depth);
+    Close();
+    return false;
+  }
+
+  width = _width;
+  depth = _depth;
+
+  tilesX = ((width - 1) + (nTileCells - 1)) / nTileCells;
+  tilesZ = ((depth - 1) + (nTileCells - 1)) / nTileCells;
+  tiles.resize(tilesX * tilesZ);
+
+  return true;
+}
+
+void cHeightmapStream::Close()
+{
+  file.Close();
+
+  width = 0;
+  depth = 0;
+  tilesX = 0;
+  tilesZ = 0;
+  tiles.clear();
+  residentTiles.clear();
+}
+
+void cHeightmapStream::ReadRow(size_t x, size_t z, size_t n, size_t step, float* pOutHeights) const
+{
+  assert((n != 0) && ((x + ((n - 1) * step)) < width) && (z < depth));
+
+  const size_t nBytesPerSample = GetBytesPerSample(format);
+  const uint8_t* pSource = file.GetData() + (((z * width) + x) * nBytesPerSample);
+
+  // The samples are not necessarily aligned so they are copied out one at a time
+  if (format == HEIGHTMAP_FORMAT::R16) {
+    const float fScale = 1.0f / 65535.0f;
+    for (size_t i = 0; i < n; i++) {
+      uint16_t value;
+      memcpy(&value, pSource + (i * step * sizeof(uint16_t)), sizeof(uint16_t));
+      pOutHeights[i] = fScale * float(value);
+    }
+  } else if (step == 1) {
+    memcpy(pOutHeights, pSource, n * sizeof(float));
+  } else {
+    for (size_t i = 0; i < n; i++) memcpy(&pOutHeights[i], pSource + (i * step * sizeof(float)), sizeof(float));
+  }
+}
+
+void cHeightmapStream::ReadRegion(size_t x, size_t z, size_t regionWidth, size_t regionDepth, float* pOutHeights, size_t step) const
+{
+  assert((step != 0) && ((x + ((regionWidth - 1) * step)) < width) && ((z + ((regionDepth - 1) * step)) < depth));
+
+  parallel::ParallelFor(regionDepth, [&](size_t begin, size_t end) {
+    for (size_t row = begin; row < end; row++) {
+      ReadRow(x, z + (row * step), regionWidth, step, &pOutHeights[row * regionWidth]);
+    }
+  });
+}
+
+void cHeightmapStream::PageIn(size_t index)
+{
+  Tile& tile = tiles[index];
+  assert(tile.heights.empty());
+
+  const size_t x = (index % tilesX) * nTileCells;
+  const size_t z = (index / tilesX) * nTileCells;
+
+  // Tiles on the far edges may hang over the end of the heightmap, the samples past the end are never read
+  const size_t samplesX = std::min(nTileSamplesPerSide, width - x);
+  const size_t samplesZ = std::min(nTileSamplesPerSide, depth - z);
+
+  tile.heights.resize(nTileSamplesPerSide * nTileSamplesPerSide, 0.0f);
+  for (size_t row = 0; row < samplesZ; row++) {
+    ReadRow(x, z + row, samplesX, 1, &tile.heights[row * nTileSamplesPerSide]);
+  }
+
+  residentTiles.push_back(uint32_t(index));
+  nTilesPagedIn++;
+}
+
+void cHeightmapStream::EvictLeastRecentlyUsed()
+{
+  if (residentTiles.size() <= nMaxResidentTiles) return;
+
+  // Most recently used first
+  std::sort(residentTiles.begin(), residentTiles.end(), [this](uint32_t a, uint32_t b) { return (tiles[a].lastUsed > tiles[b].lastUsed); });
+
+  while (residentTiles.size() > nMaxResidentTiles) {
+    Tile& tile = tiles[residentTiles.back()];
+    if (tile.lastUsed == update) break;
+
+    // Swap with an empty vector so that the memory is actually released
+    std::vector<float>().swap(tile.heights);
+    residentTiles.pop_back();
+    nTilesEvicted++;
+  }
+}
+
+void cHeightmapStream::Update(const float* pX, const float* pZ, const float* pRadius, size_t n)
+{
+  if (tiles.empty()) return;
+
+  update++;
+
+  for (size_t i = 0; i < n; i++) {
+    const size_t minX = GetCellX(pX[i] - pRadius[i]) / nTileCells;
+    const size_t maxX = GetCellX(pX[i] + pRadius[i]) / nTileCells;
+    const size_t minZ = GetCellZ(pZ[i] - pRadius[i]) / nTileCells;
+    const size_t maxZ = GetCellZ(pZ[i] + pRadius[i]) / nTileCells;
+
+    for (size_t z = minZ; z <= maxZ; z++) {
+      for (size_t x = minX; x <= maxX; x++) {
+        const size_t index = (z * tilesX) + x;
+        if (tiles[index].heights.empty()) PageIn(index);
+        tiles[index].lastUsed = update;
+      }
+    }
+  }
+
+  EvictLeastRecentlyUsed();
+}
+
+size_t cHeightmapStream::GetCellX(float x) const
+{
+  // The top left corner of the cell is clamped so that the bottom right corner is always inside the heightmap
+  return std::min(size_t(spitfire::math::clamp(x, 0.0f, float(width - 1))), width - 2);
+}
+
+size_t cHeightmapStream::GetCellZ(float z) const
+{
+  return std::min(size_t(spitfire::math::clamp(z, 0.0f, float(depth - 1))), depth - 2);
+}
+
+const cHeightmapStream::Tile& cHeightmapStream::GetTileForCell(size_t cellX, size_t cellZ) const
+{
+  return tiles[((cellZ / nTileCells) * tilesX) + (cellX / nTileCells)];
+}
+
+bool cHeightmapStream::IsResident(float x, float z) const
+{
+  if (tiles.empty()) return false;
+
+  return !GetTileForCell(GetCellX(x), GetCellZ(z)).heights.empty();
+}
+
+bool cHeightmapStream::SampleHeight(float x, float z, float& fHeight) const
+{
+  if (tiles.empty()) return false;
+
+  const size_t cellX = GetCellX(x);
+  const size_t cellZ = GetCellZ(z);
+
+  const Tile& tile = GetTileForCell(cellX, cellZ);
+  if (tile.heights.empty()) return false;
+
+  const float fractionX = spitfire::math::clamp(x, 0.0f, float(width - 1)) - float(cellX);
+  const float fractionZ = spitfire::math::clamp(z, 0.0f, float(depth - 1)) - float(cellZ);
+
+  const float* pCell = &tile.heights[((cellZ % nTileCells) * nTileSamplesPerSide) + (cellX % nTileCells)];
+  const float fTop = pCell[0] + (fractionX * (pCell[1] - pCell[0]));
+  const float fBottom = pCell[nTileSamplesPerSide] + (fractionX * (pCell[nTileSamplesPerSide + 1] - pCell[nTileSamplesPerSide]));
+  fHeight = fTop + (fractionZ * (fBottom - fTop));
+
+  return true;
+}
@@ -0,0 +1,101 @@
+#ifndef HEIGHTMAPSTREAM_H
+#define HEIGHTMAPSTREAM_H
+
+#include <vector>
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+
+// Application headers
+#include "memorymappedfile.h"
+
+enum class HEIGHTMAP_FORMAT {
+  R16, // Unsigned 16 bit samples, 0 to 65535 is mapped to 0 to 1
+  R32F // 32 bit float samples, used as they are
+};
+
+// ** cHeightmapStream
+//
+// Reads a raw heightmap, rows of little endian samples with no header, through a memory mapped file so that terrains
+// that are too big to convert in one go can still be opened.  The map is split into square tiles, only the tiles around
+// the points passed to Update, usually the camera and the agents, are converted to floats and kept and the least
+// recently used tiles are dropped once there are more than the maximum number of resident tiles.
+//
+// Update must not be called while other threads are sampling the heightmap.
+
+class cHeightmapStream
+{
+public:
+  static const size_t nTileCells = 256;
+  static const size_t nTileSamplesPerSide = nTileCells + 1; // Tiles share their last row and column with their neighbours
+
+  cHeightmapStream();
+
+  // Returns false if the extension is not one of the raw formats, .r16 and .raw are 16 bit, .r32 and .f32 are float
+  static bool GetFormatFromFilename(const spitfire::string_t& sFilename, HEIGHTMAP_FORMAT& format);
+
+  // If the width and depth are 0 the map is assumed to be square and the size is worked out from the size of the file
+  bool Open(const spitfire::string_t& sFilename, HEIGHTMAP_FORMAT format, size_t width = 0, size_t depth = 0);
+  void Close();
+
+  bool IsOpen() const { return file.IsOpen(); }
+
+  size_t GetWidth() const { return width; }
+  size_t GetDepth() const { return depth; }
+
+  void SetMaxResidentTiles(size_t nTiles) { nMaxResidentTiles = nTiles; }
+
+  // Pages in every tile within the radius of each point, the points and radii are in heightmap coordinates.  Tiles that
+  // have not been used for the longest are then dropped until we are back under the maximum, the tiles used by this update
+  // are always kept.
+  void Update(const float* pX, const float* pZ, const float* pRadius, size_t n);
+
+  // Bilinearly interpolates the height at a point given in heightmap coordinates, points outside the heightmap are clamped
+  // to the edge.  Returns false and leaves the height alone if the point is not in a resident tile.
+  bool SampleHeight(float x, float z, float& fHeight) const;
+
+  bool IsResident(float x, float z) const;
+
+  // Converts a region straight from the file without going through the tiles, every step'th sample is read so that a big
+  // map can be loaded at a lower resolution, the output is regionWidth by regionDepth samples
+  void ReadRegion(size_t x, size_t z, size_t regionWidth, size_t regionDepth, float* pOutHeights, size_t step = 1) const;
+
+  size_t GetTileCount() const { return tiles.size(); }
+  size_t GetResidentTileCount() const { return residentTiles.size(); }
+  size_t GetTilesPagedIn() const { return nTilesPagedIn; }
+  size_t GetTilesEvicted() const { return nTilesEvicted; }
+
+private:
+  struct Tile {
+    Tile();
+
+    std::vector<float> heights; // Empty unless the tile is resident
+    uint64_t lastUsed;
+  };
+
+  void ReadRow(size_t x, size_t z, size_t n, size_t step, float* pOutHeights) const;
+
+  void PageIn(size_t index);
+  void EvictLeastRecentlyUsed();
+
+  size_t GetCellX(float x) const;
+  size_t GetCellZ(float z) const;
+  const Tile& GetTileForCell(size_t cellX, size_t cellZ) const;
+
+  cMemoryMappedFile file;
+  HEIGHTMAP_FORMAT format;
+  size_t width;
+  size_t depth;
+
+  size_t tilesX;
+  size_t tilesZ;
+  std::vector<Tile> tiles;
+  std::vector<uint32_t> residentTiles;
+  size_t nMaxResidentTiles;
+  uint64_t update;
+
+  size_t nTilesPagedIn;
+  size_t nTilesEvicted;
+};
+
+#endif // HEIGHTMAPSTREAM_H
@@ -0,0 +1,145 @@
+#include <cassert>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+
+// Spitfire headers
+#include <spitfire/util/string.h>
+#include <spitfire/math/cVec2.h>
+
+// Application headers
+#include "hud.h"
+#include "profiler.h"
+
+namespace
+{
+  const float fLineHeight = 0.04f;
+
+  // Every vertex from opengl::cGeometryBuilder_v2_c4_t2 is 2 position, 4 colour and 2 texture coordinate floats
+  const size_t nFloatsPerVertex = 8;
+
+  bool IsSameColour(const spitfire::math::cColour& lhs, const spitfire::math::cColour& rhs)
+  {
+    return (lhs.r == rhs.r) && (lhs.g == rhs.g) && (lhs.b == rhs.b) && (lhs.a == rhs.a);
+  }
+}
+
+// ** cHUDText
+
+cHUDText::Line::Line() :
+  length(0),
+  bIsLaidOut(false)
+{
+  text[0] = 0;
+}
+
+cHUDText::cHUDText() :
+  nLines(0),
+  nPreviousLines(0),
+  nVertices(0),
+  nLinesLaidOut(0)
+{
+}
+
+void cHUDText::Begin()
+{
+  nLines = 0;
+}
+
+cHUDText& cHUDText::AddLine()
+{
+  // The lines are kept from frame to frame so this only allocates when the HUD has more lines than it has ever had
+  if (nLines == lines.size()) lines.push_back(Line());
+
+  Line& line = lines[nLines];
+  line.length = 0;
+  line.text[0] = 0;
+
+  nLines++;
+
+  return *this;
+}
+
+void cHUDText::AppendFormatted(const char* szFormat, ...)
+{
+  assert(nLines != 0);
+
+  Line& line = lines[nLines - 1];
+
+  const size_t nRemaining = nMaxLineLength - line.length;
+  if (nRemaining <= 1) return;
+
+  va_list arguments;
+  va_start(arguments, szFormat);
+  const int nWritten = vsnprintf(line.text + line.length, nRemaining, szFormat, arguments);
+  va_end(arguments);
+
+  // vsnprintf returns the length it would have written if there had been room
+  if (nWritten > 0) line.length += std::min(size_t(nWritten), nRemaining - 1);
+}
+
+cHUDText& cHUDText::Append(const char* szText)
+{
+  AppendFormatted("%s", szText);
+  return *this;
+}
+
+cHUDText& cHUDText::AppendInteger(int64_t value)
+{
+  AppendFormatted("%" PRId64, value);
+  return *this;
+}
+
+cHUDText& cHUDText::AppendFloat(float fValue, size_t nDecimalPlaces)
+{
+  AppendFormatted("%.*f", int(nDecimalPlaces), double(fValue));
+  return *this;
+}
+
+void cHUDText::End(opengl::cFont& font, const spitfire::math::cColour& colour)
+{
+  PROFILE_ZONE("HUD layout");
+
+  nLinesLaidOut = 0;
+
+  // Changing the colour changes every vertex
+  const bool bColourChanged = !IsSameColour(colour, previousColour);
+  previousColour = colour;
+
+  for (size_t i = 0; i < nLines; i++) {
+    Line& line = lines[i];
+
+    const bool bTextChanged = (line.length != line.sLaidOutText.length()) || (memcmp(line.text, line.sLaidOutText.c_str(), line.length) != 0);
+    if (line.bIsLaidOut && !bTextChanged && !bColourChanged) continue;
+
+    // Each line has a fixed position so its glyphs can be reused until the text changes
+    line.sLaidOutText.assign(line.text, line.length);
+    line.pGeometryData = opengl::CreateGeometryData();
+    if (line.length != 0) {
+      opengl::cGeometryBuilder_v2_c4_t2 builder(*line.pGeometryData);
+      font.PushBack(builder, spitfire::string::ToString_t(line.sLaidOutText), colour, spitfire::math::cVec2(0.0f, float(i) * fLineHeight));
+    }
+    line.bIsLaidOut = true;
+
+    nLinesLaidOut++;
+  }
+
+  if ((nLinesLaidOut == 0) && (nLines == nPreviousLines)) return;
+
+  nPreviousLines = nLines;
+
+  // Join the lines together, the vector keeps its capacity so this only allocates when the HUD grows
+  vertices.clear();
+  nVertices = 0;
+  for (size_t i = 0; i < nLines; i++) {
+    const opengl::cGeometryData& data = *(lines[i].pGeometryData);
+    if (data.nVertexCount == 0) continue;
+
+    assert(data.vertices.size() >= (data.nVertexCount * nFloatsPerVertex));
+    vertices.insert(vertices.end(), data.vertices.begin(), data.vertices.begin() + (data.nVertexCount * nFloatsPerVertex));
+    nVertices += data.nVertexCount;
+  }
+}
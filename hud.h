@@ -0,0 +1,72 @@
+#ifndef HUD_H
+#define HUD_H
+
+#include <string>
+#include <vector>
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+#include <spitfire/math/cColour.h>
+
+// libopenglmm headers
+#include <libopenglmm/cFont.h>
+#include <libopenglmm/cGeometry.h>
+
+// ** cHUDText
+//
+// The HUD is written line by line every frame into fixed size buffers, so formatting never allocates.  End compares each
+// line with the text it had last frame and only lays out the glyphs for the lines that changed, the vertices for the whole
+// HUD are only joined together again when at least one line changed.
+
+class cHUDText
+{
+public:
+  static const size_t nMaxLineLength = 128;
+
+  cHUDText();
+
+  void Begin();
+
+  // Starts a new line, the Append functions add to the end of the current line and truncate anything that does not fit
+  cHUDText& AddLine();
+  cHUDText& Append(const char* szText);
+  cHUDText& AppendInteger(int64_t value);
+  cHUDText& AppendFloat(float fValue, size_t nDecimalPlaces);
+
+  void End(opengl::cFont& font, const spitfire::math::cColour& colour);
+
+  // The vertices for every line, in the format of opengl::cGeometryBuilder_v2_c4_t2
+  const std::vector<float>& GetVertices() const { return vertices; }
+  size_t GetVertexCount() const { return nVertices; }
+
+  // Statistics for the last frame
+  size_t GetLineCount() const { return nLines; }
+  size_t GetLinesLaidOut() const { return nLinesLaidOut; }
+
+private:
+  struct Line {
+    Line();
+
+    char text[nMaxLineLength];
+    size_t length;
+
+    // The text and glyphs from the last time this line was laid out
+    std::string sLaidOutText;
+    bool bIsLaidOut;
+    opengl::cGeometryDataPtr pGeometryData;
+  };
+
+  void AppendFormatted(const char* szFormat, ...);
+
+  std::vector<Line> lines;
+  size_t nLines;
+  size_t nPreviousLines;
+  spitfire::math::cColour previousColour;
+
+  std::vector<float> vertices;
+  size_t nVertices;
+
+  size_t nLinesLaidOut;
+};
+
+#endif // HUD_H
@@ -0,0 +1,138 @@
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+
+#include <algorithm>
+
+#include "instancing.h"
+#include "profiler.h"
+
+namespace
+{
+  const GLuint ATTRIBUTE_POSITION = 0;
+  const GLuint ATTRIBUTE_NORMAL = 1;
+  const GLuint ATTRIBUTE_INSTANCE_MODEL_MATRIX = 3; // Takes up locations 3 to 6
+  const GLuint ATTRIBUTE_INSTANCE_COLOUR = 7;
+}
+
+// ** cInstancedMesh
+
+cInstancedMesh::cInstancedMesh() :
+  vertexArray(0),
+  vertexBuffer(0),
+  instanceBuffer(0),
+  nVertices(0),
+  nInstanceBufferCapacity(0)
+{
+}
+
+void cInstancedMesh::Create(const opengl::cGeometryData& data)
+{
+  Destroy();
+
+  assert(data.nVertexCount != 0);
+  assert(!data.vertices.empty());
+
+  nVertices = data.nVertexCount;
+
+  // The geometry data is interleaved with the position first followed by the normal
+  const size_t nFloatsPerVertex = data.vertices.size() / data.nVertexCount;
+  const GLsizei stride = GLsizei(nFloatsPerVertex * sizeof(float));
+
+  glGenVertexArrays(1, &vertexArray);
+  glBindVertexArray(vertexArray);
+
+  glGenBuffers(1, &vertexBuffer);
+  glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+  glBufferData(GL_ARRAY_BUFFER, data.vertices.size() * sizeof(float), &data.vertices[0], GL_STATIC_DRAW);
+
+  glEnableVertexAttribArray(ATTRIBUTE_POSITION);
+  glVertexAttribPointer(ATTRIBUTE_POSITION, 3, GL_FLOAT, GL_FALSE, stride, (const GLvoid*)0);
+
+  if (data.nNormalsPerPoint != 0) {
+    glEnableVertexAttribArray(ATTRIBUTE_NORMAL);
+    glVertexAttribPointer(ATTRIBUTE_NORMAL, 3, GL_FLOAT, GL_FALSE, stride, (const GLvoid*)(3 * sizeof(float)));
+  }
+
+  // Per instance stream, a mat4 attribute is passed as 4 vec4 columns
+  glGenBuffers(1, &instanceBuffer);
+  glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+
+  const GLsizei instanceStride = GLsizei(sizeof(Instance));
+  for (GLuint column = 0; column < 4; column++) {
+    const GLuint location = ATTRIBUTE_INSTANCE_MODEL_MATRIX + column;
+    glEnableVertexAttribArray(location);
+    glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, instanceStride, (const GLvoid*)(offsetof(Instance, matModel) + (column * 4 * sizeof(float))));
+    glVertexAttribDivisor(location, 1);
+  }
+
+  glEnableVertexAttribArray(ATTRIBUTE_INSTANCE_COLOUR);
+  glVertexAttribPointer(ATTRIBUTE_INSTANCE_COLOUR, 4, GL_FLOAT, GL_FALSE, instanceStride, (const GLvoid*)offsetof(Instance, colour));
+  glVertexAttribDivisor(ATTRIBUTE_INSTANCE_COLOUR, 1);
+
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void cInstancedMesh::Destroy()
+{
+  if (instanceBuffer != 0) {
+    glDeleteBuffers(1, &instanceBuffer);
+    instanceBuffer = 0;
+  }
+  if (vertexBuffer != 0) {
+    glDeleteBuffers(1, &vertexBuffer);
+    vertexBuffer = 0;
+  }
+  if (vertexArray != 0) {
+    glDeleteVertexArrays(1, &vertexArray);
+    vertexArray = 0;
+  }
+
+  instances.clear();
+  nVertices = 0;
+  nInstanceBufferCapacity = 0;
+}
+
+void cInstancedMesh::AddInstance(const spitfire::math::cMat4& matModel, const spitfire::math::cColour& colour)
+{
+  Instance instance;
+  memcpy(instance.matModel, matModel.entries, sizeof(instance.matModel));
+  instance.colour[0] = colour.r;
+  instance.colour[1] = colour.g;
+  instance.colour[2] = colour.b;
+  instance.colour[3] = colour.a;
+
+  instances.push_back(instance);
+}
+
+void cInstancedMesh::UpdateInstances()
+{
+  assert(IsValid());
+
+  if (instances.empty()) return;
+
+  PROFILE_ZONE("VBO upload");
+
+  glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+
+  // Orphan the previous contents so that we don't have to wait for the last frame to finish with them, the buffer only ever grows
+  if (instances.size() > nInstanceBufferCapacity) nInstanceBufferCapacity = std::max(instances.size(), 2 * nInstanceBufferCapacity);
+  glBufferData(GL_ARRAY_BUFFER, nInstanceBufferCapacity * sizeof(Instance), nullptr, GL_STREAM_DRAW);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, instances.size() * sizeof(Instance), &instances[0]);
+
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+size_t cInstancedMesh::Draw()
+{
+  assert(IsValid());
+
+  if (instances.empty()) return 0;
+
+  glBindVertexArray(vertexArray);
+  glDrawArraysInstanced(GL_TRIANGLES, 0, GLsizei(nVertices), GLsizei(instances.size()));
+  glBindVertexArray(0);
+
+  return 1;
+}
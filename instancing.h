@@ -0,0 +1,63 @@
+#ifndef INSTANCING_H
+#define INSTANCING_H
+
+#include <vector>
+
+// OpenGL headers
+#include <GL/GLee.h>
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+#include <spitfire/math/cMat4.h>
+#include <spitfire/math/cColour.h>
+
+// libopenglmm headers
+#include <libopenglmm/cGeometry.h>
+
+// Application headers
+#include "renderqueue.h"
+
+// ** cInstancedMesh
+//
+// A mesh with a second vertex stream holding a model matrix and a colour per instance.  Instances are collected on the
+// CPU, uploaded once per frame and then every instance is drawn with a single draw call.
+// Attribute locations match shaders/colourinstanced.vert.
+
+class cInstancedMesh : public cRenderQueueDrawable
+{
+public:
+  cInstancedMesh();
+
+  bool IsValid() const { return (vertexArray != 0); }
+
+  void Create(const opengl::cGeometryData& data);
+  void Destroy();
+
+  size_t GetInstanceCount() const { return instances.size(); }
+
+  void ClearInstances() { instances.clear(); }
+  void AddInstance(const spitfire::math::cMat4& matModel, const spitfire::math::cColour& colour);
+
+  // Upload this frame's instances
+  void UpdateInstances();
+
+  // The instanced shader and the projection and view matrices must already be set
+  size_t Draw() override;
+
+private:
+  struct Instance {
+    float matModel[16];
+    float colour[4];
+  };
+
+  std::vector<Instance> instances;
+
+  GLuint vertexArray;
+  GLuint vertexBuffer;
+  GLuint instanceBuffer;
+
+  size_t nVertices;
+  size_t nInstanceBufferCapacity;
+};
+
+#endif // INSTANCING_H
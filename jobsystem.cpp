@@ -0,0 +1,90 @@
+#include <cassert>
+
+#include "jobsystem.h"
+#include "profiler.h"
+
+// ** cJobSystem
+
+cJobSystem::cJobSystem() :
+  bStopThreads(false)
+{
+}
+
+cJobSystem::~cJobSystem()
+{
+  Stop();
+}
+
+void cJobSystem::Start(size_t nWorkerThreads)
+{
+  assert(threads.empty());
+  assert(nWorkerThreads != 0);
+
+  bStopThreads = false;
+
+  for (size_t i = 0; i < nWorkerThreads; i++) threads.push_back(std::thread(&cJobSystem::WorkerThreadFunction, this));
+}
+
+void cJobSystem::Stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutexJobs);
+    bStopThreads = true;
+    jobs.clear();
+  }
+  jobAdded.notify_all();
+
+  for (auto& thread : threads) thread.join();
+  threads.clear();
+}
+
+void cJobSystem::AddJob(const std::function<void()>& job)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutexJobs);
+    jobs.push_back(job);
+  }
+  jobAdded.notify_one();
+}
+
+void cJobSystem::AddMainThreadJob(const std::function<void()>& job)
+{
+  std::lock_guard<std::mutex> lock(mutexMainThreadJobs);
+  mainThreadJobs.push_back(job);
+}
+
+size_t cJobSystem::RunMainThreadJobs()
+{
+  // Swap the jobs out so that they can add more main thread jobs while they run, those are picked up next frame
+  {
+    std::lock_guard<std::mutex> lock(mutexMainThreadJobs);
+    mainThreadJobsRunning.swap(mainThreadJobs);
+  }
+
+  const size_t n = mainThreadJobsRunning.size();
+  for (auto& job : mainThreadJobsRunning) job();
+  mainThreadJobsRunning.clear();
+
+  return n;
+}
+
+void cJobSystem::WorkerThreadFunction()
+{
+  PROFILE_THREAD_NAME("Worker");
+
+  while (true) {
+    std::function<void()> job;
+
+    {
+      std::unique_lock<std::mutex> lock(mutexJobs);
+      jobAdded.wait(lock, [this] { return (bStopThreads || !jobs.empty()); });
+      if (bStopThreads) return;
+
+      job.swap(jobs.front());
+      jobs.pop_front();
+    }
+
+    PROFILE_ZONE("Job");
+    job();
+  }
+}
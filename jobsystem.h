@@ -0,0 +1,54 @@
+#ifndef JOBSYSTEM_H
+#define JOBSYSTEM_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+
+// ** cJobSystem
+//
+// A pool of worker threads that take jobs from a shared queue in the order they were added.  Anything that has to touch
+// OpenGL is added as a main thread job instead, those are held until the main thread asks for them once a frame.
+
+class cJobSystem
+{
+public:
+  cJobSystem();
+  ~cJobSystem();
+
+  void Start(size_t nWorkerThreads);
+
+  // Waits for the jobs that are running to finish, jobs that have not started yet are dropped
+  void Stop();
+
+  size_t GetWorkerThreadCount() const { return threads.size(); }
+
+  // Thread safe
+  void AddJob(const std::function<void()>& job);
+  void AddMainThreadJob(const std::function<void()>& job);
+
+  // Called from the main thread only, runs the main thread jobs that have been added so far and returns how many were run
+  size_t RunMainThreadJobs();
+
+private:
+  void WorkerThreadFunction();
+
+  std::vector<std::thread> threads;
+
+  std::mutex mutexJobs;
+  std::condition_variable jobAdded;
+  std::deque<std::function<void()>> jobs;
+  bool bStopThreads;
+
+  std::mutex mutexMainThreadJobs;
+  std::vector<std::function<void()>> mainThreadJobs;
+  std::vector<std::function<void()>> mainThreadJobsRunning;
+};
+
+#endif // JOBSYSTEM_H
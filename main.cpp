@@ -1,5 +1,7 @@
 #include <cassert>
 #include <cmath>
+#include <cstdlib>
+#include <ctime>
 
 #include <string>
 #include <iostream>
@@ -7,6 +9,7 @@
 
 #include <algorithm>
 #include <map>
+#include <memory>
 #include <vector>
 #include <list>
 
@@ -53,10 +56,16 @@
 #include <libopenglmm/cVertexBufferObject.h>
 #include <libopenglmm/cWindow.h>
 
+// libvoodoomm headers
+#include <libvoodoomm/cImage.h>
+
 // Application headers
 #include "heightmap.h"
 #include "main.h"
 #include "navigation.h"
+#include "parallel.h"
+#include "profiler.h"
+#include "terraincache.h"
 
 struct iVec4 {
   int entries[4];
@@ -110,6 +119,8 @@ void CameraRayCast(const spitfire::math::cMat4& matProjection, const spitfire::m
 
 
 
+// The heightmap data may point straight into the terrain cache so the cache has to outlive it
+cTerrainCache terrainCache;
 cHeightmapData heightMapData;
 
 spitfire::math::cVec3 heightMapScale;
@@ -142,22 +153,7 @@ void DebugPrintQuadtreeRecursive(const spitfire::math::cQuadtree<spitfire::math:
 
 void BuildQuadtree()
 {
-  const spitfire::math::cVec2 halfDimension = 0.5f * heightMapScale.GetXZ() * spitfire::math::cVec2(heightMapData.GetWidth(), heightMapData.GetDepth());
-  const spitfire::math::cVec2 origin = halfDimension;
-  quadtree.reset(new spitfire::math::cQuadtree<spitfire::math::cAABB2>(origin, halfDimension));
-
-  const size_t width = heightMapData.GetWidth();
-  const size_t depth = heightMapData.GetDepth();
-  const size_t skip = 2;
-  for (size_t z = 0; z < depth; z += skip) {
-    for (size_t x = 0; x < width; x += skip) {
-      spitfire::math::cAABB2* aabb = new spitfire::math::cAABB2;
-      const spitfire::math::cVec2 point0 = heightMapScale.GetXZ() * spitfire::math::cVec2(float(x), float(z));
-      const spitfire::math::cVec2 point1 = heightMapScale.GetXZ() * spitfire::math::cVec2(float(x + skip), float(z + skip));
-      aabb->SetExtents(point0, point1);
-      quadtree->insert(aabb);
-    }
-  }
+  quadtree = BuildHeightmapQuadtree(heightMapData, heightMapScale);
 
   DebugPrintQuadtreeRecursive(*quadtree, "");
 }
@@ -177,7 +173,6 @@ cApplication::cApplication() :
   moveCameraRight(SDLK_d),
   freeLookCamera(SDLK_LSHIFT),
 
-  bIsPhysicsRunning(true),
   bIsWireframe(false),
 
   bIsDone(false),
@@ -185,9 +180,20 @@ cApplication::cApplication() :
   pWindow(nullptr),
   pContext(nullptr),
 
+  assetLoader(jobSystem),
+
+  bIsHeightmapFromCache(false),
+
+  pGeometryDataDebugTargetTraceLinesPtr(opengl::CreateGeometryData()),
+
+  virtualTexturedTerrain(virtualTexture, terrain),
+
+
   selectedObject(-1),
 
-  ai(navigationMesh)
+  simulation(navigationMesh, heightMapData, heightMapScale),
+  pSnapshot(nullptr),
+  lastSnapshotTick(0)
 {
   // Set our main thread
   spitfire::util::SetMainThread();
@@ -203,59 +209,128 @@ opengl::cResolution cApplication::GetResolution() const
 
 void cApplication::CreateText()
 {
+  PROFILE_ZONE("Text");
+
   assert(font.IsValid());
 
-  // Destroy any existing VBO
-  pContext->DestroyStaticVertexBufferObject(textVBO);
+  // Only the lines that changed since last frame are laid out again
+  hudText.Begin();
 
-  opengl::cGeometryDataPtr pGeometryDataPtr = opengl::CreateGeometryData();
+  hudText.AddLine().Append("FPS: ").AppendInteger(int(fFPS));
+  hudText.AddLine();
 
-  opengl::cGeometryBuilder_v2_c4_t2 builder(*pGeometryDataPtr);
+  hudText.AddLine().Append("Physics running: ").Append(simulation.IsRunning() ? "On" : "Off");
+  hudText.AddLine().Append("Simulation: ").AppendInteger(simulation.GetTicksPerSecond()).Append(" ticks/s, ").AppendInteger(simulation.GetDroppedTicksPerSecond()).Append(" dropped");
+  if (pSnapshot != nullptr) {
+    hudText.AddLine().Append("AI LOD: ").AppendInteger(pSnapshot->nAgentsPerLOD[size_t(AI_LOD::FULL)]).Append(" full, ").AppendInteger(pSnapshot->nAgentsPerLOD[size_t(AI_LOD::REDUCED)]).Append(" reduced, ").AppendInteger(pSnapshot->nAgentsPerLOD[size_t(AI_LOD::LOW)]).Append(" low");
+    hudText.AddLine().Append("AI updated: ").AppendInteger(pSnapshot->nUpdatedAgentsPerLOD[size_t(AI_LOD::FULL)]).Append(" full, ").AppendInteger(pSnapshot->nUpdatedAgentsPerLOD[size_t(AI_LOD::REDUCED)]).Append(" reduced, ").AppendInteger(pSnapshot->nUpdatedAgentsPerLOD[size_t(AI_LOD::LOW)]).Append(" low");
+  }
+  hudText.AddLine().Append("Wireframe: ").Append(bIsWireframe ? "On" : "Off");
+  hudText.AddLine();
+
+  hudText.AddLine().Append("Terrain triangles: ").AppendInteger(terrain.GetTriangleCount()).Append(" of ").AppendInteger(terrain.GetFullDetailTriangleCount());
+  hudText.AddLine().Append("Terrain LOD selection: ").AppendFloat(terrain.GetSelectionTimeMS(), 3).Append(" ms");
+  hudText.AddLine().Append("Visible terrain chunks: ").AppendInteger(terrain.GetVisibleChunkCount()).Append(" of ").AppendInteger(terrain.GetChunkCount());
+  hudText.AddLine().Append("Virtual texture pages: ").AppendInteger(virtualTexture.GetResidentPageCount()).Append(" of ").AppendInteger(virtualTexture.GetPageCount()).Append(" resident, ").AppendInteger(virtualTexture.GetLoadingPageCount()).Append(" loading, ").AppendInteger(virtualTexture.GetPhysicalPageCount()).Append(" slots");
+  hudText.AddLine().Append("Virtual texture hit rate: ").AppendFloat(100.0f * virtualTexture.GetHitRate(), 1).Append("% frame, ").AppendFloat(100.0f * virtualTexture.GetTotalHitRate(), 1).Append("% total, ").AppendInteger(virtualTexture.GetPagesLoaded()).Append(" loaded, ").AppendInteger(virtualTexture.GetPagesEvicted()).Append(" evicted");
+  hudText.AddLine().Append("Visible objects: ").AppendInteger(visibleObjects.size()).Append(" of ").AppendInteger(objectBounds.size());
+  hudText.AddLine().Append("Render commands: ").AppendInteger(renderQueue.GetCommandCount());
+  hudText.AddLine().Append("Draw calls: ").AppendInteger(renderQueue.GetDrawCallCount());
+  hudText.AddLine().Append("State changes: ").AppendInteger(renderQueue.GetStateChangeCount());
+  hudText.AddLine().Append("Dynamic vertices: ").AppendInteger(dynamicVertexBufferRing.GetBytesUsed() / 1024).Append(" KB of ").AppendInteger(dynamicVertexBufferRing.GetBytesPerFrame() / 1024).Append(" KB, ").AppendInteger(dynamicVertexBufferRing.GetWaitCount()).Append(" waits");
+  hudText.AddLine().Append("HUD lines laid out: ").AppendInteger(hudText.GetLinesLaidOut()).Append(" of ").AppendInteger(hudText.GetLineCount());
+  hudText.AddLine();
+
+  hudText.AddLine().Append("Selected: ").AppendInteger(selectedObject);
+  hudText.AddLine().Append("Camera: ").AppendFloat(camera.GetPosition().x, 2).Append(", ").AppendFloat(camera.GetPosition().y, 2).Append(", ").AppendFloat(camera.GetPosition().z, 2);
+  if (selectedObject >= 0) {
+    const spitfire::math::cVec3 position = objectPositions[selectedObject];
+    hudText.AddLine().Append("Object: ").AppendFloat(position.x, 2).Append(", ").AppendFloat(position.y, 2).Append(", ").AppendFloat(position.z, 2);
 
-  std::list<spitfire::string_t> lines;
-  lines.push_back(spitfire::string_t(TEXT("FPS: ")) + spitfire::string::ToString(int(fFPS)));
-  lines.push_back(TEXT(""));
+    assert(pSnapshot != nullptr);
+    for (auto& agent : pSnapshot->agents) {
+      if (agent.object != size_t(selectedObject)) continue;
 
-  lines.push_back(spitfire::string_t(TEXT("Physics running: ")) + (bIsPhysicsRunning ? TEXT("On") : TEXT("Off")));
-  lines.push_back(spitfire::string_t(TEXT("Wireframe: ")) + (bIsWireframe ? TEXT("On") : TEXT("Off")));
-  lines.push_back(TEXT(""));
+      hudText.AddLine().Append("Object goal count: ").AppendInteger(agent.nGoals);
+      hudText.AddLine().Append("Object action count: ").AppendInteger(agent.nActions);
+      const char* szLODs[] = { "Full", "Reduced", "Low" };
+      hudText.AddLine().Append("Object AI LOD: ").Append(szLODs[size_t(agent.lod)]);
 
-  lines.push_back(spitfire::string_t(TEXT("Selected: ")) + spitfire::string::ToString(selectedObject));
-  lines.push_back(spitfire::string_t(TEXT("Camera: ")) + spitfire::string::ToString(camera.GetPosition().x) + TEXT(", ") + spitfire::string::ToString(camera.GetPosition().y) + TEXT(", ") + spitfire::string::ToString(camera.GetPosition().z));
-  if (selectedObject >= 0) {
-    const spitfire::math::cVec3 position = scene.objects.positions[selectedObject];
-    lines.push_back(spitfire::string_t(TEXT("Object: ")) + spitfire::string::ToString(position.x) + TEXT(", ") + spitfire::string::ToString(position.y) + TEXT(", ") + spitfire::string::ToString(position.z));
-
-    auto iter = scene.objects.aiagentids.find(selectedObject);
-    if (iter != scene.objects.aiagentids.end()) {
-      lines.push_back(spitfire::string_t(TEXT("Object goal count: ")) + spitfire::string::ToString(ai.GetAgentGoalCount(iter->second)));
-      lines.push_back(spitfire::string_t(TEXT("Object action count: ")) + spitfire::string::ToString(ai.GetAgentActionCount(iter->second)));
-
-      spitfire::math::cVec3 goal;
-      if (ai.GetAgentGoalPosition(iter->second, goal)) {
-        const float fDistance = (goal - position).GetLength();
-        lines.push_back(spitfire::string_t(TEXT("Object distance: ")) + spitfire::string::ToString(fDistance));
+      if (agent.bHasGoalPosition) {
+        const float fDistance = (agent.goalPosition - position).GetLength();
+        hudText.AddLine().Append("Object distance: ").AppendFloat(fDistance, 2);
       }
+      break;
     }
   }
-  lines.push_back(TEXT(""));
+  hudText.AddLine();
 
+#ifdef BUILD_PROFILER
+  {
+    // Profiler breakdown of the last few seconds
+    profiler::GetZoneStatistics(profilerStatistics);
+
+    if (profiler::IsCapturing()) hudText.AddLine().Append("Profiler: Capturing trace");
+    hudText.AddLine().Append("Profiler (average / p99 ms per frame):");
+    const std::string* pThreadName = nullptr;
+    for (auto& zone : profilerStatistics) {
+      if ((pThreadName == nullptr) || (zone.sThreadName != *pThreadName)) {
+        pThreadName = &zone.sThreadName;
+        hudText.AddLine().Append("  ").Append(pThreadName->c_str());
+      }
+
+      hudText.AddLine().Append("    ");
+      for (size_t i = 0; i < zone.depth; i++) hudText.Append("  ");
+      hudText.Append(zone.szName).Append(": ").AppendFloat(zone.fAverageMS, 2).Append(" / ").AppendFloat(zone.fP99MS, 2);
+    }
+    hudText.AddLine();
+  }
+#endif
 
-  // Add our lines of text
   const spitfire::math::cColour red(1.0f, 0.0f, 0.0f);
-  float y = 0.0f;
-  std::list<spitfire::string_t>::const_iterator iter(lines.begin());
-  const std::list<spitfire::string_t>::const_iterator iterEnd(lines.end());
-  while (iter != iterEnd) {
-    font.PushBack(builder, *iter, red, spitfire::math::cVec2(0.0f, y));
-    y += 0.04f;
-
-    iter++;
+  hudText.End(font, red);
+
+  {
+    PROFILE_ZONE("VBO upload");
+    textGeometry.SetVertices(hudText.GetVertices(), hudText.GetVertexCount());
+  }
+}
+
+void cApplication::CreateLoadingText()
+{
+  PROFILE_ZONE("Text");
+
+  assert(font.IsValid());
+
+  hudText.Begin();
+
+  hudText.AddLine().Append("Loading ").AppendInteger(assetLoader.GetFinishedCount()).Append(" of ").AppendInteger(assetLoader.GetAssets().size());
+  hudText.AddLine().Append("Workers: ").AppendInteger(jobSystem.GetWorkerThreadCount());
+  hudText.AddLine().Append("Elapsed: ").AppendFloat(float(assetLoader.GetElapsedMS()), 1).Append(" ms");
+  hudText.AddLine();
+
+  for (auto& asset : assetLoader.GetAssets()) {
+    hudText.AddLine().Append(asset.sName.c_str()).Append(": ");
+    switch (asset.state) {
+      case cAssetLoader::STATE::WAITING: {
+        hudText.Append("Waiting");
+        break;
+      }
+      case cAssetLoader::STATE::LOADING: {
+        hudText.Append("Loading");
+        break;
+      }
+      case cAssetLoader::STATE::FINISHED: {
+        hudText.AppendFloat(float(asset.fLoadMS), 1).Append(" ms load, ").AppendFloat(float(asset.fUploadMS), 1).Append(" ms upload");
+        break;
+      }
+    }
   }
 
-  textVBO.SetData(pGeometryDataPtr);
+  const spitfire::math::cColour red(1.0f, 0.0f, 0.0f);
+  hudText.End(font, red);
 
-  textVBO.Compile2D();
+  textGeometry.SetVertices(hudText.GetVertices(), hudText.GetVertexCount());
 }
 
 void cApplication::CreateSquare(opengl::cStaticVertexBufferObject& vbo, size_t nTextureCoordinates)
@@ -272,7 +347,7 @@ void cApplication::CreateSquare(opengl::cStaticVertexBufferObject& vbo, size_t n
   vbo.Compile();
 }
 
-void cApplication::CreateCube(opengl::cStaticVertexBufferObject& vbo, size_t nTextureCoordinates)
+void cApplication::CreateCube(cInstancedMesh& mesh, size_t nTextureCoordinates)
 {
   opengl::cGeometryDataPtr pGeometryDataPtr = opengl::CreateGeometryData();
 
@@ -281,12 +356,10 @@ void cApplication::CreateCube(opengl::cStaticVertexBufferObject& vbo, size_t nTe
   opengl::cGeometryBuilder builder;
   builder.CreateCube(fWidth, *pGeometryDataPtr, nTextureCoordinates);
 
-  vbo.SetData(pGeometryDataPtr);
-
-  vbo.Compile();
+  mesh.Create(*pGeometryDataPtr);
 }
 
-void cApplication::CreateSphere(opengl::cStaticVertexBufferObject& vbo, size_t nTextureCoordinates, float fRadius)
+void cApplication::CreateSphere(cInstancedMesh& mesh, size_t nTextureCoordinates, float fRadius)
 {
   opengl::cGeometryDataPtr pGeometryDataPtr = opengl::CreateGeometryData();
 
@@ -295,12 +368,10 @@ void cApplication::CreateSphere(opengl::cStaticVertexBufferObject& vbo, size_t n
   opengl::cGeometryBuilder builder;
   builder.CreateSphere(fRadius, nSegments, *pGeometryDataPtr, nTextureCoordinates);
 
-  vbo.SetData(pGeometryDataPtr);
-
-  vbo.Compile();
+  mesh.Create(*pGeometryDataPtr);
 }
 
-void cApplication::CreateGear(opengl::cStaticVertexBufferObject& vbo)
+void cApplication::CreateGear(cInstancedMesh& mesh)
 {
   opengl::cGeometryDataPtr pGeometryDataPtr = opengl::CreateGeometryData();
 
@@ -313,9 +384,7 @@ void cApplication::CreateGear(opengl::cStaticVertexBufferObject& vbo)
   opengl::cGeometryBuilder builder;
   builder.CreateGear(fInnerRadius, fOuterRadius, fWidth, nTeeth, fToothDepth, *pGeometryDataPtr);
 
-  vbo.SetData(pGeometryDataPtr);
-
-  vbo.Compile();
+  mesh.Create(*pGeometryDataPtr);
 }
 
 void cApplication::CreateScreenRectVariableTextureSizeVBO(opengl::cStaticVertexBufferObject& staticVertexBufferObject, float_t fWidth, float_t fHeight)
@@ -418,161 +487,203 @@ void cApplication::CreateScreenHalfRectVBO(opengl::cStaticVertexBufferObject& st
   staticVertexBufferObject.Compile2D();
 }
 
-void cApplication::CreateScene()
+namespace
 {
-  // Create our heightmap
-  heightMapData.LoadFromFile(TEXT("textures/heightmap.png"));
-
-  pContext->CreateTexture(textureDiffuse, TEXT("textures/diffuse.png"));
-  pContext->CreateTexture(textureDetail, TEXT("textures/detail.png"));
-
-
-  heightMapScale.Set(0.5f, 10.0f, 0.5f);
-
-  const uint8_t* pBuffer = heightMapData.GetLightmapBuffer();
-  const size_t widthLightmap = heightMapData.GetLightmapWidth();
-  const size_t depthLightmap = heightMapData.GetLightmapDepth();
-  pContext->CreateTextureFromBuffer(textureLightMap, pBuffer, widthLightmap, depthLightmap, opengl::PIXELFORMAT::R8G8B8A8);
-
+  // Everything that is worked out from the heightmap is kept in a cache next to it so that later runs can use it in place
+  const spitfire::string_t sHeightmapFilePath = TEXT("textures/heightmap.png");
+  const spitfire::string_t sTerrainCacheFilePath = sHeightmapFilePath + TEXT(".cache");
 
-  pContext->CreateStaticVertexBufferObject(staticVertexBufferObjectHeightmapTriangles);
-  CreateHeightmapTriangles(staticVertexBufferObjectHeightmapTriangles, heightMapData, heightMapScale);
+  // The diffuse map and the lightmap are cut into pages for the virtual texture
+  const spitfire::string_t sDiffuseFilePath = TEXT("textures/diffuse.png");
+  const spitfire::string_t sVirtualTextureFilePath = sDiffuseFilePath + TEXT(".vt");
 
-  BuildQuadtree();
+  // How far from the camera the virtual texture pages are wanted in world units
+  const float fVirtualTextureRadius = 40.0f;
 
-  DebugAddQuadtreeLines();
+  // The navigation mesh and the scene are generated from this so that every run starts the same
+  const uint32_t sceneSeed = 1;
+}
 
+void cApplication::StartLoading()
+{
   // Use Cornflower blue as the sky colour
   // http://en.wikipedia.org/wiki/Cornflower_blue
   const spitfire::math::cColour cornFlowerBlue(100.0f / 255.0f, 149.0f / 255.0f, 237.0f / 255.0f);
 
-  scene.skyColour = cornFlowerBlue;
+  skyColour = cornFlowerBlue;
 
-  spitfire::math::cRand rand;
-
-  for (size_t i = 0; i < 100; i++) {
-    const spitfire::math::cVec2 p(rand.randomZeroToOnef() * 100.0f, rand.randomZeroToOnef() * 100.0f);
-    const spitfire::math::cVec3 randomPosition(p.x, heightMapScale.y * heightMapData.GetHeight(p.x / heightMapScale.x, p.y / heightMapScale.z), p.y);
+  heightMapScale.Set(0.5f, 10.0f, 0.5f);
 
-    scene.objects.positions.push_back(randomPosition);
+  // The images are decoded on the worker threads, only the texture upload happens on the main thread
+  std::shared_ptr<voodoo::cImage> pImageDetail(new voodoo::cImage);
+  assetLoader.Add("Detail texture",
+    [pImageDetail]() { pImageDetail->LoadFromFile(TEXT("textures/detail.png")); },
+    [this, pImageDetail]() { pContext->CreateTextureFromImage(textureDetail, *pImageDetail); }
+  );
+
+  const size_t heightmap = assetLoader.Add("Heightmap",
+    [this]() { LoadHeightmap(); },
+    nullptr
+  );
+
+  assetLoader.Add("Virtual texture",
+    [this]() { LoadVirtualTexture(); },
+    [this]() { CreateTerrainTextures(); },
+    { heightmap }
+  );
+
+  assetLoader.Add("Terrain",
+    [this]() { BuildTerrain(); },
+    [this]() { terrain.Upload(); },
+    { heightmap }
+  );
+
+  assetLoader.Add("Quadtree",
+    []() { BuildQuadtree(); },
+    [this]() { DebugAddQuadtreeLines(); },
+    { heightmap }
+  );
+
+  const size_t navigation = assetLoader.Add("Navigation mesh",
+    [this]() { CreateNavigationMesh(); },
+    [this]() {
+      CreateNavigationMeshDebugShapes();
+      CreateNavigationMeshDebugWayPointLines();
+    },
+    { heightmap }
+  );
+
+  assetLoader.Add("Scene",
+    [this]() {
+      // Raw heightmaps that were too big to load at full resolution are paged in around the camera and the agents
+      HEIGHTMAP_FORMAT format = HEIGHTMAP_FORMAT::R16;
+      if (cHeightmapStream::GetFormatFromFilename(sHeightmapFilePath, format)) simulation.OpenHeightmapStream(sHeightmapFilePath);
+
+      simulation.CreateScene(100, 100.0f, sceneSeed);
+    },
+    nullptr,
+    { heightmap, navigation }
+  );
+
+  assetLoader.Start();
+}
 
-    const spitfire::math::cVec3 rotationDegrees(rand.randomf(-180.0f, 180.0f), 0.0f, 0.0f);
-    const spitfire::math::cQuaternion rotation(spitfire::math::cMat4::RotationMatrix(rotationDegrees).GetRotation());
+void cApplication::LoadHeightmap()
+{
+  // The heightmap is only hashed if it has changed since the cache was made
+  bIsHeightmapFromCache = (
+    heightmapSource.SetFile(sHeightmapFilePath) && terrainCache.Open(sTerrainCacheFilePath, heightmapSource, heightMapScale) &&
+    heightMapData.LoadFromCache(terrainCache)
+  );
+  if (bIsHeightmapFromCache) {
+    LOG("Loaded the heightmap from \"", sTerrainCacheFilePath, "\"");
+  } else {
+    terrainCache.Close();
+    heightMapData.LoadFromFile(sHeightmapFilePath);
+
+    // The terrain and the virtual texture both need the hash and are loaded at the same time, so work it out here
+    if (heightmapSource.IsValid()) heightmapSource.GetHash();
+  }
+}
 
-    scene.objects.rotations.push_back(rotation);
+void cApplication::BuildTerrain()
+{
+  if (bIsHeightmapFromCache) {
+    if (terrain.BuildFromCache(terrainCache)) return;
 
-    const spitfire::math::cVec2 g(rand.randomZeroToOnef() * 100.0f, rand.randomZeroToOnef() * 100.0f);
-    const spitfire::math::cVec3 randomGoalPosition(g.x, heightMapScale.y * heightMapData.GetHeight(g.x / heightMapScale.x, g.y / heightMapScale.z), g.y);
+    // The heightmap still points into the cache so we can't write over it, just build the terrain this time
+    terrain.Build(heightMapData, heightMapScale);
+    return;
+  }
 
-    switch (rand.random(3)) {
-      case 0: {
-        scene.objects.types.push_back(TYPE::SOLDIER);
+  if (!heightmapSource.IsValid()) {
+    terrain.Build(heightMapData, heightMapScale);
+    return;
+  }
 
-        // Soldiers have AI agents
-        const aiagentid_t id = ai.AddAgent(randomPosition, rotation);
-        ai.AddAgentGoal(id, new AIGoalTakeControlPoint(randomGoalPosition));
+  cTerrainCacheWriter terrainCacheWriter(heightmapSource, heightMapScale);
+  heightMapData.AddToCache(terrainCacheWriter);
+  terrain.Build(heightMapData, heightMapScale, &terrainCacheWriter);
 
-        scene.objects.aiagentids[i] = id;
-        break;
-      }
-      case 1: {
-        scene.objects.types.push_back(TYPE::BULLET);
-        break;
-      }
-      case 2: {
-        scene.objects.types.push_back(TYPE::TREE);
-        break;
-      }
-    }
-  }
+  terrainCacheWriter.Write(sTerrainCacheFilePath);
 }
 
-void cApplication::CreateNavigationMesh()
+void cApplication::LoadVirtualTexture()
 {
-  astar::config<Node> cfg;
-  cfg.node_limit = 1000;
-  cfg.cost_limit = 1000;
-  cfg.route_cost = 0.0f;
+  // The lightmap comes from the heightmap and its scale so they are part of the hash as well as the diffuse map
+  cCacheSource diffuseSource;
+  if (!diffuseSource.SetFile(sDiffuseFilePath)) {
+    LOGERROR("cApplication::LoadVirtualTexture Could not find \"", sDiffuseFilePath, "\"");
+    return;
+  }
 
-  std::vector<spitfire::math::cVec3> nodePositions;
-  std::vector<std::pair<size_t, size_t>> edges;
+  const uint64_t heightmapHash = heightmapSource.IsValid() ? heightmapSource.GetHash() : 0;
+  uint64_t dependencyHash = cTerrainCache::HashBuffer(&heightmapHash, sizeof(heightmapHash));
+  dependencyHash = cTerrainCache::HashBuffer(&heightMapScale, sizeof(heightMapScale), dependencyHash);
 
-  const float fScale = 10.0f;
-  const float fOffsetY = 0.5f;
+  if (virtualTextureFile.Open(sVirtualTextureFilePath, diffuseSource, dependencyHash)) {
+    LOG("Loaded the virtual texture from \"", sVirtualTextureFilePath, "\"");
+    return;
+  }
 
-  const size_t width = 10;
-  const size_t height = 10;
+  // The image is kept so that it can be used as a plain texture if the virtual texture can't be created
+  pImageDiffuse.reset(new voodoo::cImage);
+  if (!pImageDiffuse->LoadFromFile(sDiffuseFilePath)) {
+    LOGERROR("cApplication::LoadVirtualTexture Could not load \"", sDiffuseFilePath, "\"");
+    pImageDiffuse.reset();
+    return;
+  }
 
-  spitfire::math::cRand rand;
+  const cVirtualTextureFile::Layer diffuse = { pImageDiffuse->GetPointerToBuffer(), pImageDiffuse->GetWidth(), pImageDiffuse->GetHeight(), pImageDiffuse->GetBytesPerPixel() };
+  const cVirtualTextureFile::Layer lightmap = { heightMapData.GetLightmapBuffer(), heightMapData.GetLightmapWidth(), heightMapData.GetLightmapDepth(), 4 };
+  if (!cVirtualTextureFile::Write(sVirtualTextureFilePath, diffuseSource, dependencyHash, diffuse, lightmap) || !virtualTextureFile.Open(sVirtualTextureFilePath, diffuseSource, dependencyHash)) {
+    LOGERROR("cApplication::LoadVirtualTexture Could not create \"", sVirtualTextureFilePath, "\"");
+  }
+}
 
-  // Create a grid of node positions and connections
-  for (size_t z = 0; z < height; z++) {
-    for (size_t x = 0; x < width; x++) {
-      const float fJitteredX = (fScale * float(x + 1)) + rand.randomMinusOneToPlusOnef() * 4.0f;
-      const float fJitteredZ = (fScale * float(z + 1)) + rand.randomMinusOneToPlusOnef() * 4.0f;
-      const float fY = (heightMapScale.y * heightMapData.GetHeight(fJitteredX / heightMapScale.x, fJitteredZ / heightMapScale.z)) + fOffsetY;
-      const spitfire::math::cVec3 position(fJitteredX, fY, fJitteredZ);
-      nodePositions.push_back(position);
-    }
+void cApplication::CreateTerrainTextures()
+{
+  if (virtualTextureFile.IsOpen() && virtualTexture.Create(virtualTextureFile, jobSystem)) {
+    pImageDiffuse.reset();
+    return;
   }
 
+  // Fall back to a diffuse texture and a lightmap that each cover the whole map
+  LOGERROR("cApplication::CreateTerrainTextures The virtual texture could not be created, using whole map textures instead");
 
-  // Create our edges
-  // Create these edges:
-  // +<--->+
-  // ^
-  // |
-  // v
-  // +
-  for (size_t z = 0; z < height - 1; z++) {
-    for (size_t x = 0; x < width - 1; x++) {
-      const size_t top_left = (z * width) + x;
-      const size_t top_right = (z * width) + x + 1;
-      const size_t bottom_left = ((z + 1) * width) + x;
-
-      // Edges from left to right, right to left
-      edges.push_back(std::make_pair(top_left, top_right));
-      edges.push_back(std::make_pair(top_right, top_left));
-
-      // Edges from top to bottom, bottom to top
-      edges.push_back(std::make_pair(top_left, bottom_left));
-      edges.push_back(std::make_pair(bottom_left, top_left));
-    }
+  if (!pImageDiffuse && virtualTextureFile.IsOpen()) {
+    // The virtual texture was opened from its file so the diffuse map was never loaded
+    pImageDiffuse.reset(new voodoo::cImage);
+    if (!pImageDiffuse->LoadFromFile(sDiffuseFilePath)) pImageDiffuse.reset();
   }
 
-  // Create the right hand edges:
-  // +
-  // ^
-  // |
-  // v
-  // +
-  for (size_t z = 0; z < height - 1; z++) {
-    const size_t x = width - 1;
-
-    const size_t top_left = (z * width) + x;
-    const size_t bottom_left = ((z + 1) * width) + x;
-
-    // Edges from top to bottom, bottom to top
-    edges.push_back(std::make_pair(top_left, bottom_left));
-    edges.push_back(std::make_pair(bottom_left, top_left));
+  if (pImageDiffuse) pContext->CreateTextureFromImage(textureDiffuse, *pImageDiffuse);
+  else {
+    // Without a diffuse map the terrain is still drawn with just the lightmap and the detail texture
+    const uint8_t white[4] = { 255, 255, 255, 255 };
+    pContext->CreateTextureFromBuffer(textureDiffuse, white, 1, 1, opengl::PIXELFORMAT::R8G8B8A8);
   }
 
-  // Create the bottom edges:
-  // +<--->+
-  for (size_t x = 0; x < width - 1; x++) {
-    const size_t z = height - 1;
+  pImageDiffuse.reset();
 
-    const size_t top_left = (z * width) + x;
-    const size_t top_right = (z * width) + x + 1;
+  const uint8_t* pBuffer = heightMapData.GetLightmapBuffer();
+  const size_t widthLightmap = heightMapData.GetLightmapWidth();
+  const size_t depthLightmap = heightMapData.GetLightmapDepth();
+  pContext->CreateTextureFromBuffer(textureLightMap, pBuffer, widthLightmap, depthLightmap, opengl::PIXELFORMAT::R8G8B8A8);
+}
 
-    // Edges from left to right, right to left
-    edges.push_back(std::make_pair(top_left, top_right));
-    edges.push_back(std::make_pair(top_right, top_left));
-  }
+void cApplication::CreateNavigationMesh()
+{
+  astar::config<Node> cfg;
+  cfg.node_limit = 1000;
+  cfg.cost_limit = 1000;
+  cfg.route_cost = 0.0f;
 
+  const size_t width = 10;
+  const size_t height = 10;
+  const float fSpacing = 10.0f;
 
-  // Create our navigation mesh
-  navigationMesh.SetNodesAndEdges(nodePositions, edges);
+  CreateGridNavigationMesh(navigationMesh, heightMapData, heightMapScale, width, height, fSpacing, sceneSeed);
 
   const Node& from = navigationMesh.GetNode(0);
   const Node& to = navigationMesh.GetNode((width * height) - 1);
@@ -581,7 +692,7 @@ void cApplication::CreateNavigationMesh()
   std::list<Node> path;
   const bool result = astar::astar(from, to, path, &astar::straight_distance_heuristic<Node>, cfg);
 
-  std::cout<<"Nodes size: "<<nodePositions.size()<<std::endl;
+  std::cout<<"Nodes size: "<<navigationMesh.GetNodeCount()<<std::endl;
   std::cout<<"Path size: "<<path.size()<<std::endl;
   size_t i = 0;
   for (auto node : path) {
@@ -595,45 +706,6 @@ void cApplication::CreateNavigationMesh()
   std::cout<<"cfg.route_cost: "<<cfg.route_cost<<std::endl;
 }
 
-void cApplication::CreateHeightmapTriangles(opengl::cStaticVertexBufferObject& staticVertexBufferObject, const cHeightmapData& data, const spitfire::math::cVec3& scale)
-{
-  opengl::cGeometryDataPtr pGeometryDataPtr = opengl::CreateGeometryData();
-
-  const float fDetailMapRepeat = 10.0f;
-  const float fDetailMapWidth = fDetailMapRepeat;
-
-  // NOTE: Diffuse and lightmap will have the duplicated texture coordinates (0..1)
-  // Detail map will have repeated texture coordinates (0..fDetailMapRepeat)
-  opengl::cGeometryBuilder_v3_n3_t2_t2_t2 builder(*pGeometryDataPtr);
-
-  const size_t width = data.GetWidth();
-  const size_t depth = data.GetDepth();
-  for (size_t z = 0; z < depth - 1; z++) {
-    for (size_t x = 0; x < width - 1; x++) {
-      const float fDiffuseAndLightmapU = float(x) / float(width);
-      const float fDiffuseAndLightmapV = float(z) / float(depth);
-      const float fDiffuseAndLightmapU2 = (float(x) + 1.0f) / float(width);
-      const float fDiffuseAndLightmapV2 = (float(z) + 1.0f) / float(depth);
-
-      const float fDetailMapU = float(x) / float(width) * fDetailMapWidth;
-      const float fDetailMapV = float(z) / float(depth) * fDetailMapWidth;
-      const float fDetailMapU2 = (float(x) + 1.0f) / float(width) * fDetailMapWidth;
-      const float fDetailMapV2 = (float(z) + 1.0f) / float(depth) * fDetailMapWidth;
-
-      builder.PushBack(scale * spitfire::math::cVec3(float(x + 1), data.GetHeight(x + 1, z + 1), float(z + 1)), data.GetNormal(x + 1, z + 1, scale), spitfire::math::cVec2(fDiffuseAndLightmapU2, fDiffuseAndLightmapV2), spitfire::math::cVec2(fDiffuseAndLightmapU2, fDiffuseAndLightmapV2), spitfire::math::cVec2(fDetailMapU2, fDetailMapV2));
-      builder.PushBack(scale * spitfire::math::cVec3(float(x + 1), data.GetHeight(x + 1, z), float(z)), data.GetNormal(x + 1, z, scale), spitfire::math::cVec2(fDiffuseAndLightmapU2, fDiffuseAndLightmapV), spitfire::math::cVec2(fDiffuseAndLightmapU2, fDiffuseAndLightmapV), spitfire::math::cVec2(fDetailMapU2, fDetailMapV));
-      builder.PushBack(scale * spitfire::math::cVec3(float(x), data.GetHeight(x, z), float(z)), data.GetNormal(x, z, scale), spitfire::math::cVec2(fDiffuseAndLightmapU, fDiffuseAndLightmapV), spitfire::math::cVec2(fDiffuseAndLightmapU, fDiffuseAndLightmapV), spitfire::math::cVec2(fDetailMapU, fDetailMapV));
-      builder.PushBack(scale * spitfire::math::cVec3(float(x), data.GetHeight(x, z + 1), float(z + 1)), data.GetNormal(x, z + 1, scale), spitfire::math::cVec2(fDiffuseAndLightmapU, fDiffuseAndLightmapV2), spitfire::math::cVec2(fDiffuseAndLightmapU, fDiffuseAndLightmapV2), spitfire::math::cVec2(fDetailMapU, fDetailMapV2));
-      builder.PushBack(scale * spitfire::math::cVec3(float(x + 1), data.GetHeight(x + 1, z + 1), float(z + 1)), data.GetNormal(x, z + 1, scale), spitfire::math::cVec2(fDiffuseAndLightmapU2, fDiffuseAndLightmapV2), spitfire::math::cVec2(fDiffuseAndLightmapU2, fDiffuseAndLightmapV2), spitfire::math::cVec2(fDetailMapU2, fDetailMapV2));
-      builder.PushBack(scale * spitfire::math::cVec3(float(x), data.GetHeight(x, z), float(z)), data.GetNormal(x, z, scale), spitfire::math::cVec2(fDiffuseAndLightmapU, fDiffuseAndLightmapV), spitfire::math::cVec2(fDiffuseAndLightmapU, fDiffuseAndLightmapV), spitfire::math::cVec2(fDetailMapU, fDetailMapV));
-    }
-  }
-
-  staticVertexBufferObject.SetData(pGeometryDataPtr);
-
-  staticVertexBufferObject.Compile();
-}
-
 void cApplication::CreateNavigationMeshDebugShapes()
 {
   opengl::cGeometryDataPtr pGeometryDataPtr = opengl::CreateGeometryData();
@@ -723,8 +795,15 @@ bool cApplication::Create()
 
   CreateShaders();
 
-  // Create our text VBO
-  pContext->CreateStaticVertexBufferObject(textVBO);
+  // One worker per core for loading, the main thread only uploads
+  jobSystem.Start(parallel::GetThreadCount());
+
+  // Create our dynamic geometry
+  const size_t nDynamicVertexBufferBytesPerFrame = 4 * 1024 * 1024;
+  dynamicVertexBufferRing.Create(nDynamicVertexBufferBytesPerFrame);
+  textGeometry.Create(dynamicVertexBufferRing, cDynamicGeometry::VERTEX_FORMAT::V2_C4_T2, cRenderQueue::PRIMITIVE::TRIANGLES);
+  rayCastLinesGeometry.Create(dynamicVertexBufferRing, cDynamicGeometry::VERTEX_FORMAT::V3_N3, cRenderQueue::PRIMITIVE::LINES);
+  debugTargetTraceLinesGeometry.Create(dynamicVertexBufferRing, cDynamicGeometry::VERTEX_FORMAT::V3_N3, cRenderQueue::PRIMITIVE::LINES);
 
 
   pContext->CreateStaticVertexBufferObject(staticVertexBufferObjectGuiRectangle);
@@ -733,23 +812,13 @@ bool cApplication::Create()
 
   const float fRadius = 1.0f;
 
-  pContext->CreateStaticVertexBufferObject(staticVertexBufferObjectCube0);
-  CreateCube(staticVertexBufferObjectCube0, 0);
-  pContext->CreateStaticVertexBufferObject(staticVertexBufferObjectSphere0);
-  CreateSphere(staticVertexBufferObjectSphere0, 0, fRadius);
-  pContext->CreateStaticVertexBufferObject(staticVertexBufferObjectGear0);
-  CreateGear(staticVertexBufferObjectGear0);
+  CreateCube(instancedMeshCube0, 0);
+  CreateSphere(instancedMeshSphere0, 0, fRadius);
+  CreateGear(instancedMeshGear0);
 
 
-  // Create our scene
-  CreateScene();
-
-  // Create navigation mesh
-  CreateNavigationMesh();
-
-  // Create our debug shapes
-  CreateNavigationMeshDebugShapes();
-  CreateNavigationMeshDebugWayPointLines();
+  // Start loading our scene, it is finished off while the loading screen is shown
+  StartLoading();
 
 
   // Setup our event listeners
@@ -763,29 +832,38 @@ void cApplication::Destroy()
 {
   ASSERT(pContext != nullptr);
 
-  pContext->DestroyStaticVertexBufferObject(staticVertexBufferDebugTargetTraceLines);
+  // Wait for any assets that are still loading
+  jobSystem.Stop();
+
+  simulation.Stop();
+
   pContext->DestroyStaticVertexBufferObject(staticVertexBufferGreenDebugTraceLines);
   pContext->DestroyStaticVertexBufferObject(staticVertexBufferDebugNavigationMesh);
   pContext->DestroyStaticVertexBufferObject(staticVertexBufferDebugNavigationMeshWayPointLines);
 
-  pContext->DestroyStaticVertexBufferObject(staticVertexBufferObjectRayCasts);
+  instancedMeshGear0.Destroy();
+  instancedMeshSphere0.Destroy();
+  instancedMeshCube0.Destroy();
 
-  pContext->DestroyStaticVertexBufferObject(staticVertexBufferObjectGear0);
-  pContext->DestroyStaticVertexBufferObject(staticVertexBufferObjectSphere0);
-  pContext->DestroyStaticVertexBufferObject(staticVertexBufferObjectCube0);
 
+  terrain.Destroy();
 
-  pContext->DestroyStaticVertexBufferObject(staticVertexBufferObjectHeightmapTriangles);
+  virtualTexture.Destroy();
+  virtualTextureFile.Close();
+
+  if (textureLightMap.IsValid()) pContext->DestroyTexture(textureLightMap);
+  if (textureDiffuse.IsValid()) pContext->DestroyTexture(textureDiffuse);
 
   pContext->DestroyTexture(textureDetail);
-  pContext->DestroyTexture(textureLightMap);
-  pContext->DestroyTexture(textureDiffuse);
 
 
   pContext->DestroyStaticVertexBufferObject(staticVertexBufferObjectGuiRectangle);
 
-  // Destroy our text VBO
-  pContext->DestroyStaticVertexBufferObject(textVBO);
+  // Destroy our dynamic geometry
+  debugTargetTraceLinesGeometry.Destroy();
+  rayCastLinesGeometry.Destroy();
+  textGeometry.Destroy();
+  dynamicVertexBufferRing.Destroy();
 
   // Destroy our font
   if (font.IsValid()) pContext->DestroyFont(font);
@@ -805,15 +883,24 @@ void cApplication::CreateShaders()
   pContext->CreateShader(shaderHeightmap, TEXT("shaders/heightmap.vert"), TEXT("shaders/heightmap.frag"));
   assert(shaderHeightmap.IsCompiledProgram());
 
+  pContext->CreateShader(shaderHeightmapWholeMap, TEXT("shaders/heightmap.vert"), TEXT("shaders/heightmapwholemap.frag"));
+  assert(shaderHeightmapWholeMap.IsCompiledProgram());
+
   pContext->CreateShader(shaderColour, TEXT("shaders/colour.vert"), TEXT("shaders/colour.frag"));
   assert(shaderColour.IsCompiledProgram());
+
+  pContext->CreateShader(shaderColourInstanced, TEXT("shaders/colourinstanced.vert"), TEXT("shaders/colourinstanced.frag"));
+  assert(shaderColourInstanced.IsCompiledProgram());
 }
 
 void cApplication::DestroyShaders()
 {
   if (shaderHeightmap.IsCompiledProgram()) pContext->DestroyShader(shaderHeightmap);
+  if (shaderHeightmapWholeMap.IsCompiledProgram()) pContext->DestroyShader(shaderHeightmapWholeMap);
 
   if (shaderColour.IsCompiledProgram()) pContext->DestroyShader(shaderColour);
+
+  if (shaderColourInstanced.IsCompiledProgram()) pContext->DestroyShader(shaderColourInstanced);
 }
 
 void cApplication::RenderScreenRectangleDepthTexture(float x, float y, opengl::cStaticVertexBufferObject& vbo, const opengl::cTextureFrameBufferObject& texture, opengl::cShader& shader)
@@ -890,10 +977,10 @@ ssize_t cApplication::CollideRayWithObjects(const spitfire::math::cRay3& ray) co
   const float fRadius = 1.0f;
   float fDepth = 0.0f;
 
-  const size_t n = scene.objects.positions.size();
+  const size_t n = objectPositions.size();
   for (size_t i = 0; i < n; i++) {
     spitfire::math::cSphere sphere;
-    sphere.SetPosition(scene.objects.positions[i]);
+    sphere.SetPosition(objectPositions[i]);
     sphere.SetRadius(fRadius);
 
     if (ray.CollideWithSphere(sphere, fDepth)) {
@@ -904,115 +991,20 @@ ssize_t cApplication::CollideRayWithObjects(const spitfire::math::cRay3& ray) co
   return -1;
 }
 
-float cApplication::CollideRayWithHeightmap(const spitfire::math::cRay3& _ray) const
+float cApplication::CollideRayWithHeightmap(const spitfire::math::cRay3& ray) const
 {
   assert(quadtree != nullptr);
 
-  spitfire::math::cRay2 ray;
-  ray.SetOriginAndDirection(_ray.GetOrigin().GetXZ(), _ray.GetDirection().GetXZ());
-
-  std::vector<const spitfire::math::cQuadtree<spitfire::math::cAABB2>*> nodes;
-  quadtree->CollideRay(ray, nodes);
-  std::cout << "Potential collision with " << nodes.size() << " nodes" << std::endl;
-
-  // Sort the nodes based on how far they are from the start of the ray
-  std::sort(nodes.begin(), nodes.end(), [ray](const spitfire::math::cQuadtree<spitfire::math::cAABB2>* a, const spitfire::math::cQuadtree<spitfire::math::cAABB2>* b) {
-    return spitfire::math::cVec2(ray.GetOrigin() - b->GetOrigin()).GetSquaredLength() > spitfire::math::cVec2(ray.GetOrigin() - a->GetOrigin()).GetSquaredLength();
-  });
-
-  const float fGridSize = 1.0f;
-
   cApplication* pThis = (cApplication*)this;
 
   const spitfire::durationms_t start = spitfire::util::GetTimeMS();
 
-  size_t i = 0;
-
-  for (auto pNode : nodes) {
-
-    const spitfire::math::cAABB2* data = pNode->GetData();
-    assert(data != nullptr);
-
-    const spitfire::math::cVec2 nodeMin = data->GetMin();
-    const spitfire::math::cVec2 nodeMax = data->GetMax();
-    const spitfire::math::cVec2 nodeDimensions(nodeMax - nodeMin);
-    const size_t nGridWidth = nodeDimensions.x / fGridSize;
-    const size_t nGridDepth = nodeDimensions.y / fGridSize;
-
-    spitfire::math::cAABB3 aabb3D;
-    aabb3D.SetExtents(spitfire::math::cVec3(nodeMin.x, 0.0f, nodeMin.y), spitfire::math::cVec3(nodeMax.x, 10.0f, nodeMax.y));
-
-    //std::cout << "Colliding with node " << i << std::endl;
-    const float fHalfGridSize = 0.5f * fGridSize;
-
-    spitfire::math::cVec3 point(_ray.GetOrigin() + (spitfire::math::cEPSILON * _ray.GetDirection()));
-
-    // If the origin of the ray is not already already within this node then find a point on the closest face and iterate from there
-    if (!point.IsWithinBounds(aabb3D.GetMin(), aabb3D.GetMax())) {
-      float fDepth = -1.0f;
-      if (!_ray.CollideWithAABB(aabb3D, fDepth)) {
-        continue;
-      }
-
-      point = _ray.GetOrigin() + ((fDepth + spitfire::math::cEPSILON) * _ray.GetDirection());
-    }
-
-    pThis->DebugAddRayCastBox(aabb3D);
-
-    size_t x = 0;
-
-    float fDepth = -1.0f;
-    while (point.IsWithinBounds(aabb3D.GetMin(), aabb3D.GetMax())) {
-      //std::cout << "Line part " <<x << std::endl;
-
-      pThis->AddRayCastLine(spitfire::math::cLine3(_ray.GetOrigin(), point));
-
-      const float fX0 = point.x - fHalfGridSize;
-      const float fZ0 = point.z - fHalfGridSize;
-      const spitfire::math::cVec3 point0(fX0, heightMapScale.y * heightMapData.GetHeight(fX0 / heightMapScale.x, fZ0 / heightMapScale.z), fZ0);
-
-      const float fX1 = point.x + fHalfGridSize;
-      const float fZ1 = point.z - fHalfGridSize;
-      const spitfire::math::cVec3 point1(fX1, heightMapScale.y * heightMapData.GetHeight(fX1 / heightMapScale.x, fZ1 / heightMapScale.z), fZ1);
-
-      const float fZ2 = point.z + fHalfGridSize;
-      const float fX2 = point.x - fHalfGridSize;
-      const spitfire::math::cVec3 point2(fX2, heightMapScale.y * heightMapData.GetHeight(fX2 / heightMapScale.x, fZ2 / heightMapScale.z), fZ2);
-
-      const float fX3 = point.x + fHalfGridSize;
-      const float fZ3 = point.z + fHalfGridSize;
-      const spitfire::math::cVec3 point3(fX3, heightMapScale.y * heightMapData.GetHeight(fX3 / heightMapScale.x, fZ3 / heightMapScale.z), fZ3);
-
-      pThis->AddRayCastLine(spitfire::math::cLine3(point0, point1));
-      pThis->AddRayCastLine(spitfire::math::cLine3(point1, point2));
-      pThis->AddRayCastLine(spitfire::math::cLine3(point2, point0));
-      pThis->AddRayCastLine(spitfire::math::cLine3(point2, point3));
-      pThis->AddRayCastLine(spitfire::math::cLine3(point3, point1));
-
-      if (_ray.CollideWithTriangle(point0, point1, point2, fDepth) || _ray.CollideWithTriangle(point1, point2, point3, fDepth) ||
-        _ray.CollideWithTriangle(point1, point0, point2, fDepth) || _ray.CollideWithTriangle(point2, point1, point3, fDepth)) {
-        const spitfire::durationms_t end = spitfire::util::GetTimeMS();
-        std::cout<<"Collision depth="<<fDepth<<std::endl;
-        std::cout<<(end - start)<<" ms"<<std::endl;
-        pThis->CreateRayCastLineStaticVertexBuffer();
-        return fDepth;
-      }
-
-      point += 0.1f * _ray.GetDirection();
-
-      x++;
-    }
-
-    i++;
-  }
-
-  pThis->CreateRayCastLineStaticVertexBuffer();
+  const float fDepth = ::CollideRayWithHeightmap(heightMapData, heightMapScale, *quadtree, ray, pThis);
 
   const spitfire::durationms_t end = spitfire::util::GetTimeMS();
   std::cout << (end - start) << " ms" << std::endl;
 
-  // No collision, return an invalid depth
-  return -1.0f;
+  return fDepth;
 }
 
 void cApplication::HandleSelectionAndOrders(int mouseX, int mouseY)
@@ -1057,12 +1049,7 @@ void cApplication::HandleSelectionAndOrders(int mouseX, int mouseY)
     // Add a ray
     AddRayCastLine(spitfire::math::cLine3(origin, point));
 
-    if (selectedObject != -1) {
-      auto iter = scene.objects.aiagentids.find(selectedObject);
-      if (iter != scene.objects.aiagentids.end()) ai.AddAgentGoal(iter->second, new AIGoalTakeControlPoint(point));
-    }
-
-    CreateRayCastLineStaticVertexBuffer();
+    if (selectedObject != -1) simulation.OrderObjectToPosition(selectedObject, point);
   }
 }
 
@@ -1091,7 +1078,8 @@ void cApplication::_OnMouseEvent(const opengl::cMouseEvent& event)
     if (fabs(event.GetY() - (pWindow->GetHeight() * 0.5f)) > 1.5f) {
       camera.RotateY(0.05f * (event.GetY() - (pWindow->GetHeight() * 0.5f)));
     }
-  } else if (event.IsButtonUp() && (event.GetButton() == SDL_BUTTON_LEFT)) {
+  } else if (event.IsButtonUp() && (event.GetButton() == SDL_BUTTON_LEFT) && assetLoader.IsFinished()) {
+    // Selection needs the quadtree and the scene so it has to wait until loading has finished
     HandleSelectionAndOrders(event.GetX(), event.GetY());
   }
 }
@@ -1116,7 +1104,7 @@ void cApplication::_OnKeyboardEvent(const opengl::cKeyboardEvent& event)
 
       case SDLK_SPACE: {
         //LOG("spacebar down");
-        bIsPhysicsRunning = false;
+        simulation.SetRunning(false);
         break;
       }
     }
@@ -1124,7 +1112,7 @@ void cApplication::_OnKeyboardEvent(const opengl::cKeyboardEvent& event)
     switch (event.GetKeyCode()) {
       case SDLK_SPACE: {
         LOG("spacebar up");
-        bIsPhysicsRunning = true;
+        simulation.SetRunning(true);
         break;
       }
 
@@ -1137,6 +1125,10 @@ void cApplication::_OnKeyboardEvent(const opengl::cKeyboardEvent& event)
         bIsWireframe = !bIsWireframe;
         break;
       }
+      case SDLK_F9: {
+        StartProfilerCapture(nProfilerCaptureFrames);
+        break;
+      }
     }
   }
 }
@@ -1150,6 +1142,7 @@ std::vector<std::string> cApplication::GetInputDescription() const
   description.push_back("D right");
   description.push_back("Space pause rotation");
   description.push_back("F5 reload shaders");
+  description.push_back("F9 capture a profiler trace");
   description.push_back("1 toggle wireframe");
   description.push_back("2 toggle directional light");
   description.push_back("3 toggle point light");
@@ -1175,18 +1168,14 @@ opengl::cGeometryDataPtr pGeometryDataGreenDebugLinesPtr = opengl::CreateGeometr
 
 opengl::cGeometryBuilder_v3_n3 builderGreenDebugLines(*pGeometryDataGreenDebugLinesPtr);
 
-void cApplication::CreateRayCastLineStaticVertexBuffer()
+void cApplication::OnRayCastTestNode(const spitfire::math::cAABB3& aabb)
 {
-  // Recreate our ray casts vertex buffer object
-  if (staticVertexBufferObjectRayCasts.IsCompiled()) pContext->DestroyStaticVertexBufferObject(staticVertexBufferObjectRayCasts);
-
-  if (pGeometryDataRedRayLinesPtr->nVertexCount != 0) {
-    pContext->CreateStaticVertexBufferObject(staticVertexBufferObjectRayCasts);
-
-    staticVertexBufferObjectRayCasts.SetData(pGeometryDataRedRayLinesPtr);
+  DebugAddRayCastBox(aabb);
+}
 
-    staticVertexBufferObjectRayCasts.Compile();
-  }
+void cApplication::OnRayCastTestLine(const spitfire::math::cLine3& line)
+{
+  AddRayCastLine(line);
 }
 
 void cApplication::AddRayCastLine(const spitfire::math::cLine3& line)
@@ -1226,6 +1215,8 @@ void cApplication::DebugAddRayCastBox(const spitfire::math::cAABB3& aabb)
 
 void cApplication::CreateGreenDebugLinesStaticVertexBuffer()
 {
+  PROFILE_ZONE("Debug VBO rebuild");
+
   // Recreate our vertex buffer object
   if (staticVertexBufferGreenDebugTraceLines.IsCompiled()) pContext->DestroyStaticVertexBufferObject(staticVertexBufferGreenDebugTraceLines);
 
@@ -1234,6 +1225,7 @@ void cApplication::CreateGreenDebugLinesStaticVertexBuffer()
 
     staticVertexBufferGreenDebugTraceLines.SetData(pGeometryDataGreenDebugLinesPtr);
 
+    PROFILE_ZONE("VBO upload");
     staticVertexBufferGreenDebugTraceLines.Compile();
   }
 }
@@ -1248,26 +1240,33 @@ void AddLineToBuilder(opengl::cGeometryBuilder_v3_n3& builder, const spitfire::m
   builder.PushBack(line.GetDestination(), normal);
 }
 
-void cApplication::CreateDebugTargetTraceLinesStaticVertexBuffer()
+void cApplication::CreateDebugTargetTraceLines()
 {
-  opengl::cGeometryDataPtr pGeometryDataDebugTargetTraceLinesPtr = opengl::CreateGeometryData();
+  PROFILE_ZONE("Debug geometry rebuild");
+
+  pGeometryDataDebugTargetTraceLinesPtr = opengl::CreateGeometryData();
 
   opengl::cGeometryBuilder_v3_n3 builder(*pGeometryDataDebugTargetTraceLinesPtr);
 
-  for (auto iter : scene.objects.aiagentids) {
-    spitfire::math::cVec3 goalPosition;
-    if (ai.GetAgentGoalPosition(iter.second, goalPosition)) AddLineToBuilder(builder, spitfire::math::cLine3(scene.objects.positions[iter.first], goalPosition));
+  assert(pSnapshot != nullptr);
+  for (auto& agent : pSnapshot->agents) {
+    if (agent.bHasGoalPosition) AddLineToBuilder(builder, spitfire::math::cLine3(pSnapshot->positions[agent.object], agent.goalPosition));
   }
+}
 
-  // Recreate our vertex buffer object
-  if (staticVertexBufferDebugTargetTraceLines.IsCompiled()) pContext->DestroyStaticVertexBufferObject(staticVertexBufferDebugTargetTraceLines);
+void cApplication::UpdateObjectsFromSimulation()
+{
+  PROFILE_ZONE("Simulation snapshot");
 
-  if (pGeometryDataDebugTargetTraceLinesPtr->nVertexCount != 0) {
-    pContext->CreateStaticVertexBufferObject(staticVertexBufferDebugTargetTraceLines);
+  pSnapshot = &simulation.GetLatestSnapshot();
 
-    staticVertexBufferDebugTargetTraceLines.SetData(pGeometryDataDebugTargetTraceLinesPtr);
+  const float fAlpha = pSnapshot->GetInterpolationAlpha(std::chrono::steady_clock::now());
+  pSnapshot->Interpolate(fAlpha, objectPositions, objectRotations);
 
-    staticVertexBufferDebugTargetTraceLines.Compile();
+  // The goals only change when the simulation ticks
+  if (pSnapshot->tick != lastSnapshotTick) {
+    CreateDebugTargetTraceLines();
+    lastSnapshotTick = pSnapshot->tick;
   }
 }
 
@@ -1322,198 +1321,184 @@ void cApplication::DebugAddQuadtreeLinesRecursive(const spitfire::math::cQuadtre
   }
 }
 
-void cApplication::RenderFrame()
+void cApplication::RunLoadingScreen()
 {
-  assert(textVBO.IsCompiled());
-
-  const spitfire::math::cMat4 matProjection = pContext->CalculateProjectionMatrix();
-
-  const spitfire::math::cMat4 matView = camera.CalculateViewMatrix();
-
-  {
-    // Render the scene into a texture for later
-    pContext->SetClearColour(scene.skyColour);
-
-    pContext->BeginRenderToScreen();
-
-    if (bIsWireframe) pContext->EnableWireframe();
-
+  while (!bIsDone && !assetLoader.IsFinished()) {
+    PROFILE_END_FRAME();
+    PROFILE_ZONE("Loading frame");
 
-    // Render terrain
-    {
-      pContext->BindTexture(0, textureDiffuse);
-      pContext->BindTexture(1, textureLightMap);
-      pContext->BindTexture(2, textureDetail);
+    pWindow->ProcessEvents();
 
-      pContext->BindShader(shaderHeightmap);
+    // Upload anything that the workers have finished with
+    assetLoader.Update();
 
-      spitfire::math::cMat4 matModel;
+    dynamicVertexBufferRing.BeginFrame();
 
-      pContext->BindStaticVertexBufferObject(staticVertexBufferObjectHeightmapTriangles);
-      pContext->SetShaderProjectionAndViewAndModelMatrices(matProjection, matView, matModel);
-      pContext->DrawStaticVertexBufferObjectTriangles(staticVertexBufferObjectHeightmapTriangles);
-      pContext->UnBindStaticVertexBufferObject(staticVertexBufferObjectHeightmapTriangles);
+    CreateLoadingText();
+    RenderLoadingFrame();
 
-      pContext->UnBindShader(shaderHeightmap);
+    dynamicVertexBufferRing.EndFrame();
+  }
 
-      pContext->UnBindTexture(2, textureDetail);
-      pContext->UnBindTexture(1, textureLightMap);
-      pContext->UnBindTexture(0, textureDiffuse);
-    }
+  if (assetLoader.IsFinished()) assetLoader.LogTimings();
+}
 
-    {
-      // Render objects
-      pContext->BindShader(shaderColour);
-
-      const spitfire::math::cColour white(1.0f, 1.0f, 1.0f);
-      const spitfire::math::cColour red(1.0f, 0.0f, 0.0f);
-      const spitfire::math::cColour blue(0.0f, 0.0f, 1.0f);
-      const spitfire::math::cColour orange(1.0f, 1.0f, 0.0f);
-
-      const size_t n = scene.objects.types.size();
-      for (size_t i = 0; i < n; i++) {
-        const spitfire::math::cMat4 matTranslation(spitfire::math::cMat4::TranslationMatrix(scene.objects.positions[i]));
-        if (selectedObject == ssize_t(i)) {
-          pContext->SetShaderConstant("colour", orange);
-          pContext->BindStaticVertexBufferObject(staticVertexBufferObjectCube0);
-          pContext->SetShaderProjectionAndModelViewMatrices(matProjection, matView * matTranslation * scene.objects.rotations[i].GetMatrix());
-          pContext->DrawStaticVertexBufferObjectTriangles(staticVertexBufferObjectCube0);
-          pContext->UnBindStaticVertexBufferObject(staticVertexBufferObjectCube0);
-        } else {
-          switch (scene.objects.types[i]) {
-            case TYPE::SOLDIER: {
-              pContext->SetShaderConstant("colour", red);
-              pContext->BindStaticVertexBufferObject(staticVertexBufferObjectCube0);
-              pContext->SetShaderProjectionAndModelViewMatrices(matProjection, matView * matTranslation * scene.objects.rotations[i].GetMatrix());
-              pContext->DrawStaticVertexBufferObjectTriangles(staticVertexBufferObjectCube0);
-              pContext->UnBindStaticVertexBufferObject(staticVertexBufferObjectCube0);
-              break;
-            }
-            case TYPE::BULLET: {
-              pContext->SetShaderConstant("colour", white);
-              pContext->BindStaticVertexBufferObject(staticVertexBufferObjectSphere0);
-              pContext->SetShaderProjectionAndModelViewMatrices(matProjection, matView * matTranslation * scene.objects.rotations[i].GetMatrix());
-              pContext->DrawStaticVertexBufferObjectTriangles(staticVertexBufferObjectSphere0);
-              pContext->UnBindStaticVertexBufferObject(staticVertexBufferObjectSphere0);
-            }
-            case TYPE::TREE: {
-              pContext->SetShaderConstant("colour", blue);
-              pContext->BindStaticVertexBufferObject(staticVertexBufferObjectGear0);
-              pContext->SetShaderProjectionAndModelViewMatrices(matProjection, matView * matTranslation * scene.objects.rotations[i].GetMatrix());
-              pContext->DrawStaticVertexBufferObjectTriangles(staticVertexBufferObjectGear0);
-              pContext->UnBindStaticVertexBufferObject(staticVertexBufferObjectGear0);
-            }
-          }
-        }
-      }
+void cApplication::RenderLoadingFrame()
+{
+  pContext->SetClearColour(skyColour);
 
-      pContext->UnBindShader(shaderColour);
-    }
+  pContext->BeginRenderToScreen();
 
+  pContext->BeginRenderMode2D(opengl::MODE2D_TYPE::Y_INCREASES_DOWN_SCREEN);
 
-    opengl::cSystem::GetErrorString();
+  {
+    pContext->BindFont(font);
 
+    spitfire::math::cMat4 matModelView;
+    matModelView.SetTranslation(0.02f, 0.05f, 0.0f);
 
-    if (staticVertexBufferDebugNavigationMesh.IsCompiled()) {
-      // Render our debug navigation mesh
-      pContext->BindShader(shaderColour);
+    pContext->SetShaderProjectionAndModelViewMatricesRenderMode2D(opengl::MODE2D_TYPE::Y_INCREASES_DOWN_SCREEN, matModelView);
 
-      const spitfire::math::cColour green(0.0f, 1.0f, 0.0f);
+    textGeometry.Draw();
 
-      pContext->SetShaderConstant("colour", green);
+    pContext->UnBindFont(font);
+  }
 
-      const spitfire::math::cMat4 matModel;
+  pContext->EndRenderMode2D();
 
-      pContext->BindStaticVertexBufferObject(staticVertexBufferDebugNavigationMesh);
-      pContext->SetShaderProjectionAndViewAndModelMatrices(matProjection, matView, matModel);
-      pContext->DrawStaticVertexBufferObjectTriangles(staticVertexBufferDebugNavigationMesh);
-      pContext->UnBindStaticVertexBufferObject(staticVertexBufferDebugNavigationMesh);
+  pContext->EndRenderToScreen(*pWindow);
+}
 
-      pContext->UnBindShader(shaderColour);
-    }
+void cApplication::RenderFrame()
+{
+  PROFILE_ZONE("Render");
 
-    if (staticVertexBufferDebugNavigationMeshWayPointLines.IsCompiled()) {
-      // Render our debug navigation mesh way point lines
-      pContext->BindShader(shaderColour);
+  const spitfire::math::cMat4 matProjection = pContext->CalculateProjectionMatrix();
 
-      const spitfire::math::cColour darkGreen(0.0f, 0.5f, 0.0f);
+  const spitfire::math::cMat4 matView = camera.CalculateViewMatrix();
 
-      pContext->SetShaderConstant("colour", darkGreen);
+  // Pick the terrain level of detail for this frame
+  {
+    PROFILE_ZONE("Terrain LOD");
+    terrain.SelectLOD(camera.GetPosition(), matProjection, resolution.height);
+  }
 
-      const spitfire::math::cMat4 matModel;
+  // Page in the diffuse map and lightmap around the camera, the terrain texture coordinates go from 0 to 1 across the heightmap
+  if (virtualTexture.IsValid()) {
+    const float fTexelsPerUnitX = float(virtualTextureFile.GetWidth()) / (float(heightMapData.GetWidth()) * heightMapScale.x);
+    const float fTexelsPerUnitZ = float(virtualTextureFile.GetDepth()) / (float(heightMapData.GetDepth()) * heightMapScale.z);
+    virtualTexture.Update(fTexelsPerUnitX * camera.GetPosition().x, fTexelsPerUnitZ * camera.GetPosition().z, fTexelsPerUnitX * fVirtualTextureRadius);
+  }
 
-      pContext->BindStaticVertexBufferObject(staticVertexBufferDebugNavigationMeshWayPointLines);
-      pContext->SetShaderProjectionAndViewAndModelMatrices(matProjection, matView, matModel);
-      pContext->DrawStaticVertexBufferObjectLines(staticVertexBufferDebugNavigationMeshWayPointLines);
-      pContext->UnBindStaticVertexBufferObject(staticVertexBufferDebugNavigationMeshWayPointLines);
+  // Find the terrain chunks and objects that are inside the view frustum
+  {
+    PROFILE_ZONE("Culling");
 
-      pContext->UnBindShader(shaderColour);
-    }
+    cFrustumCuller frustumCuller;
+    frustumCuller.SetViewProjection(matProjection * matView);
 
-    opengl::cSystem::GetErrorString();
+    terrain.Cull(frustumCuller);
 
+    const spitfire::math::cVec3 extents(1.0f, 1.0f, 1.0f);
 
-    if (staticVertexBufferObjectRayCasts.IsCompiled()) {
-      // Render our ray casts
-      pContext->BindShader(shaderColour);
+    objectBounds.clear();
+    for (auto& position : objectPositions) objectBounds.push_back(position - extents, position + extents);
 
-      const spitfire::math::cColour red(1.0f, 0.0f, 0.0f);
+    frustumCuller.Cull(objectBounds, visibleObjects);
+  }
 
-      pContext->SetShaderConstant("colour", red);
+  // Collect everything we want to draw this frame, the queue sorts it by state before submitting it
+  renderQueue.Clear();
 
-      const spitfire::math::cMat4 matModel;
+  const spitfire::math::cMat4 matIdentity;
 
-      pContext->BindStaticVertexBufferObject(staticVertexBufferObjectRayCasts);
-      pContext->SetShaderProjectionAndViewAndModelMatrices(matProjection, matView, matModel);
-      pContext->DrawStaticVertexBufferObjectLines(staticVertexBufferObjectRayCasts);
-      pContext->UnBindStaticVertexBufferObject(staticVertexBufferObjectRayCasts);
+  if (virtualTexture.IsValid()) {
+    // The diffuse map and lightmap are bound by the virtual texture
+    const opengl::cTexture* textures[cRenderQueue::nMaxTextures] = { nullptr, nullptr, &textureDetail };
+    renderQueue.AddDrawable(shaderHeightmap, textures, virtualTexturedTerrain, matIdentity);
+  } else {
+    const opengl::cTexture* textures[cRenderQueue::nMaxTextures] = { &textureDiffuse, &textureLightMap, &textureDetail };
+    renderQueue.AddDrawable(shaderHeightmapWholeMap, textures, terrain, matIdentity);
+  }
 
-      pContext->UnBindShader(shaderColour);
+  {
+    PROFILE_ZONE("Instances");
+
+    // Objects are bucketed by type and each type is drawn with a single instanced draw call
+    const spitfire::math::cColour white(1.0f, 1.0f, 1.0f);
+    const spitfire::math::cColour red(1.0f, 0.0f, 0.0f);
+    const spitfire::math::cColour blue(0.0f, 0.0f, 1.0f);
+    const spitfire::math::cColour orange(1.0f, 1.0f, 0.0f);
+
+    instancedMeshCube0.ClearInstances();
+    instancedMeshSphere0.ClearInstances();
+    instancedMeshGear0.ClearInstances();
+
+    for (auto i : visibleObjects) {
+      const spitfire::math::cMat4 matTranslation(spitfire::math::cMat4::TranslationMatrix(objectPositions[i]));
+      const spitfire::math::cMat4 matModel = matTranslation * objectRotations[i].GetMatrix();
+      if (selectedObject == ssize_t(i)) {
+        instancedMeshCube0.AddInstance(matModel, orange);
+      } else {
+        switch (pSnapshot->types[i]) {
+          case TYPE::SOLDIER: {
+            instancedMeshCube0.AddInstance(matModel, red);
+            break;
+          }
+          case TYPE::BULLET: {
+            instancedMeshSphere0.AddInstance(matModel, white);
+            break;
+          }
+          case TYPE::TREE: {
+            instancedMeshGear0.AddInstance(matModel, blue);
+            break;
+          }
+        }
+      }
     }
 
+    // The instances provide their own model matrices
+    cInstancedMesh* meshes[] = { &instancedMeshCube0, &instancedMeshSphere0, &instancedMeshGear0 };
+    for (auto pMesh : meshes) {
+      if (pMesh->GetInstanceCount() == 0) continue;
 
-    opengl::cSystem::GetErrorString();
-
-
-    if (staticVertexBufferGreenDebugTraceLines.IsCompiled()) {
-      // Render our green debug lines
-      pContext->BindShader(shaderColour);
-
-      const spitfire::math::cColour green(0.0f, 1.0f, 0.0f);
-
-      pContext->SetShaderConstant("colour", green);
-
-      const spitfire::math::cMat4 matModel;
+      pMesh->UpdateInstances();
+      renderQueue.AddDrawable(shaderColourInstanced, nullptr, *pMesh, matIdentity);
+    }
+  }
 
-      pContext->BindStaticVertexBufferObject(staticVertexBufferGreenDebugTraceLines);
-      pContext->SetShaderProjectionAndViewAndModelMatrices(matProjection, matView, matModel);
-      pContext->DrawStaticVertexBufferObjectLines(staticVertexBufferGreenDebugTraceLines);
-      pContext->UnBindStaticVertexBufferObject(staticVertexBufferGreenDebugTraceLines);
+  {
+    // Debug layers
+    const spitfire::math::cColour green(0.0f, 1.0f, 0.0f);
+    const spitfire::math::cColour darkGreen(0.0f, 0.5f, 0.0f);
+    const spitfire::math::cColour red(1.0f, 0.0f, 0.0f);
 
-      pContext->UnBindShader(shaderColour);
+    if (staticVertexBufferDebugNavigationMesh.IsCompiled()) renderQueue.AddStaticVertexBufferObject(shaderColour, staticVertexBufferDebugNavigationMesh, cRenderQueue::PRIMITIVE::TRIANGLES, matIdentity, green);
+    if (staticVertexBufferDebugNavigationMeshWayPointLines.IsCompiled()) renderQueue.AddStaticVertexBufferObject(shaderColour, staticVertexBufferDebugNavigationMeshWayPointLines, cRenderQueue::PRIMITIVE::LINES, matIdentity, darkGreen);
+    {
+      PROFILE_ZONE("VBO upload");
+      rayCastLinesGeometry.SetVertices(pGeometryDataRedRayLinesPtr->vertices, pGeometryDataRedRayLinesPtr->nVertexCount);
+      debugTargetTraceLinesGeometry.SetVertices(pGeometryDataDebugTargetTraceLinesPtr->vertices, pGeometryDataDebugTargetTraceLinesPtr->nVertexCount);
     }
 
-    if (staticVertexBufferDebugTargetTraceLines.IsCompiled()) {
-      // Render our red debug target trace lines
-      pContext->BindShader(shaderColour);
-
-      const spitfire::math::cColour red(1.0f, 0.0f, 0.0f);
+    if (rayCastLinesGeometry.GetVertexCount() != 0) renderQueue.AddDrawable(shaderColour, nullptr, rayCastLinesGeometry, matIdentity, red);
+    if (staticVertexBufferGreenDebugTraceLines.IsCompiled()) renderQueue.AddStaticVertexBufferObject(shaderColour, staticVertexBufferGreenDebugTraceLines, cRenderQueue::PRIMITIVE::LINES, matIdentity, green);
+    if (debugTargetTraceLinesGeometry.GetVertexCount() != 0) renderQueue.AddDrawable(shaderColour, nullptr, debugTargetTraceLinesGeometry, matIdentity, red);
+  }
 
-      pContext->SetShaderConstant("colour", red);
+  {
+    // Render the scene into a texture for later
+    pContext->SetClearColour(skyColour);
 
-      const spitfire::math::cMat4 matModel;
+    pContext->BeginRenderToScreen();
 
-      pContext->BindStaticVertexBufferObject(staticVertexBufferDebugTargetTraceLines);
-      pContext->SetShaderProjectionAndViewAndModelMatrices(matProjection, matView, matModel);
-      pContext->DrawStaticVertexBufferObjectLines(staticVertexBufferDebugTargetTraceLines);
-      pContext->UnBindStaticVertexBufferObject(staticVertexBufferDebugTargetTraceLines);
+    if (bIsWireframe) pContext->EnableWireframe();
 
-      pContext->UnBindShader(shaderColour);
+    {
+      PROFILE_ZONE("Render queue submit");
+      renderQueue.Submit(*pContext, camera.GetPosition(), matProjection, matView);
     }
 
-    
-
-
     opengl::cSystem::GetErrorString();
 
 
@@ -1582,6 +1567,8 @@ void cApplication::RenderFrame()
 
     // Draw the text overlay
     {
+      PROFILE_ZONE("Text overlay");
+
       pContext->BindFont(font);
 
       // Rendering the font in the middle of the screen
@@ -1590,42 +1577,71 @@ void cApplication::RenderFrame()
 
       pContext->SetShaderProjectionAndModelViewMatricesRenderMode2D(opengl::MODE2D_TYPE::Y_INCREASES_DOWN_SCREEN, matModelView);
 
-      pContext->BindStaticVertexBufferObject2D(textVBO);
-
-      {
-        pContext->DrawStaticVertexBufferObjectTriangles2D(textVBO);
-      }
-
-      pContext->UnBindStaticVertexBufferObject2D(textVBO);
+      textGeometry.Draw();
 
       pContext->UnBindFont(font);
     }
 
     pContext->EndRenderMode2D();
 
-    pContext->EndRenderToScreen(*pWindow);
+    {
+      PROFILE_ZONE("Present");
+      pContext->EndRenderToScreen(*pWindow);
+    }
   }
 }
 
+void cApplication::StartProfilerCapture(size_t nFrames)
+{
+#ifdef BUILD_PROFILER
+  if (profiler::IsCapturing()) return;
+
+  // Name the trace after the time it was started so that we don't overwrite earlier captures
+  const std::time_t now = std::time(nullptr);
+  char szTime[32];
+  std::strftime(szTime, sizeof(szTime), "%Y%m%d_%H%M%S", std::localtime(&now));
+
+  const std::string sFilePath = std::string("trace_") + szTime + ".json";
+  LOG("Capturing a profiler trace of ", nFrames, " frames to \"", sFilePath, "\"");
+  profiler::StartCapture(nFrames, sFilePath);
+#else
+  (void)nFrames;
+  LOG("Profiler trace capture is not available, build with BUILD_PROFILER");
+#endif
+}
+
 void cApplication::Run()
 {
+  PROFILE_THREAD_NAME("Main");
+
   LOG("");
 
   assert(pContext != nullptr);
   assert(pContext->IsValid());
   assert(font.IsValid());
+  assert(dynamicVertexBufferRing.IsValid());
   assert(shaderColour.IsCompiledProgram());
 
-  assert(textureDiffuse.IsValid());
-  assert(textureLightMap.IsValid());
+  // Show the loading screen until everything has been loaded and uploaded
+  RunLoadingScreen();
+  if (bIsDone) return;
+
+  // Without the virtual texture the terrain is drawn with whole map textures
+  if (!virtualTexture.IsValid()) {
+    assert(textureDiffuse.IsValid());
+    assert(textureLightMap.IsValid());
+  }
+
   assert(textureDetail.IsValid());
   assert(shaderHeightmap.IsCompiledProgram());
+  assert(shaderHeightmapWholeMap.IsCompiledProgram());
 
-  assert(staticVertexBufferObjectHeightmapTriangles.IsCompiled());
+  assert(terrain.IsValid());
 
-  assert(staticVertexBufferObjectCube0.IsCompiled());
-  assert(staticVertexBufferObjectSphere0.IsCompiled());
-  assert(staticVertexBufferObjectGear0.IsCompiled());
+  assert(shaderColourInstanced.IsCompiledProgram());
+  assert(instancedMeshCube0.IsValid());
+  assert(instancedMeshSphere0.IsValid());
+  assert(instancedMeshGear0.IsValid());
 
   // Print the input instructions
   const std::vector<std::string> inputDescription = GetInputDescription();
@@ -1682,16 +1698,23 @@ void cApplication::Run()
   //const float fFogDensity = 0.5f;
 
 
+  // Start updating the simulation on its own thread
+  simulation.Start();
+
   const uint32_t uiUpdateInputDelta = uint32_t(1000.0f / 120.0f);
   const uint32_t uiUpdateDelta = uint32_t(1000.0f / 60.0f);
 
-  spitfire::durationms_t currentSimulationTime = 0;
-
   while (!bIsDone) {
+    // Finish the profiler statistics for the previous frame before we start timing this one
+    PROFILE_END_FRAME();
+    PROFILE_ZONE("Frame");
+
     // Update state
     currentTime = spitfire::util::GetTimeMS();
 
     if ((currentTime - previousUpdateInputTime) > uiUpdateInputDelta) {
+      PROFILE_ZONE("Input");
+
       // Update window events
       pWindow->ProcessEvents();
 
@@ -1717,33 +1740,8 @@ void cApplication::Run()
       if (moveCameraLeft.bDown) camera.MoveX(-fDistance);
       if (moveCameraRight.bDown) camera.MoveX(fDistance);
 
-
-      if (bIsPhysicsRunning) {
-        currentSimulationTime++;
-
-        // Tell the AI about our current object positions and rotations
-        for (auto iter : scene.objects.aiagentids) {
-          ai.SetAgentPositionAndRotation(iter.second, scene.objects.positions[iter.first], scene.objects.rotations[iter.first]);
-        }
-
-        // Update our systems
-        // Update AI
-        ai.Update(currentSimulationTime);
-
-        // Get the new object positions and rotations
-        for (auto iter : scene.objects.aiagentids) {
-          scene.objects.positions[iter.first] = ai.GetAgentPosition(iter.second);
-        }
-
-        // Keep our object on the heightmap
-        const size_t n = scene.objects.positions.size();
-        for (size_t i = 0; i < n; i++) {
-          scene.objects.positions[i].y = heightMapScale.y * heightMapData.GetHeight(scene.objects.positions[i].x / heightMapScale.x, scene.objects.positions[i].z / heightMapScale.z);
-        }
-      }
-
-      // Update our debug lines
-      CreateDebugTargetTraceLinesStaticVertexBuffer();
+      // The agents near the camera or on screen are updated at the full rate
+      simulation.SetCamera(camera.GetPosition(), pContext->CalculateProjectionMatrix() * camera.CalculateViewMatrix());
 
       previousUpdateTime = currentTime;
     }
@@ -1766,12 +1764,26 @@ void cApplication::Run()
     }
 
 
+    // Upload anything that the workers have finished with, such as virtual texture pages
+    {
+      PROFILE_ZONE("Main thread jobs");
+      jobSystem.RunMainThreadJobs();
+    }
+
+    // Wait until we can write this frame's dynamic geometry
+    dynamicVertexBufferRing.BeginFrame();
+
+    // Get the latest state of the objects from the simulation
+    UpdateObjectsFromSimulation();
+
     // Update our text
     CreateText();
-    
+
     // Render a frame to the screen
     RenderFrame();
 
+    dynamicVertexBufferRing.EndFrame();
+
     // Gather our frames per second
     Frames++;
     {
@@ -1786,6 +1798,8 @@ void cApplication::Run()
     }
   };
 
+  simulation.Stop();
+
   pWindow->ShowCursor(true);
 }
 
@@ -1795,11 +1809,23 @@ int main(int argc, char** argv)
 
   util::RedirectStandardOutputToOutputWindow();
 
+  // --trace-capture=N records a profiler trace of the first N frames
+  size_t nTraceCaptureFrames = 0;
+  const std::string sTraceCapture = "--trace-capture=";
+  for (int i = 1; i < argc; i++) {
+    const std::string sArgument = argv[i];
+    if (sArgument.compare(0, sTraceCapture.length(), sTraceCapture) == 0) nTraceCaptureFrames = size_t(strtoul(sArgument.c_str() + sTraceCapture.length(), nullptr, 10));
+  }
+
   {
     cApplication application;
 
     bIsSuccess = application.Create();
-    if (bIsSuccess) application.Run();
+    if (bIsSuccess) {
+      if (nTraceCaptureFrames != 0) application.StartProfilerCapture(nTraceCaptureFrames);
+
+      application.Run();
+    }
 
     application.Destroy();
   }
@@ -12,6 +12,7 @@
 #include <map>
 #include <vector>
 #include <list>
+#include <memory>
 
 // OpenGL headers
 #include <GL/GLee.h>
@@ -38,6 +39,9 @@
 #include <spitfire/storage/filesystem.h>
 #include <spitfire/util/log.h>
 
+// libvoodoomm headers
+#include <libvoodoomm/cImage.h>
+
 // libopenglmm headers
 #include <libopenglmm/libopenglmm.h>
 #include <libopenglmm/cContext.h>
@@ -50,11 +54,23 @@
 #include <libopenglmm/cWindow.h>
 
 // Application headers
-#include "ai.h"
+#include "assetloader.h"
 #include "astar.h"
+#include "culling.h"
+#include "dynamicvertexbuffer.h"
+#include "hud.h"
+#include "instancing.h"
+#include "jobsystem.h"
 #include "main.h"
 #include "navigation.h"
+#include "profiler.h"
+#include "raycast.h"
+#include "renderqueue.h"
+#include "simulation.h"
+#include "terrain.h"
+#include "terraincache.h"
 #include "util.h"
+#include "virtualtexture.h"
 
 struct KeyBoolPair {
   KeyBoolPair(unsigned int _key) : key(_key), bDown(false) {}
@@ -67,31 +83,12 @@ struct KeyBoolPair {
 
 
 
-enum class TYPE {
-  SOLDIER,
-  BULLET,
-  TREE,
-};
-
-
-struct Scene {
-  spitfire::math::cColour skyColour;
-
-  struct Objects {
-    std::vector<spitfire::math::cVec3> positions;
-    std::vector<spitfire::math::cQuaternion> rotations;
-    std::vector<TYPE> types;
-    std::map<size_t, aiagentid_t> aiagentids;
-  } objects;
-};
-
-
 class cHeightmapData;
 
 
 // ** cApplication
 
-class cApplication : public opengl::cWindowEventListener, public opengl::cInputEventListener
+class cApplication : public opengl::cWindowEventListener, public opengl::cInputEventListener, public cHeightmapRayCastListener
 {
 public:
   cApplication();
@@ -101,6 +98,9 @@ public:
 
   void Run();
 
+  // Records a profiler trace of the next nFrames frames, only available when built with BUILD_PROFILER
+  void StartProfilerCapture(size_t nFrames);
+
   opengl::cResolution GetResolution() const;
 
 protected:
@@ -112,19 +112,24 @@ protected:
   void RenderScreenRectangleShaderAndTextureAlreadySet();
 
 private:
-  void CreateScene();
+  static const size_t nProfilerCaptureFrames = 300;
+
+  void StartLoading();
+  void LoadHeightmap();
+  void BuildTerrain();
+  void LoadVirtualTexture();
+  void CreateTerrainTextures();
   void CreateNavigationMesh();
   
   void CreateShaders();
   void DestroyShaders();
 
-  void CreateHeightmapTriangles(opengl::cStaticVertexBufferObject& staticVertexBufferObject, const cHeightmapData& data, const spitfire::math::cVec3& scale);
-
   void CreateText();
+  void CreateLoadingText();
   void CreateSquare(opengl::cStaticVertexBufferObject& vbo, size_t nTextureCoordinates);
-  void CreateCube(opengl::cStaticVertexBufferObject& vbo, size_t nTextureCoordinates);
-  void CreateSphere(opengl::cStaticVertexBufferObject& vbo, size_t nTextureCoordinates, float fRadius);
-  void CreateGear(opengl::cStaticVertexBufferObject& vbo);
+  void CreateCube(cInstancedMesh& mesh, size_t nTextureCoordinates);
+  void CreateSphere(cInstancedMesh& mesh, size_t nTextureCoordinates, float fRadius);
+  void CreateGear(cInstancedMesh& mesh);
 
   void CreateScreenRectVariableTextureSizeVBO(opengl::cStaticVertexBufferObject& staticVertexBufferObject, float_t fWidth, float_t fHeight);
   void CreateScreenRectVBO(opengl::cStaticVertexBufferObject& staticVertexBufferObject, float_t fWidth, float_t fHeight);
@@ -138,6 +143,8 @@ private:
   void RenderScreenRectangle(float x, float y, opengl::cStaticVertexBufferObject& vbo, const opengl::cTexture& texture, opengl::cShader& shader);
   void RenderDebugScreenRectangleVariableSize(float x, float y, const opengl::cTexture& texture);
 
+  void RunLoadingScreen();
+  void RenderLoadingFrame();
   void RenderFrame();
 
   void _OnWindowEvent(const opengl::cWindowEvent& event);
@@ -150,17 +157,21 @@ private:
   float CollideRayWithHeightmap(const spitfire::math::cRay3& ray) const;
   void HandleSelectionAndOrders(int mouseX, int mouseY);
 
+  void OnRayCastTestNode(const spitfire::math::cAABB3& aabb) override;
+  void OnRayCastTestLine(const spitfire::math::cLine3& line) override;
+
   void AddRayCastLine(const spitfire::math::cLine3& line);
   void DebugAddRayCastBox(const spitfire::math::cAABB3& aabb);
 
   void DebugAddQuadtreeLines();
   void DebugAddQuadtreeLinesRecursive(const spitfire::math::cQuadtree<spitfire::math::cAABB2>& node);
-  void CreateRayCastLineStaticVertexBuffer();
 
   void AddGreenDebugLine(const spitfire::math::cLine3& line);
   void CreateGreenDebugLinesStaticVertexBuffer();
 
-  void CreateDebugTargetTraceLinesStaticVertexBuffer();
+  void CreateDebugTargetTraceLines();
+
+  void UpdateObjectsFromSimulation();
 
   float fFPS;
 
@@ -174,7 +185,6 @@ private:
   KeyBoolPair freeLookCamera;
 
 
-  bool bIsPhysicsRunning;
   bool bIsWireframe;
 
   bool bIsDone;
@@ -187,29 +197,61 @@ private:
 
   opengl::cContext* pContext;
 
+  // Everything after the window, the font and the shaders is loaded on the worker threads while a loading screen is shown
+  cJobSystem jobSystem;
+  cAssetLoader assetLoader;
+
+  // Set by the heightmap asset for the terrain asset
+  cCacheSource heightmapSource;
+  bool bIsHeightmapFromCache;
+
   cFreeLookCamera camera;
 
 
   opengl::cFont font;
-  opengl::cStaticVertexBufferObject textVBO;
+  cHUDText hudText;
+
+#ifdef BUILD_PROFILER
+  std::vector<profiler::ZoneStatistics> profilerStatistics;
+#endif
+
+  // Geometry that is rebuilt every frame or every tick is written straight into the ring
+  cDynamicVertexBufferRing dynamicVertexBufferRing;
+  cDynamicGeometry textGeometry;
+  cDynamicGeometry rayCastLinesGeometry;
+  cDynamicGeometry debugTargetTraceLinesGeometry;
+  opengl::cGeometryDataPtr pGeometryDataDebugTargetTraceLinesPtr;
 
 
-  opengl::cTexture textureDiffuse;
-  opengl::cTexture textureLightMap;
   opengl::cTexture textureDetail;
 
   opengl::cShader shaderHeightmap;
 
-  opengl::cStaticVertexBufferObject staticVertexBufferObjectHeightmapTriangles;
+  cGeoMipMapTerrain terrain;
+
+  // The diffuse map and lightmap are paged in around the camera
+  cVirtualTextureFile virtualTextureFile;
+  cVirtualTexture virtualTexture;
+  cVirtualTexturedDrawable virtualTexturedTerrain;
+
+  // If the virtual texture can't be created the whole diffuse map and lightmap are used as plain textures instead
+  std::unique_ptr<voodoo::cImage> pImageDiffuse; // Only set between loading and uploading
+  opengl::cTexture textureDiffuse;
+  opengl::cTexture textureLightMap;
+  opengl::cShader shaderHeightmapWholeMap;
 
 
   opengl::cStaticVertexBufferObject navigationMeshVBO;
   
   opengl::cShader shaderColour;
+  opengl::cShader shaderColourInstanced;
 
-  opengl::cStaticVertexBufferObject staticVertexBufferObjectCube0;
-  opengl::cStaticVertexBufferObject staticVertexBufferObjectSphere0;
-  opengl::cStaticVertexBufferObject staticVertexBufferObjectGear0;
+  // Objects are drawn with one instanced draw call per type
+  cInstancedMesh instancedMeshCube0;
+  cInstancedMesh instancedMeshSphere0;
+  cInstancedMesh instancedMeshGear0;
+
+  cRenderQueue renderQueue;
   
 
   opengl::cStaticVertexBufferObject staticVertexBufferObjectGuiRectangle;
@@ -217,17 +259,23 @@ private:
 
   NavigationMesh navigationMesh;
 
-  Scene scene;
-  AISystem ai;
+  cSimulation simulation;
+
+  // The objects for this frame interpolated between the last two simulation ticks
+  spitfire::math::cColour skyColour;
+  const cSceneSnapshot* pSnapshot;
+  uint64_t lastSnapshotTick;
+  std::vector<spitfire::math::cVec3> objectPositions;
+  std::vector<spitfire::math::cQuaternion> objectRotations;
+
+  cBoundingBoxes objectBounds;
+  std::vector<uint32_t> visibleObjects;
 
   opengl::cStaticVertexBufferObject staticVertexBufferDebugNavigationMesh;
   opengl::cStaticVertexBufferObject staticVertexBufferDebugNavigationMeshWayPointLines;
   opengl::cStaticVertexBufferObject staticVertexBufferGreenDebugTraceLines;
-  opengl::cStaticVertexBufferObject staticVertexBufferDebugTargetTraceLines;
 
   ssize_t selectedObject;
-
-  opengl::cStaticVertexBufferObject staticVertexBufferObjectRayCasts;
 };
 
 #endif // MAIN_H
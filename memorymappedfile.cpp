@@ -0,0 +1,129 @@
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <spitfire/util/log.h>
+#include <spitfire/util/string.h>
+
+#include "memorymappedfile.h"
+
+// ** cMemoryMappedFile
+
+cMemoryMappedFile::cMemoryMappedFile() :
+#ifdef _WIN32
+  hFile(INVALID_HANDLE_VALUE),
+  hMapping(NULL),
+#endif
+  pData(nullptr),
+  size(0)
+{
+}
+
+cMemoryMappedFile::~cMemoryMappedFile()
+{
+  Close();
+}
+
+bool cMemoryMappedFile::GetFileStamp(const spitfire::string_t& sFilename, uint64_t& size, uint64_t& lastWriteTime)
+{
+#ifdef _WIN32
+  WIN32_FILE_ATTRIBUTE_DATA attributes;
+  if (!GetFileAttributesEx(sFilename.c_str(), GetFileExInfoStandard, &attributes)) return false;
+
+  size = (uint64_t(attributes.nFileSizeHigh) << 32) | uint64_t(attributes.nFileSizeLow);
+  lastWriteTime = (uint64_t(attributes.ftLastWriteTime.dwHighDateTime) << 32) | uint64_t(attributes.ftLastWriteTime.dwLowDateTime);
+#else
+  struct stat status;
+  if (stat(spitfire::string::ToUTF8(sFilename).c_str(), &status) != 0) return false;
+
+  size = uint64_t(status.st_size);
+  lastWriteTime = (uint64_t(status.st_mtim.tv_sec) * 1000000000ull) + uint64_t(status.st_mtim.tv_nsec);
+#endif
+
+  return true;
+}
+
+bool cMemoryMappedFile::Open(const spitfire::string_t& sFilename)
+{
+  Close();
+
+#ifdef _WIN32
+  hFile = CreateFile(sFilename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+  if (hFile == INVALID_HANDLE_VALUE) {
+    LOG("cMemoryMappedFile::Open Could not open \"", sFilename, "\"");
+    return false;
+  }
+
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(hFile, &fileSize) || (fileSize.QuadPart == 0)) {
+    LOG("cMemoryMappedFile::Open \"", sFilename, "\" is empty");
+    Close();
+    return false;
+  }
+
+  hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (hMapping == NULL) {
+    LOG("cMemoryMappedFile::Open Could not create a mapping for \"", sFilename, "\"");
+    Close();
+    return false;
+  }
+
+  pData = (const uint8_t*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+  if (pData == nullptr) {
+    LOG("cMemoryMappedFile::Open Could not map \"", sFilename, "\"");
+    Close();
+    return false;
+  }
+
+  size = size_t(fileSize.QuadPart);
+#else
+  const int fd = open(spitfire::string::ToUTF8(sFilename).c_str(), O_RDONLY);
+  if (fd == -1) {
+    LOG("cMemoryMappedFile::Open Could not open \"", sFilename, "\"");
+    return false;
+  }
+
+  struct stat status;
+  if ((fstat(fd, &status) != 0) || (status.st_size == 0)) {
+    LOG("cMemoryMappedFile::Open \"", sFilename, "\" is empty");
+    close(fd);
+    return false;
+  }
+
+  // The mapping keeps its own reference to the file so we can close the descriptor straight away
+  void* pMapping = mmap(nullptr, size_t(status.st_size), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (pMapping == MAP_FAILED) {
+    LOG("cMemoryMappedFile::Open Could not map \"", sFilename, "\"");
+    return false;
+  }
+
+  pData = (const uint8_t*)pMapping;
+  size = size_t(status.st_size);
+#endif
+
+  return true;
+}
+
+void cMemoryMappedFile::Close()
+{
+#ifdef _WIN32
+  if (pData != nullptr) UnmapViewOfFile(pData);
+  if (hMapping != NULL) CloseHandle(hMapping);
+  if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
+
+  hMapping = NULL;
+  hFile = INVALID_HANDLE_VALUE;
+#else
+  if (pData != nullptr) munmap((void*)pData, size);
+#endif
+
+  pData = nullptr;
+  size = 0;
+}
@@ -0,0 +1,42 @@
+#ifndef MEMORYMAPPEDFILE_H
+#define MEMORYMAPPEDFILE_H
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+
+// ** cMemoryMappedFile
+//
+// A read only view of a whole file.  Nothing is read when the file is opened, the operating system pages the file in as
+// it is touched and can drop those pages again when memory is low.
+
+class cMemoryMappedFile
+{
+public:
+  cMemoryMappedFile();
+  ~cMemoryMappedFile();
+
+  // The size of a file and when it was last written to without opening it, returns false if the file does not exist
+  static bool GetFileStamp(const spitfire::string_t& sFilename, uint64_t& size, uint64_t& lastWriteTime);
+
+  bool Open(const spitfire::string_t& sFilename);
+  void Close();
+
+  bool IsOpen() const { return (pData != nullptr); }
+
+  const uint8_t* GetData() const { return pData; }
+  size_t GetSize() const { return size; }
+
+private:
+  cMemoryMappedFile(const cMemoryMappedFile&) = delete;
+  cMemoryMappedFile& operator=(const cMemoryMappedFile&) = delete;
+
+#ifdef _WIN32
+  void* hFile;
+  void* hMapping;
+#endif
+
+  const uint8_t* pData;
+  size_t size;
+};
+
+#endif // MEMORYMAPPEDFILE_H
@@ -1,3 +1,9 @@
+#include <cassert>
+
+#include <random>
+
+// Application headers
+#include "heightmap.h"
 #include "navigation.h"
 
 void NavigationMesh::SetNodesAndEdges(const std::vector<spitfire::math::cVec3>& nodePositions, const std::vector<std::pair<size_t, size_t>>& _edges)
@@ -39,3 +45,97 @@ const Node* NavigationMesh::GetClosestNodeToPoint(const spitfire::math::cVec3& p
   return pClosestNode;
 }
 
+void CreateGridNavigationMesh(NavigationMesh& navigationMesh, const cHeightmapData& heightMapData, const spitfire::math::cVec3& heightMapScale, size_t width, size_t height, float fSpacing, uint32_t seed)
+{
+  assert(width >= 2);
+  assert(height >= 2);
+
+  std::vector<spitfire::math::cVec3> nodePositions;
+  std::vector<std::pair<size_t, size_t>> edges;
+
+  const float fOffsetY = 0.5f;
+
+  std::mt19937 generator(seed);
+  std::uniform_real_distribution<float> jitter(-1.0f, 1.0f);
+
+  const float fJitter = 0.4f * fSpacing;
+
+  // Create a grid of node positions and connections
+  const size_t nNodes = width * height;
+  nodePositions.reserve(nNodes);
+  std::vector<float> mapX(nNodes);
+  std::vector<float> mapZ(nNodes);
+  for (size_t z = 0; z < height; z++) {
+    for (size_t x = 0; x < width; x++) {
+      const float fJitteredX = (fSpacing * float(x + 1)) + jitter(generator) * fJitter;
+      const float fJitteredZ = (fSpacing * float(z + 1)) + jitter(generator) * fJitter;
+      mapX[nodePositions.size()] = fJitteredX / heightMapScale.x;
+      mapZ[nodePositions.size()] = fJitteredZ / heightMapScale.z;
+      nodePositions.push_back(spitfire::math::cVec3(fJitteredX, 0.0f, fJitteredZ));
+    }
+  }
+
+  // Sample the heights for every node in one go
+  std::vector<float> heights(nNodes);
+  heightMapData.SampleHeights(&mapX[0], &mapZ[0], &heights[0], nNodes);
+
+  for (size_t i = 0; i < nNodes; i++) nodePositions[i].y = (heightMapScale.y * heights[i]) + fOffsetY;
+
+
+  // Create our edges
+  // Create these edges:
+  // +<--->+
+  // ^
+  // |
+  // v
+  // +
+  for (size_t z = 0; z < height - 1; z++) {
+    for (size_t x = 0; x < width - 1; x++) {
+      const size_t top_left = (z * width) + x;
+      const size_t top_right = (z * width) + x + 1;
+      const size_t bottom_left = ((z + 1) * width) + x;
+
+      // Edges from left to right, right to left
+      edges.push_back(std::make_pair(top_left, top_right));
+      edges.push_back(std::make_pair(top_right, top_left));
+
+      // Edges from top to bottom, bottom to top
+      edges.push_back(std::make_pair(top_left, bottom_left));
+      edges.push_back(std::make_pair(bottom_left, top_left));
+    }
+  }
+
+  // Create the right hand edges:
+  // +
+  // ^
+  // |
+  // v
+  // +
+  for (size_t z = 0; z < height - 1; z++) {
+    const size_t x = width - 1;
+
+    const size_t top_left = (z * width) + x;
+    const size_t bottom_left = ((z + 1) * width) + x;
+
+    // Edges from top to bottom, bottom to top
+    edges.push_back(std::make_pair(top_left, bottom_left));
+    edges.push_back(std::make_pair(bottom_left, top_left));
+  }
+
+  // Create the bottom edges:
+  // +<--->+
+  for (size_t x = 0; x < width - 1; x++) {
+    const size_t z = height - 1;
+
+    const size_t top_left = (z * width) + x;
+    const size_t top_right = (z * width) + x + 1;
+
+    // Edges from left to right, right to left
+    edges.push_back(std::make_pair(top_left, top_right));
+    edges.push_back(std::make_pair(top_right, top_left));
+  }
+
+
+  // Create our navigation mesh
+  navigationMesh.SetNodesAndEdges(nodePositions, edges);
+}
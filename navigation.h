@@ -4,6 +4,8 @@
 #include <spitfire/math/math.h>
 #include <spitfire/math/cVec3.h>
 
+class cHeightmapData;
+
 struct Node;
 
 struct Edge {
@@ -76,4 +78,8 @@ private:
   std::vector<Edge> edges;
 };
 
+// Create a grid of width by height jittered nodes fSpacing apart that sit on the heightmap, each node is connected to its neighbours.
+// The same seed always creates the same navigation mesh.
+void CreateGridNavigationMesh(NavigationMesh& navigationMesh, const cHeightmapData& heightMapData, const spitfire::math::cVec3& heightMapScale, size_t width, size_t height, float fSpacing, uint32_t seed);
+
 #endif // NAVIGATION_H
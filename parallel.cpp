@@ -0,0 +1,156 @@
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Application headers
+#include "parallel.h"
+
+namespace parallel
+{
+  namespace
+  {
+    // ** cThreadPool
+    //
+    // The worker threads that ParallelFor hands its ranges to, they are started the first time ParallelFor needs them and
+    // live until the application exits.  This is separate to the job system because the loading jobs call ParallelFor
+    // themselves, a job that waited for other jobs on the same workers could wait forever.
+
+    class cThreadPool
+    {
+    public:
+      explicit cThreadPool(size_t nWorkerThreads);
+      ~cThreadPool();
+
+      // Runs every range, the calling thread runs the first range and then helps with any ranges that are still waiting
+      void Run(const std::function<void(size_t begin, size_t end)>& function, const std::vector<std::pair<size_t, size_t>>& ranges);
+
+    private:
+      struct Range {
+        const std::function<void(size_t begin, size_t end)>* pFunction;
+        size_t begin;
+        size_t end;
+        size_t* pnRemaining; // The number of ranges of the ParallelFor call that are not done yet
+      };
+
+      void WorkerThreadFunction();
+
+      // Called with the mutex locked, it is unlocked while the range runs
+      void RunRange(std::unique_lock<std::mutex>& lock);
+
+      std::vector<std::thread> threads;
+
+      std::mutex mutex;
+      std::condition_variable rangeAdded;
+      std::condition_variable rangeFinished;
+      std::deque<Range> waitingRanges;
+      bool bStopThreads;
+    };
+
+    cThreadPool::cThreadPool(size_t nWorkerThreads) :
+      bStopThreads(false)
+    {
+      for (size_t i = 0; i < nWorkerThreads; i++) threads.push_back(std::thread(&cThreadPool::WorkerThreadFunction, this));
+    }
+
+    cThreadPool::~cThreadPool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        bStopThreads = true;
+      }
+      rangeAdded.notify_all();
+
+      for (auto& thread : threads) thread.join();
+    }
+
+    void cThreadPool::Run(const std::function<void(size_t begin, size_t end)>& function, const std::vector<std::pair<size_t, size_t>>& ranges)
+    {
+      size_t nRemaining = ranges.size() - 1;
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 1; i < ranges.size(); i++) {
+          Range range;
+          range.pFunction = &function;
+          range.begin = ranges[i].first;
+          range.end = ranges[i].second;
+          range.pnRemaining = &nRemaining;
+          waitingRanges.push_back(range);
+        }
+      }
+      rangeAdded.notify_all();
+
+      function(ranges[0].first, ranges[0].second);
+
+      // Rather than just waiting, run any ranges that no worker has picked up yet, they may belong to another call
+      std::unique_lock<std::mutex> lock(mutex);
+      while (nRemaining != 0) {
+        if (!waitingRanges.empty()) RunRange(lock);
+        else rangeFinished.wait(lock);
+      }
+    }
+
+    void cThreadPool::RunRange(std::unique_lock<std::mutex>& lock)
+    {
+      const Range range = waitingRanges.front();
+      waitingRanges.pop_front();
+
+      lock.unlock();
+      (*range.pFunction)(range.begin, range.end);
+      lock.lock();
+
+      (*range.pnRemaining)--;
+      rangeFinished.notify_all();
+    }
+
+    void cThreadPool::WorkerThreadFunction()
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+
+      while (true) {
+        rangeAdded.wait(lock, [this] { return (bStopThreads || !waitingRanges.empty()); });
+        if (bStopThreads) return;
+
+        RunRange(lock);
+      }
+    }
+  }
+
+  size_t GetThreadCount()
+  {
+    // hardware_concurrency is allowed to return 0 if it does not know
+    return std::max<size_t>(1, std::thread::hardware_concurrency());
+  }
+
+  void ParallelFor(size_t n, const std::function<void(size_t begin, size_t end)>& function)
+  {
+    if (n == 0) return;
+
+    const size_t nRanges = std::min(GetThreadCount(), n);
+    if (nRanges == 1) {
+      function(0, n);
+      return;
+    }
+
+    // Spread the remainder over the first ranges so that no range is more than 1 item longer than another
+    const size_t nPerRange = n / nRanges;
+    const size_t nRemainder = n % nRanges;
+
+    std::vector<std::pair<size_t, size_t>> ranges;
+    ranges.reserve(nRanges);
+
+    size_t begin = 0;
+    for (size_t i = 0; i < nRanges; i++) {
+      const size_t end = begin + nPerRange + ((i < nRemainder) ? 1 : 0);
+      ranges.push_back(std::make_pair(begin, end));
+      begin = end;
+    }
+
+    // The calling thread runs a range too so the pool has one thread less than there are hardware threads
+    static cThreadPool pool(GetThreadCount() - 1);
+    pool.Run(function, ranges);
+  }
+}
@@ -0,0 +1,20 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <functional>
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+
+namespace parallel
+{
+  // The number of threads that ParallelFor spreads work over, at least 1
+  size_t GetThreadCount();
+
+  // Splits [0, n) into one contiguous range per thread and calls function(begin, end) for each range, the calling thread
+  // runs the first range itself and the rest run on a pool of threads that is kept between calls.  Returns once every range
+  // is done, so function may write to anything its range owns.  Safe to call from several threads at once.
+  void ParallelFor(size_t n, const std::function<void(size_t begin, size_t end)>& function);
+}
+
+#endif // PARALLEL_H
@@ -0,0 +1,658 @@
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <vector>
+
+// Spitfire headers
+#include <spitfire/util/log.h>
+
+// Application headers
+#include "memorymappedfile.h"
+#include "pngreader.h"
+
+namespace png
+{
+  namespace
+  {
+    const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+    // Signature, then the IHDR chunk length, type and 13 bytes of data
+    const size_t nHeaderBytes = 8 + 8 + 13;
+
+    // Deflate never refers back further than this into the output
+    const size_t nWindowBytes = 32768;
+
+    // How much output is built up before it is handed on to be put back together into rows
+    const size_t nFlushBytes = 256 * 1024;
+
+    // The longest length and distance pair
+    const size_t nMaxCopyBytes = 258;
+
+    const size_t nMaxCodeBits = 15;
+    const size_t nFastBits = 9;
+
+    const size_t nLengthSymbols = 29;
+    const uint16_t lengthBase[nLengthSymbols] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    const uint8_t lengthExtraBits[nLengthSymbols] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+
+    const size_t nDistanceSymbols = 30;
+    const uint16_t distanceBase[nDistanceSymbols] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    const uint8_t distanceExtraBits[nDistanceSymbols] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+    // The order that the code length code lengths are sent in
+    const uint8_t codeLengthOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+    struct Range {
+      const uint8_t* pData;
+      size_t size;
+    };
+
+    uint32_t ReadBigEndian32(const uint8_t* p)
+    {
+      return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+    }
+
+    size_t GetChannels(COLOUR_TYPE colourType)
+    {
+      switch (colourType) {
+        case COLOUR_TYPE::GREY: return 1;
+        case COLOUR_TYPE::GREY_ALPHA: return 2;
+        case COLOUR_TYPE::RGB: return 3;
+        case COLOUR_TYPE::RGBA: return 4;
+        default: return 0;
+      }
+    }
+
+    bool ParseHeader(const uint8_t* pData, size_t size, Header& header)
+    {
+      if ((size < nHeaderBytes) || (memcmp(pData, signature, sizeof(signature)) != 0)) return false;
+
+      // IHDR is always the first chunk
+      if ((ReadBigEndian32(pData + 8) != 13) || (memcmp(pData + 12, "IHDR", 4) != 0)) return false;
+
+      header.width = ReadBigEndian32(pData + 16);
+      header.height = ReadBigEndian32(pData + 20);
+      header.bitDepth = pData[24];
+      header.colourType = COLOUR_TYPE(pData[25]);
+      header.bIsInterlaced = (pData[28] != 0);
+
+      // Compression and filter method 0 are the only ones there are
+      return (header.width != 0) && (header.height != 0) && (pData[26] == 0) && (pData[27] == 0);
+    }
+
+    // Finds the IDAT chunks which together hold the zlib stream
+    bool FindImageData(const uint8_t* pData, size_t size, std::vector<Range>& chunks)
+    {
+      size_t offset = sizeof(signature);
+      while ((offset + 12) <= size) {
+        const size_t length = ReadBigEndian32(pData + offset);
+        if (length > (size - offset - 12)) return false;
+
+        const uint8_t* pType = pData + offset + 4;
+        if (memcmp(pType, "IDAT", 4) == 0) {
+          const Range range = { pData + offset + 8, length };
+          chunks.push_back(range);
+        } else if (memcmp(pType, "IEND", 4) == 0) break;
+
+        // Length, type, data and CRC
+        offset += 12 + length;
+      }
+
+      return !chunks.empty();
+    }
+
+
+    // ** cBitReader
+    //
+    // Reads the deflate stream least significant bit first, carrying on from one IDAT chunk to the next.  Reading past the
+    // end returns zeros and is reported by IsOverrun.
+
+    class cBitReader
+    {
+    public:
+      explicit cBitReader(const std::vector<Range>& chunks);
+
+      // Up to 32 bits
+      uint32_t PeekBits(size_t n) { Refill(); return uint32_t(bits & ((uint64_t(1) << n) - 1)); }
+      void SkipBits(size_t n) { bits >>= n; nBits -= n; }
+      uint32_t GetBits(size_t n) { const uint32_t value = PeekBits(n); SkipBits(n); return value; }
+
+      void AlignToByte() { SkipBits(nBits % 8); }
+
+      bool IsOverrun() const { return ((8 * nPaddingBytes) > nBits); }
+
+    private:
+      void Refill();
+      uint8_t GetByte();
+
+      const std::vector<Range>& chunks;
+      size_t chunk;
+      const uint8_t* p;
+      const uint8_t* pEnd;
+
+      uint64_t bits;
+      size_t nBits;
+      size_t nPaddingBytes;
+    };
+
+    cBitReader::cBitReader(const std::vector<Range>& _chunks) :
+      chunks(_chunks),
+      chunk(0),
+      p(nullptr),
+      pEnd(nullptr),
+      bits(0),
+      nBits(0),
+      nPaddingBytes(0)
+    {
+      if (!chunks.empty()) {
+        p = chunks[0].pData;
+        pEnd = p + chunks[0].size;
+      }
+    }
+
+    void cBitReader::Refill()
+    {
+      while (nBits <= 56) {
+        bits |= uint64_t(GetByte()) << nBits;
+        nBits += 8;
+      }
+    }
+
+    uint8_t cBitReader::GetByte()
+    {
+      while (p == pEnd) {
+        if ((chunk + 1) >= chunks.size()) {
+          nPaddingBytes++;
+          return 0;
+        }
+
+        chunk++;
+        p = chunks[chunk].pData;
+        pEnd = p + chunks[chunk].size;
+      }
+
+      return *p++;
+    }
+
+
+    // ** cHuffman
+    //
+    // A canonical Huffman code.  Codes up to nFastBits long are decoded with one table lookup, longer codes are decoded a bit
+    // at a time from the number of codes of each length.
+
+    class cHuffman
+    {
+    public:
+      // Returns false if the lengths describe more codes than there are bit patterns for
+      bool Create(const uint8_t* pLengths, size_t n);
+
+      // Returns -1 if the bits are not a code
+      int Decode(cBitReader& reader) const;
+
+    private:
+      uint16_t count[nMaxCodeBits + 1];
+      uint16_t symbols[288];
+      uint16_t fast[1 << nFastBits]; // The code length above the symbol, 0 if the code is longer than nFastBits
+    };
+
+    bool cHuffman::Create(const uint8_t* pLengths, size_t n)
+    {
+      memset(count, 0, sizeof(count));
+      for (size_t i = 0; i < n; i++) count[pLengths[i]]++;
+
+      // Codes that don't use every bit pattern are allowed, a single distance code only uses one of the two 1 bit patterns
+      int left = 1;
+      for (size_t length = 1; length <= nMaxCodeBits; length++) {
+        left = (left << 1) - int(count[length]);
+        if (left < 0) return false;
+      }
+
+      // Sort the symbols by code length, symbols with the same length are already in order
+      uint16_t offsets[nMaxCodeBits + 1];
+      offsets[1] = 0;
+      for (size_t length = 1; length < nMaxCodeBits; length++) offsets[length + 1] = offsets[length] + count[length];
+      for (size_t i = 0; i < n; i++) {
+        if (pLengths[i] != 0) symbols[offsets[pLengths[i]]++] = uint16_t(i);
+      }
+
+      // The codes are sent most significant bit first, so they are reversed to index the table with the bits as we read them
+      memset(fast, 0, sizeof(fast));
+      uint32_t code = 0;
+      size_t index = 0;
+      for (size_t length = 1; length <= nFastBits; length++) {
+        for (size_t i = 0; i < count[length]; i++) {
+          uint32_t reversed = 0;
+          for (size_t bit = 0; bit < length; bit++) reversed |= ((code >> bit) & 1) << (length - 1 - bit);
+
+          const uint16_t entry = uint16_t((length << 12) | symbols[index]);
+          for (uint32_t j = reversed; j < (1u << nFastBits); j += (1u << length)) fast[j] = entry;
+
+          code++;
+          index++;
+        }
+
+        code <<= 1;
+      }
+
+      return true;
+    }
+
+    int cHuffman::Decode(cBitReader& reader) const
+    {
+      const uint16_t entry = fast[reader.PeekBits(nFastBits)];
+      if (entry != 0) {
+        reader.SkipBits(entry >> 12);
+        return (entry & 0xFFF);
+      }
+
+      int code = 0;
+      int first = 0;
+      int index = 0;
+      for (size_t length = 1; length <= nMaxCodeBits; length++) {
+        code |= int(reader.GetBits(1));
+
+        const int n = count[length];
+        if ((code - n) < first) return symbols[index + (code - first)];
+
+        index += n;
+        first = (first + n) << 1;
+        code <<= 1;
+      }
+
+      return -1;
+    }
+
+
+    // ** cInflater
+    //
+    // Inflates a zlib stream.  The output is built up in a buffer and handed on every nFlushBytes, only the last
+    // nWindowBytes are kept after that for later blocks to copy from.
+
+    class cInflater
+    {
+    public:
+      cInflater(const std::vector<Range>& chunks, const std::function<bool(const uint8_t* pData, size_t size)>& output);
+
+      bool Inflate();
+
+    private:
+      bool InflateStored();
+      bool InflateCodes(const cHuffman& lengths, const cHuffman& distances);
+      bool ReadDynamicCodes(cHuffman& lengths, cHuffman& distances);
+
+      bool Flush(bool bIsFinal);
+
+      cBitReader reader;
+      const std::function<bool(const uint8_t* pData, size_t size)>& output;
+
+      std::vector<uint8_t> buffer;
+      size_t nBuffered;
+      size_t nHandedOn; // The start of the buffer that has already been handed on, kept so that it can be copied from
+
+      // Adler-32 of everything that has been handed on
+      uint32_t adlerA;
+      uint32_t adlerB;
+
+      cHuffman fixedLengths;
+      cHuffman fixedDistances;
+      cHuffman dynamicLengths;
+      cHuffman dynamicDistances;
+    };
+
+    cInflater::cInflater(const std::vector<Range>& chunks, const std::function<bool(const uint8_t* pData, size_t size)>& _output) :
+      reader(chunks),
+      output(_output),
+      buffer(nWindowBytes + nFlushBytes + nMaxCopyBytes),
+      nBuffered(0),
+      nHandedOn(0),
+      adlerA(1),
+      adlerB(0)
+    {
+      uint8_t lengths[288];
+      std::fill(lengths, lengths + 144, 8);
+      std::fill(lengths + 144, lengths + 256, 9);
+      std::fill(lengths + 256, lengths + 280, 7);
+      std::fill(lengths + 280, lengths + 288, 8);
+      fixedLengths.Create(lengths, 288);
+
+      std::fill(lengths, lengths + nDistanceSymbols, 5);
+      fixedDistances.Create(lengths, nDistanceSymbols);
+    }
+
+    bool cInflater::Inflate()
+    {
+      // Deflate with no preset dictionary
+      const uint32_t method = reader.GetBits(8);
+      const uint32_t flags = reader.GetBits(8);
+      if (((method & 0x0F) != 8) || ((((method << 8) | flags) % 31) != 0) || ((flags & 0x20) != 0)) return false;
+
+      bool bIsFinal = false;
+      while (!bIsFinal) {
+        bIsFinal = (reader.GetBits(1) != 0);
+
+        bool bResult = false;
+        switch (reader.GetBits(2)) {
+          case 0: {
+            bResult = InflateStored();
+            break;
+          }
+          case 1: {
+            bResult = InflateCodes(fixedLengths, fixedDistances);
+            break;
+          }
+          case 2: {
+            bResult = (ReadDynamicCodes(dynamicLengths, dynamicDistances) && InflateCodes(dynamicLengths, dynamicDistances));
+            break;
+          }
+        }
+
+        if (!bResult || reader.IsOverrun()) return false;
+      }
+
+      if (!Flush(true)) return false;
+
+      reader.AlignToByte();
+      uint32_t adler = 0;
+      for (size_t i = 0; i < 4; i++) adler = (adler << 8) | reader.GetBits(8);
+
+      return !reader.IsOverrun() && (adler == ((adlerB << 16) | adlerA));
+    }
+
+    bool cInflater::InflateStored()
+    {
+      reader.AlignToByte();
+
+      const uint32_t length = reader.GetBits(16);
+      const uint32_t inverse = reader.GetBits(16);
+      if ((length ^ 0xFFFF) != inverse) return false;
+
+      for (size_t i = 0; i < length; i++) {
+        buffer[nBuffered++] = uint8_t(reader.GetBits(8));
+        if ((nBuffered >= (nWindowBytes + nFlushBytes)) && !Flush(false)) return false;
+      }
+
+      return true;
+    }
+
+    bool cInflater::InflateCodes(const cHuffman& lengths, const cHuffman& distances)
+    {
+      while (true) {
+        const int symbol = lengths.Decode(reader);
+        if (symbol < 0) return false;
+
+        if (symbol < 256) buffer[nBuffered++] = uint8_t(symbol);
+        else if (symbol == 256) return true;
+        else {
+          const size_t lengthSymbol = size_t(symbol - 257);
+          if (lengthSymbol >= nLengthSymbols) return false;
+          const size_t length = lengthBase[lengthSymbol] + reader.GetBits(lengthExtraBits[lengthSymbol]);
+
+          const int distanceSymbol = distances.Decode(reader);
+          if ((distanceSymbol < 0) || (size_t(distanceSymbol) >= nDistanceSymbols)) return false;
+          const size_t distance = distanceBase[distanceSymbol] + reader.GetBits(distanceExtraBits[distanceSymbol]);
+          if (distance > nBuffered) return false;
+
+          // The source and destination can overlap, that is how runs are repeated, so this has to go a byte at a time
+          uint8_t* pDestination = &buffer[nBuffered];
+          const uint8_t* pSource = pDestination - distance;
+          for (size_t i = 0; i < length; i++) pDestination[i] = pSource[i];
+          nBuffered += length;
+        }
+
+        if (nBuffered >= (nWindowBytes + nFlushBytes)) {
+          if (!Flush(false)) return false;
+        }
+
+        // A corrupt stream could otherwise keep decoding the zeros past the end
+        if (reader.IsOverrun()) return false;
+      }
+    }
+
+    bool cInflater::ReadDynamicCodes(cHuffman& lengths, cHuffman& distances)
+    {
+      const size_t nLengthCodes = 257 + reader.GetBits(5);
+      const size_t nDistanceCodes = 1 + reader.GetBits(5);
+      const size_t nCodeLengthCodes = 4 + reader.GetBits(4);
+      if ((nLengthCodes > 286) || (nDistanceCodes > nDistanceSymbols)) return false;
+
+      uint8_t codeLengths[19] = { 0 };
+      for (size_t i = 0; i < nCodeLengthCodes; i++) codeLengths[codeLengthOrder[i]] = uint8_t(reader.GetBits(3));
+
+      cHuffman codeLengthCodes;
+      if (!codeLengthCodes.Create(codeLengths, 19)) return false;
+
+      // The code lengths for both codes are sent together and runs can carry on from one to the other
+      uint8_t codeLengthsForBoth[286 + nDistanceSymbols] = { 0 };
+      const size_t n = nLengthCodes + nDistanceCodes;
+      size_t i = 0;
+      while (i < n) {
+        const int symbol = codeLengthCodes.Decode(reader);
+        if (symbol < 0) return false;
+
+        if (symbol < 16) {
+          codeLengthsForBoth[i++] = uint8_t(symbol);
+          continue;
+        }
+
+        uint8_t value = 0;
+        size_t repeat = 0;
+        if (symbol == 16) {
+          if (i == 0) return false;
+          value = codeLengthsForBoth[i - 1];
+          repeat = 3 + reader.GetBits(2);
+        } else if (symbol == 17) repeat = 3 + reader.GetBits(3);
+        else repeat = 11 + reader.GetBits(7);
+
+        if ((i + repeat) > n) return false;
+        for (size_t j = 0; j < repeat; j++) codeLengthsForBoth[i++] = value;
+      }
+
+      // There has to be a code for the end of the block
+      if (codeLengthsForBoth[256] == 0) return false;
+
+      return (lengths.Create(codeLengthsForBoth, nLengthCodes) && distances.Create(codeLengthsForBoth + nLengthCodes, nDistanceCodes));
+    }
+
+    bool cInflater::Flush(bool bIsFinal)
+    {
+      const uint8_t* pData = &buffer[nHandedOn];
+      const size_t size = nBuffered - nHandedOn;
+
+      // The sums are reduced before they can overflow
+      for (size_t offset = 0; offset < size; offset += 5552) {
+        const size_t end = std::min(size, offset + 5552);
+        for (size_t i = offset; i < end; i++) {
+          adlerA += pData[i];
+          adlerB += adlerA;
+        }
+        adlerA %= 65521;
+        adlerB %= 65521;
+      }
+
+      if ((size != 0) && !output(pData, size)) return false;
+
+      if (!bIsFinal) {
+        // Keep the window for later blocks to copy from
+        memmove(&buffer[0], &buffer[nBuffered - nWindowBytes], nWindowBytes);
+        nBuffered = nWindowBytes;
+      }
+
+      nHandedOn = nBuffered;
+
+      return true;
+    }
+
+
+    // ** cRowReader
+    //
+    // Puts the inflated bytes back together into rows and undoes the filter on each row.  Samples are big endian.
+
+    class cRowReader
+    {
+    public:
+      cRowReader(const Header& header, const std::function<void(size_t y, const uint16_t* pRow)>& function);
+
+      bool Add(const uint8_t* pData, size_t size);
+
+      bool IsComplete() const { return (y == height); }
+
+    private:
+      bool FinishRow();
+
+      const std::function<void(size_t y, const uint16_t* pRow)>& function;
+
+      size_t width;
+      size_t height;
+      size_t bytesPerPixel;
+
+      // The filter type and then the row
+      std::vector<uint8_t> row;
+      std::vector<uint8_t> previousRow;
+      size_t nRowBytes;
+
+      std::vector<uint16_t> samples;
+      size_t y;
+    };
+
+    cRowReader::cRowReader(const Header& header, const std::function<void(size_t y, const uint16_t* pRow)>& _function) :
+      function(_function),
+      width(header.width),
+      height(header.height),
+      bytesPerPixel(2 * GetChannels(header.colourType)),
+      nRowBytes(0),
+      y(0)
+    {
+      // The row above the first row is all zeros
+      row.resize(1 + (width * bytesPerPixel), 0);
+      previousRow.resize(row.size(), 0);
+      samples.resize(width);
+    }
+
+    bool cRowReader::Add(const uint8_t* pData, size_t size)
+    {
+      while (size != 0) {
+        if (y == height) return false;
+
+        const size_t n = std::min(size, row.size() - nRowBytes);
+        memcpy(&row[nRowBytes], pData, n);
+        nRowBytes += n;
+        pData += n;
+        size -= n;
+
+        if (nRowBytes == row.size()) {
+          if (!FinishRow()) return false;
+          nRowBytes = 0;
+        }
+      }
+
+      return true;
+    }
+
+    bool cRowReader::FinishRow()
+    {
+      const size_t n = row.size() - 1;
+      const size_t bpp = bytesPerPixel;
+      uint8_t* p = &row[1];
+      const uint8_t* pAbove = &previousRow[1];
+
+      switch (row[0]) {
+        case 0: {
+          break;
+        }
+        case 1: {
+          for (size_t i = bpp; i < n; i++) p[i] += p[i - bpp];
+          break;
+        }
+        case 2: {
+          for (size_t i = 0; i < n; i++) p[i] += pAbove[i];
+          break;
+        }
+        case 3: {
+          for (size_t i = 0; i < bpp; i++) p[i] += pAbove[i] / 2;
+          for (size_t i = bpp; i < n; i++) p[i] += uint8_t((int(p[i - bpp]) + int(pAbove[i])) / 2);
+          break;
+        }
+        case 4: {
+          // Paeth, on the left edge the left and above left are 0 so it always picks the byte above
+          for (size_t i = 0; i < bpp; i++) p[i] += pAbove[i];
+          for (size_t i = bpp; i < n; i++) {
+            const int a = p[i - bpp];
+            const int b = pAbove[i];
+            const int c = pAbove[i - bpp];
+            const int estimate = a + b - c;
+            const int distanceA = abs(estimate - a);
+            const int distanceB = abs(estimate - b);
+            const int distanceC = abs(estimate - c);
+            if ((distanceA <= distanceB) && (distanceA <= distanceC)) p[i] += uint8_t(a);
+            else if (distanceB <= distanceC) p[i] += uint8_t(b);
+            else p[i] += uint8_t(c);
+          }
+          break;
+        }
+        default: {
+          return false;
+        }
+      }
+
+      // PNG samples are big endian, we only want the first channel
+      for (size_t x = 0; x < width; x++) samples[x] = uint16_t((uint16_t(p[x * bpp]) << 8) | p[(x * bpp) + 1]);
+
+      function(y, &samples[0]);
+      y++;
+
+      row.swap(previousRow);
+
+      return true;
+    }
+  }
+
+  bool ReadHeader(const spitfire::string_t& sFilename, Header& header)
+  {
+    // Only the first page of the file is touched
+    cMemoryMappedFile file;
+    return (file.Open(sFilename) && ParseHeader(file.GetData(), file.GetSize(), header));
+  }
+
+  bool Read16BitRows(const spitfire::string_t& sFilename, const std::function<void(size_t y, const uint16_t* pRow)>& function)
+  {
+    cMemoryMappedFile file;
+    if (!file.Open(sFilename)) {
+      LOGERROR("png::Read16BitRows Could not open \"", sFilename, "\"");
+      return false;
+    }
+
+    Header header;
+    if (!ParseHeader(file.GetData(), file.GetSize(), header)) {
+      LOGERROR("png::Read16BitRows \"", sFilename, "\" is not a PNG");
+      return false;
+    }
+
+    if ((header.bitDepth != 16) || (GetChannels(header.colourType) == 0)) {
+      LOGERROR("png::Read16BitRows \"", sFilename, "\" is not a 16 bit grey, grey and alpha, RGB or RGBA image");
+      return false;
+    }
+
+    if (header.bIsInterlaced) {
+      LOGERROR("png::Read16BitRows \"", sFilename, "\" is interlaced which is not supported, save it without interlacing");
+      return false;
+    }
+
+    std::vector<Range> chunks;
+    if (!FindImageData(file.GetData(), file.GetSize(), chunks)) {
+      LOGERROR("png::Read16BitRows \"", sFilename, "\" has no image data or is truncated");
+      return false;
+    }
+
+    cRowReader rows(header, function);
+    const std::function<bool(const uint8_t* pData, size_t size)> output = [&rows](const uint8_t* pData, size_t size) { return rows.Add(pData, size); };
+
+    cInflater inflater(chunks, output);
+    if (!inflater.Inflate() || !rows.IsComplete()) {
+      LOGERROR("png::Read16BitRows \"", sFilename, "\" is corrupt");
+      return false;
+    }
+
+    return true;
+  }
+}
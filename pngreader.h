@@ -0,0 +1,38 @@
+#ifndef PNGREADER_H
+#define PNGREADER_H
+
+#include <functional>
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+
+// Decodes 16 bit PNGs at full precision, the image loader reduces every image to 8 bits per channel.  The file is memory
+// mapped and inflated a little at a time so only the last 32 KB of output and two rows are held in memory.
+
+namespace png
+{
+  enum class COLOUR_TYPE {
+    GREY = 0,
+    RGB = 2,
+    PALETTE = 3,
+    GREY_ALPHA = 4,
+    RGBA = 6
+  };
+
+  struct Header {
+    size_t width;
+    size_t height;
+    uint8_t bitDepth;
+    COLOUR_TYPE colourType;
+    bool bIsInterlaced;
+  };
+
+  // Reads the header without decoding anything, returns false if the file is not a PNG
+  bool ReadHeader(const spitfire::string_t& sFilename, Header& header);
+
+  // Decodes a 16 bit grey, grey and alpha, RGB or RGBA PNG that is not interlaced.  The function is called with the first
+  // channel of each row in order from the top, returns false if the image is a different format or is corrupt.
+  bool Read16BitRows(const spitfire::string_t& sFilename, const std::function<void(size_t y, const uint16_t* pRow)>& function);
+}
+
+#endif // PNGREADER_H
@@ -0,0 +1,378 @@
+#ifdef BUILD_PROFILER
+
+#include <cassert>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+
+// Spitfire headers
+#include <spitfire/util/log.h>
+
+// Application headers
+#include "profiler.h"
+
+namespace profiler
+{
+  namespace
+  {
+    enum class EVENT_TYPE : uint8_t {
+      ZONE,
+      COUNTER,
+    };
+
+    struct Event {
+      EVENT_TYPE type;
+      const char* szName;
+      uint32_t depth;
+      uint64_t startNS;
+      uint64_t endNS;
+      uint64_t value; // Only used by counters
+    };
+
+
+    // ** cThreadBuffer
+    //
+    // A single producer, single consumer ring buffer.  The owning thread never waits, if the main thread does not drain
+    // the buffer in time then the oldest events are overwritten and counted as dropped when the main thread catches up.
+
+    class cThreadBuffer
+    {
+    public:
+      explicit cThreadBuffer(const std::string& sName);
+
+      // Called by the owning thread
+      void Push(const Event& event);
+
+      // Called by the main thread
+      template <class F>
+      void Drain(F function);
+
+      std::string sName; // Protected by mutexThreads
+      uint32_t depth;    // Only touched by the owning thread
+      size_t nDropped;   // Only touched by the main thread
+
+    private:
+      static const size_t nCapacity = 8192;
+      static const size_t nMask = nCapacity - 1;
+      static_assert((nCapacity & nMask) == 0, "nCapacity must be a power of two");
+
+      Event events[nCapacity];
+      std::atomic<uint64_t> writeIndex;
+      uint64_t readIndex;
+    };
+
+    cThreadBuffer::cThreadBuffer(const std::string& _sName) :
+      sName(_sName),
+      depth(0),
+      nDropped(0),
+      writeIndex(0),
+      readIndex(0)
+    {
+    }
+
+    void cThreadBuffer::Push(const Event& event)
+    {
+      const uint64_t index = writeIndex.load(std::memory_order_relaxed);
+      events[index & nMask] = event;
+      writeIndex.store(index + 1, std::memory_order_release);
+    }
+
+    template <class F>
+    void cThreadBuffer::Drain(F function)
+    {
+      const uint64_t end = writeIndex.load(std::memory_order_acquire);
+
+      // Skip anything that has already been overwritten
+      if ((end - readIndex) > nCapacity) {
+        nDropped += size_t(end - readIndex - nCapacity);
+        readIndex = end - nCapacity;
+      }
+
+      for (; readIndex != end; readIndex++) {
+        const Event event = events[readIndex & nMask];
+
+        // The owning thread may have wrapped around and overwritten this event while we were copying it
+        if ((writeIndex.load(std::memory_order_acquire) - readIndex) > nCapacity) {
+          nDropped++;
+          continue;
+        }
+
+        function(event);
+      }
+    }
+
+
+    std::mutex mutexThreads;
+    std::vector<std::unique_ptr<cThreadBuffer>> threads;
+
+    thread_local cThreadBuffer* pThreadBuffer = nullptr;
+
+    cThreadBuffer& GetThreadBuffer()
+    {
+      if (pThreadBuffer == nullptr) {
+        std::lock_guard<std::mutex> lock(mutexThreads);
+        threads.push_back(std::unique_ptr<cThreadBuffer>(new cThreadBuffer("Thread " + std::to_string(threads.size()))));
+        pThreadBuffer = threads.back().get();
+      }
+
+      return *pThreadBuffer;
+    }
+
+
+    // Per frame history, only touched by the main thread
+    const size_t nHistoryFrames = 128;
+
+    struct Zone {
+      size_t thread;
+      const char* szName;
+      uint32_t depth;
+      uint64_t firstStartNS; // Used to sort children after their parents
+      uint64_t frameNS;
+      float historyMS[nHistoryFrames];
+    };
+
+    std::vector<Zone> zones;
+    std::map<std::tuple<size_t, const char*, uint32_t>, size_t> zoneIndices;
+    size_t historyIndex = 0;
+    size_t nHistoryFramesFilled = 0;
+
+    void AddEventToZone(size_t thread, const Event& event)
+    {
+      if (event.type != EVENT_TYPE::ZONE) return;
+
+      const std::tuple<size_t, const char*, uint32_t> key(thread, event.szName, event.depth);
+      auto iter = zoneIndices.find(key);
+      if (iter == zoneIndices.end()) {
+        Zone zone;
+        zone.thread = thread;
+        zone.szName = event.szName;
+        zone.depth = event.depth;
+        zone.firstStartNS = event.startNS;
+        zone.frameNS = 0;
+        std::fill(zone.historyMS, zone.historyMS + nHistoryFrames, 0.0f);
+        zones.push_back(zone);
+
+        iter = zoneIndices.insert(std::make_pair(key, zones.size() - 1)).first;
+      }
+
+      zones[iter->second].frameNS += event.endNS - event.startNS;
+    }
+
+
+    // Capture state, only touched by the main thread
+    struct CapturedEvent {
+      size_t thread;
+      Event event;
+    };
+
+    size_t nCaptureFramesRemaining = 0;
+    std::string sCaptureFilePath;
+    uint64_t captureStartNS = 0;
+    std::vector<CapturedEvent> capturedEvents;
+
+    void WriteJSONString(std::ostream& o, const std::string& sText)
+    {
+      o<<"\"";
+      for (auto c : sText) {
+        if ((c == '"') || (c == '\\')) o<<'\\';
+        o<<c;
+      }
+      o<<"\"";
+    }
+
+    // Timestamps in the Chrome trace event format are in microseconds
+    double GetCaptureTimeUS(uint64_t timeNS)
+    {
+      return double(timeNS - captureStartNS) / 1000.0;
+    }
+
+    // Called with mutexThreads locked
+    bool WriteCapture()
+    {
+      std::ofstream file(sCaptureFilePath.c_str());
+      if (!file.good()) return false;
+
+      file.setf(std::ios::fixed);
+      file.precision(3);
+
+      file<<"{\"displayTimeUnit\":\"ms\",\"traceEvents\":["<<std::endl;
+
+      const size_t nThreads = threads.size();
+      for (size_t i = 0; i < nThreads; i++) {
+        file<<"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"<<i<<",\"args\":{\"name\":";
+        WriteJSONString(file, threads[i]->sName);
+        file<<"}},"<<std::endl;
+      }
+
+      for (auto& captured : capturedEvents) {
+        const Event& event = captured.event;
+
+        file<<"{\"name\":";
+        WriteJSONString(file, event.szName);
+        file<<",\"pid\":1,\"tid\":"<<captured.thread<<",\"ts\":"<<GetCaptureTimeUS(event.startNS);
+        if (event.type == EVENT_TYPE::ZONE) file<<",\"ph\":\"X\",\"dur\":"<<(double(event.endNS - event.startNS) / 1000.0)<<"},"<<std::endl;
+        else file<<",\"ph\":\"C\",\"args\":{\"value\":"<<event.value<<"}},"<<std::endl;
+      }
+
+      // The format does not allow a trailing comma so finish with the process name
+      file<<"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"rebellion\"}}"<<std::endl;
+      file<<"]}"<<std::endl;
+
+      return file.good();
+    }
+  }
+
+  uint64_t GetTimeNS()
+  {
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+  }
+
+  void SetThreadName(const char* szName)
+  {
+    cThreadBuffer& buffer = GetThreadBuffer();
+
+    std::lock_guard<std::mutex> lock(mutexThreads);
+    buffer.sName = szName;
+  }
+
+  void EndFrame()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutexThreads);
+
+      const size_t n = threads.size();
+      for (size_t i = 0; i < n; i++) {
+        threads[i]->Drain([i](const Event& event) {
+          AddEventToZone(i, event);
+
+          if ((nCaptureFramesRemaining != 0) && (event.startNS >= captureStartNS)) {
+            CapturedEvent captured;
+            captured.thread = i;
+            captured.event = event;
+            capturedEvents.push_back(captured);
+          }
+        });
+      }
+
+      if (nCaptureFramesRemaining != 0) {
+        nCaptureFramesRemaining--;
+        if (nCaptureFramesRemaining == 0) {
+          if (WriteCapture()) LOG("Profiler trace of ", capturedEvents.size(), " events written to \"", sCaptureFilePath, "\"");
+          else LOGERROR("Could not write profiler trace to \"", sCaptureFilePath, "\"");
+
+          capturedEvents.clear();
+          capturedEvents.shrink_to_fit();
+        }
+      }
+    }
+
+    for (auto& zone : zones) {
+      zone.historyMS[historyIndex] = float(double(zone.frameNS) / 1000000.0);
+      zone.frameNS = 0;
+    }
+
+    historyIndex = (historyIndex + 1) % nHistoryFrames;
+    nHistoryFramesFilled = std::min(nHistoryFramesFilled + 1, nHistoryFrames);
+  }
+
+  void GetZoneStatistics(std::vector<ZoneStatistics>& statistics)
+  {
+    statistics.clear();
+
+    if (nHistoryFramesFilled == 0) return;
+
+    std::vector<const Zone*> sorted;
+    for (auto& zone : zones) sorted.push_back(&zone);
+    std::sort(sorted.begin(), sorted.end(), [](const Zone* a, const Zone* b) {
+      return (a->thread != b->thread) ? (a->thread < b->thread) : (a->firstStartNS < b->firstStartNS);
+    });
+
+    std::lock_guard<std::mutex> lock(mutexThreads);
+
+    std::vector<float> frames(nHistoryFramesFilled);
+    const size_t p99 = ((nHistoryFramesFilled - 1) * 99) / 100;
+
+    for (auto pZone : sorted) {
+      // The history is filled from the start so the first nHistoryFramesFilled entries are valid
+      std::copy(pZone->historyMS, pZone->historyMS + nHistoryFramesFilled, frames.begin());
+
+      float fTotalMS = 0.0f;
+      for (auto fMS : frames) fTotalMS += fMS;
+
+      std::nth_element(frames.begin(), frames.begin() + p99, frames.end());
+
+      ZoneStatistics zoneStatistics;
+      zoneStatistics.sThreadName = threads[pZone->thread]->sName;
+      zoneStatistics.szName = pZone->szName;
+      zoneStatistics.depth = pZone->depth;
+      zoneStatistics.fAverageMS = fTotalMS / float(nHistoryFramesFilled);
+      zoneStatistics.fP99MS = frames[p99];
+      statistics.push_back(zoneStatistics);
+    }
+  }
+
+
+  void RecordCounter(const char* szName, uint64_t value)
+  {
+    cThreadBuffer& buffer = GetThreadBuffer();
+
+    Event event;
+    event.type = EVENT_TYPE::COUNTER;
+    event.szName = szName;
+    event.depth = buffer.depth;
+    event.startNS = GetTimeNS();
+    event.endNS = event.startNS;
+    event.value = value;
+    buffer.Push(event);
+  }
+
+  void StartCapture(size_t nFrames, const std::string& sFilePath)
+  {
+    assert(nFrames != 0);
+
+    nCaptureFramesRemaining = nFrames;
+    sCaptureFilePath = sFilePath;
+    captureStartNS = GetTimeNS();
+    capturedEvents.clear();
+  }
+
+  bool IsCapturing()
+  {
+    return (nCaptureFramesRemaining != 0);
+  }
+
+
+  // ** cScopedZone
+
+  cScopedZone::cScopedZone(const char* _szName) :
+    szName(_szName),
+    startNS(GetTimeNS())
+  {
+    GetThreadBuffer().depth++;
+  }
+
+  cScopedZone::~cScopedZone()
+  {
+    cThreadBuffer& buffer = GetThreadBuffer();
+
+    assert(buffer.depth != 0);
+    buffer.depth--;
+
+    Event event;
+    event.type = EVENT_TYPE::ZONE;
+    event.szName = szName;
+    event.depth = buffer.depth;
+    event.startNS = startNS;
+    event.endNS = GetTimeNS();
+    event.value = 0;
+    buffer.Push(event);
+  }
+}
+
+#endif // BUILD_PROFILER
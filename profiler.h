@@ -0,0 +1,84 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+// A hierarchical frame profiler
+//
+// Code is instrumented with PROFILE_ZONE("Name") which times the rest of the enclosing scope.  Each thread records its
+// zones into its own lock free ring buffer, the main thread drains every buffer once a frame in profiler::EndFrame and
+// keeps a history of the time spent in each zone per frame for the on screen breakdown.
+//
+// profiler::StartCapture records every zone and counter for a number of frames and writes them out in the Chrome trace
+// event format, the file can be opened in chrome://tracing or https://ui.perfetto.dev to find where a hitch started.
+//
+// The profiler is only built when BUILD_PROFILER is defined, otherwise the macros compile to nothing.
+//
+// Zone names must be string literals, they are stored and compared by pointer.
+
+#ifdef BUILD_PROFILER
+
+#include <cstdint>
+
+#include <string>
+#include <vector>
+
+namespace profiler
+{
+  uint64_t GetTimeNS();
+
+  // Names the calling thread in the breakdown
+  void SetThreadName(const char* szName);
+
+  // Called by the main thread once at the end of each frame
+  void EndFrame();
+
+  struct ZoneStatistics {
+    std::string sThreadName;
+    const char* szName;
+    size_t depth;
+    float fAverageMS; // Rolling average of the time spent in this zone per frame
+    float fP99MS;     // 99th percentile of the time spent in this zone per frame
+  };
+
+  // Zones are returned in the order they were first seen, grouped by thread, so that children follow their parents
+  void GetZoneStatistics(std::vector<ZoneStatistics>& statistics);
+
+  // Records a value at the current time, counters only appear in captured traces
+  void RecordCounter(const char* szName, uint64_t value);
+
+  // Called by the main thread, the trace is written when the last frame ends
+  void StartCapture(size_t nFrames, const std::string& sFilePath);
+  bool IsCapturing();
+
+
+  // ** cScopedZone
+
+  class cScopedZone
+  {
+  public:
+    explicit cScopedZone(const char* szName);
+    ~cScopedZone();
+
+  private:
+    const char* szName;
+    uint64_t startNS;
+  };
+}
+
+#define PROFILE_CONCATENATE_INNER(a, b) a##b
+#define PROFILE_CONCATENATE(a, b) PROFILE_CONCATENATE_INNER(a, b)
+
+#define PROFILE_ZONE(szName) profiler::cScopedZone PROFILE_CONCATENATE(profilerZone, __LINE__)(szName)
+#define PROFILE_THREAD_NAME(szName) profiler::SetThreadName(szName)
+#define PROFILE_COUNTER(szName, value) profiler::RecordCounter(szName, uint64_t(value))
+#define PROFILE_END_FRAME() profiler::EndFrame()
+
+#else
+
+#define PROFILE_ZONE(szName)
+#define PROFILE_THREAD_NAME(szName)
+#define PROFILE_COUNTER(szName, value)
+#define PROFILE_END_FRAME()
+
+#endif // BUILD_PROFILER
+
+#endif // PROFILER_H
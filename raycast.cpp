@@ -0,0 +1,128 @@
+#include <cassert>
+
+#include <algorithm>
+#include <vector>
+
+// Spitfire headers
+#include <spitfire/math/math.h>
+#include <spitfire/math/cVec2.h>
+
+// Application headers
+#include "heightmap.h"
+#include "raycast.h"
+
+std::unique_ptr<spitfire::math::cQuadtree<spitfire::math::cAABB2>> BuildHeightmapQuadtree(const cHeightmapData& heightMapData, const spitfire::math::cVec3& heightMapScale)
+{
+  const spitfire::math::cVec2 halfDimension = 0.5f * heightMapScale.GetXZ() * spitfire::math::cVec2(heightMapData.GetWidth(), heightMapData.GetDepth());
+  const spitfire::math::cVec2 origin = halfDimension;
+  std::unique_ptr<spitfire::math::cQuadtree<spitfire::math::cAABB2>> quadtree(new spitfire::math::cQuadtree<spitfire::math::cAABB2>(origin, halfDimension));
+
+  const size_t width = heightMapData.GetWidth();
+  const size_t depth = heightMapData.GetDepth();
+  const size_t skip = 2;
+  for (size_t z = 0; z < depth; z += skip) {
+    for (size_t x = 0; x < width; x += skip) {
+      spitfire::math::cAABB2* aabb = new spitfire::math::cAABB2;
+      const spitfire::math::cVec2 point0 = heightMapScale.GetXZ() * spitfire::math::cVec2(float(x), float(z));
+      const spitfire::math::cVec2 point1 = heightMapScale.GetXZ() * spitfire::math::cVec2(float(x + skip), float(z + skip));
+      aabb->SetExtents(point0, point1);
+      quadtree->insert(aabb);
+    }
+  }
+
+  return quadtree;
+}
+
+float CollideRayWithHeightmap(const cHeightmapData& heightMapData, const spitfire::math::cVec3& heightMapScale, const spitfire::math::cQuadtree<spitfire::math::cAABB2>& quadtree, const spitfire::math::cRay3& _ray, cHeightmapRayCastListener* pListener)
+{
+  spitfire::math::cRay2 ray;
+  ray.SetOriginAndDirection(_ray.GetOrigin().GetXZ(), _ray.GetDirection().GetXZ());
+
+  std::vector<const spitfire::math::cQuadtree<spitfire::math::cAABB2>*> nodes;
+  quadtree.CollideRay(ray, nodes);
+
+  // Sort the nodes based on how far they are from the start of the ray
+  std::sort(nodes.begin(), nodes.end(), [ray](const spitfire::math::cQuadtree<spitfire::math::cAABB2>* a, const spitfire::math::cQuadtree<spitfire::math::cAABB2>* b) {
+    return spitfire::math::cVec2(ray.GetOrigin() - b->GetOrigin()).GetSquaredLength() > spitfire::math::cVec2(ray.GetOrigin() - a->GetOrigin()).GetSquaredLength();
+  });
+
+  const float fGridSize = 1.0f;
+
+  size_t i = 0;
+
+  for (auto pNode : nodes) {
+
+    const spitfire::math::cAABB2* data = pNode->GetData();
+    assert(data != nullptr);
+
+    const spitfire::math::cVec2 nodeMin = data->GetMin();
+    const spitfire::math::cVec2 nodeMax = data->GetMax();
+
+    spitfire::math::cAABB3 aabb3D;
+    aabb3D.SetExtents(spitfire::math::cVec3(nodeMin.x, 0.0f, nodeMin.y), spitfire::math::cVec3(nodeMax.x, 10.0f, nodeMax.y));
+
+    //std::cout << "Colliding with node " << i << std::endl;
+    const float fHalfGridSize = 0.5f * fGridSize;
+
+    spitfire::math::cVec3 point(_ray.GetOrigin() + (spitfire::math::cEPSILON * _ray.GetDirection()));
+
+    // If the origin of the ray is not already already within this node then find a point on the closest face and iterate from there
+    if (!point.IsWithinBounds(aabb3D.GetMin(), aabb3D.GetMax())) {
+      float fDepth = -1.0f;
+      if (!_ray.CollideWithAABB(aabb3D, fDepth)) {
+        continue;
+      }
+
+      point = _ray.GetOrigin() + ((fDepth + spitfire::math::cEPSILON) * _ray.GetDirection());
+    }
+
+    if (pListener != nullptr) pListener->OnRayCastTestNode(aabb3D);
+
+    size_t x = 0;
+
+    float fDepth = -1.0f;
+    while (point.IsWithinBounds(aabb3D.GetMin(), aabb3D.GetMax())) {
+      //std::cout << "Line part " <<x << std::endl;
+
+      if (pListener != nullptr) pListener->OnRayCastTestLine(spitfire::math::cLine3(_ray.GetOrigin(), point));
+
+      const float fX0 = point.x - fHalfGridSize;
+      const float fZ0 = point.z - fHalfGridSize;
+      const spitfire::math::cVec3 point0(fX0, heightMapScale.y * heightMapData.SampleHeight(fX0 / heightMapScale.x, fZ0 / heightMapScale.z), fZ0);
+
+      const float fX1 = point.x + fHalfGridSize;
+      const float fZ1 = point.z - fHalfGridSize;
+      const spitfire::math::cVec3 point1(fX1, heightMapScale.y * heightMapData.SampleHeight(fX1 / heightMapScale.x, fZ1 / heightMapScale.z), fZ1);
+
+      const float fZ2 = point.z + fHalfGridSize;
+      const float fX2 = point.x - fHalfGridSize;
+      const spitfire::math::cVec3 point2(fX2, heightMapScale.y * heightMapData.SampleHeight(fX2 / heightMapScale.x, fZ2 / heightMapScale.z), fZ2);
+
+      const float fX3 = point.x + fHalfGridSize;
+      const float fZ3 = point.z + fHalfGridSize;
+      const spitfire::math::cVec3 point3(fX3, heightMapScale.y * heightMapData.SampleHeight(fX3 / heightMapScale.x, fZ3 / heightMapScale.z), fZ3);
+
+      if (pListener != nullptr) {
+        pListener->OnRayCastTestLine(spitfire::math::cLine3(point0, point1));
+        pListener->OnRayCastTestLine(spitfire::math::cLine3(point1, point2));
+        pListener->OnRayCastTestLine(spitfire::math::cLine3(point2, point0));
+        pListener->OnRayCastTestLine(spitfire::math::cLine3(point2, point3));
+        pListener->OnRayCastTestLine(spitfire::math::cLine3(point3, point1));
+      }
+
+      if (_ray.CollideWithTriangle(point0, point1, point2, fDepth) || _ray.CollideWithTriangle(point1, point2, point3, fDepth) ||
+        _ray.CollideWithTriangle(point1, point0, point2, fDepth) || _ray.CollideWithTriangle(point2, point1, point3, fDepth)) {
+        return fDepth;
+      }
+
+      point += 0.1f * _ray.GetDirection();
+
+      x++;
+    }
+
+    i++;
+  }
+
+  // No collision, return an invalid depth
+  return -1.0f;
+}
@@ -0,0 +1,34 @@
+#ifndef RAYCAST_H
+#define RAYCAST_H
+
+#include <memory>
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+#include <spitfire/math/cVec3.h>
+#include <spitfire/math/cQuadtree.h>
+#include <spitfire/math/geometry.h>
+
+class cHeightmapData;
+
+// ** cHeightmapRayCastListener
+//
+// Optionally told about each quadtree node and step of a ray cast, used for drawing debug lines
+
+class cHeightmapRayCastListener
+{
+public:
+  virtual ~cHeightmapRayCastListener() {}
+
+  virtual void OnRayCastTestNode(const spitfire::math::cAABB3& aabb) = 0;
+  virtual void OnRayCastTestLine(const spitfire::math::cLine3& line) = 0;
+};
+
+
+// Split the heightmap into a quadtree of 2x2 cell areas in world space
+std::unique_ptr<spitfire::math::cQuadtree<spitfire::math::cAABB2>> BuildHeightmapQuadtree(const cHeightmapData& heightMapData, const spitfire::math::cVec3& heightMapScale);
+
+// Returns the depth along the ray of the first collision with the heightmap or -1 if there is no collision
+float CollideRayWithHeightmap(const cHeightmapData& heightMapData, const spitfire::math::cVec3& heightMapScale, const spitfire::math::cQuadtree<spitfire::math::cAABB2>& quadtree, const spitfire::math::cRay3& ray, cHeightmapRayCastListener* pListener);
+
+#endif // RAYCAST_H
@@ -0,0 +1,222 @@
+#include <cassert>
+#include <cstring>
+
+#include "renderqueue.h"
+
+namespace
+{
+  template <class T>
+  size_t GetOrAddID(std::vector<T>& ids, T value)
+  {
+    const size_t n = ids.size();
+    for (size_t i = 0; i < n; i++) {
+      if (ids[i] == value) return i;
+    }
+
+    ids.push_back(value);
+    return n;
+  }
+
+  bool IsSameColour(const spitfire::math::cColour& a, const spitfire::math::cColour& b)
+  {
+    return ((a.r == b.r) && (a.g == b.g) && (a.b == b.b) && (a.a == b.a));
+  }
+}
+
+// ** cRenderQueue
+
+cRenderQueue::cRenderQueue() :
+  nCommands(0),
+  nDrawCalls(0),
+  nStateChanges(0)
+{
+}
+
+void cRenderQueue::Clear()
+{
+  commands.clear();
+
+  shaderIDs.clear();
+  textureSetIDs.clear();
+  geometryIDs.clear();
+}
+
+void cRenderQueue::AddStaticVertexBufferObject(opengl::cShader& shader, opengl::cStaticVertexBufferObject& vbo, PRIMITIVE primitive, const spitfire::math::cMat4& matModel, const spitfire::math::cColour& colour)
+{
+  Command command;
+  command.pShader = &shader;
+  for (size_t i = 0; i < nMaxTextures; i++) command.textures[i] = nullptr;
+  command.pVBO = &vbo;
+  command.pDrawable = nullptr;
+  command.primitive = primitive;
+  command.matModel = matModel;
+  command.colour = colour;
+  command.bHasColour = true;
+
+  commands.push_back(command);
+}
+
+void cRenderQueue::AddDrawable(opengl::cShader& shader, const opengl::cTexture* const textures[nMaxTextures], cRenderQueueDrawable& drawable, const spitfire::math::cMat4& matModel)
+{
+  Command command;
+  command.pShader = &shader;
+  for (size_t i = 0; i < nMaxTextures; i++) command.textures[i] = (textures != nullptr) ? textures[i] : nullptr;
+  command.pVBO = nullptr;
+  command.pDrawable = &drawable;
+  command.primitive = PRIMITIVE::TRIANGLES;
+  command.matModel = matModel;
+  command.bHasColour = false;
+
+  commands.push_back(command);
+}
+
+void cRenderQueue::AddDrawable(opengl::cShader& shader, const opengl::cTexture* const textures[nMaxTextures], cRenderQueueDrawable& drawable, const spitfire::math::cMat4& matModel, const spitfire::math::cColour& colour)
+{
+  AddDrawable(shader, textures, drawable, matModel);
+
+  commands.back().colour = colour;
+  commands.back().bHasColour = true;
+}
+
+uint64_t cRenderQueue::GetSortKey(const Command& command, const spitfire::math::cVec3& cameraPosition)
+{
+  // Key layout from most to least significant:
+  // 8 bits shader, 8 bits texture set, 16 bits vertex buffer or drawable, 32 bits depth
+  const uint64_t shader = GetOrAddID<const opengl::cShader*>(shaderIDs, command.pShader) & 0xFF;
+
+  size_t textureSet = 0;
+  const size_t nTextureSets = textureSetIDs.size() / nMaxTextures;
+  for (; textureSet < nTextureSets; textureSet++) {
+    if (memcmp(&textureSetIDs[textureSet * nMaxTextures], command.textures, sizeof(command.textures)) == 0) break;
+  }
+  if (textureSet == nTextureSets) textureSetIDs.insert(textureSetIDs.end(), command.textures, command.textures + nMaxTextures);
+
+  const void* pGeometry = (command.pVBO != nullptr) ? (const void*)command.pVBO : (const void*)command.pDrawable;
+  const uint64_t geometry = GetOrAddID<const void*>(geometryIDs, pGeometry) & 0xFFFF;
+
+  // Distances are positive so the bits of the float sort the same way as the float, this gives us front to back within a batch
+  const spitfire::math::cVec3 position(command.matModel.entries[12], command.matModel.entries[13], command.matModel.entries[14]);
+  const float fDistance = (position - cameraPosition).GetLength();
+  uint32_t depth = 0;
+  memcpy(&depth, &fDistance, sizeof(depth));
+
+  return (shader << 56) | ((uint64_t(textureSet) & 0xFF) << 48) | (geometry << 32) | uint64_t(depth);
+}
+
+void cRenderQueue::RadixSort(std::vector<SortItem>& items, std::vector<SortItem>& temp)
+{
+  const size_t n = items.size();
+  if (n < 2) return;
+
+  temp.resize(n);
+
+  // Least significant digit first, 8 bits at a time
+  for (size_t shift = 0; shift < 64; shift += 8) {
+    size_t counts[256] = { 0 };
+    for (size_t i = 0; i < n; i++) counts[(items[i].key >> shift) & 0xFF]++;
+
+    // Every key has the same value for this digit so there is nothing to do
+    if (counts[(items[0].key >> shift) & 0xFF] == n) continue;
+
+    size_t offsets[256];
+    size_t total = 0;
+    for (size_t i = 0; i < 256; i++) {
+      offsets[i] = total;
+      total += counts[i];
+    }
+
+    for (size_t i = 0; i < n; i++) temp[offsets[(items[i].key >> shift) & 0xFF]++] = items[i];
+
+    items.swap(temp);
+  }
+}
+
+void cRenderQueue::Submit(opengl::cContext& context, const spitfire::math::cVec3& cameraPosition, const spitfire::math::cMat4& matProjection, const spitfire::math::cMat4& matView)
+{
+  nCommands = commands.size();
+  nDrawCalls = 0;
+  nStateChanges = 0;
+
+  sortItems.clear();
+  for (size_t i = 0; i < nCommands; i++) {
+    SortItem item;
+    item.key = GetSortKey(commands[i], cameraPosition);
+    item.command = uint32_t(i);
+    sortItems.push_back(item);
+  }
+
+  RadixSort(sortItems, sortTemp);
+
+  opengl::cShader* pCurrentShader = nullptr;
+  const opengl::cTexture* currentTextures[nMaxTextures] = { nullptr };
+  opengl::cStaticVertexBufferObject* pCurrentVBO = nullptr;
+  const spitfire::math::cMat4* pCurrentModel = nullptr;
+  const spitfire::math::cColour* pCurrentColour = nullptr;
+
+  for (auto& item : sortItems) {
+    const Command& command = commands[item.command];
+
+    // A vertex buffer stays bound until we need a different one, a different shader or a drawable with its own vertex arrays
+    if ((pCurrentVBO != nullptr) && ((pCurrentVBO != command.pVBO) || (pCurrentShader != command.pShader))) {
+      context.UnBindStaticVertexBufferObject(*pCurrentVBO);
+      pCurrentVBO = nullptr;
+    }
+
+    if (pCurrentShader != command.pShader) {
+      if (pCurrentShader != nullptr) context.UnBindShader(*pCurrentShader);
+
+      context.BindShader(*command.pShader);
+      pCurrentShader = command.pShader;
+      nStateChanges++;
+
+      // Constants belong to the shader so they have to be set again
+      pCurrentModel = nullptr;
+      pCurrentColour = nullptr;
+    }
+
+    for (size_t unit = 0; unit < nMaxTextures; unit++) {
+      if (currentTextures[unit] != command.textures[unit]) {
+        if (currentTextures[unit] != nullptr) context.UnBindTexture(unit, *currentTextures[unit]);
+        if (command.textures[unit] != nullptr) context.BindTexture(unit, *command.textures[unit]);
+        currentTextures[unit] = command.textures[unit];
+        nStateChanges++;
+      }
+    }
+
+    if (command.bHasColour && ((pCurrentColour == nullptr) || !IsSameColour(*pCurrentColour, command.colour))) {
+      context.SetShaderConstant("colour", command.colour);
+      pCurrentColour = &command.colour;
+    }
+
+    if ((pCurrentModel == nullptr) || (memcmp(pCurrentModel->entries, command.matModel.entries, sizeof(command.matModel.entries)) != 0)) {
+      context.SetShaderProjectionAndViewAndModelMatrices(matProjection, matView, command.matModel);
+      pCurrentModel = &command.matModel;
+    }
+
+    if (command.pDrawable != nullptr) {
+      nDrawCalls += command.pDrawable->Draw();
+    } else {
+      assert(command.pVBO != nullptr);
+
+      if (pCurrentVBO != command.pVBO) {
+        context.BindStaticVertexBufferObject(*command.pVBO);
+        pCurrentVBO = command.pVBO;
+        nStateChanges++;
+      }
+
+      if (command.primitive == PRIMITIVE::LINES) context.DrawStaticVertexBufferObjectLines(*command.pVBO);
+      else context.DrawStaticVertexBufferObjectTriangles(*command.pVBO);
+
+      nDrawCalls++;
+    }
+  }
+
+  // Leave everything unbound
+  if (pCurrentVBO != nullptr) context.UnBindStaticVertexBufferObject(*pCurrentVBO);
+
+  for (size_t unit = nMaxTextures; unit > 0; unit--) {
+    if (currentTextures[unit - 1] != nullptr) context.UnBindTexture(unit - 1, *currentTextures[unit - 1]);
+  }
+
+  if (pCurrentShader != nullptr) context.UnBindShader(*pCurrentShader);
+}
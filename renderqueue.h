@@ -0,0 +1,98 @@
+#ifndef RENDERQUEUE_H
+#define RENDERQUEUE_H
+
+#include <vector>
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+#include <spitfire/math/cVec3.h>
+#include <spitfire/math/cMat4.h>
+#include <spitfire/math/cColour.h>
+
+// libopenglmm headers
+#include <libopenglmm/cContext.h>
+#include <libopenglmm/cShader.h>
+#include <libopenglmm/cTexture.h>
+#include <libopenglmm/cVertexBufferObject.h>
+
+// ** cRenderQueueDrawable
+//
+// Something that manages its own vertex arrays, the queue binds the shader, textures and matrices before calling Draw
+
+class cRenderQueueDrawable
+{
+public:
+  virtual ~cRenderQueueDrawable() {}
+
+  // Returns the number of draw calls that were made
+  virtual size_t Draw() = 0;
+};
+
+
+// ** cRenderQueue
+//
+// Passes add draw commands during the frame, each command gets a sort key made from its shader, textures, vertex buffer
+// and depth.  Submit radix sorts the commands by key and then only changes state when it differs from the previous command.
+
+class cRenderQueue
+{
+public:
+  static const size_t nMaxTextures = 3;
+
+  enum class PRIMITIVE {
+    TRIANGLES,
+    LINES,
+  };
+
+  cRenderQueue();
+
+  void Clear();
+
+  void AddStaticVertexBufferObject(opengl::cShader& shader, opengl::cStaticVertexBufferObject& vbo, PRIMITIVE primitive, const spitfire::math::cMat4& matModel, const spitfire::math::cColour& colour);
+  void AddDrawable(opengl::cShader& shader, const opengl::cTexture* const textures[nMaxTextures], cRenderQueueDrawable& drawable, const spitfire::math::cMat4& matModel);
+  void AddDrawable(opengl::cShader& shader, const opengl::cTexture* const textures[nMaxTextures], cRenderQueueDrawable& drawable, const spitfire::math::cMat4& matModel, const spitfire::math::cColour& colour);
+
+  void Submit(opengl::cContext& context, const spitfire::math::cVec3& cameraPosition, const spitfire::math::cMat4& matProjection, const spitfire::math::cMat4& matView);
+
+  // Statistics for the last submitted frame
+  size_t GetCommandCount() const { return nCommands; }
+  size_t GetDrawCallCount() const { return nDrawCalls; }
+  size_t GetStateChangeCount() const { return nStateChanges; }
+
+private:
+  struct Command {
+    opengl::cShader* pShader;
+    const opengl::cTexture* textures[nMaxTextures];
+    opengl::cStaticVertexBufferObject* pVBO;
+    cRenderQueueDrawable* pDrawable;
+    PRIMITIVE primitive;
+    spitfire::math::cMat4 matModel;
+    spitfire::math::cColour colour;
+    bool bHasColour;
+  };
+
+  struct SortItem {
+    uint64_t key;
+    uint32_t command;
+  };
+
+  uint64_t GetSortKey(const Command& command, const spitfire::math::cVec3& cameraPosition);
+
+  static void RadixSort(std::vector<SortItem>& items, std::vector<SortItem>& temp);
+
+  std::vector<Command> commands;
+
+  // Small per frame tables used to give each shader, texture set and vertex buffer a small id for the sort key
+  std::vector<const opengl::cShader*> shaderIDs;
+  std::vector<const opengl::cTexture*> textureSetIDs; // nMaxTextures entries per texture set
+  std::vector<const void*> geometryIDs;
+
+  std::vector<SortItem> sortItems;
+  std::vector<SortItem> sortTemp;
+
+  size_t nCommands;
+  size_t nDrawCalls;
+  size_t nStateChanges;
+};
+
+#endif // RENDERQUEUE_H
@@ -0,0 +1,10 @@
+#version 330
+
+flat in vec4 vertOutColour;
+
+out vec4 fragmentColour;
+
+void main()
+{
+  fragmentColour = vertOutColour;
+}
@@ -0,0 +1,17 @@
+#version 330
+
+// Projection * view, each instance supplies its own model matrix
+uniform mat4 matModelViewProjection;
+
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 normal;
+layout(location = 3) in mat4 matInstanceModel;
+layout(location = 7) in vec4 instanceColour;
+
+flat out vec4 vertOutColour;
+
+void main()
+{
+  gl_Position = matModelViewProjection * matInstanceModel * vec4(position, 1.0);
+  vertOutColour = instanceColour;
+}
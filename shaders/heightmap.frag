@@ -1,17 +1,28 @@
 #version 330
 
-uniform sampler2D texUnit0; // Diffuse texture
-uniform sampler2D texUnit1; // Lightmap texture
+uniform sampler2D texUnit0; // Virtual texture diffuse page cache
+uniform sampler2D texUnit1; // Virtual texture lightmap page cache
 uniform sampler2D texUnit2; // Detail texture
+uniform sampler2D texUnit3; // Virtual texture page table
 
 smooth in vec2 vertOutTexCoord0;
 smooth in vec2 vertOutTexCoord1;
 smooth in vec2 vertOutTexCoord2;
 
+vec2 GetPhysicalTexCoord(vec2 virtualTexCoord)
+{
+  // Each page table texel holds the scale and offset from the virtual texture to where that page is in the page cache
+  vec4 page = texture(texUnit3, virtualTexCoord);
+  return (virtualTexCoord * page.xy) + page.zw;
+}
+
 void main(void)
 {
-  vec3 diffuse = texture(texUnit0, vertOutTexCoord0).rgb;
-  vec3 lightmap = texture(texUnit1, vertOutTexCoord1).rgb;
+  // The diffuse map and lightmap share the same pages
+  vec2 physicalTexCoord = GetPhysicalTexCoord(vertOutTexCoord0);
+
+  vec3 diffuse = texture(texUnit0, physicalTexCoord).rgb;
+  float lightmap = texture(texUnit1, physicalTexCoord).r;
   vec3 detail = texture(texUnit2, vertOutTexCoord2).rgb;
 
   gl_FragColor = vec4(diffuse * lightmap * detail, 1.0);
@@ -0,0 +1,539 @@
+#include <cassert>
+#include <cmath>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+// Spitfire headers
+#include <spitfire/math/math.h>
+#include <spitfire/math/cVec2.h>
+#include <spitfire/util/log.h>
+#include <spitfire/math/cMat4.h>
+
+// Application headers
+#include "heightmap.h"
+#include "navigation.h"
+#include "profiler.h"
+#include "simulation.h"
+
+namespace
+{
+  // Full resolution heights are kept around the camera out to this many world units
+  const float fHeightmapStreamCameraRadius = 100.0f;
+}
+
+// ** cSceneSnapshot
+
+cSceneSnapshot::cSceneSnapshot() :
+  tick(0),
+  time(std::chrono::steady_clock::now()),
+  fTickDurationSeconds(cSimulation::fTimeStepSeconds)
+{
+  for (size_t i = 0; i < AISystem::nLODs; i++) {
+    nAgentsPerLOD[i] = 0;
+    nUpdatedAgentsPerLOD[i] = 0;
+  }
+}
+
+float cSceneSnapshot::GetInterpolationAlpha(std::chrono::steady_clock::time_point currentTime) const
+{
+  if (currentTime <= time) return 0.0f;
+
+  const float fElapsedSeconds = std::chrono::duration<float>(currentTime - time).count();
+  return spitfire::math::clamp(fElapsedSeconds / fTickDurationSeconds, 0.0f, 1.0f);
+}
+
+void cSceneSnapshot::Interpolate(float fAlpha, std::vector<spitfire::math::cVec3>& outPositions, std::vector<spitfire::math::cQuaternion>& outRotations) const
+{
+  const size_t n = positions.size();
+  assert(previousPositions.size() == n);
+  assert(previousRotations.size() == n);
+  assert(rotations.size() == n);
+
+  outPositions.resize(n);
+  outRotations.resize(n);
+
+  for (size_t i = 0; i < n; i++) {
+    outPositions[i] = previousPositions[i] + (fAlpha * (positions[i] - previousPositions[i]));
+
+    // Normalised lerp is close enough to a slerp for the small rotations between two ticks
+    const spitfire::math::cQuaternion& a = previousRotations[i];
+    const spitfire::math::cQuaternion& b = rotations[i];
+    const float fDot = (a.x * b.x) + (a.y * b.y) + (a.z * b.z) + (a.w * b.w);
+    const float fSign = (fDot < 0.0f) ? -1.0f : 1.0f;
+
+    spitfire::math::cQuaternion& q = outRotations[i];
+    q.x = a.x + (fAlpha * ((fSign * b.x) - a.x));
+    q.y = a.y + (fAlpha * ((fSign * b.y) - a.y));
+    q.z = a.z + (fAlpha * ((fSign * b.z) - a.z));
+    q.w = a.w + (fAlpha * ((fSign * b.w) - a.w));
+
+    const float fLength = sqrtf((q.x * q.x) + (q.y * q.y) + (q.z * q.z) + (q.w * q.w));
+    if (fLength > 0.0f) {
+      const float fInverseLength = 1.0f / fLength;
+      q.x *= fInverseLength;
+      q.y *= fInverseLength;
+      q.z *= fInverseLength;
+      q.w *= fInverseLength;
+    }
+  }
+}
+
+
+// ** cSceneSnapshotTripleBuffer
+
+cSceneSnapshotTripleBuffer::cSceneSnapshotTripleBuffer() :
+  writeIndex(0),
+  readIndex(1),
+  middle(2)
+{
+}
+
+void cSceneSnapshotTripleBuffer::Publish()
+{
+  // Hand our finished buffer over and take whatever was in the middle, the consumer may not have seen it but it is older anyway
+  const uint8_t previous = middle.exchange(writeIndex | FLAG_NEW, std::memory_order_acq_rel);
+  writeIndex = previous & INDEX_MASK;
+}
+
+bool cSceneSnapshotTripleBuffer::Consume()
+{
+  if ((middle.load(std::memory_order_acquire) & FLAG_NEW) == 0) return false;
+
+  const uint8_t previous = middle.exchange(readIndex, std::memory_order_acq_rel);
+  readIndex = previous & INDEX_MASK;
+
+  return true;
+}
+
+
+// ** cSimulation
+
+constexpr float cSimulation::fTimeStepSeconds;
+
+cSimulation::Timings::Timings() :
+  nTicks(0),
+  fCommandsSeconds(0.0),
+  fAISeconds(0.0),
+  fHeightmapSeconds(0.0),
+  fSnapshotSeconds(0.0)
+{
+}
+
+cSimulation::cSimulation(const NavigationMesh& navigationMesh, const cHeightmapData& _heightMapData, const spitfire::math::cVec3& _heightMapScale) :
+  heightMapData(_heightMapData),
+  heightMapScale(_heightMapScale),
+  ai(navigationMesh),
+  tick(0),
+  fHeightmapStreamStep(1.0f),
+  bHasStreamCamera(false),
+  bIsRunning(true),
+  bStopThread(false),
+  nTicksPerSecond(0),
+  nDroppedTicksPerSecond(0),
+  bHasCamera(false)
+{
+}
+
+cSimulation::~cSimulation()
+{
+  Stop();
+}
+
+spitfire::math::cVec3 cSimulation::GetRandomPositionOnHeightmap(std::mt19937& generator, float fAreaSize) const
+{
+  std::uniform_real_distribution<float> distribution(0.0f, fAreaSize);
+  const float fX = distribution(generator);
+  const float fZ = distribution(generator);
+  const spitfire::math::cVec2 p(fX, fZ);
+  return spitfire::math::cVec3(p.x, heightMapScale.y * heightMapData.SampleHeight(p.x / heightMapScale.x, p.y / heightMapScale.z), p.y);
+}
+
+void cSimulation::AddObject(TYPE type, const spitfire::math::cVec3& position, const spitfire::math::cQuaternion& rotation, const spitfire::math::cVec3& goalPosition)
+{
+  // Soldiers have AI agents
+  const bool bIsAgent = (type == TYPE::SOLDIER);
+
+  const entityid_t id = entities.AddEntity(bIsAgent ? COMPONENT::AGENT : 0, type, position, rotation);
+
+  if (bIsAgent) {
+    AIBlackboard* pBlackboard = entities.GetBlackboard(id);
+    pBlackboard->goals.push_back(new AIGoalTakeControlPoint(goalPosition));
+
+    // The agent's first update covers the ticks from now
+    pBlackboard->lastUpdateTick = ai.GetTick();
+  }
+}
+
+void cSimulation::CreateScene(size_t nObjects, float fAreaSize, uint32_t seed)
+{
+  assert(!thread.joinable());
+
+  std::mt19937 generator(seed);
+  std::uniform_real_distribution<float> degrees(-180.0f, 180.0f);
+  std::uniform_int_distribution<size_t> typeIndex(0, 2);
+
+  for (size_t i = 0; i < nObjects; i++) {
+    const spitfire::math::cVec3 randomPosition = GetRandomPositionOnHeightmap(generator, fAreaSize);
+
+    const spitfire::math::cVec3 rotationDegrees(degrees(generator), 0.0f, 0.0f);
+    const spitfire::math::cQuaternion rotation(spitfire::math::cMat4::RotationMatrix(rotationDegrees).GetRotation());
+
+    const spitfire::math::cVec3 randomGoalPosition = GetRandomPositionOnHeightmap(generator, fAreaSize);
+
+    const TYPE types[] = { TYPE::SOLDIER, TYPE::BULLET, TYPE::TREE };
+    AddObject(types[typeIndex(generator)], randomPosition, rotation, randomGoalPosition);
+  }
+}
+
+void cSimulation::CreateSoldiers(size_t nSoldiers, float fAreaSize, uint32_t seed)
+{
+  assert(!thread.joinable());
+
+  std::mt19937 generator(seed);
+  std::uniform_real_distribution<float> degrees(-180.0f, 180.0f);
+
+  for (size_t i = 0; i < nSoldiers; i++) {
+    const spitfire::math::cVec3 randomPosition = GetRandomPositionOnHeightmap(generator, fAreaSize);
+
+    const spitfire::math::cVec3 rotationDegrees(degrees(generator), 0.0f, 0.0f);
+    const spitfire::math::cQuaternion rotation(spitfire::math::cMat4::RotationMatrix(rotationDegrees).GetRotation());
+
+    const spitfire::math::cVec3 randomGoalPosition = GetRandomPositionOnHeightmap(generator, fAreaSize);
+
+    AddObject(TYPE::SOLDIER, randomPosition, rotation, randomGoalPosition);
+  }
+}
+
+void cSimulation::Start()
+{
+  assert(!thread.joinable());
+
+  // Publish the starting state so that the renderer has something to draw before the first tick
+  PublishSnapshot(std::chrono::steady_clock::now());
+
+  bStopThread = false;
+  thread = std::thread(&cSimulation::ThreadFunction, this);
+}
+
+void cSimulation::Stop()
+{
+  bStopThread = true;
+  if (thread.joinable()) thread.join();
+}
+
+void cSimulation::OrderObjectToPosition(size_t object, const spitfire::math::cVec3& position)
+{
+  Command command;
+  command.object = object;
+  command.position = position;
+
+  std::lock_guard<std::mutex> lock(mutexCommands);
+  commands.push_back(command);
+}
+
+bool cSimulation::OpenHeightmapStream(const spitfire::string_t& sFilename)
+{
+  assert(!thread.joinable());
+
+  heightmapStream.Close();
+
+  HEIGHTMAP_FORMAT format = HEIGHTMAP_FORMAT::R16;
+  if (!cHeightmapStream::GetFormatFromFilename(sFilename, format) || !heightmapStream.Open(sFilename, format)) return false;
+
+  // The heightmap was loaded with every step'th sample of the stream
+  const size_t step = cHeightmapData::GetLoadStep(heightmapStream.GetWidth(), heightmapStream.GetDepth());
+  if ((((heightmapStream.GetWidth() - 1) / step) + 1 != heightMapData.GetWidth()) || (((heightmapStream.GetDepth() - 1) / step) + 1 != heightMapData.GetDepth())) {
+    LOGERROR("cSimulation::OpenHeightmapStream \"", sFilename, "\" is ", heightmapStream.GetWidth(), "x", heightmapStream.GetDepth(), " which does not match the ", heightMapData.GetWidth(), "x", heightMapData.GetDepth(), " heightmap");
+    heightmapStream.Close();
+    return false;
+  }
+
+  // The heightmap already has every sample
+  if (step == 1) {
+    heightmapStream.Close();
+    return true;
+  }
+
+  fHeightmapStreamStep = float(step);
+
+  LOG("cSimulation::OpenHeightmapStream Paging full resolution tiles in from \"", sFilename, "\"");
+
+  return true;
+}
+
+void cSimulation::SetCamera(const spitfire::math::cVec3& position, const spitfire::math::cMat4& matViewProjection)
+{
+  cFrustumCuller frustum;
+  frustum.SetViewProjection(matViewProjection);
+
+  std::lock_guard<std::mutex> lock(mutexCommands);
+  bHasCamera = true;
+  cameraPosition = position;
+  cameraFrustum = frustum;
+}
+
+void cSimulation::Step()
+{
+  assert(!thread.joinable());
+
+  Update(std::chrono::steady_clock::now());
+}
+
+const cSceneSnapshot& cSimulation::GetLatestSnapshot()
+{
+  snapshots.Consume();
+  return snapshots.GetReadBuffer();
+}
+
+void cSimulation::ThreadFunction()
+{
+  PROFILE_THREAD_NAME("Simulation");
+
+  typedef std::chrono::steady_clock clock;
+
+  const clock::duration timeStep = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(fTimeStepSeconds));
+
+  clock::time_point previousTime = clock::now();
+  clock::duration accumulator(0);
+
+  clock::time_point statisticsStartTime = previousTime;
+  size_t nTicks = 0;
+  size_t nDroppedTicks = 0;
+
+  while (!bStopThread) {
+    const clock::time_point currentTime = clock::now();
+    accumulator += currentTime - previousTime;
+    previousTime = currentTime;
+
+    // Run as many fixed steps as we have time for, each tick is stamped with the real time it represents
+    size_t nSteps = 0;
+    while ((accumulator >= timeStep) && (nSteps < nMaxSubSteps)) {
+      accumulator -= timeStep;
+      Update(currentTime - accumulator);
+      nSteps++;
+    }
+
+    nTicks += nSteps;
+
+    // We are too far behind to catch up so drop the whole steps and keep the remainder
+    if (accumulator >= timeStep) {
+      nDroppedTicks += size_t(accumulator / timeStep);
+      accumulator %= timeStep;
+    }
+
+    if ((currentTime - statisticsStartTime) >= std::chrono::seconds(1)) {
+      nTicksPerSecond = nTicks;
+      nDroppedTicksPerSecond = nDroppedTicks;
+      nTicks = 0;
+      nDroppedTicks = 0;
+      statisticsStartTime = currentTime;
+    }
+
+    // Give the time back to the render thread until the next tick is due
+    std::this_thread::sleep_for(timeStep - accumulator);
+  }
+}
+
+void cSimulation::ProcessCommands()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutexCommands);
+    commandsProcessing.swap(commands);
+
+    if (bHasCamera) {
+      ai.SetLODCentre(cameraPosition);
+      ai.SetLODFrustum(cameraFrustum);
+
+      bHasStreamCamera = true;
+      streamCameraPosition = cameraPosition;
+    }
+  }
+
+  for (auto& command : commandsProcessing) {
+    AIBlackboard* pBlackboard = entities.GetBlackboard(entityid_t(command.object));
+    if (pBlackboard != nullptr) pBlackboard->goals.push_back(new AIGoalTakeControlPoint(command.position));
+  }
+
+  commandsProcessing.clear();
+}
+
+void cSimulation::UpdateHeightmapStream()
+{
+  const float fInverseScaleX = fHeightmapStreamStep / heightMapScale.x;
+  const float fInverseScaleZ = fHeightmapStreamStep / heightMapScale.z;
+
+  streamX.clear();
+  streamZ.clear();
+  streamRadius.clear();
+
+  if (bHasStreamCamera) {
+    streamX.push_back(streamCameraPosition.x * fInverseScaleX);
+    streamZ.push_back(streamCameraPosition.z * fInverseScaleZ);
+    streamRadius.push_back(fHeightmapStreamCameraRadius * fInverseScaleX);
+  }
+
+  // Just the cell that each moved object is in
+  for (auto& archetype : entities.GetArchetypes()) {
+    for (size_t i : archetype.moved) {
+      const spitfire::math::cVec3& position = archetype.positions[i];
+      streamX.push_back(position.x * fInverseScaleX);
+      streamZ.push_back(position.z * fInverseScaleZ);
+      streamRadius.push_back(1.0f);
+    }
+  }
+
+  heightmapStream.Update(streamX.data(), streamZ.data(), streamRadius.data(), streamX.size());
+}
+
+void cSimulation::SnapMovedObjectsToHeightmap()
+{
+  const float fInverseScaleX = 1.0f / heightMapScale.x;
+  const float fInverseScaleZ = 1.0f / heightMapScale.z;
+
+  const bool bIsStreaming = heightmapStream.IsOpen();
+  if (bIsStreaming) UpdateHeightmapStream();
+
+  // Objects that have not moved across the terrain are still on it, so static objects cost nothing here
+  for (auto& archetype : entities.GetArchetypes()) {
+    const size_t n = archetype.moved.size();
+    if (n == 0) continue;
+
+    // Gather the moved objects into flat arrays so that the heights can be sampled in a batch
+    snapX.resize(n);
+    snapZ.resize(n);
+    snapHeights.resize(n);
+    for (size_t i = 0; i < n; i++) {
+      const spitfire::math::cVec3& position = archetype.positions[archetype.moved[i]];
+      snapX[i] = position.x * fInverseScaleX;
+      snapZ[i] = position.z * fInverseScaleZ;
+    }
+
+    heightMapData.SampleHeights(&snapX[0], &snapZ[0], &snapHeights[0], n);
+
+    // Use the full resolution heights where we have them
+    if (bIsStreaming) {
+      for (size_t i = 0; i < n; i++) heightmapStream.SampleHeight(fHeightmapStreamStep * snapX[i], fHeightmapStreamStep * snapZ[i], snapHeights[i]);
+    }
+
+    for (size_t i = 0; i < n; i++) archetype.positions[archetype.moved[i]].y = heightMapScale.y * snapHeights[i];
+
+    archetype.moved.clear();
+  }
+}
+
+void cSimulation::Update(std::chrono::steady_clock::time_point tickTime)
+{
+  PROFILE_ZONE("Simulation tick");
+
+  typedef std::chrono::steady_clock clock;
+
+  const clock::time_point startTime = clock::now();
+
+  {
+    PROFILE_ZONE("Commands");
+    ProcessCommands();
+  }
+
+  const clock::time_point commandsTime = clock::now();
+  clock::time_point aiTime = commandsTime;
+
+  if (bIsRunning) {
+    {
+      PROFILE_ZONE("AI");
+
+      // The AI moves the agents in place in the entity store
+      ai.Update(entities, fTimeStepSeconds);
+    }
+
+    aiTime = clock::now();
+
+    {
+      PROFILE_ZONE("Heightmap snap");
+
+      SnapMovedObjectsToHeightmap();
+    }
+  }
+
+  tick++;
+
+  const clock::time_point heightmapTime = clock::now();
+
+  {
+    PROFILE_ZONE("Snapshot");
+    PublishSnapshot(tickTime);
+  }
+
+  const clock::time_point endTime = clock::now();
+
+  timings.nTicks++;
+  timings.fCommandsSeconds += std::chrono::duration<double>(commandsTime - startTime).count();
+  timings.fAISeconds += std::chrono::duration<double>(aiTime - commandsTime).count();
+  timings.fHeightmapSeconds += std::chrono::duration<double>(heightmapTime - aiTime).count();
+  timings.fSnapshotSeconds += std::chrono::duration<double>(endTime - heightmapTime).count();
+}
+
+void cSimulation::PublishSnapshot(std::chrono::steady_clock::time_point tickTime)
+{
+  cSceneSnapshot& snapshot = snapshots.GetWriteBuffer();
+
+  snapshot.tick = tick;
+  snapshot.time = tickTime;
+  snapshot.fTickDurationSeconds = fTimeStepSeconds;
+
+  // Scatter the dense archetype arrays into arrays indexed by entity id, resizing reuses the capacity of the buffer from
+  // the last time it was written
+  const size_t n = entities.GetEntityIDCount();
+  snapshot.positions.resize(n);
+  snapshot.rotations.resize(n);
+  snapshot.types.resize(n);
+  snapshot.agents.clear();
+
+  for (auto& archetype : entities.GetArchetypes()) {
+    const bool bIsAgent = archetype.HasComponents(COMPONENT::AGENT);
+
+    const size_t nEntities = archetype.size();
+    for (size_t i = 0; i < nEntities; i++) {
+      const entityid_t id = archetype.entities[i];
+      snapshot.positions[id] = archetype.positions[i];
+      snapshot.rotations[id] = archetype.rotations[i];
+      snapshot.types[id] = archetype.types[i];
+
+      if (bIsAgent) {
+        const AIBlackboard& blackboard = archetype.blackboards[i];
+
+        cSceneSnapshot::Agent agent;
+        agent.object = id;
+        agent.nGoals = blackboard.goals.size();
+        agent.nActions = blackboard.actions.size();
+        agent.bHasGoalPosition = blackboard.GetGoalPosition(agent.goalPosition);
+        agent.lod = blackboard.lod;
+        snapshot.agents.push_back(agent);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < AISystem::nLODs; i++) {
+    snapshot.nAgentsPerLOD[i] = ai.GetLODAgentCount(AI_LOD(i));
+    snapshot.nUpdatedAgentsPerLOD[i] = ai.GetLODUpdatedAgentCount(AI_LOD(i));
+  }
+
+  // Entities added since the last snapshot have nowhere to interpolate from so they start where they are
+  const size_t nPrevious = std::min(previousPositions.size(), n);
+  previousPositions.resize(n);
+  previousRotations.resize(n);
+  for (size_t i = nPrevious; i < n; i++) {
+    previousPositions[i] = snapshot.positions[i];
+    previousRotations[i] = snapshot.rotations[i];
+  }
+
+  snapshot.previousPositions.assign(previousPositions.begin(), previousPositions.end());
+  snapshot.previousRotations.assign(previousRotations.begin(), previousRotations.end());
+
+  // This snapshot is where the next one interpolates from
+  previousPositions.assign(snapshot.positions.begin(), snapshot.positions.end());
+  previousRotations.assign(snapshot.rotations.begin(), snapshot.rotations.end());
+
+  snapshots.Publish();
+}
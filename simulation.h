@@ -0,0 +1,218 @@
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+#include <spitfire/math/math.h>
+#include <spitfire/math/cVec3.h>
+#include <spitfire/math/cQuaternion.h>
+
+// Application headers
+#include "ai.h"
+#include "entities.h"
+#include "heightmapstream.h"
+
+class cHeightmapData;
+class NavigationMesh;
+
+
+// ** cSceneSnapshot
+//
+// An immutable copy of the scene made by the simulation thread at the end of a tick.  It holds the object transforms from
+// the previous tick as well so that the render thread can interpolate between the two without keeping its own history.
+// The object arrays are indexed by entity id.
+
+struct cSceneSnapshot {
+  cSceneSnapshot();
+
+  // How far the render time is between the previous tick and this one, 0 to 1
+  float GetInterpolationAlpha(std::chrono::steady_clock::time_point currentTime) const;
+  void Interpolate(float fAlpha, std::vector<spitfire::math::cVec3>& outPositions, std::vector<spitfire::math::cQuaternion>& outRotations) const;
+
+  uint64_t tick;
+  std::chrono::steady_clock::time_point time; // The real time that this tick represents
+  float fTickDurationSeconds;
+
+  std::vector<spitfire::math::cVec3> previousPositions;
+  std::vector<spitfire::math::cQuaternion> previousRotations;
+  std::vector<spitfire::math::cVec3> positions;
+  std::vector<spitfire::math::cQuaternion> rotations;
+  std::vector<TYPE> types;
+
+  // AI state for the HUD and the debug target lines
+  struct Agent {
+    size_t object;
+    size_t nGoals;
+    size_t nActions;
+    bool bHasGoalPosition;
+    spitfire::math::cVec3 goalPosition;
+    AI_LOD lod;
+  };
+  std::vector<Agent> agents;
+
+  // How many agents were on each AI_LOD and how many of those were updated in this tick
+  size_t nAgentsPerLOD[AISystem::nLODs];
+  size_t nUpdatedAgentsPerLOD[AISystem::nLODs];
+};
+
+
+// ** cSceneSnapshotTripleBuffer
+//
+// Single producer, single consumer.  The producer always has a buffer to write into and the consumer always has a
+// complete buffer to read from, they only exchange buffers through an atomic swap of the middle buffer.
+
+class cSceneSnapshotTripleBuffer
+{
+public:
+  cSceneSnapshotTripleBuffer();
+
+  // Producer
+  cSceneSnapshot& GetWriteBuffer() { return buffers[writeIndex]; }
+  void Publish();
+
+  // Consumer, returns true if a newer snapshot was swapped in
+  bool Consume();
+  const cSceneSnapshot& GetReadBuffer() const { return buffers[readIndex]; }
+
+private:
+  static const uint8_t FLAG_NEW = 0x4;
+  static const uint8_t INDEX_MASK = 0x3;
+
+  cSceneSnapshot buffers[3];
+  uint8_t writeIndex;
+  uint8_t readIndex;
+  std::atomic<uint8_t> middle; // Index of the middle buffer and FLAG_NEW if it has not been consumed yet
+};
+
+
+// ** cSimulation
+//
+// Owns the scene objects and the AI and updates them on their own thread.  Everything else talks to the simulation
+// through thread safe commands and reads the results from the published snapshots.
+//
+// The simulation always advances in fixed steps.  Real time is added to an accumulator and as many steps as fit are
+// run, if the simulation falls more than nMaxSubSteps behind then the extra time is dropped rather than trying to catch up.
+
+class cSimulation
+{
+public:
+  static constexpr float fTimeStepSeconds = 1.0f / 60.0f;
+  static const size_t nMaxSubSteps = 5;
+
+  cSimulation(const NavigationMesh& navigationMesh, const cHeightmapData& heightMapData, const spitfire::math::cVec3& heightMapScale);
+  ~cSimulation();
+
+  // Called before the thread is started, objects are spread over fAreaSize by fAreaSize world units
+  // The same seed always creates the same objects and goals
+  void CreateScene(size_t nObjects, float fAreaSize, uint32_t seed);
+  void CreateSoldiers(size_t nSoldiers, float fAreaSize, uint32_t seed);
+
+  void Start();
+  void Stop();
+
+  // Run a single tick on the calling thread, for when the simulation thread is not running
+  void Step();
+
+  // Thread safe
+  void SetRunning(bool bRunning) { bIsRunning = bRunning; }
+  bool IsRunning() const { return bIsRunning; }
+  void OrderObjectToPosition(size_t object, const spitfire::math::cVec3& position);
+
+  // Pages the full resolution heights of a raw heightmap in around the camera and the agents, for maps that were loaded at a
+  // lower resolution.  Only call this while the simulation thread is not running.
+  bool OpenHeightmapStream(const spitfire::string_t& sFilename);
+
+  // Agents near the camera or on screen are updated every tick, until this is called every agent is updated every tick
+  void SetCamera(const spitfire::math::cVec3& position, const spitfire::math::cMat4& matViewProjection);
+
+  // Statistics for the last second
+  size_t GetTicksPerSecond() const { return nTicksPerSecond; }
+  size_t GetDroppedTicksPerSecond() const { return nDroppedTicksPerSecond; }
+
+  // Time spent in each part of a tick, summed over every tick
+  struct Timings {
+    Timings();
+
+    size_t nTicks;
+    double fCommandsSeconds;
+    double fAISeconds;
+    double fHeightmapSeconds;
+    double fSnapshotSeconds;
+  };
+
+  // Only safe to call while the simulation thread is not running
+  const Timings& GetTimings() const { return timings; }
+  const cHeightmapStream& GetHeightmapStream() const { return heightmapStream; }
+
+  // Called from the render thread only, the snapshot stays valid until the next call
+  const cSceneSnapshot& GetLatestSnapshot();
+
+private:
+  struct Command {
+    size_t object;
+    spitfire::math::cVec3 position;
+  };
+
+  void ThreadFunction();
+
+  void AddObject(TYPE type, const spitfire::math::cVec3& position, const spitfire::math::cQuaternion& rotation, const spitfire::math::cVec3& goalPosition);
+  spitfire::math::cVec3 GetRandomPositionOnHeightmap(std::mt19937& generator, float fAreaSize) const;
+
+  void Update(std::chrono::steady_clock::time_point tickTime);
+  void ProcessCommands();
+  void UpdateHeightmapStream();
+  void SnapMovedObjectsToHeightmap();
+  void PublishSnapshot(std::chrono::steady_clock::time_point tickTime);
+
+  const cHeightmapData& heightMapData;
+  const spitfire::math::cVec3& heightMapScale;
+
+  // Only touched by the simulation thread once it has started
+  cEntityStore entities;
+  AISystem ai;
+  uint64_t tick;
+
+  // The transforms from the last published snapshot, indexed by entity id
+  std::vector<spitfire::math::cVec3> previousPositions;
+  std::vector<spitfire::math::cQuaternion> previousRotations;
+
+  // Scratch space for snapping objects to the heightmap, kept between ticks so that it is only allocated once
+  std::vector<float> snapX;
+  std::vector<float> snapZ;
+  std::vector<float> snapHeights;
+
+  // The full resolution heightmap, only open if the heightmap was loaded at a lower resolution
+  cHeightmapStream heightmapStream;
+  float fHeightmapStreamStep; // Samples in the stream per sample in the heightmap
+  std::vector<float> streamX;
+  std::vector<float> streamZ;
+  std::vector<float> streamRadius;
+  bool bHasStreamCamera;
+  spitfire::math::cVec3 streamCameraPosition;
+
+  Timings timings;
+
+  std::atomic<bool> bIsRunning;
+  std::atomic<bool> bStopThread;
+  std::atomic<size_t> nTicksPerSecond;
+  std::atomic<size_t> nDroppedTicksPerSecond;
+  std::thread thread;
+
+  std::mutex mutexCommands;
+  std::vector<Command> commands;
+  std::vector<Command> commandsProcessing;
+  bool bHasCamera;
+  spitfire::math::cVec3 cameraPosition;
+  cFrustumCuller cameraFrustum;
+
+  cSceneSnapshotTripleBuffer snapshots;
+};
+
+#endif // SIMULATION_H
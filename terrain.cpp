@@ -0,0 +1,436 @@
+#include <cassert>
+#include <cmath>
+
+#include <algorithm>
+#include <chrono>
+
+#include <spitfire/util/log.h>
+
+#include "heightmap.h"
+#include "terrain.h"
+#include "terraincache.h"
+
+namespace
+{
+  // Position, normal, diffuse texture coordinate, lightmap texture coordinate and detail texture coordinate
+  const size_t nFloatsPerVertex = 3 + 3 + 2 + 2 + 2;
+}
+
+
+// ** cGeoMipMapTerrain
+
+cGeoMipMapTerrain::cGeoMipMapTerrain() :
+  chunksX(0),
+  chunksZ(0),
+  pVertices(nullptr),
+  nVertices(0),
+  vertexArray(0),
+  vertexBuffer(0),
+  indexBuffer(0),
+  fMaxScreenSpaceErrorPixels(2.0f),
+  nTriangles(0),
+  fSelectionTimeMS(0.0f)
+{
+  for (size_t lod = 0; lod < nLevels; lod++) {
+    for (size_t stitch = 0; stitch < nStitchCombinations; stitch++) {
+      indexRanges[lod][stitch].offset = 0;
+      indexRanges[lod][stitch].count = 0;
+    }
+  }
+}
+
+float cGeoMipMapTerrain::GetInterpolatedHeightAtLevel(const float* pHeights, size_t x, size_t z, size_t step)
+{
+  // Find the cell at this level that contains the vertex
+  const size_t x0 = (x / step) * step;
+  const size_t z0 = (z / step) * step;
+  const size_t x1 = std::min(x0 + step, nChunkCells);
+  const size_t z1 = std::min(z0 + step, nChunkCells);
+
+  const float fX = float(x - x0) / float(step);
+  const float fZ = float(z - z0) / float(step);
+
+  const float a = pHeights[(z0 * nChunkVerticesPerSide) + x0];
+  const float b = pHeights[(z0 * nChunkVerticesPerSide) + x1];
+  const float c = pHeights[(z1 * nChunkVerticesPerSide) + x0];
+  const float d = pHeights[(z1 * nChunkVerticesPerSide) + x1];
+
+  // Cells are split along the diagonal from (x0, z0) to (x1, z1)
+  if (fX >= fZ) return a + (fX * (b - a)) + (fZ * (d - b));
+
+  return a + (fZ * (c - a)) + (fX * (d - c));
+}
+
+void cGeoMipMapTerrain::AddChunkIndices(size_t lod, size_t stitch, std::vector<uint16_t>& indices)
+{
+  const size_t step = size_t(1) << lod;
+  const size_t coarseStep = 2 * step;
+
+  // Vertices along a stitched edge are moved back to the previous vertex of the coarser neighbour, the triangles
+  // that collapse are skipped and the remaining triangles form a fan onto the neighbour's edge
+  auto GetIndex = [stitch, coarseStep](size_t x, size_t z) -> uint16_t
+  {
+    if (((stitch & STITCH_TOP) != 0) && (z == 0)) x = (x / coarseStep) * coarseStep;
+    if (((stitch & STITCH_BOTTOM) != 0) && (z == nChunkCells)) x = (x / coarseStep) * coarseStep;
+    if (((stitch & STITCH_LEFT) != 0) && (x == 0)) z = (z / coarseStep) * coarseStep;
+    if (((stitch & STITCH_RIGHT) != 0) && (x == nChunkCells)) z = (z / coarseStep) * coarseStep;
+
+    return uint16_t((z * nChunkVerticesPerSide) + x);
+  };
+
+  auto AddTriangle = [&indices](uint16_t a, uint16_t b, uint16_t c)
+  {
+    if ((a == b) || (b == c) || (c == a)) return;
+
+    indices.push_back(a);
+    indices.push_back(b);
+    indices.push_back(c);
+  };
+
+  for (size_t z = 0; z < nChunkCells; z += step) {
+    for (size_t x = 0; x < nChunkCells; x += step) {
+      // Same winding and diagonal as the original full resolution heightmap triangles
+      AddTriangle(GetIndex(x + step, z + step), GetIndex(x + step, z), GetIndex(x, z));
+      AddTriangle(GetIndex(x, z + step), GetIndex(x + step, z + step), GetIndex(x, z));
+    }
+  }
+}
+
+bool cGeoMipMapTerrain::Build(const cHeightmapData& data, const spitfire::math::cVec3& scale, cTerrainCacheWriter* pCacheWriter)
+{
+  assert(!IsValid());
+  Clear();
+
+  const size_t width = data.GetWidth();
+  const size_t depth = data.GetDepth();
+  if ((width < 2) || (depth < 2)) {
+    LOGERROR("cGeoMipMapTerrain::Create Heightmap is too small ", width, "x", depth);
+    return false;
+  }
+
+  // Chunks on the far edges may hang over the end of the heightmap, their vertices are clamped to the last row and column
+  chunksX = ((width - 1) + (nChunkCells - 1)) / nChunkCells;
+  chunksZ = ((depth - 1) + (nChunkCells - 1)) / nChunkCells;
+  chunks.resize(chunksX * chunksZ);
+  chunkBounds.reserve(chunks.size());
+
+  const float fDetailMapRepeat = 10.0f;
+  const float fDetailMapWidth = fDetailMapRepeat;
+
+  vertices.reserve(chunks.size() * nChunkVertices * nFloatsPerVertex);
+
+  std::vector<float> heights(nChunkVertices, 0.0f);
+
+  for (size_t cz = 0; cz < chunksZ; cz++) {
+    for (size_t cx = 0; cx < chunksX; cx++) {
+      Chunk& chunk = chunks[(cz * chunksX) + cx];
+
+      float fLowest = spitfire::math::cINFINITY;
+      float fHighest = -spitfire::math::cINFINITY;
+
+      for (size_t z = 0; z < nChunkVerticesPerSide; z++) {
+        for (size_t x = 0; x < nChunkVerticesPerSide; x++) {
+          const size_t mapX = std::min((cx * nChunkCells) + x, width - 1);
+          const size_t mapZ = std::min((cz * nChunkCells) + z, depth - 1);
+
+          const float fHeight = data.GetHeight(mapX, mapZ);
+          heights[(z * nChunkVerticesPerSide) + x] = fHeight;
+          fLowest = std::min(fLowest, fHeight);
+          fHighest = std::max(fHighest, fHeight);
+
+          const spitfire::math::cVec3 position = scale * spitfire::math::cVec3(float(mapX), fHeight, float(mapZ));
+          const spitfire::math::cVec3 normal = data.GetNormal(mapX, mapZ, scale);
+
+          // NOTE: Diffuse and lightmap have the same texture coordinates (0..1), the detail map is repeated (0..fDetailMapRepeat)
+          const float fDiffuseAndLightmapU = float(mapX) / float(width);
+          const float fDiffuseAndLightmapV = float(mapZ) / float(depth);
+
+          const float vertex[nFloatsPerVertex] = {
+            position.x, position.y, position.z,
+            normal.x, normal.y, normal.z,
+            fDiffuseAndLightmapU, fDiffuseAndLightmapV,
+            fDiffuseAndLightmapU, fDiffuseAndLightmapV,
+            fDiffuseAndLightmapU * fDetailMapWidth, fDiffuseAndLightmapV * fDetailMapWidth
+          };
+          vertices.insert(vertices.end(), vertex, vertex + nFloatsPerVertex);
+        }
+      }
+
+      const spitfire::math::cVec3 minimum(scale.x * float(cx * nChunkCells), scale.y * fLowest, scale.z * float(cz * nChunkCells));
+      const spitfire::math::cVec3 maximum(scale.x * float(std::min((cx + 1) * nChunkCells, width - 1)), scale.y * fHighest, scale.z * float(std::min((cz + 1) * nChunkCells, depth - 1)));
+      chunkBounds.push_back(minimum, maximum);
+
+      // Work out how far each level strays from the full resolution surface, a coarser level can never be more accurate than a finer one
+      float fPreviousError = 0.0f;
+      for (size_t lod = 0; lod < nLevels; lod++) {
+        const size_t step = size_t(1) << lod;
+
+        float fError = 0.0f;
+        for (size_t z = 0; z < nChunkVerticesPerSide; z++) {
+          for (size_t x = 0; x < nChunkVerticesPerSide; x++) {
+            const float fDifference = fabs(heights[(z * nChunkVerticesPerSide) + x] - GetInterpolatedHeightAtLevel(&heights[0], x, z, step));
+            fError = std::max(fError, fDifference);
+          }
+        }
+
+        fPreviousError = std::max(fPreviousError, scale.y * fError);
+        chunk.fGeometricError[lod] = fPreviousError;
+      }
+
+      chunk.lod = 0;
+      chunk.stitch = 0;
+    }
+  }
+
+  if (pCacheWriter != nullptr) {
+    const size_t n = chunks.size();
+    pCacheWriter->AddToSection(TERRAIN_CACHE_SECTION::TERRAIN_CHUNKS, &chunks[0], n * sizeof(Chunk));
+    for (auto pBounds : { &chunkBounds.minX, &chunkBounds.minY, &chunkBounds.minZ, &chunkBounds.maxX, &chunkBounds.maxY, &chunkBounds.maxZ }) {
+      pCacheWriter->AddToSection(TERRAIN_CACHE_SECTION::TERRAIN_BOUNDS, &(*pBounds)[0], n * sizeof(float));
+    }
+    pCacheWriter->AddToSection(TERRAIN_CACHE_SECTION::TERRAIN_VERTICES, &vertices[0], vertices.size() * sizeof(float));
+  }
+
+  pVertices = &vertices[0];
+  nVertices = vertices.size() / nFloatsPerVertex;
+
+  return true;
+}
+
+bool cGeoMipMapTerrain::BuildFromCache(const cTerrainCache& cache)
+{
+  assert(!IsValid());
+  Clear();
+
+  const size_t width = cache.GetWidth();
+  const size_t depth = cache.GetDepth();
+  if ((width < 2) || (depth < 2)) {
+    LOGERROR("cGeoMipMapTerrain::BuildFromCache Heightmap is too small ", width, "x", depth);
+    return false;
+  }
+
+  chunksX = ((width - 1) + (nChunkCells - 1)) / nChunkCells;
+  chunksZ = ((depth - 1) + (nChunkCells - 1)) / nChunkCells;
+  const size_t n = chunksX * chunksZ;
+
+  const Chunk* pChunks = cache.GetSection<Chunk>(TERRAIN_CACHE_SECTION::TERRAIN_CHUNKS, n);
+  const float* pBounds = cache.GetSection<float>(TERRAIN_CACHE_SECTION::TERRAIN_BOUNDS, 6 * n);
+  const float* pCachedVertices = cache.GetSection<float>(TERRAIN_CACHE_SECTION::TERRAIN_VERTICES, n * nChunkVertices * nFloatsPerVertex);
+  if ((pChunks == nullptr) || (pBounds == nullptr) || (pCachedVertices == nullptr)) {
+    LOG("cGeoMipMapTerrain::BuildFromCache The cache is missing some of the terrain");
+    Clear();
+    return false;
+  }
+
+  chunks.assign(pChunks, pChunks + n);
+
+  for (auto pBoundsArray : { &chunkBounds.minX, &chunkBounds.minY, &chunkBounds.minZ, &chunkBounds.maxX, &chunkBounds.maxY, &chunkBounds.maxZ }) {
+    pBoundsArray->assign(pBounds, pBounds + n);
+    pBounds += n;
+  }
+
+  // The vertices go straight from the mapped file to the vertex buffer
+  pVertices = pCachedVertices;
+  nVertices = n * nChunkVertices;
+
+  return true;
+}
+
+bool cGeoMipMapTerrain::Upload()
+{
+  assert(!IsValid());
+
+  if (pVertices == nullptr) {
+    LOGERROR("cGeoMipMapTerrain::Upload The terrain has not been built");
+    return false;
+  }
+
+  // Create the shared index lists for each level and each combination of stitched edges
+  std::vector<uint16_t> indices;
+  for (size_t lod = 0; lod < nLevels; lod++) {
+    // The coarsest level can never have a coarser neighbour
+    const size_t nCombinations = ((lod + 1) < nLevels) ? nStitchCombinations : 1;
+    for (size_t stitch = 0; stitch < nCombinations; stitch++) {
+      IndexRange& range = indexRanges[lod][stitch];
+      range.offset = indices.size();
+      AddChunkIndices(lod, stitch, indices);
+      range.count = indices.size() - range.offset;
+    }
+  }
+
+  // Upload everything
+  glGenVertexArrays(1, &vertexArray);
+  glBindVertexArray(vertexArray);
+
+  glGenBuffers(1, &vertexBuffer);
+  glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+  glBufferData(GL_ARRAY_BUFFER, nVertices * nFloatsPerVertex * sizeof(float), pVertices, GL_STATIC_DRAW);
+
+  glGenBuffers(1, &indexBuffer);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint16_t), &indices[0], GL_STATIC_DRAW);
+
+  // Attribute locations match shaders/heightmap.vert
+  const GLsizei stride = GLsizei(nFloatsPerVertex * sizeof(float));
+  const size_t attributeSizes[5] = { 3, 3, 2, 2, 2 };
+  size_t offset = 0;
+  for (GLuint location = 0; location < 5; location++) {
+    glEnableVertexAttribArray(location);
+    glVertexAttribPointer(location, GLint(attributeSizes[location]), GL_FLOAT, GL_FALSE, stride, (const GLvoid*)(offset * sizeof(float)));
+    offset += attributeSizes[location];
+  }
+
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+  LOG("cGeoMipMapTerrain::Upload ", chunksX, "x", chunksZ, " chunks, ", nVertices, " vertices, ", indices.size(), " shared indices");
+
+  // The vertices live in the vertex buffer now
+  std::vector<float>().swap(vertices);
+  pVertices = nullptr;
+  nVertices = 0;
+
+  return true;
+}
+
+void cGeoMipMapTerrain::Destroy()
+{
+  if (indexBuffer != 0) {
+    glDeleteBuffers(1, &indexBuffer);
+    indexBuffer = 0;
+  }
+  if (vertexBuffer != 0) {
+    glDeleteBuffers(1, &vertexBuffer);
+    vertexBuffer = 0;
+  }
+  if (vertexArray != 0) {
+    glDeleteVertexArrays(1, &vertexArray);
+    vertexArray = 0;
+  }
+
+  Clear();
+}
+
+void cGeoMipMapTerrain::Clear()
+{
+  chunks.clear();
+  chunkBounds.clear();
+  visibleChunks.clear();
+  chunksX = 0;
+  chunksZ = 0;
+  nTriangles = 0;
+
+  std::vector<float>().swap(vertices);
+  pVertices = nullptr;
+  nVertices = 0;
+}
+
+size_t cGeoMipMapTerrain::GetNeighbourLOD(size_t x, size_t z, size_t defaultLOD) const
+{
+  // Chunks outside the terrain never force a neighbour to change
+  if ((x >= chunksX) || (z >= chunksZ)) return defaultLOD;
+
+  return chunks[(z * chunksX) + x].lod;
+}
+
+void cGeoMipMapTerrain::SelectLOD(const spitfire::math::cVec3& cameraPosition, const spitfire::math::cMat4& matProjection, size_t viewportHeight)
+{
+  const std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+  // Converts an error in world units at a distance of one unit into pixels on the screen
+  const float fPixelsPerUnitAtOneUnit = 0.5f * float(viewportHeight) * matProjection.entries[5];
+
+  const size_t n = chunks.size();
+  for (size_t i = 0; i < n; i++) {
+    Chunk& chunk = chunks[i];
+
+    // Distance from the camera to the closest point on the chunk
+    const spitfire::math::cVec3 closest(
+      spitfire::math::clamp(cameraPosition.x, chunkBounds.minX[i], chunkBounds.maxX[i]),
+      spitfire::math::clamp(cameraPosition.y, chunkBounds.minY[i], chunkBounds.maxY[i]),
+      spitfire::math::clamp(cameraPosition.z, chunkBounds.minZ[i], chunkBounds.maxZ[i])
+    );
+    const float fDistance = std::max((closest - cameraPosition).GetLength(), 0.001f);
+
+    // Pick the coarsest level that is still accurate enough
+    uint8_t lod = 0;
+    for (size_t level = 1; level < nLevels; level++) {
+      const float fScreenSpaceError = fPixelsPerUnitAtOneUnit * chunk.fGeometricError[level] / fDistance;
+      if (fScreenSpaceError > fMaxScreenSpaceErrorPixels) break;
+
+      lod = uint8_t(level);
+    }
+
+    chunk.lod = lod;
+  }
+
+  // Neighbouring chunks may only differ by one level, refine any chunk that is too coarse until nothing changes
+  bool bChanged = true;
+  while (bChanged) {
+    bChanged = false;
+
+    for (size_t z = 0; z < chunksZ; z++) {
+      for (size_t x = 0; x < chunksX; x++) {
+        Chunk& chunk = chunks[(z * chunksX) + x];
+
+        size_t finest = chunk.lod;
+        finest = std::min(finest, GetNeighbourLOD(x - 1, z, chunk.lod));
+        finest = std::min(finest, GetNeighbourLOD(x + 1, z, chunk.lod));
+        finest = std::min(finest, GetNeighbourLOD(x, z - 1, chunk.lod));
+        finest = std::min(finest, GetNeighbourLOD(x, z + 1, chunk.lod));
+
+        if (chunk.lod > (finest + 1)) {
+          chunk.lod = uint8_t(finest + 1);
+          bChanged = true;
+        }
+      }
+    }
+  }
+
+  // Stitch any edge that borders a coarser chunk
+  for (size_t z = 0; z < chunksZ; z++) {
+    for (size_t x = 0; x < chunksX; x++) {
+      Chunk& chunk = chunks[(z * chunksX) + x];
+
+      uint8_t stitch = 0;
+      if (GetNeighbourLOD(x - 1, z, chunk.lod) > chunk.lod) stitch |= STITCH_LEFT;
+      if (GetNeighbourLOD(x + 1, z, chunk.lod) > chunk.lod) stitch |= STITCH_RIGHT;
+      if (GetNeighbourLOD(x, z - 1, chunk.lod) > chunk.lod) stitch |= STITCH_TOP;
+      if (GetNeighbourLOD(x, z + 1, chunk.lod) > chunk.lod) stitch |= STITCH_BOTTOM;
+      chunk.stitch = stitch;
+    }
+  }
+
+  const std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+  fSelectionTimeMS = std::chrono::duration<float, std::milli>(end - start).count();
+}
+
+void cGeoMipMapTerrain::Cull(const cFrustumCuller& culler)
+{
+  culler.Cull(chunkBounds, visibleChunks);
+}
+
+size_t cGeoMipMapTerrain::Draw()
+{
+  assert(IsValid());
+
+  nTriangles = 0;
+
+  if (visibleChunks.empty()) return 0;
+
+  glBindVertexArray(vertexArray);
+
+  // Every chunk uses the same local indices, the base vertex selects the chunk's vertices
+  for (auto i : visibleChunks) {
+    const Chunk& chunk = chunks[i];
+    const IndexRange& range = indexRanges[chunk.lod][chunk.stitch];
+    glDrawElementsBaseVertex(GL_TRIANGLES, GLsizei(range.count), GL_UNSIGNED_SHORT, (const GLvoid*)(range.offset * sizeof(uint16_t)), GLint(i * nChunkVertices));
+
+    nTriangles += range.count / 3;
+  }
+
+  glBindVertexArray(0);
+
+  return visibleChunks.size();
+}
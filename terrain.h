@@ -0,0 +1,124 @@
+#ifndef TERRAIN_H
+#define TERRAIN_H
+
+#include <vector>
+
+// OpenGL headers
+#include <GL/GLee.h>
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+#include <spitfire/math/math.h>
+#include <spitfire/math/cVec3.h>
+#include <spitfire/math/cMat4.h>
+
+// Application headers
+#include "culling.h"
+#include "renderqueue.h"
+
+class cHeightmapData;
+class cTerrainCache;
+class cTerrainCacheWriter;
+
+// ** cGeoMipMapTerrain
+//
+// The heightmap is split into square chunks which all live in one vertex buffer at full resolution.  Each level of detail
+// skips every other vertex of the level below it, the level of each chunk is selected on the CPU every frame from the
+// screen space error of the camera, and chunks next to a coarser neighbour use an index buffer that snaps their edge
+// vertices onto the vertices of the neighbour so that there are no cracks.  The index buffers only depend on the level
+// and which edges need stitching so they are shared by every chunk.
+
+class cGeoMipMapTerrain : public cRenderQueueDrawable
+{
+public:
+  static const size_t nChunkCells = 32;
+  static const size_t nChunkVerticesPerSide = nChunkCells + 1;
+  static const size_t nChunkVertices = nChunkVerticesPerSide * nChunkVerticesPerSide;
+  static const size_t nLevels = 6; // Steps of 1, 2, 4, 8, 16 and 32 cells
+
+  cGeoMipMapTerrain();
+
+  bool IsValid() const { return (vertexArray != 0); }
+
+  // Works out the chunks and vertices without touching OpenGL so that it can be called from a worker thread.  If a cache
+  // writer is given the chunks and vertices are added to it.
+  bool Build(const cHeightmapData& data, const spitfire::math::cVec3& scale, cTerrainCacheWriter* pCacheWriter = nullptr);
+
+  // The cache must have been made with the same scale and has to stay open until the terrain is uploaded
+  bool BuildFromCache(const cTerrainCache& cache);
+
+  // Creates the vertex and index buffers on the main thread once the terrain has been built
+  bool Upload();
+
+  void Destroy();
+
+  // Select the level of each chunk for this frame
+  void SelectLOD(const spitfire::math::cVec3& cameraPosition, const spitfire::math::cMat4& matProjection, size_t viewportHeight);
+
+  // Find the chunks that are inside the frustum for this frame
+  void Cull(const cFrustumCuller& culler);
+
+  // Draws the visible chunks, the heightmap shader, textures and matrices must already be set
+  size_t Draw() override;
+
+  size_t GetChunkCount() const { return chunks.size(); }
+  size_t GetVisibleChunkCount() const { return visibleChunks.size(); }
+  size_t GetTriangleCount() const { return nTriangles; }
+  size_t GetFullDetailTriangleCount() const { return chunks.size() * nChunkCells * nChunkCells * 2; }
+  float GetSelectionTimeMS() const { return fSelectionTimeMS; }
+
+  void SetMaxScreenSpaceErrorPixels(float fPixels) { fMaxScreenSpaceErrorPixels = fPixels; }
+
+private:
+  // Stitching flags for the edges of a chunk that border a coarser chunk
+  enum STITCH {
+    STITCH_LEFT = 1,
+    STITCH_RIGHT = 2,
+    STITCH_TOP = 4,
+    STITCH_BOTTOM = 8,
+  };
+  static const size_t nStitchCombinations = 16;
+
+  struct Chunk {
+    float fGeometricError[nLevels]; // Maximum height difference in world units when rendering this chunk at each level
+    uint8_t lod;
+    uint8_t stitch;
+  };
+
+  struct IndexRange {
+    size_t offset;
+    size_t count;
+  };
+
+  static void AddChunkIndices(size_t lod, size_t stitch, std::vector<uint16_t>& indices);
+
+  void Clear();
+
+  static float GetInterpolatedHeightAtLevel(const float* pHeights, size_t x, size_t z, size_t step);
+
+  size_t GetNeighbourLOD(size_t x, size_t z, size_t defaultLOD) const;
+
+  std::vector<Chunk> chunks;
+  cBoundingBoxes chunkBounds;
+  std::vector<uint32_t> visibleChunks;
+  size_t chunksX;
+  size_t chunksZ;
+
+  // Waiting to be uploaded, the vertices either point at our own array or straight into a terrain cache
+  std::vector<float> vertices;
+  const float* pVertices;
+  size_t nVertices;
+
+  IndexRange indexRanges[nLevels][nStitchCombinations];
+
+  GLuint vertexArray;
+  GLuint vertexBuffer;
+  GLuint indexBuffer;
+
+  float fMaxScreenSpaceErrorPixels;
+
+  size_t nTriangles;
+  float fSelectionTimeMS;
+};
+
+#endif // TERRAIN_H
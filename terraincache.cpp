@@ -0,0 +1,311 @@
+#include <cassert>
+#include <cstring>
+
+#include <fstream>
+
+#include <spitfire/util/log.h>
+#include <spitfire/util/string.h>
+
+#include "terraincache.h"
+
+namespace
+{
+  const char szMagic[4] = { 'R', 'B', 'T', 'C' };
+
+  // Increase this whenever the layout of the file or the way that any of the sections are worked out changes
+  const uint32_t nVersion = 2;
+
+  // Sections start on a page boundary so that they are aligned for SSE and only the pages that are used are read in
+  const size_t nSectionAlignment = 4096;
+
+  size_t AlignSectionOffset(size_t offset)
+  {
+    return ((offset + (nSectionAlignment - 1)) / nSectionAlignment) * nSectionAlignment;
+  }
+}
+
+struct cTerrainCache::Header {
+  char magic[4];
+  uint32_t version;
+  uint64_t sourceSize;
+  uint64_t sourceLastWriteTime;
+  uint64_t sourceHash;
+  float scale[3];
+
+  uint32_t width;
+  uint32_t depth;
+  float fLowestPoint;
+  float fHighestPoint;
+
+  struct Section {
+    uint64_t offset;
+    uint64_t size;
+  };
+  Section sections[size_t(TERRAIN_CACHE_SECTION::COUNT)];
+};
+
+
+// ** cCacheSource
+
+cCacheSource::cCacheSource() :
+  size(0),
+  lastWriteTime(0),
+  bIsHashed(false),
+  hash(0)
+{
+}
+
+bool cCacheSource::SetFile(const spitfire::string_t& _sFilename)
+{
+  sFilename.clear();
+  bIsHashed = false;
+  hash = 0;
+
+  if (!cMemoryMappedFile::GetFileStamp(_sFilename, size, lastWriteTime)) {
+    LOG("cCacheSource::SetFile Could not find \"", _sFilename, "\"");
+    return false;
+  }
+
+  sFilename = _sFilename;
+
+  return true;
+}
+
+uint64_t cCacheSource::GetHash()
+{
+  assert(IsValid());
+
+  if (!bIsHashed) {
+    bIsHashed = true;
+    if (!cTerrainCache::HashFile(sFilename, hash)) hash = 0;
+  }
+
+  return hash;
+}
+
+bool cCacheSource::Matches(uint64_t _size, uint64_t _lastWriteTime, uint64_t _hash)
+{
+  assert(IsValid());
+
+  // The file has not been written to since the cache was made so we can use the hash that the cache was made with
+  if (!bIsHashed && (_size == size) && (_lastWriteTime == lastWriteTime)) {
+    bIsHashed = true;
+    hash = _hash;
+    return true;
+  }
+
+  return (GetHash() == _hash);
+}
+
+
+// ** cTerrainCache
+
+cTerrainCache::cTerrainCache() :
+  pHeader(nullptr)
+{
+}
+
+bool cTerrainCache::HashFile(const spitfire::string_t& sFilename, uint64_t& hash)
+{
+  cMemoryMappedFile source;
+  if (!source.Open(sFilename)) return false;
+
+  hash = HashBuffer(source.GetData(), source.GetSize());
+
+  return true;
+}
+
+uint64_t cTerrainCache::HashBuffer(const void* pData, size_t size, uint64_t hash)
+{
+  const uint64_t prime = 1099511628211ull;
+
+  const uint8_t* pBytes = (const uint8_t*)pData;
+  size_t i = 0;
+
+  // Each lane only waits on its own multiply so the four of them run side by side
+  const size_t nLanes = 4;
+  const size_t nBlockBytes = nLanes * sizeof(uint64_t);
+  if (size >= nBlockBytes) {
+    uint64_t lanes[nLanes] = { hash, hash ^ 1, hash ^ 2, hash ^ 3 };
+
+    for (; (i + nBlockBytes) <= size; i += nBlockBytes) {
+      uint64_t words[nLanes];
+      memcpy(words, pBytes + i, sizeof(words));
+
+      for (size_t lane = 0; lane < nLanes; lane++) {
+        lanes[lane] ^= words[lane];
+        lanes[lane] *= prime;
+      }
+    }
+
+    for (size_t lane = 0; lane < nLanes; lane++) {
+      hash ^= lanes[lane];
+      hash *= prime;
+    }
+  }
+
+  // Any remaining bytes
+  for (; i < size; i++) {
+    hash ^= pBytes[i];
+    hash *= prime;
+  }
+
+  return hash;
+}
+
+bool cTerrainCache::Open(const spitfire::string_t& sFilename, cCacheSource& source, const spitfire::math::cVec3& scale)
+{
+  Close();
+
+  if (!file.Open(sFilename)) return false;
+
+  const Header* pFileHeader = (const Header*)file.GetData();
+  if ((file.GetSize() < sizeof(Header)) || (memcmp(pFileHeader->magic, szMagic, sizeof(szMagic)) != 0) || (pFileHeader->version != nVersion)) {
+    LOG("cTerrainCache::Open \"", sFilename, "\" is not a terrain cache or is from a different version");
+    Close();
+    return false;
+  }
+
+  if (
+    (pFileHeader->scale[0] != scale.x) || (pFileHeader->scale[1] != scale.y) || (pFileHeader->scale[2] != scale.z) ||
+    !source.Matches(pFileHeader->sourceSize, pFileHeader->sourceLastWriteTime, pFileHeader->sourceHash)
+  ) {
+    LOG("cTerrainCache::Open \"", sFilename, "\" is out of date");
+    Close();
+    return false;
+  }
+
+  for (auto&& section : pFileHeader->sections) {
+    if ((section.offset > file.GetSize()) || (section.size > (file.GetSize() - section.offset))) {
+      LOG("cTerrainCache::Open \"", sFilename, "\" is truncated");
+      Close();
+      return false;
+    }
+  }
+
+  pHeader = pFileHeader;
+
+  return true;
+}
+
+void cTerrainCache::Close()
+{
+  pHeader = nullptr;
+  file.Close();
+}
+
+size_t cTerrainCache::GetWidth() const
+{
+  assert(IsOpen());
+  return pHeader->width;
+}
+
+size_t cTerrainCache::GetDepth() const
+{
+  assert(IsOpen());
+  return pHeader->depth;
+}
+
+float cTerrainCache::GetLowestPoint() const
+{
+  assert(IsOpen());
+  return pHeader->fLowestPoint;
+}
+
+float cTerrainCache::GetHighestPoint() const
+{
+  assert(IsOpen());
+  return pHeader->fHighestPoint;
+}
+
+const void* cTerrainCache::GetSection(TERRAIN_CACHE_SECTION section, size_t size) const
+{
+  assert(IsOpen());
+
+  const Header::Section& entry = pHeader->sections[size_t(section)];
+  if ((size == 0) || (entry.size != size)) return nullptr;
+
+  return file.GetData() + entry.offset;
+}
+
+
+// ** cTerrainCacheWriter
+
+cTerrainCacheWriter::cTerrainCacheWriter(cCacheSource& source, const spitfire::math::cVec3& _scale) :
+  sourceSize(source.GetSize()),
+  sourceLastWriteTime(source.GetLastWriteTime()),
+  sourceHash(source.GetHash()),
+  scale(_scale),
+  width(0),
+  depth(0),
+  fLowestPoint(0.0f),
+  fHighestPoint(0.0f)
+{
+}
+
+void cTerrainCacheWriter::SetHeightmap(size_t _width, size_t _depth, float _fLowestPoint, float _fHighestPoint)
+{
+  width = _width;
+  depth = _depth;
+  fLowestPoint = _fLowestPoint;
+  fHighestPoint = _fHighestPoint;
+}
+
+void cTerrainCacheWriter::AddToSection(TERRAIN_CACHE_SECTION section, const void* pData, size_t size)
+{
+  const uint8_t* pBytes = (const uint8_t*)pData;
+  sections[size_t(section)].insert(sections[size_t(section)].end(), pBytes, pBytes + size);
+}
+
+bool cTerrainCacheWriter::Write(const spitfire::string_t& sFilename) const
+{
+  std::ofstream file(spitfire::string::ToUTF8(sFilename).c_str(), std::ios::binary | std::ios::trunc);
+  if (!file.is_open()) {
+    LOG("cTerrainCacheWriter::Write Could not open \"", sFilename, "\"");
+    return false;
+  }
+
+  cTerrainCache::Header header;
+  memset(&header, 0, sizeof(header));
+  header.version = nVersion;
+  header.sourceSize = sourceSize;
+  header.sourceLastWriteTime = sourceLastWriteTime;
+  header.sourceHash = sourceHash;
+  header.scale[0] = scale.x;
+  header.scale[1] = scale.y;
+  header.scale[2] = scale.z;
+  header.width = uint32_t(width);
+  header.depth = uint32_t(depth);
+  header.fLowestPoint = fLowestPoint;
+  header.fHighestPoint = fHighestPoint;
+
+  // Write a header without the magic first to reserve the space
+  file.write((const char*)&header, sizeof(header));
+
+  size_t offset = sizeof(header);
+  const std::vector<char> padding(nSectionAlignment, 0);
+
+  for (size_t i = 0; i < size_t(TERRAIN_CACHE_SECTION::COUNT); i++) {
+    const std::vector<uint8_t>& section = sections[i];
+    if (section.empty()) continue;
+
+    const size_t alignedOffset = AlignSectionOffset(offset);
+    file.write(&padding[0], alignedOffset - offset);
+    file.write((const char*)&section[0], section.size());
+
+    header.sections[i].offset = alignedOffset;
+    header.sections[i].size = section.size();
+    offset = alignedOffset + section.size();
+  }
+
+  memcpy(header.magic, szMagic, sizeof(szMagic));
+  file.seekp(0);
+  file.write((const char*)&header, sizeof(header));
+
+  if (!file.good()) {
+    LOG("cTerrainCacheWriter::Write Could not write \"", sFilename, "\"");
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,138 @@
+#ifndef TERRAINCACHE_H
+#define TERRAINCACHE_H
+
+#include <vector>
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+#include <spitfire/math/cVec3.h>
+
+// Application headers
+#include "memorymappedfile.h"
+
+enum class TERRAIN_CACHE_SECTION {
+  HEIGHTS,
+  NORMALS_X,
+  NORMALS_Y,
+  NORMALS_Z,
+  AMBIENT_OCCLUSION,
+  LIGHTMAP,
+  TERRAIN_CHUNKS,
+  TERRAIN_BOUNDS,
+  TERRAIN_VERTICES,
+
+  COUNT
+};
+
+// ** cCacheSource
+//
+// The file that a cache is made from, identified by its size, when it was last written to and a hash of its contents.
+// Hashing a big file takes a while so the hash is only worked out when it is needed.  A cache made from a file with the
+// same size and last write time takes the hash that the cache was made with, otherwise the file is hashed and compared.
+
+class cCacheSource
+{
+public:
+  cCacheSource();
+
+  // Returns false if the file does not exist
+  bool SetFile(const spitfire::string_t& sFilename);
+
+  bool IsValid() const { return !sFilename.empty(); }
+
+  uint64_t GetSize() const { return size; }
+  uint64_t GetLastWriteTime() const { return lastWriteTime; }
+
+  // Hashes the file the first time it is called unless a cache has already provided the hash
+  uint64_t GetHash();
+
+  // Returns true if the file is the one that a cache with this size, last write time and hash was made from
+  bool Matches(uint64_t size, uint64_t lastWriteTime, uint64_t hash);
+
+private:
+  spitfire::string_t sFilename;
+  uint64_t size;
+  uint64_t lastWriteTime;
+
+  bool bIsHashed;
+  uint64_t hash;
+};
+
+
+// ** cTerrainCache
+//
+// Everything that is worked out from a heightmap when the terrain is created, saved to a file so that later runs can skip
+// the work.  Each section starts on a page boundary so the file is memory mapped and the sections are used in place, they
+// are only valid while the cache is open.  A cache is only used if it was made from a source file with the same contents,
+// for the same scale and by the same version of this code, see cCacheSource for how the contents are compared.
+
+class cTerrainCache
+{
+public:
+  cTerrainCache();
+
+  // A hash of the contents of a file, or of a buffer continuing on from a previous hash.  This is FNV-1a over 8 byte words
+  // in four interleaved lanes so that it runs at memory speed rather than a byte per multiply.
+  static bool HashFile(const spitfire::string_t& sFilename, uint64_t& hash);
+  static uint64_t HashBuffer(const void* pData, size_t size, uint64_t hash = 14695981039346656037ull);
+
+  // Returns false if the cache is missing, damaged or out of date
+  bool Open(const spitfire::string_t& sFilename, cCacheSource& source, const spitfire::math::cVec3& scale);
+  void Close();
+
+  bool IsOpen() const { return (pHeader != nullptr); }
+
+  size_t GetWidth() const;
+  size_t GetDepth() const;
+  float GetLowestPoint() const;
+  float GetHighestPoint() const;
+
+  // Returns a pointer straight into the mapped file, or nullptr if the section does not hold exactly n elements
+  template <class T>
+  const T* GetSection(TERRAIN_CACHE_SECTION section, size_t n) const { return (const T*)GetSection(section, n * sizeof(T)); }
+
+private:
+  struct Header;
+
+  const void* GetSection(TERRAIN_CACHE_SECTION section, size_t size) const;
+
+  cMemoryMappedFile file;
+  const Header* pHeader;
+
+  friend class cTerrainCacheWriter;
+};
+
+
+// ** cTerrainCacheWriter
+//
+// Collects the sections for a new cache file, the data is copied so the caller does not have to keep it around
+
+class cTerrainCacheWriter
+{
+public:
+  // Hashes the source file if it has not been hashed yet
+  cTerrainCacheWriter(cCacheSource& source, const spitfire::math::cVec3& scale);
+
+  void SetHeightmap(size_t width, size_t depth, float fLowestPoint, float fHighestPoint);
+
+  // Appends to the end of a section
+  void AddToSection(TERRAIN_CACHE_SECTION section, const void* pData, size_t size);
+
+  // The header is written last so that a file that was only partly written is never used
+  bool Write(const spitfire::string_t& sFilename) const;
+
+private:
+  uint64_t sourceSize;
+  uint64_t sourceLastWriteTime;
+  uint64_t sourceHash;
+  spitfire::math::cVec3 scale;
+
+  size_t width;
+  size_t depth;
+  float fLowestPoint;
+  float fHighestPoint;
+
+  std::vector<uint8_t> sections[size_t(TERRAIN_CACHE_SECTION::COUNT)];
+};
+
+#endif // TERRAINCACHE_H
@@ -0,0 +1,684 @@
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#include <algorithm>
+#include <fstream>
+#include <memory>
+
+#include <spitfire/util/log.h>
+#include <spitfire/util/string.h>
+
+#include "jobsystem.h"
+#include "parallel.h"
+#include "profiler.h"
+#include "terraincache.h"
+#include "virtualtexture.h"
+
+namespace
+{
+  const char szMagic[4] = { 'R', 'B', 'V', 'T' };
+
+  // Increase this whenever the layout of the file or the way that the pages are made changes
+  const uint32_t nVersion = 2;
+
+  // Limits how many pages are uploaded in one frame when the camera jumps to somewhere new
+  const size_t nMaxLoadingPages = 8;
+
+  // Averages the texels of a layer under a footprint given in texels of the layer, footprints that are no bigger than a texel
+  // are bilinearly filtered instead.  Channels that the layer does not have are set to 255.
+  void SampleLayer(const cVirtualTextureFile::Layer& layer, float fX0, float fZ0, float fX1, float fZ1, size_t nChannels, uint8_t* pOut)
+  {
+    assert(nChannels <= 4);
+
+    const size_t nLayerChannels = std::min(nChannels, layer.nBytesPerPixel);
+    float fValues[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+    auto GetTexel = [&layer](size_t x, size_t z) -> const uint8_t*
+    {
+      return &layer.pBuffer[((z * layer.width) + x) * layer.nBytesPerPixel];
+    };
+
+    if (((fX1 - fX0) <= 1.0f) && ((fZ1 - fZ0) <= 1.0f)) {
+      // Texel centres are at half texels
+      const float fX = std::min(std::max((0.5f * (fX0 + fX1)) - 0.5f, 0.0f), float(layer.width - 1));
+      const float fZ = std::min(std::max((0.5f * (fZ0 + fZ1)) - 0.5f, 0.0f), float(layer.depth - 1));
+
+      const size_t x0 = size_t(fX);
+      const size_t z0 = size_t(fZ);
+      const size_t x1 = std::min(x0 + 1, layer.width - 1);
+      const size_t z1 = std::min(z0 + 1, layer.depth - 1);
+      const float fU = fX - float(x0);
+      const float fV = fZ - float(z0);
+
+      const uint8_t* a = GetTexel(x0, z0);
+      const uint8_t* b = GetTexel(x1, z0);
+      const uint8_t* c = GetTexel(x0, z1);
+      const uint8_t* d = GetTexel(x1, z1);
+      for (size_t channel = 0; channel < nLayerChannels; channel++) {
+        const float fTop = float(a[channel]) + (fU * (float(b[channel]) - float(a[channel])));
+        const float fBottom = float(c[channel]) + (fU * (float(d[channel]) - float(c[channel])));
+        fValues[channel] = fTop + (fV * (fBottom - fTop));
+      }
+    } else {
+      const size_t x0 = std::min(size_t(fX0), layer.width - 1);
+      const size_t z0 = std::min(size_t(fZ0), layer.depth - 1);
+      const size_t x1 = std::max(x0 + 1, std::min(size_t(ceilf(fX1)), layer.width));
+      const size_t z1 = std::max(z0 + 1, std::min(size_t(ceilf(fZ1)), layer.depth));
+
+      for (size_t z = z0; z < z1; z++) {
+        for (size_t x = x0; x < x1; x++) {
+          const uint8_t* pTexel = GetTexel(x, z);
+          for (size_t channel = 0; channel < nLayerChannels; channel++) fValues[channel] += float(pTexel[channel]);
+        }
+      }
+
+      const float fCount = float((x1 - x0) * (z1 - z0));
+      for (size_t channel = 0; channel < nLayerChannels; channel++) fValues[channel] /= fCount;
+    }
+
+    for (size_t channel = 0; channel < nChannels; channel++) pOut[channel] = (channel < nLayerChannels) ? uint8_t(fValues[channel] + 0.5f) : 255;
+  }
+
+  // Fills the slot of a page that starts at originX, originZ on a grid of texels that covers the whole map, the border
+  // texels are taken from the neighbouring pages and are clamped at the edges of the map
+  void FillPage(const cVirtualTextureFile::Layer& diffuse, const cVirtualTextureFile::Layer& lightmap, size_t gridWidth, size_t gridDepth, size_t originX, size_t originZ, uint8_t* pPage)
+  {
+    const size_t nSlotTexels = cVirtualTextureFile::nPageSlotTexels;
+    const int border = int(cVirtualTextureFile::nPageBorderTexels);
+
+    uint8_t* pDiffuse = pPage;
+    uint8_t* pLightmap = pPage + cVirtualTextureFile::nDiffuseBytesPerPage;
+
+    const float fDiffuseScaleX = float(diffuse.width) / float(gridWidth);
+    const float fDiffuseScaleZ = float(diffuse.depth) / float(gridDepth);
+    const float fLightmapScaleX = float(lightmap.width) / float(gridWidth);
+    const float fLightmapScaleZ = float(lightmap.depth) / float(gridDepth);
+
+    for (size_t z = 0; z < nSlotTexels; z++) {
+      const float fGridZ = float(std::min(std::max(int(originZ + z) - border, 0), int(gridDepth) - 1));
+
+      for (size_t x = 0; x < nSlotTexels; x++) {
+        const float fGridX = float(std::min(std::max(int(originX + x) - border, 0), int(gridWidth) - 1));
+
+        const size_t texel = (z * nSlotTexels) + x;
+        SampleLayer(diffuse, fGridX * fDiffuseScaleX, fGridZ * fDiffuseScaleZ, (fGridX + 1.0f) * fDiffuseScaleX, (fGridZ + 1.0f) * fDiffuseScaleZ, 4, &pDiffuse[4 * texel]);
+        SampleLayer(lightmap, fGridX * fLightmapScaleX, fGridZ * fLightmapScaleZ, (fGridX + 1.0f) * fLightmapScaleX, (fGridZ + 1.0f) * fLightmapScaleZ, 1, &pLightmap[texel]);
+      }
+    }
+  }
+
+  GLuint CreateTexture(GLint internalFormat, GLenum format, GLenum type, size_t width, size_t height, GLint filter, const void* pData)
+  {
+    GLuint texture = 0;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, GLsizei(width), GLsizei(height), 0, format, type, pData);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    return texture;
+  }
+}
+
+struct cVirtualTextureFile::Header {
+  char magic[4];
+  uint32_t version;
+  uint64_t sourceSize;
+  uint64_t sourceLastWriteTime;
+  uint64_t sourceHash;
+  uint64_t dependencyHash;
+
+  uint32_t width;
+  uint32_t depth;
+  uint32_t pagesX;
+  uint32_t pagesZ;
+  uint32_t overviewWidth;
+  uint32_t overviewDepth;
+};
+
+
+// ** cVirtualTextureFile
+
+cVirtualTextureFile::cVirtualTextureFile() :
+  pHeader(nullptr)
+{
+}
+
+bool cVirtualTextureFile::Write(const spitfire::string_t& sFilename, cCacheSource& source, uint64_t dependencyHash, const Layer& diffuse, const Layer& lightmap)
+{
+  if ((diffuse.width == 0) || (diffuse.depth == 0) || (lightmap.width == 0) || (lightmap.depth == 0)) {
+    LOGERROR("cVirtualTextureFile::Write Layers cannot be empty");
+    return false;
+  }
+
+  std::ofstream file(spitfire::string::ToUTF8(sFilename).c_str(), std::ios::binary | std::ios::trunc);
+  if (!file.is_open()) {
+    LOG("cVirtualTextureFile::Write Could not open \"", sFilename, "\"");
+    return false;
+  }
+
+  const size_t pagesX = (std::max(diffuse.width, lightmap.width) + (nPageTexels - 1)) / nPageTexels;
+  const size_t pagesZ = (std::max(diffuse.depth, lightmap.depth) + (nPageTexels - 1)) / nPageTexels;
+  const size_t width = pagesX * nPageTexels;
+  const size_t depth = pagesZ * nPageTexels;
+
+  // The overview keeps the shape of the map with its longest side filling a page
+  const size_t overviewWidth = (width >= depth) ? nPageTexels : std::max<size_t>(1, (nPageTexels * width) / depth);
+  const size_t overviewDepth = (depth >= width) ? nPageTexels : std::max<size_t>(1, (nPageTexels * depth) / width);
+
+  Header header;
+  memset(&header, 0, sizeof(header));
+  header.version = nVersion;
+  header.sourceSize = source.GetSize();
+  header.sourceLastWriteTime = source.GetLastWriteTime();
+  header.sourceHash = source.GetHash();
+  header.dependencyHash = dependencyHash;
+  header.width = uint32_t(width);
+  header.depth = uint32_t(depth);
+  header.pagesX = uint32_t(pagesX);
+  header.pagesZ = uint32_t(pagesZ);
+  header.overviewWidth = uint32_t(overviewWidth);
+  header.overviewDepth = uint32_t(overviewDepth);
+
+  // Write a header without the magic first to reserve the space
+  file.write((const char*)&header, sizeof(header));
+
+  std::vector<uint8_t> row(pagesX * nBytesPerPage);
+
+  FillPage(diffuse, lightmap, overviewWidth, overviewDepth, 0, 0, &row[0]);
+  file.write((const char*)&row[0], nBytesPerPage);
+
+  // Fill a row of pages at a time so that we never hold the whole virtual texture
+  for (size_t z = 0; z < pagesZ; z++) {
+    parallel::ParallelFor(pagesX, [&](size_t begin, size_t end)
+    {
+      for (size_t x = begin; x < end; x++) FillPage(diffuse, lightmap, width, depth, x * nPageTexels, z * nPageTexels, &row[x * nBytesPerPage]);
+    });
+
+    file.write((const char*)&row[0], row.size());
+  }
+
+  memcpy(header.magic, szMagic, sizeof(szMagic));
+  file.seekp(0);
+  file.write((const char*)&header, sizeof(header));
+
+  if (!file.good()) {
+    LOG("cVirtualTextureFile::Write Could not write \"", sFilename, "\"");
+    return false;
+  }
+
+  return true;
+}
+
+bool cVirtualTextureFile::Open(const spitfire::string_t& sFilename, cCacheSource& source, uint64_t dependencyHash)
+{
+  Close();
+
+  if (!file.Open(sFilename)) return false;
+
+  const Header* pFileHeader = (const Header*)file.GetData();
+  if ((file.GetSize() < sizeof(Header)) || (memcmp(pFileHeader->magic, szMagic, sizeof(szMagic)) != 0) || (pFileHeader->version != nVersion)) {
+    LOG("cVirtualTextureFile::Open \"", sFilename, "\" is not a virtual texture or is from a different version");
+    Close();
+    return false;
+  }
+
+  if ((pFileHeader->dependencyHash != dependencyHash) || !source.Matches(pFileHeader->sourceSize, pFileHeader->sourceLastWriteTime, pFileHeader->sourceHash)) {
+    LOG("cVirtualTextureFile::Open \"", sFilename, "\" is out of date");
+    Close();
+    return false;
+  }
+
+  const size_t nPages = 1 + (size_t(pFileHeader->pagesX) * size_t(pFileHeader->pagesZ));
+  if ((pFileHeader->pagesX == 0) || (pFileHeader->pagesZ == 0) || (file.GetSize() != (sizeof(Header) + (nPages * nBytesPerPage)))) {
+    LOG("cVirtualTextureFile::Open \"", sFilename, "\" is truncated");
+    Close();
+    return false;
+  }
+
+  pHeader = pFileHeader;
+
+  return true;
+}
+
+void cVirtualTextureFile::Close()
+{
+  pHeader = nullptr;
+  file.Close();
+}
+
+size_t cVirtualTextureFile::GetWidth() const
+{
+  assert(IsOpen());
+  return pHeader->width;
+}
+
+size_t cVirtualTextureFile::GetDepth() const
+{
+  assert(IsOpen());
+  return pHeader->depth;
+}
+
+size_t cVirtualTextureFile::GetPagesX() const
+{
+  assert(IsOpen());
+  return pHeader->pagesX;
+}
+
+size_t cVirtualTextureFile::GetPagesZ() const
+{
+  assert(IsOpen());
+  return pHeader->pagesZ;
+}
+
+size_t cVirtualTextureFile::GetOverviewWidth() const
+{
+  assert(IsOpen());
+  return pHeader->overviewWidth;
+}
+
+size_t cVirtualTextureFile::GetOverviewDepth() const
+{
+  assert(IsOpen());
+  return pHeader->overviewDepth;
+}
+
+const uint8_t* cVirtualTextureFile::GetOverview() const
+{
+  assert(IsOpen());
+  return file.GetData() + sizeof(Header);
+}
+
+const uint8_t* cVirtualTextureFile::GetPage(size_t x, size_t z) const
+{
+  assert(IsOpen());
+  assert(x < pHeader->pagesX);
+  assert(z < pHeader->pagesZ);
+
+  const size_t index = 1 + (z * pHeader->pagesX) + x;
+  return file.GetData() + sizeof(Header) + (index * nBytesPerPage);
+}
+
+
+// ** cVirtualTexture
+
+cVirtualTexture::cVirtualTexture() :
+  pFile(nullptr),
+  pJobs(nullptr),
+  nPhysicalPagesPerSide(0),
+  nPhysicalTexels(0),
+  update(0),
+  textureDiffuse(0),
+  textureLightmap(0),
+  texturePageTable(0),
+  nResidentPages(0),
+  nLoadingPages(0),
+  nRequests(0),
+  nHits(0),
+  nTotalRequests(0),
+  nTotalHits(0),
+  nPagesLoaded(0),
+  nPagesEvicted(0)
+{
+}
+
+bool cVirtualTexture::Create(const cVirtualTextureFile& file, cJobSystem& jobs, size_t _nPhysicalPagesPerSide)
+{
+  assert(!IsValid());
+  assert(file.IsOpen());
+
+  if (_nPhysicalPagesPerSide < 2) {
+    LOGERROR("cVirtualTexture::Create The page cache needs room for the overview and at least one page");
+    return false;
+  }
+
+  pFile = &file;
+  pJobs = &jobs;
+
+  pLoadState.reset(new LoadState);
+  pLoadState->pFile = &file;
+  pLoadState->nReading = 0;
+
+  nPhysicalPagesPerSide = _nPhysicalPagesPerSide;
+  nPhysicalTexels = nPhysicalPagesPerSide * cVirtualTextureFile::nPageSlotTexels;
+
+  Page page;
+  page.slot = -1;
+  page.bIsLoading = false;
+  page.lastWantedUpdate = 0;
+  pages.assign(file.GetPagesX() * file.GetPagesZ(), page);
+
+  slotPages.assign(nPhysicalPagesPerSide * nPhysicalPagesPerSide, -1);
+
+  update = 0;
+  nResidentPages = 0;
+  nLoadingPages = 0;
+  nRequests = 0;
+  nHits = 0;
+  nTotalRequests = 0;
+  nTotalHits = 0;
+  nPagesLoaded = 0;
+  nPagesEvicted = 0;
+
+  textureDiffuse = CreateTexture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, nPhysicalTexels, nPhysicalTexels, GL_LINEAR, nullptr);
+  textureLightmap = CreateTexture(GL_R8, GL_RED, GL_UNSIGNED_BYTE, nPhysicalTexels, nPhysicalTexels, GL_LINEAR, nullptr);
+
+  // Every page starts off pointing at the overview
+  std::vector<float> pageTable(4 * pages.size());
+  for (size_t i = 0; i < pages.size(); i++) GetPageTableEntry(i, &pageTable[4 * i]);
+  texturePageTable = CreateTexture(GL_RGBA32F, GL_RGBA, GL_FLOAT, file.GetPagesX(), file.GetPagesZ(), GL_NEAREST, &pageTable[0]);
+
+  UploadSlot(0, file.GetOverview());
+
+  return true;
+}
+
+void cVirtualTexture::Destroy()
+{
+  // Cancel the pages that are queued and wait for any that are being read from the file
+  if (pLoadState) {
+    std::unique_lock<std::mutex> lock(pLoadState->mutex);
+    pLoadState->pFile = nullptr;
+    pLoadState->finishedReading.wait(lock, [this] { return (pLoadState->nReading == 0); });
+  }
+  pLoadState.reset();
+
+  if (texturePageTable != 0) {
+    glDeleteTextures(1, &texturePageTable);
+    texturePageTable = 0;
+  }
+
+  if (textureLightmap != 0) {
+    glDeleteTextures(1, &textureLightmap);
+    textureLightmap = 0;
+  }
+
+  if (textureDiffuse != 0) {
+    glDeleteTextures(1, &textureDiffuse);
+    textureDiffuse = 0;
+  }
+
+  pages.clear();
+  slotPages.clear();
+  wantedPages.clear();
+  nResidentPages = 0;
+  nLoadingPages = 0;
+
+  pFile = nullptr;
+  pJobs = nullptr;
+}
+
+void cVirtualTexture::Update(float fX, float fZ, float fRadius)
+{
+  PROFILE_ZONE("Virtual texture");
+
+  assert(IsValid());
+
+  update++;
+
+  const size_t pagesX = pFile->GetPagesX();
+  const size_t pagesZ = pFile->GetPagesZ();
+  const float fPageTexels = float(cVirtualTextureFile::nPageTexels);
+
+  // Find the pages that are within the radius, measured to the closest point of each page
+  wantedPages.clear();
+
+  const int firstX = std::max(int(floorf((fX - fRadius) / fPageTexels)), 0);
+  const int firstZ = std::max(int(floorf((fZ - fRadius) / fPageTexels)), 0);
+  const int lastX = std::min(int(floorf((fX + fRadius) / fPageTexels)), int(pagesX) - 1);
+  const int lastZ = std::min(int(floorf((fZ + fRadius) / fPageTexels)), int(pagesZ) - 1);
+
+  for (int z = firstZ; z <= lastZ; z++) {
+    const float fClosestZ = std::min(std::max(fZ, float(z) * fPageTexels), float(z + 1) * fPageTexels);
+
+    for (int x = firstX; x <= lastX; x++) {
+      const float fClosestX = std::min(std::max(fX, float(x) * fPageTexels), float(x + 1) * fPageTexels);
+
+      const float fDistance = sqrtf(((fClosestX - fX) * (fClosestX - fX)) + ((fClosestZ - fZ) * (fClosestZ - fZ)));
+      if (fDistance > fRadius) continue;
+
+      WantedPage wanted;
+      wanted.fDistance = fDistance;
+      wanted.page = uint32_t((size_t(z) * pagesX) + size_t(x));
+      wantedPages.push_back(wanted);
+    }
+  }
+
+  // Closest first, there is no point wanting more pages than the cache can hold
+  std::sort(wantedPages.begin(), wantedPages.end(), [](const WantedPage& lhs, const WantedPage& rhs) { return (lhs.fDistance < rhs.fDistance); });
+  if (wantedPages.size() > GetPhysicalPageCount()) wantedPages.resize(GetPhysicalPageCount());
+
+  // Mark every wanted page before loading any so that none of them are evicted to make room for the others
+  for (auto& wanted : wantedPages) pages[wanted.page].lastWantedUpdate = update;
+
+  nRequests = wantedPages.size();
+  nHits = 0;
+
+  for (auto& wanted : wantedPages) {
+    const Page& page = pages[wanted.page];
+    if (IsResident(page)) {
+      nHits++;
+      continue;
+    }
+
+    if (page.bIsLoading || (nLoadingPages >= nMaxLoadingPages)) continue;
+
+    const int32_t slot = FindFreeSlot();
+    if (slot < 0) break;
+
+    StartLoading(wanted.page, slot);
+  }
+
+  nTotalRequests += nRequests;
+  nTotalHits += nHits;
+}
+
+int32_t cVirtualTexture::FindFreeSlot()
+{
+  int32_t leastRecentlyWantedSlot = -1;
+  uint64_t leastRecentlyWantedUpdate = update;
+
+  for (size_t slot = 1; slot < slotPages.size(); slot++) {
+    const int32_t index = slotPages[slot];
+    if (index < 0) return int32_t(slot);
+
+    const Page& page = pages[index];
+    if (!page.bIsLoading && (page.lastWantedUpdate < leastRecentlyWantedUpdate)) {
+      leastRecentlyWantedSlot = int32_t(slot);
+      leastRecentlyWantedUpdate = page.lastWantedUpdate;
+    }
+  }
+
+  if (leastRecentlyWantedSlot >= 0) Evict(size_t(slotPages[leastRecentlyWantedSlot]));
+
+  return leastRecentlyWantedSlot;
+}
+
+void cVirtualTexture::Evict(size_t index)
+{
+  Page& page = pages[index];
+  assert(IsResident(page));
+
+  slotPages[page.slot] = -1;
+  page.slot = -1;
+
+  nResidentPages--;
+  nPagesEvicted++;
+
+  UploadPageTableEntry(index);
+}
+
+void cVirtualTexture::StartLoading(size_t index, int32_t slot)
+{
+  Page& page = pages[index];
+  assert(page.slot < 0);
+
+  // The slot is held by the page while it loads, the page table keeps pointing at the overview until it is uploaded
+  page.slot = slot;
+  page.bIsLoading = true;
+  slotPages[slot] = int32_t(index);
+  nLoadingPages++;
+
+  const size_t pageX = index % pFile->GetPagesX();
+  const size_t pageZ = index / pFile->GetPagesX();
+
+  // The jobs only use this once they know that the virtual texture has not been destroyed
+  cJobSystem* pJobSystem = pJobs;
+  std::shared_ptr<LoadState> pState = pLoadState;
+
+  std::shared_ptr<std::vector<uint8_t>> pTexels(new std::vector<uint8_t>(cVirtualTextureFile::nBytesPerPage));
+  pJobSystem->AddJob([this, pJobSystem, pState, index, pageX, pageZ, pTexels]() {
+    const cVirtualTextureFile* pStateFile = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(pState->mutex);
+      pStateFile = pState->pFile;
+      if (pStateFile == nullptr) return;
+      pState->nReading++;
+    }
+
+    // Copying the page out of the mapped file here means that any reads from the disk happen on the worker
+    memcpy(&(*pTexels)[0], pStateFile->GetPage(pageX, pageZ), cVirtualTextureFile::nBytesPerPage);
+
+    {
+      std::lock_guard<std::mutex> lock(pState->mutex);
+      pState->nReading--;
+    }
+    pState->finishedReading.notify_all();
+
+    // The main thread job runs on the same thread as Destroy so checking the state there is enough
+    pJobSystem->AddMainThreadJob([this, pState, index, pTexels]() {
+      if (pState->pFile != nullptr) OnPageLoaded(index, &(*pTexels)[0]);
+    });
+  });
+}
+
+void cVirtualTexture::OnPageLoaded(size_t index, const uint8_t* pTexels)
+{
+  assert(IsValid());
+
+  Page& page = pages[index];
+  assert(page.bIsLoading);
+
+  UploadSlot(page.slot, pTexels);
+  page.bIsLoading = false;
+
+  nLoadingPages--;
+  nResidentPages++;
+  nPagesLoaded++;
+
+  UploadPageTableEntry(index);
+}
+
+void cVirtualTexture::GetPageTableEntry(size_t index, float entry[4]) const
+{
+  // A physical texture coordinate is the virtual texture coordinate times the scale plus the offset
+  const float fPhysicalTexels = float(nPhysicalTexels);
+  const float fBorder = float(cVirtualTextureFile::nPageBorderTexels);
+
+  const Page& page = pages[index];
+  if (!IsResident(page)) {
+    entry[0] = float(pFile->GetOverviewWidth()) / fPhysicalTexels;
+    entry[1] = float(pFile->GetOverviewDepth()) / fPhysicalTexels;
+    entry[2] = fBorder / fPhysicalTexels;
+    entry[3] = fBorder / fPhysicalTexels;
+    return;
+  }
+
+  const size_t slotX = size_t(page.slot) % nPhysicalPagesPerSide;
+  const size_t slotZ = size_t(page.slot) / nPhysicalPagesPerSide;
+  const size_t pageX = index % pFile->GetPagesX();
+  const size_t pageZ = index / pFile->GetPagesX();
+
+  entry[0] = float(pFile->GetWidth()) / fPhysicalTexels;
+  entry[1] = float(pFile->GetDepth()) / fPhysicalTexels;
+  entry[2] = (float(slotX * cVirtualTextureFile::nPageSlotTexels) + fBorder - float(pageX * cVirtualTextureFile::nPageTexels)) / fPhysicalTexels;
+  entry[3] = (float(slotZ * cVirtualTextureFile::nPageSlotTexels) + fBorder - float(pageZ * cVirtualTextureFile::nPageTexels)) / fPhysicalTexels;
+}
+
+void cVirtualTexture::UploadSlot(int32_t slot, const uint8_t* pTexels)
+{
+  const GLint x = GLint((size_t(slot) % nPhysicalPagesPerSide) * cVirtualTextureFile::nPageSlotTexels);
+  const GLint y = GLint((size_t(slot) / nPhysicalPagesPerSide) * cVirtualTextureFile::nPageSlotTexels);
+  const GLsizei size = GLsizei(cVirtualTextureFile::nPageSlotTexels);
+
+  // Rows of the lightmap are not a multiple of 4 bytes
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+  glBindTexture(GL_TEXTURE_2D, textureDiffuse);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, size, size, GL_RGBA, GL_UNSIGNED_BYTE, pTexels);
+
+  glBindTexture(GL_TEXTURE_2D, textureLightmap);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, size, size, GL_RED, GL_UNSIGNED_BYTE, pTexels + cVirtualTextureFile::nDiffuseBytesPerPage);
+
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+void cVirtualTexture::UploadPageTableEntry(size_t index)
+{
+  float entry[4];
+  GetPageTableEntry(index, entry);
+
+  const GLint x = GLint(index % pFile->GetPagesX());
+  const GLint y = GLint(index / pFile->GetPagesX());
+
+  glBindTexture(GL_TEXTURE_2D, texturePageTable);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, 1, 1, GL_RGBA, GL_FLOAT, entry);
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void cVirtualTexture::Bind() const
+{
+  assert(IsValid());
+
+  // The context only sets the samplers of the textures that are bound through it so we set ours on the current shader
+  GLint program = 0;
+  glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+  glUniform1i(glGetUniformLocation(GLuint(program), "texUnit0"), GLint(nDiffuseTextureUnit));
+  glUniform1i(glGetUniformLocation(GLuint(program), "texUnit1"), GLint(nLightmapTextureUnit));
+  glUniform1i(glGetUniformLocation(GLuint(program), "texUnit3"), GLint(nPageTableTextureUnit));
+
+  glActiveTexture(GLenum(GL_TEXTURE0 + nDiffuseTextureUnit));
+  glBindTexture(GL_TEXTURE_2D, textureDiffuse);
+  glActiveTexture(GLenum(GL_TEXTURE0 + nLightmapTextureUnit));
+  glBindTexture(GL_TEXTURE_2D, textureLightmap);
+  glActiveTexture(GLenum(GL_TEXTURE0 + nPageTableTextureUnit));
+  glBindTexture(GL_TEXTURE_2D, texturePageTable);
+
+  glActiveTexture(GL_TEXTURE0);
+}
+
+void cVirtualTexture::UnBind() const
+{
+  glActiveTexture(GLenum(GL_TEXTURE0 + nPageTableTextureUnit));
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glActiveTexture(GLenum(GL_TEXTURE0 + nLightmapTextureUnit));
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glActiveTexture(GLenum(GL_TEXTURE0 + nDiffuseTextureUnit));
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  glActiveTexture(GL_TEXTURE0);
+}
+
+
+// ** cVirtualTexturedDrawable
+
+cVirtualTexturedDrawable::cVirtualTexturedDrawable(const cVirtualTexture& _virtualTexture, cRenderQueueDrawable& _drawable) :
+  virtualTexture(_virtualTexture),
+  drawable(_drawable)
+{
+}
+
+size_t cVirtualTexturedDrawable::Draw()
+{
+  virtualTexture.Bind();
+  const size_t nDrawCalls = drawable.Draw();
+  virtualTexture.UnBind();
+
+  return nDrawCalls;
+}
@@ -0,0 +1,211 @@
+#ifndef VIRTUALTEXTURE_H
+#define VIRTUALTEXTURE_H
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// OpenGL headers
+#include <GL/GLee.h>
+
+// Spitfire headers
+#include <spitfire/spitfire.h>
+
+// Application headers
+#include "memorymappedfile.h"
+#include "renderqueue.h"
+
+class cCacheSource;
+class cJobSystem;
+
+// ** cVirtualTextureFile
+//
+// The terrain diffuse map and lightmap resampled to one virtual size and cut into square pages.  Each page is stored with
+// a border of the texels around it so that a page can be filtered on its own, the diffuse texels of a page are followed by
+// its lightmap texels so loading a page is one contiguous read.  The first page is an overview of the whole map that is
+// always resident.  The file is memory mapped and only the pages that are loaded are read in.
+
+class cVirtualTextureFile
+{
+public:
+  static const size_t nPageTexels = 128;
+  static const size_t nPageBorderTexels = 1;
+  static const size_t nPageSlotTexels = nPageTexels + (2 * nPageBorderTexels);
+  static const size_t nDiffuseBytesPerPage = nPageSlotTexels * nPageSlotTexels * 4;
+  static const size_t nLightmapBytesPerPage = nPageSlotTexels * nPageSlotTexels;
+  static const size_t nBytesPerPage = nDiffuseBytesPerPage + nLightmapBytesPerPage;
+
+  // A source image, rows of texels starting at the first row of the texture
+  struct Layer {
+    const uint8_t* pBuffer;
+    size_t width;
+    size_t depth;
+    size_t nBytesPerPixel;
+  };
+
+  cVirtualTextureFile();
+
+  // The virtual size is the larger of the two layers rounded up to a whole number of pages, the diffuse layer is RGB or
+  // RGBA and only the first channel of the lightmap layer is used.  The source is the diffuse map file and the dependency
+  // hash covers everything else that the layers are made from.
+  static bool Write(const spitfire::string_t& sFilename, cCacheSource& source, uint64_t dependencyHash, const Layer& diffuse, const Layer& lightmap);
+
+  // Returns false if the file is missing, damaged or out of date
+  bool Open(const spitfire::string_t& sFilename, cCacheSource& source, uint64_t dependencyHash);
+  void Close();
+
+  bool IsOpen() const { return (pHeader != nullptr); }
+
+  // The size of the virtual texture in texels
+  size_t GetWidth() const;
+  size_t GetDepth() const;
+
+  size_t GetPagesX() const;
+  size_t GetPagesZ() const;
+
+  // The overview is stored in the top left of its page with the same border as the other pages
+  size_t GetOverviewWidth() const;
+  size_t GetOverviewDepth() const;
+
+  const uint8_t* GetOverview() const;
+  const uint8_t* GetPage(size_t x, size_t z) const;
+
+private:
+  struct Header;
+
+  cMemoryMappedFile file;
+  const Header* pHeader;
+};
+
+
+// ** cVirtualTexture
+//
+// Keeps the pages of a virtual texture file that are closest to the camera in a physical page cache on the GPU, one texture
+// for the diffuse map and one for the lightmap with the same layout.  A page table texture holds a scale and offset for
+// each page which takes a virtual texture coordinate to where that page is in the cache, pages that are not resident point
+// at the overview instead.  Pages are read from the file on the job system's worker threads and uploaded by a main thread
+// job, so the job system's main thread jobs have to be run every frame.  When the cache is full the least recently wanted
+// page is evicted.
+//
+// Destroy waits for any page that a worker is in the middle of reading and cancels the rest, jobs that are still queued
+// do nothing once the virtual texture has been destroyed.  This means that the job system can be stopped before or after
+// Destroy is called, but the job system and the file must not be destroyed while the virtual texture is still valid.
+
+class cVirtualTexture
+{
+public:
+  // The texture units that the shader expects
+  static const size_t nDiffuseTextureUnit = 0;
+  static const size_t nLightmapTextureUnit = 1;
+  static const size_t nPageTableTextureUnit = 3;
+
+  cVirtualTexture();
+
+  bool IsValid() const { return (textureDiffuse != 0); }
+
+  // The file and the job system must outlive the virtual texture, one slot of the cache is used by the overview
+  bool Create(const cVirtualTextureFile& file, cJobSystem& jobs, size_t nPhysicalPagesPerSide = 8);
+  void Destroy();
+
+  // Wants every page within fRadius of a point, the closest pages first.  The point and radius are in virtual texels.
+  void Update(float fX, float fZ, float fRadius);
+
+  // Binds the page caches and the page table to their texture units, the heightmap shader must already be bound
+  void Bind() const;
+  void UnBind() const;
+
+  size_t GetPageCount() const { return pages.size(); }
+  size_t GetPhysicalPageCount() const { return slotPages.empty() ? 0 : (slotPages.size() - 1); }
+  size_t GetResidentPageCount() const { return nResidentPages; }
+  size_t GetLoadingPageCount() const { return nLoadingPages; }
+
+  // Statistics, a hit is a wanted page that was already resident
+  float GetHitRate() const { return (nRequests == 0) ? 1.0f : float(nHits) / float(nRequests); }
+  float GetTotalHitRate() const { return (nTotalRequests == 0) ? 1.0f : float(nTotalHits) / float(nTotalRequests); }
+  size_t GetPagesLoaded() const { return nPagesLoaded; }
+  size_t GetPagesEvicted() const { return nPagesEvicted; }
+
+private:
+  struct Page {
+    int32_t slot; // -1 unless the page is resident or loading into a slot
+    bool bIsLoading;
+    uint64_t lastWantedUpdate;
+  };
+
+  struct WantedPage {
+    float fDistance;
+    uint32_t page;
+  };
+
+  // Shared with the page loading jobs so that they can tell when the virtual texture has been destroyed, a new one is made
+  // each time the virtual texture is created
+  struct LoadState {
+    std::mutex mutex;
+    std::condition_variable finishedReading;
+    const cVirtualTextureFile* pFile; // nullptr once the virtual texture has been destroyed
+    size_t nReading;
+  };
+
+  cVirtualTexture(const cVirtualTexture&) = delete;
+  cVirtualTexture& operator=(const cVirtualTexture&) = delete;
+
+  bool IsResident(const Page& page) const { return ((page.slot >= 0) && !page.bIsLoading); }
+
+  // Returns -1 if every slot is used by a page that is wanted this update or still loading
+  int32_t FindFreeSlot();
+  void Evict(size_t index);
+
+  void StartLoading(size_t index, int32_t slot);
+  void OnPageLoaded(size_t index, const uint8_t* pTexels);
+
+  void GetPageTableEntry(size_t index, float entry[4]) const;
+
+  void UploadSlot(int32_t slot, const uint8_t* pTexels);
+  void UploadPageTableEntry(size_t index);
+
+  const cVirtualTextureFile* pFile;
+  cJobSystem* pJobs;
+  std::shared_ptr<LoadState> pLoadState;
+
+  size_t nPhysicalPagesPerSide;
+  size_t nPhysicalTexels;
+
+  std::vector<Page> pages;
+  std::vector<int32_t> slotPages; // The page in each slot or -1, slot 0 is always the overview
+  std::vector<WantedPage> wantedPages;
+  uint64_t update;
+
+  GLuint textureDiffuse;
+  GLuint textureLightmap;
+  GLuint texturePageTable;
+
+  size_t nResidentPages;
+  size_t nLoadingPages;
+
+  size_t nRequests;
+  size_t nHits;
+  uint64_t nTotalRequests;
+  uint64_t nTotalHits;
+  size_t nPagesLoaded;
+  size_t nPagesEvicted;
+};
+
+
+// ** cVirtualTexturedDrawable
+//
+// Binds a virtual texture around the draw calls of another drawable
+
+class cVirtualTexturedDrawable : public cRenderQueueDrawable
+{
+public:
+  cVirtualTexturedDrawable(const cVirtualTexture& virtualTexture, cRenderQueueDrawable& drawable);
+
+  size_t Draw() override;
+
+private:
+  const cVirtualTexture& virtualTexture;
+  cRenderQueueDrawable& drawable;
+};
+
+#endif // VIRTUALTEXTURE_H